@@ -0,0 +1,49 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  esindex_api.h
+ *    Description:  parallel frame index of annex-b and adts files with sidecar cache
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef ESINDEX_API_H
+#define ESINDEX_API_H
+
+#include <stdint.h>
+
+#define ESINDEX_TYPE_H264 0
+#define ESINDEX_TYPE_HEVC 1
+#define ESINDEX_TYPE_ADTS 2
+
+#define ESINDEX_FLAG_KEY 0x01 // idr / irap access unit
+
+// one access unit (annex-b, start codes included) or one adts frame
+struct esindex_entry {
+    uint64_t pos;
+    uint32_t size;
+    uint32_t flags;
+};
+
+struct esindex {
+    int type;
+    uint64_t file_size;
+    struct esindex_entry *entries;
+    int64_t count;
+    int64_t keyframes;
+};
+
+// Scan the file on a pool of threads (0 - one per cpu).
+struct esindex *esindex_build(const char *path, int type, int threads);
+// Load <path>.idx when it matches the file size and mtime, otherwise build it and
+// write the sidecar. Writing is best effort.
+struct esindex *esindex_open(const char *path, int type, int threads);
+// Write <path>.idx for the media file at path.
+int esindex_save(struct esindex *index, const char *path);
+void esindex_free(struct esindex *index);
+
+#endif
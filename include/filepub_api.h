@@ -0,0 +1,88 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  filepub_api.h
+ *    Description:  publish a flv file or an annex-b/adts pair in real time
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef FILEPUB_API_H
+#define FILEPUB_API_H
+
+#include <stdint.h>
+
+#include "flvreader_api.h"
+
+#define FILEPUB_MAX_LATE 1000 // ms behind schedule before the clock is rebased
+#define FILEPUB_MAX_WAIT 5000 // ms ahead of schedule (timestamp jump) before rebasing
+
+struct rtmp_context;
+struct flvmux_context;
+struct esindex;
+
+struct filepub_para {
+    char path[1024];       // flv file. Leave empty to publish video_path/audio_path
+    char video_path[1024]; // annex-b h264 or hevc, may be empty
+    char audio_path[1024]; // adts aac, may be empty
+    int vfmt;              // FLVMUX_VFMT_H264 / FLVMUX_VFMT_HEVC for video_path
+    double framerate;      // used when the sps carries no timing info, default 25
+    int loop;              // restart at end of file, timestamps keep increasing
+    int index_threads;     // elementary stream indexing, 0 - one per cpu
+};
+
+// one elementary stream file and the flv tags muxed from its current frame
+struct filepub_es {
+    int fd;
+    uint8_t *data;
+    uint64_t size;
+    struct esindex *index; // access units / adts frames
+    int64_t next;  // next index entry
+    int64_t count; // frames (video) or samples since base_ts (audio) this pass
+    int64_t base_ts;
+    int sample_rate;
+    struct flvreader_context tags; // malloc'ed flvmux output
+};
+
+struct filepub_context {
+    struct filepub_para para;
+    struct rtmp_context *rtmp;
+    struct flvreader_context *flv; // flv source
+    struct flvmux_context *mux;    // elementary stream source
+    struct filepub_es video;
+    struct filepub_es audio;
+
+    struct flvreader_tag tag; // next tag to send
+    int tag_ready;
+    int pass_started;
+    uint32_t pass_base;   // first timestamp of the current pass
+    uint32_t loop_offset; // output timestamp of the current pass start
+    uint32_t last_ts;     // last output timestamp
+    uint32_t last_delta;  // last gap between two output timestamps
+    int64_t clock_base;   // monotonic ms at which ts_base is due
+    uint32_t ts_base;
+    int clock_started;
+    int loops;
+
+    uint8_t *send_buf;    // tag body with room for the rtmp header in front
+    uint32_t send_buf_size;
+    int packets_sent;
+    int stop;
+};
+
+// rtmp must be opened with write_enable and outlive the publisher.
+struct filepub_context *filepub_open(struct filepub_para *para, struct rtmp_context *rtmp);
+// Send every tag that is due now. Returns ms until the next tag is due, -1 at end or on error.
+// Lets one thread drive many channels: call each due channel, then sleep for the minimum.
+int filepub_step(struct filepub_context *handle);
+// Blocking loop around filepub_step. Returns when done or after filepub_stop.
+int filepub_run(struct filepub_context *handle);
+// Thread safe, makes filepub_run return.
+void filepub_stop(struct filepub_context *handle);
+int filepub_close(struct filepub_context *handle);
+
+#endif
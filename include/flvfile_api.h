@@ -0,0 +1,65 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  flvfile_api.h
+ *    Description:  buffered flv file recorder with keyframe index
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef FLVFILE_API_H
+#define FLVFILE_API_H
+
+#include <stdint.h>
+
+#define FLVFILE_DEFAULT_BUFFER_SIZE (1024 * 1024)
+#define FLVFILE_DEFAULT_INDEX_RESERVE (64 * 1024) // ~3600 keyframes
+#define FLVFILE_MIN_INDEX_RESERVE 256              // onMetaData without a keyframe index
+#define FLVFILE_ALIGN 4096
+
+struct flvfile_para {
+    char path[1024];
+    int buffer_size;   // write buffer, rounded up to FLVFILE_ALIGN. 0 - default
+    int index_reserve; // bytes reserved for onMetaData at the file head. 0 - default,
+                       // at least FLVFILE_MIN_INDEX_RESERVE
+    int direct_io;     // open with O_DIRECT, bypassing the page cache
+};
+
+struct flvfile_index {
+    double *times;     // seconds
+    double *positions; // file offset of the tag header
+    int count;
+    int capacity;
+};
+
+struct flvfile_context {
+    struct flvfile_para para;
+    int fd;
+    uint8_t *buffer;   // FLVFILE_ALIGN aligned
+    int buffer_size;
+    int buffer_pos;
+    uint64_t file_pos; // logical size, including buffered bytes
+    uint64_t metadata_pos; // offset of the reserved onMetaData tag
+    uint8_t *metadata; // last onMetaData body received, re-encoded on close
+    uint32_t metadata_size;
+    int has_audio;
+    int has_video;
+    uint32_t last_ts;
+    uint32_t last_keyframe_ts;
+    struct flvfile_index video_index; // video keyframes
+    struct flvfile_index audio_index; // ~1s audio seek points, used for audio only files
+    int error;
+};
+
+struct flvfile_context *flvfile_open(struct flvfile_para *para);
+// data holds whole flv tags (each followed by its previous tag size), e.g. the output
+// of flvmux. A leading 13 byte flv file header is skipped. Returns size or -1.
+int flvfile_write(struct flvfile_context *handle, uint8_t *data, int size);
+// Flush, patch the header flags and rewrite onMetaData with duration and keyframes.
+int flvfile_close(struct flvfile_context *handle);
+
+#endif
@@ -21,40 +21,94 @@
 #include <fcntl.h>
 #include <string.h>
 
+#define FLVMUX_PKT_FLAG_KEY    0x01
+#define FLVMUX_PKT_FLAG_HEADER 0x02 // sequence header / decoder config
+#define FLVMUX_PKT_FLAG_OTHER  0x04 // sequence end and other non frame packets
+
 struct flvmux_packet {
     uint8_t *data;
     uint32_t size;
-    int64_t pts;
-    int64_t dts;
+    int64_t pts; // ms
+    int64_t dts; // ms, pts - dts goes into the video tag CompositionTime
 
-    int type; // 0-v 1-a
+    int type; // 0-v 1-a 2-script
+    int codec; // FLVMUX_VFMT_* or FLVMUX_AFMT_*, filled by flvmux_parse_tag
+    int flags; // FLVMUX_PKT_FLAG_*, filled by flvmux_parse_tag
 };
 
+// vfmt
+#define FLVMUX_VFMT_H264 0
+#define FLVMUX_VFMT_HEVC 1 // annex-b input, enhanced rtmp hvc1
+#define FLVMUX_VFMT_AV1  2 // temporal units of obus, enhanced rtmp av01
+// afmt
+#define FLVMUX_AFMT_AAC  0 // adts input
+#define FLVMUX_AFMT_OPUS 1 // raw opus packets, enhanced rtmp Opus
+
+#define FLV_FOURCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+#define FLV_FOURCC_AVC  FLV_FOURCC('a', 'v', 'c', '1')
+#define FLV_FOURCC_HEVC FLV_FOURCC('h', 'v', 'c', '1')
+#define FLV_FOURCC_HEV1 FLV_FOURCC('h', 'e', 'v', '1')
+#define FLV_FOURCC_AV1  FLV_FOURCC('a', 'v', '0', '1')
+#define FLV_FOURCC_OPUS FLV_FOURCC('O', 'p', 'u', 's')
+
 struct flvmux_para {
     int has_audio;
     int has_video;
     int afmt;
     int vfmt;
+    int video_bitrate; // bps, reported when the sps carries no hrd info
+    int audio_sample_rate; // opus head, default 48000
+    int audio_channels; // opus head, default 2
+    int audio_pre_skip; // opus head, 48 kHz samples the decoder drops at the start, from the encoder
 };
 
 #define AAC_ADTS_HEADER_SIZE 7
 #define FLV_TAG_HEAD_LEN 11
 #define FLV_PRE_TAG_LEN 4
+#define FLVMUX_MAX_VPS 2
+#define FLVMUX_MAX_SPS 4
+#define FLVMUX_MAX_PPS 8
+#define FLVMUX_MAX_PARAM_SET_SIZE 512
 struct AudioSpecificConfig {
     uint8_t audio_object_type;
     uint8_t sample_frequency_index;
     uint8_t channel_configuration;
 };
 
+struct flvmux_video_info {
+    int width;
+    int height;
+    double framerate;
+    int profile;
+    int level;
+    int bitrate;
+};
+
+struct flvmux_param_set {
+    uint8_t data[FLVMUX_MAX_PARAM_SET_SIZE];
+    int size;
+};
+
 struct flvmux_context {
     struct flvmux_para para;
     // audio
     int audio_config_ok;
+    uint32_t audio_config_hash;
     struct AudioSpecificConfig config;
     // video 
     uint8_t header[1024];
     int header_size;
     int video_config_ok;
+    uint32_t video_config_hash; // hash of the sps/pps last sent in a sequence header
+    struct flvmux_param_set vps[FLVMUX_MAX_VPS]; // hevc only
+    int vps_count;
+    struct flvmux_param_set sps[FLVMUX_MAX_SPS]; // av1 keeps its sequence header obu in sps[0]
+    int sps_count;
+    int av1_seq_ok;        // sps[0] parsed, av1_still_picture holds
+    int av1_still_picture; // reduced_still_picture_header of sps[0], all frames are key frames
+    struct flvmux_param_set pps[FLVMUX_MAX_PPS];
+    int pps_count;
+    struct flvmux_video_info video_info; // last info sent in onMetaData
 };
 
 struct flvmux_context *flvmux_open(struct flvmux_para *para);
@@ -62,4 +116,8 @@ int flvmux_setup_audio_frame(struct flvmux_context *handle, struct flvmux_packet
 int flvmux_setup_video_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out);
 int flvmux_close(struct flvmux_context *handle);
 
+// Parse the audio/video tag header of a tag body (legacy or enhanced rtmp).
+// out->data points into body. Returns 0 on success.
+int flvmux_parse_tag(int tag_type, uint8_t *body, uint32_t size, uint32_t ts, struct flvmux_packet *out);
+
 #endif
@@ -0,0 +1,43 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  flvreader_api.h
+ *    Description:  zero copy flv tag reader over a memory mapped file
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef FLVREADER_API_H
+#define FLVREADER_API_H
+
+#include <stdint.h>
+
+struct flvreader_tag {
+    int type;      // 8-audio 9-video 18-script
+    uint32_t ts;   // ms
+    uint8_t *body; // points into the mapping
+    uint32_t size; // body size
+    uint64_t pos;  // offset of the tag header
+};
+
+struct flvreader_context {
+    int fd;        // -1 when walking a memory buffer
+    uint8_t *data; // mapping, or any buffer of tags each followed by its previous tag size
+    uint64_t size;
+    uint64_t pos;  // next tag
+    uint64_t first_tag; // offset of the first tag, after the flv file header
+    int has_audio; // header flags
+    int has_video;
+};
+
+struct flvreader_context *flvreader_open(const char *path);
+// Returns 0, or -1 at end of data / on a truncated tag.
+int flvreader_read_tag(struct flvreader_context *handle, struct flvreader_tag *tag);
+void flvreader_rewind(struct flvreader_context *handle);
+int flvreader_close(struct flvreader_context *handle);
+
+#endif
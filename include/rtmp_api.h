@@ -21,21 +21,39 @@
 #include <stdlib.h>
 #include <string.h>
 
+struct RTMPCancel;
+struct rtmp_pool;
+
 struct rtmp_para {
     char uri[1024];
     char ip[100];
     int port;
     int write_enable;
+    int pipeline; // send connect/createStream/publish without waiting for each reply
+    int fastopen; // tcp fast open, C0/C1 ride in the SYN once the server gave a cookie
+    int connect_timeout_ms; // 0: use the 10s session timeout
+    int handshake_timeout_ms;
+    int command_timeout_ms; // connect until play/publish starts, 0: none
+    struct RTMPCancel *cancel; // RTMP_Cancel() from another thread aborts rtmp_open
+    struct rtmp_pool *pool; // start on a warm connection when one matches, see rtmp_pool_api.h
 };
 
 struct rtmp_context {
     struct rtmp_para para;
     void *rtmp;
+    void *read_packet; // packet returned by rtmp_read_packet
+    uint32_t read_pos; // next tag inside an aggregate packet
+    int32_t read_delta; // aggregate timestamp correction
 };
 
+struct flvmux_packet;
+
 struct rtmp_context *rtmp_open(struct rtmp_para *para);
 int rtmp_read(struct rtmp_context *handle, uint8_t *data, int size);
 int rtmp_write(struct rtmp_context *handle, uint8_t *data, int size);
+// Read one audio/video/script message. pkt->data stays valid until the next call.
+// Returns payload size or -1 on end of stream / error.
+int rtmp_read_packet(struct rtmp_context *handle, struct flvmux_packet *pkt);
 int rtmp_pause(struct rtmp_context *handle, int time);
 int rtmp_set_parameter();
 int rtmp_get_parameter();
@@ -0,0 +1,75 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  rtmp_pool_api.h
+ *    Description:  connected rtmp sessions kept ready per host/port/app
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef RTMP_POOL_API_H
+#define RTMP_POOL_API_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define RTMP_POOL_PING_INTERVAL 5000 // ms between health checks of an idle connection
+#define RTMP_POOL_PING_TIMEOUT 3000  // ms a pong may take before the connection is dropped
+#define RTMP_POOL_RETRY_DELAY 1000   // ms before reconnecting after a failed warm up
+
+struct rtmp_pool_para {
+    int idle_per_key;     // connections kept handshaked and connected per key, default 1
+    int ping_interval_ms; // 0 - RTMP_POOL_PING_INTERVAL
+    int ping_timeout_ms;  // 0 - RTMP_POOL_PING_TIMEOUT
+    int max_idle_ms;      // recycle older idle connections, 0 - never
+};
+
+// one idle connection: handshake done and connect answered, no stream yet
+struct rtmp_pool_conn {
+    void *rtmp;
+    int64_t born;
+    int64_t last_pong; // ms, born until the first pong
+    int64_t ping_sent; // ms, 0 - no ping outstanding
+    int busy;          // being checked by the worker, not claimable
+    int round;         // last check round
+    struct rtmp_pool_conn *next;
+};
+
+struct rtmp_pool_key {
+    char uri[1024];   // warm up url, its playpath is never used
+    char id[512];     // protocol/host/port/app and direction
+    int write_enable;
+    int opening;      // connections being warmed up by the worker
+    int64_t retry_at; // ms, after a failed warm up
+    struct rtmp_pool_conn *idle;
+    struct rtmp_pool_key *next;
+};
+
+struct RTMPCancel;
+
+struct rtmp_pool {
+    struct rtmp_pool_para para;
+    struct rtmp_pool_key *keys;
+    struct RTMPCancel *cancel; // aborts a warm up in progress on destroy
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t worker;
+    int round;
+    int quit;
+};
+
+// Starts the worker thread that warms up and health-checks connections.
+struct rtmp_pool *rtmp_pool_create(struct rtmp_pool_para *para);
+// Keep connections to the host/port/app of uri ready, for publishing when write_enable.
+// uri may carry librtmp options, e.g. "rtmp://host/app/x pipeline=1".
+int rtmp_pool_add(struct rtmp_pool *pool, const char *uri, int write_enable);
+// Take an idle connection matching uri. Returns an RTMP * ready for RTMP_StartStream or NULL.
+// The worker opens a replacement in the background.
+void *rtmp_pool_claim(struct rtmp_pool *pool, const char *uri, int write_enable);
+void rtmp_pool_destroy(struct rtmp_pool *pool);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  rtmp_server_api.h
+ *    Description:  embeddable rtmp ingest/relay server
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef RTMP_SERVER_API_H
+#define RTMP_SERVER_API_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define RTMP_SERVER_PORT 1935
+#define RTMP_SERVER_CHUNK_SIZE 4096             // outgoing chunk size announced after connect
+#define RTMP_SERVER_MAX_QUEUE (4 * 1024 * 1024) // bytes a player may lag before frames are dropped
+#define RTMP_SERVER_GOP_CACHE (4 * 1024 * 1024) // bytes of the latest gop kept for new players
+#define RTMP_SERVER_TIMEOUT 10000               // ms for handshake + connect, publisher silence, stalled player
+#define RTMP_SERVER_DVR_KBPS 2000               // stream bitrate the default ring size is made for
+#define RTMP_SERVER_DVR_SECONDS 300             // how far back players may seek
+
+struct rtmp_server_para {
+    char ip[100];       // listen address, "" - any
+    int port;           // 0 - RTMP_SERVER_PORT, -1 - any free port, server->para.port has it after open
+    int threads;        // epoll workers, 0 - one per cpu
+    int chunk_size;     // 0 - RTMP_SERVER_CHUNK_SIZE
+    int max_queue;      // 0 - RTMP_SERVER_MAX_QUEUE
+    int timeout_ms;     // 0 - RTMP_SERVER_TIMEOUT
+    int gop_cache_size; // 0 - RTMP_SERVER_GOP_CACHE, -1 - off, at most max_queue. A larger gop is not cached
+    int gop_audio_ms;   // audio only streams replay this much audio to new players, 0 - none
+    char dvr_dir[1024]; // time shift: published streams keep their recent tags in a ring file here
+                        // and play with start > 0 or seek replay from there. "" - off
+    int dvr_size;       // mb of ring file per stream, 0 - dvr_seconds at RTMP_SERVER_DVR_KBPS.
+                        // dvr_seconds of the bitrate must fit
+    int dvr_seconds;    // 0 - RTMP_SERVER_DVR_SECONDS
+    int http_port;      // http-flv players GET http://ip:http_port/app/name.flv, 0 - off, -1 - any free port
+    char origin[1024];  // edge mode, e.g. "rtmp://origin:1935". A play of app/name nobody
+                        // publishes here pulls origin/app/name while it has players. "" - off
+};
+
+struct rtmp_server_worker;
+struct rtmp_server_stream;
+struct RTMPCancel;
+
+struct rtmp_server {
+    struct rtmp_server_para para;
+    int listen_fd;
+    int http_fd;
+    struct rtmp_server_worker *workers;
+    int worker_count;
+    struct rtmp_server_stream *streams; // by app/name, publishers and players meet here
+    struct RTMPCancel *cancel;          // aborts origin connects on close
+    pthread_mutex_t lock;               // streams, pulls
+    pthread_cond_t cond;
+    int pulls;                          // origin pull threads running
+    volatile int quit;
+};
+
+// Binds, starts the workers and serves until rtmp_server_close. NULL when the port is taken.
+// Clients publish to and play rtmp://ip:port/app/name. With http_port set,
+// http://ip:http_port/app/name.flv plays the same stream.
+struct rtmp_server *rtmp_server_open(struct rtmp_server_para *para);
+void rtmp_server_close(struct rtmp_server *server);
+
+#endif
@@ -32,10 +32,25 @@
 #include "log.h"
 #include "bytes.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 static const AMFObjectProperty AMFProp_Invalid = { {0, 0}, AMF_INVALID };
 static const AMFObject AMFObj_Invalid = { 0, 0 };
 static const AVal AV_empty = { 0, 0 };
 
+static int AMFProp_DecodeIn(AMFObjectProperty *prop, const char *pBuffer,
+			    int nSize, int bDecodeName, AMFArena *arena);
+static int AMF_DecodeIn(AMFObject *obj, const char *pBuffer, int nSize,
+			int bDecodeName, AMFArena *arena);
+static int AMF_DecodeArrayIn(AMFObject *obj, const char *pBuffer, int nSize,
+			     int nArrayLen, int bDecodeName, AMFArena *arena);
+static int AMF_AddPropIn(AMFObject *obj, const AMFObjectProperty *prop,
+			 int *nCap, AMFArena *arena);
+
 /* Data is Big-Endian */
 unsigned short
 AMF_DecodeInt16(const char *data)
@@ -128,6 +143,48 @@ AMF_DecodeNumber(const char *data)
   return dVal;
 }
 
+/* Bulk decode of a strict array holding only numbers. Elements sit 9 bytes
+ * apart (marker + big endian double), two are swapped per vector op. */
+int
+AMF_DecodeNumberArray(const char *pBuffer, int nSize, int nArrayLen,
+		      double *out)
+{
+  int i = 0;
+
+  if (nArrayLen < 0 || nArrayLen > nSize / 9)
+    return -1;
+  for (i = 0; i < nArrayLen; i++)
+    if (pBuffer[i * 9] != AMF_NUMBER)
+      return -1;
+
+  i = 0;
+#if __BYTE_ORDER == __LITTLE_ENDIAN && __FLOAT_WORD_ORDER == __BYTE_ORDER
+#if defined(__SSE2__)
+  for (; i + 2 <= nArrayLen; i += 2)
+    {
+      const char *p = pBuffer + i * 9 + 1;
+      __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p),
+				     _mm_loadl_epi64((const __m128i *)(p + 9)));
+      /* bytes within words, then words within each 64 bit lane */
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+      _mm_storeu_si128((__m128i *)(out + i), v);
+    }
+#elif defined(__ARM_NEON)
+  for (; i + 2 <= nArrayLen; i += 2)
+    {
+      const uint8_t *p = (const uint8_t *)pBuffer + i * 9 + 1;
+      uint8x16_t v = vcombine_u8(vld1_u8(p), vld1_u8(p + 9));
+      vst1q_u8((uint8_t *)(out + i), vrev64q_u8(v));
+    }
+#endif
+#endif
+  for (; i < nArrayLen; i++)
+    out[i] = AMF_DecodeNumber(pBuffer + i * 9 + 1);
+  return nArrayLen * 9;
+}
+
 int
 AMF_DecodeBoolean(const char *data)
 {
@@ -494,42 +551,451 @@ AMF3ReadString(const char *data, AVal *str)
   return len;
 }
 
-int
-AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
-		int bDecodeName)
+/* AMF3 reference tables, one set per AMF3 value in an AMF0 stream */
+typedef struct AMF3Refs
 {
-  int nOriginalSize = nSize;
-  AMF3DataType type;
+  AVal *r_strings;
+  int r_nstrings;
+  AMFObjectProperty *r_objects;	/* shallow views, set once a value is complete */
+  int r_nobjects;
+  AMF3ClassDef *r_traits;
+  int r_ntraits;
+  int r_depth;
+  int r_copies;			/* properties duplicated to resolve references */
+} AMF3Refs;
+
+#define AMF3_MAX_DEPTH	64
+#define AMF3_MAX_COPIES	65536
+
+static int AMF3_DecodeValue(AMF3Refs *refs, AMFObjectProperty *prop,
+			    const char *pBuffer, int nSize);
+
+static void
+AMF3Refs_Free(AMF3Refs *refs)
+{
+  int i;
+  for (i = 0; i < refs->r_ntraits; i++)
+    free(refs->r_traits[i].cd_props);
+  free(refs->r_traits);
+  free(refs->r_strings);
+  free(refs->r_objects);
+  memset(refs, 0, sizeof(*refs));
+}
 
-  prop->p_name.av_len = 0;
-  prop->p_name.av_val = NULL;
+/* tables grow by 16 entries, as AMF_AddProp */
+static int
+AMF3_Reserve(void **table, int num, size_t size)
+{
+  void *p;
+  if (num & 0x0f)
+    return TRUE;
+  p = realloc(*table, (num + 16) * size);
+  if (!p)
+    return FALSE;
+  *table = p;
+  return TRUE;
+}
 
-  if (nSize == 0 || !pBuffer)
+static int
+AMF3_ReadU29(const char *pBuffer, int nSize, uint32_t *val)
+{
+  const unsigned char *p = (const unsigned char *)pBuffer;
+  uint32_t v = 0;
+  int i;
+
+  for (i = 0; i < 3; i++)
     {
-      RTMP_Log(RTMP_LOGDEBUG, "empty buffer/no buffer pointer!");
+      if (i >= nSize)
+	return -1;
+      if (!(p[i] & 0x80))
+	{
+	  *val = (v << 7) | p[i];
+	  return i + 1;
+	}
+      v = (v << 7) | (p[i] & 0x7f);
+    }
+  if (nSize < 4)
+    return -1;
+  *val = (v << 8) | p[3];
+  return 4;
+}
+
+static int
+AMF3_ReadStr(AMF3Refs *refs, const char *pBuffer, int nSize, AVal *str)
+{
+  uint32_t ref;
+  int len = AMF3_ReadU29(pBuffer, nSize, &ref);
+
+  if (len < 0)
+    return -1;
+  if (!(ref & 1))
+    {
+      ref >>= 1;
+      if (ref >= (uint32_t)refs->r_nstrings)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, string reference %u out of range",
+	      __FUNCTION__, ref);
+	  return -1;
+	}
+      *str = refs->r_strings[ref];
+      return len;
+    }
+  ref >>= 1;
+  if (ref > (uint32_t)(nSize - len))
+    return -1;
+  str->av_val = (char *)pBuffer + len;
+  str->av_len = ref;
+  /* the empty string is never sent by reference */
+  if (ref)
+    {
+      if (!AMF3_Reserve((void **)&refs->r_strings, refs->r_nstrings, sizeof(AVal)))
+	return -1;
+      refs->r_strings[refs->r_nstrings++] = *str;
+    }
+  return len + ref;
+}
+
+/* Slot in the object table, filled by AMF3_SetObject when complete */
+static int
+AMF3_AddObject(AMF3Refs *refs)
+{
+  if (!AMF3_Reserve((void **)&refs->r_objects, refs->r_nobjects,
+		    sizeof(AMFObjectProperty)))
+    return -1;
+  memset(&refs->r_objects[refs->r_nobjects], 0, sizeof(AMFObjectProperty));
+  /* referenced while still being decoded, e.g. a cycle: empty object */
+  refs->r_objects[refs->r_nobjects].p_type = AMF_OBJECT;
+  return refs->r_nobjects++;
+}
+
+static void
+AMF3_SetObject(AMF3Refs *refs, int idx, const AMFObjectProperty *prop)
+{
+  refs->r_objects[idx] = *prop;
+  refs->r_objects[idx].p_name.av_val = NULL;
+  refs->r_objects[idx].p_name.av_len = 0;
+}
+
+/* Resolve a reference by copying, the decoded tree owns no shared nodes */
+static int
+AMF3_CopyProp(AMF3Refs *refs, AMFObjectProperty *dst, const AMFObjectProperty *src)
+{
+  AVal name = dst->p_name;
+  int i;
+
+  if (++refs->r_copies > AMF3_MAX_COPIES)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s, too many references", __FUNCTION__);
+      return FALSE;
+    }
+  *dst = *src;
+  dst->p_name = name;
+  if (src->p_type == AMF_OBJECT || src->p_type == AMF_ECMA_ARRAY ||
+      src->p_type == AMF_STRICT_ARRAY)
+    {
+      dst->p_vu.p_object.o_num = 0;
+      dst->p_vu.p_object.o_props = NULL;
+      for (i = 0; i < src->p_vu.p_object.o_num; i++)
+	{
+	  AMFObjectProperty child;
+	  child.p_name = src->p_vu.p_object.o_props[i].p_name;
+	  if (!AMF3_CopyProp(refs, &child, &src->p_vu.p_object.o_props[i]))
+	    {
+	      AMF_Reset(&dst->p_vu.p_object);
+	      return FALSE;
+	    }
+	  AMF_AddProp(&dst->p_vu.p_object, &child);
+	}
+    }
+  return TRUE;
+}
+
+/* U29 header of a referencable value: copies the target for a reference
+ * and returns 0, else returns the header length with the inline value */
+static int
+AMF3_ReadRef(AMF3Refs *refs, AMFObjectProperty *prop, const char *pBuffer,
+	     int nSize, uint32_t *val)
+{
+  int len = AMF3_ReadU29(pBuffer, nSize, val);
+  if (len < 0)
+    return -1;
+  if (*val & 1)
+    {
+      *val >>= 1;
+      return len;
+    }
+  *val >>= 1;
+  if (*val >= (uint32_t)refs->r_nobjects)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s, object reference %u out of range",
+	  __FUNCTION__, *val);
       return -1;
     }
+  if (!AMF3_CopyProp(refs, prop, &refs->r_objects[*val]))
+    return -1;
+  return -len - 2;		/* reference, -2 - bytes read */
+}
 
-  /* decode name */
-  if (bDecodeName)
+static int
+AMF3_DecodeArray(AMF3Refs *refs, AMFObjectProperty *prop, const char *pBuffer,
+		 int nSize)
+{
+  const char *p = pBuffer, *end = pBuffer + nSize;
+  AMFObject obj = { 0, NULL };
+  uint32_t count;
+  int len, idx, assoc = FALSE;
+
+  len = AMF3_ReadRef(refs, prop, p, end - p, &count);
+  if (len < -1)
+    return -len - 2;
+  if (len < 0 || (idx = AMF3_AddObject(refs)) < 0)
+    return -1;
+  p += len;
+  /* associative part: name/value pairs up to an empty name */
+  for (;;)
     {
+      AMFObjectProperty elem;
       AVal name;
-      int nRes = AMF3ReadString(pBuffer, &name);
+      if ((len = AMF3_ReadStr(refs, p, end - p, &name)) < 0)
+	goto fail;
+      p += len;
+      if (!name.av_len)
+	break;
+      elem.p_name = name;
+      if ((len = AMF3_DecodeValue(refs, &elem, p, end - p)) < 0)
+	goto fail;
+      p += len;
+      AMF_AddProp(&obj, &elem);
+      assoc = TRUE;
+    }
+  /* dense part, every element takes at least one byte */
+  if (count > (uint32_t)(end - p))
+    goto fail;
+  while (count--)
+    {
+      AMFObjectProperty elem;
+      elem.p_name.av_val = NULL;
+      elem.p_name.av_len = 0;
+      if ((len = AMF3_DecodeValue(refs, &elem, p, end - p)) < 0)
+	goto fail;
+      p += len;
+      AMF_AddProp(&obj, &elem);
+    }
+  /* a mixed array keeps its dense elements unnamed after the named ones */
+  prop->p_type = assoc ? AMF_ECMA_ARRAY : AMF_STRICT_ARRAY;
+  prop->p_vu.p_object = obj;
+  AMF3_SetObject(refs, idx, prop);
+  return p - pBuffer;
+
+fail:
+  AMF_Reset(&obj);
+  return -1;
+}
 
-      if (name.av_len <= 0)
-	return nRes;
+static const AVal av_DEFAULT_ATTRIBUTE = AVC("DEFAULT_ATTRIBUTE");
 
-      nSize -= nRes;
-      if (nSize <= 0)
+/* Externalizable Flex wrappers that serialize a single value */
+static int
+AMF3_IsProxyClass(const AVal *name)
+{
+  static const AVal classes[] = {
+    AVC("flex.messaging.io.ArrayCollection"),
+    AVC("flex.messaging.io.ArrayList"),
+    AVC("flex.messaging.io.ObjectProxy"),
+  };
+  int i;
+  for (i = 0; i < (int)(sizeof(classes) / sizeof(classes[0])); i++)
+    if (AVMATCH(name, &classes[i]))
+      return TRUE;
+  return FALSE;
+}
+
+static int
+AMF3_DecodeObject(AMF3Refs *refs, AMFObjectProperty *prop, const char *pBuffer,
+		  int nSize)
+{
+  const char *p = pBuffer, *end = pBuffer + nSize;
+  AMFObject obj = { 0, NULL };
+  AMF3ClassDef cd;
+  uint32_t u;
+  int len, idx, i;
+
+  len = AMF3_ReadRef(refs, prop, p, end - p, &u);
+  if (len < -1)
+    return -len - 2;
+  if (len < 0)
+    return -1;
+  p += len;
+
+  if (!(u & 1))
+    {				/* trait reference */
+      u >>= 1;
+      if (u >= (uint32_t)refs->r_ntraits)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, trait reference %u out of range",
+	      __FUNCTION__, u);
+	  return -1;
+	}
+      cd = refs->r_traits[u];
+    }
+  else
+    {
+      memset(&cd, 0, sizeof(cd));
+      u >>= 1;
+      cd.cd_externalizable = u & 1;
+      cd.cd_dynamic = (u >> 1) & 1;
+      u >>= 2;
+      if ((len = AMF3_ReadStr(refs, p, end - p, &cd.cd_name)) < 0)
+	return -1;
+      p += len;
+      if (u > (uint32_t)(end - p))
 	return -1;
-      prop->p_name = name;
-      pBuffer += nRes;
+      for (i = 0; i < (int)u; i++)
+	{
+	  AVal member;
+	  if ((len = AMF3_ReadStr(refs, p, end - p, &member)) < 0)
+	    {
+	      free(cd.cd_props);
+	      return -1;
+	    }
+	  p += len;
+	  AMF3CD_AddProp(&cd, &member);
+	}
+      if (!AMF3_Reserve((void **)&refs->r_traits, refs->r_ntraits, sizeof(AMF3ClassDef)))
+	{
+	  free(cd.cd_props);
+	  return -1;
+	}
+      refs->r_traits[refs->r_ntraits++] = cd;
     }
+  if (cd.cd_name.av_len)
+    RTMP_Log(RTMP_LOGDEBUG, "%s, class %.*s", __FUNCTION__, cd.cd_name.av_len,
+	cd.cd_name.av_val);
 
-  /* decode */
-  type = *pBuffer++;
-  nSize--;
+  if ((idx = AMF3_AddObject(refs)) < 0)
+    return -1;
+  if (cd.cd_externalizable)
+    {
+      AMFObjectProperty elem;
+      if (!AMF3_IsProxyClass(&cd.cd_name))
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, externalizable class %.*s not supported",
+	      __FUNCTION__, cd.cd_name.av_len, cd.cd_name.av_val);
+	  return -1;
+	}
+      elem.p_name = av_DEFAULT_ATTRIBUTE;
+      if ((len = AMF3_DecodeValue(refs, &elem, p, end - p)) < 0)
+	return -1;
+      p += len;
+      AMF_AddProp(&obj, &elem);
+    }
+  else
+    {
+      for (i = 0; i < cd.cd_num; i++)
+	{
+	  AMFObjectProperty elem;
+	  elem.p_name = cd.cd_props[i];
+	  if ((len = AMF3_DecodeValue(refs, &elem, p, end - p)) < 0)
+	    goto fail;
+	  p += len;
+	  AMF_AddProp(&obj, &elem);
+	}
+      while (cd.cd_dynamic)
+	{
+	  AMFObjectProperty elem;
+	  if ((len = AMF3_ReadStr(refs, p, end - p, &elem.p_name)) < 0)
+	    goto fail;
+	  p += len;
+	  if (!elem.p_name.av_len)
+	    break;
+	  if ((len = AMF3_DecodeValue(refs, &elem, p, end - p)) < 0)
+	    goto fail;
+	  p += len;
+	  AMF_AddProp(&obj, &elem);
+	}
+    }
+  prop->p_type = AMF_OBJECT;
+  prop->p_vu.p_object = obj;
+  AMF3_SetObject(refs, idx, prop);
+  return p - pBuffer;
+
+fail:
+  AMF_Reset(&obj);
+  return -1;
+}
+
+/* Vector.<int|uint|Number|Object>, decoded as a strict array */
+static int
+AMF3_DecodeVector(AMF3Refs *refs, AMFObjectProperty *prop, int type,
+		  const char *pBuffer, int nSize)
+{
+  const char *p = pBuffer, *end = pBuffer + nSize;
+  AMFObject obj = { 0, NULL };
+  uint32_t count;
+  int len, idx, size;
+
+  len = AMF3_ReadRef(refs, prop, p, end - p, &count);
+  if (len < -1)
+    return -len - 2;
+  if (len < 0 || end - p - len < 1 || (idx = AMF3_AddObject(refs)) < 0)
+    return -1;
+  p += len + 1;			/* fixed-length flag */
+  if (type == AMF3_VECTOR_OBJECT)
+    {
+      AVal typeName;
+      if ((len = AMF3_ReadStr(refs, p, end - p, &typeName)) < 0)
+	return -1;
+      p += len;
+    }
+  size = type == AMF3_VECTOR_DOUBLE ? 8 : type == AMF3_VECTOR_OBJECT ? 1 : 4;
+  if (count > (uint32_t)(end - p) / size)
+    return -1;
+  while (count--)
+    {
+      AMFObjectProperty elem;
+      memset(&elem, 0, sizeof(elem));
+      elem.p_type = AMF_NUMBER;
+      if (type == AMF3_VECTOR_OBJECT)
+	{
+	  if ((len = AMF3_DecodeValue(refs, &elem, p, end - p)) < 0)
+	    {
+	      AMF_Reset(&obj);
+	      return -1;
+	    }
+	  p += len;
+	}
+      else if (type == AMF3_VECTOR_DOUBLE)
+	{
+	  elem.p_vu.p_number = AMF_DecodeNumber(p);
+	  p += 8;
+	}
+      else
+	{
+	  uint32_t v = AMF_DecodeInt32(p);
+	  elem.p_vu.p_number = type == AMF3_VECTOR_INT ? (double)(int32_t)v : (double)v;
+	  p += 4;
+	}
+      AMF_AddProp(&obj, &elem);
+    }
+  prop->p_type = AMF_STRICT_ARRAY;
+  prop->p_vu.p_object = obj;
+  AMF3_SetObject(refs, idx, prop);
+  return p - pBuffer;
+}
 
+/* Decodes one value, the caller sets prop->p_name */
+static int
+AMF3_DecodeValue(AMF3Refs *refs, AMFObjectProperty *prop, const char *pBuffer,
+		 int nSize)
+{
+  const char *p = pBuffer + 1, *end = pBuffer + nSize;
+  uint32_t u;
+  int len, idx, type;
+
+  if (nSize < 1)
+    return -1;
+  prop->p_UTCoffset = 0;
+  type = (unsigned char)*pBuffer;
   switch (type)
     {
     case AMF3_UNDEFINED:
@@ -537,87 +1003,135 @@ AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
       prop->p_type = AMF_NULL;
       break;
     case AMF3_FALSE:
-      prop->p_type = AMF_BOOLEAN;
-      prop->p_vu.p_number = 0.0;
-      break;
     case AMF3_TRUE:
       prop->p_type = AMF_BOOLEAN;
-      prop->p_vu.p_number = 1.0;
+      prop->p_vu.p_number = type == AMF3_TRUE;
       break;
     case AMF3_INTEGER:
-      {
-	int32_t res = 0;
-	int len = AMF3ReadInteger(pBuffer, &res);
-	prop->p_vu.p_number = (double)res;
-	prop->p_type = AMF_NUMBER;
-	nSize -= len;
-	break;
-      }
+      if ((len = AMF3_ReadU29(p, end - p, &u)) < 0)
+	return -1;
+      p += len;
+      prop->p_type = AMF_NUMBER;
+      /* 29 bit two's complement */
+      prop->p_vu.p_number = (u & 0x10000000) ? (double)((int32_t)u - (1 << 29)) : (double)u;
+      break;
     case AMF3_DOUBLE:
-      if (nSize < 8)
+      if (end - p < 8)
 	return -1;
-      prop->p_vu.p_number = AMF_DecodeNumber(pBuffer);
       prop->p_type = AMF_NUMBER;
-      nSize -= 8;
+      prop->p_vu.p_number = AMF_DecodeNumber(p);
+      p += 8;
       break;
     case AMF3_STRING:
+      if ((len = AMF3_ReadStr(refs, p, end - p, &prop->p_vu.p_aval)) < 0)
+	return -1;
+      p += len;
+      prop->p_type = AMF_STRING;
+      break;
     case AMF3_XML_DOC:
     case AMF3_XML:
-      {
-	int len = AMF3ReadString(pBuffer, &prop->p_vu.p_aval);
-	prop->p_type = AMF_STRING;
-	nSize -= len;
-	break;
-      }
+    case AMF3_BYTE_ARRAY:
+      /* kept as a string pointing at the raw bytes */
+      len = AMF3_ReadRef(refs, prop, p, end - p, &u);
+      if (len < -1)
+	return 1 - len - 2;
+      if (len < 0 || u > (uint32_t)(end - p - len) || (idx = AMF3_AddObject(refs)) < 0)
+	return -1;
+      p += len;
+      prop->p_type = AMF_STRING;
+      prop->p_vu.p_aval.av_val = (char *)p;
+      prop->p_vu.p_aval.av_len = u;
+      p += u;
+      AMF3_SetObject(refs, idx, prop);
+      break;
     case AMF3_DATE:
-      {
-	int32_t res = 0;
-	int len = AMF3ReadInteger(pBuffer, &res);
-
-	nSize -= len;
-	pBuffer += len;
-
-	if ((res & 0x1) == 0)
-	  {			/* reference */
-	    uint32_t nIndex = (res >> 1);
-	    RTMP_Log(RTMP_LOGDEBUG, "AMF3_DATE reference: %d, not supported!", nIndex);
-	  }
-	else
-	  {
-	    if (nSize < 8)
-	      return -1;
-
-	    prop->p_vu.p_number = AMF_DecodeNumber(pBuffer);
-	    nSize -= 8;
-	    prop->p_type = AMF_NUMBER;
-	  }
-	break;
-      }
+      len = AMF3_ReadRef(refs, prop, p, end - p, &u);
+      if (len < -1)
+	return 1 - len - 2;
+      if (len < 0 || end - p - len < 8 || (idx = AMF3_AddObject(refs)) < 0)
+	return -1;
+      p += len;
+      prop->p_type = AMF_DATE;
+      prop->p_vu.p_number = AMF_DecodeNumber(p);
+      p += 8;
+      AMF3_SetObject(refs, idx, prop);
+      break;
+    case AMF3_ARRAY:
     case AMF3_OBJECT:
-      {
-	int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
-	if (nRes == -1)
+    case AMF3_VECTOR_INT:
+    case AMF3_VECTOR_UINT:
+    case AMF3_VECTOR_DOUBLE:
+    case AMF3_VECTOR_OBJECT:
+      if (refs->r_depth >= AMF3_MAX_DEPTH)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, nesting too deep", __FUNCTION__);
 	  return -1;
-	nSize -= nRes;
-	prop->p_type = AMF_OBJECT;
-	break;
-      }
-    case AMF3_ARRAY:
-    case AMF3_BYTE_ARRAY:
+	}
+      refs->r_depth++;
+      if (type == AMF3_ARRAY)
+	len = AMF3_DecodeArray(refs, prop, p, end - p);
+      else if (type == AMF3_OBJECT)
+	len = AMF3_DecodeObject(refs, prop, p, end - p);
+      else
+	len = AMF3_DecodeVector(refs, prop, type, p, end - p);
+      refs->r_depth--;
+      if (len < 0)
+	return -1;
+      p += len;
+      break;
     default:
       RTMP_Log(RTMP_LOGDEBUG, "%s - AMF3 unknown/unsupported datatype 0x%02x, @%p",
-	  __FUNCTION__, (unsigned char)(*pBuffer), pBuffer);
+	  __FUNCTION__, type, pBuffer);
       return -1;
     }
-  if (nSize < 0)
-    return -1;
+  return p - pBuffer;
+}
 
-  return nOriginalSize - nSize;
+int
+AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
+		int bDecodeName)
+{
+  AMF3Refs refs;
+  AVal name = { 0, 0 };
+  int nName = 0, nRes;
+
+  prop->p_name.av_len = 0;
+  prop->p_name.av_val = NULL;
+  if (nSize <= 0 || !pBuffer)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "empty buffer/no buffer pointer!");
+      return -1;
+    }
+
+  memset(&refs, 0, sizeof(refs));
+  if (bDecodeName)
+    {
+      nName = AMF3_ReadStr(&refs, pBuffer, nSize, &name);
+      if (nName < 0 || !name.av_len)
+	{
+	  AMF3Refs_Free(&refs);
+	  return nName;
+	}
+    }
+  nRes = AMF3_DecodeValue(&refs, prop, pBuffer + nName, nSize - nName);
+  prop->p_name = name;
+  AMF3Refs_Free(&refs);
+  if (nRes < 0)
+    return -1;
+  return nName + nRes;
 }
 
 int
 AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 	       int bDecodeName)
+{
+  return AMFProp_DecodeIn(prop, pBuffer, nSize, bDecodeName, NULL);
+}
+
+/* arena == NULL allocates nested objects on the heap, as AMF_Decode */
+static int
+AMFProp_DecodeIn(AMFObjectProperty *prop, const char *pBuffer, int nSize,
+		 int bDecodeName, AMFArena *arena)
 {
   int nOriginalSize = nSize;
   int nRes;
@@ -689,7 +1203,7 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
       }
     case AMF_OBJECT:
       {
-	int nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
+	int nRes = AMF_DecodeIn(&prop->p_vu.p_object, pBuffer, nSize, TRUE, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -717,7 +1231,7 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 	nSize -= 4;
 
 	/* next comes the rest, mixed array has a final 0x000009 mark and names, so its an object */
-	nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer + 4, nSize, TRUE);
+	nRes = AMF_DecodeIn(&prop->p_vu.p_object, pBuffer + 4, nSize, TRUE, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -733,8 +1247,8 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 	unsigned int nArrayLen = AMF_DecodeInt32(pBuffer);
 	nSize -= 4;
 
-	nRes = AMF_DecodeArray(&prop->p_vu.p_object, pBuffer + 4, nSize,
-				   nArrayLen, FALSE);
+	nRes = AMF_DecodeArrayIn(&prop->p_vu.p_object, pBuffer + 4, nSize,
+				     nArrayLen, FALSE, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -779,11 +1293,19 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
       }
     case AMF_AVMPLUS:
       {
-	int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
+	AVal name = prop->p_name;
+	int nRes;
+	if (arena)
+	  {
+	    /* AMF3 objects live on the heap, the caller falls back to AMF_Decode */
+	    RTMP_Log(RTMP_LOGDEBUG, "%s: AMF3 value in arena decode", __FUNCTION__);
+	    return -1;
+	  }
+	nRes = AMF3Prop_Decode(prop, pBuffer, nSize, FALSE);
+	prop->p_name = name;
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
-	prop->p_type = AMF_OBJECT;
 	break;
       }
     default:
@@ -904,7 +1426,7 @@ AMF_Encode(AMFObject *obj, char *pBuffer, char *pBufEnd)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "AMF_Encode - failed to encode property in index %d",
 	      i);
-	  break;
+	  return NULL;
 	}
       else
 	{
@@ -939,7 +1461,7 @@ AMF_EncodeEcmaArray(AMFObject *obj, char *pBuffer, char *pBufEnd)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "AMF_Encode - failed to encode property in index %d",
 	      i);
-	  break;
+	  return NULL;
 	}
       else
 	{
@@ -974,7 +1496,7 @@ AMF_EncodeArray(AMFObject *obj, char *pBuffer, char *pBufEnd)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "AMF_Encode - failed to encode property in index %d",
 	      i);
-	  break;
+	  return NULL;
 	}
       else
 	{
@@ -993,16 +1515,85 @@ AMF_EncodeArray(AMFObject *obj, char *pBuffer, char *pBufEnd)
 int
 AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize,
 		int nArrayLen, int bDecodeName)
+{
+  return AMF_DecodeArrayIn(obj, pBuffer, nSize, nArrayLen, bDecodeName, NULL);
+}
+
+/* Largest message an AMFBuilder grows to, RTMP bodies are 24 bit sized */
+#define AMF_BUILDER_MAX	(32 << 20)
+
+/* Strict arrays of at least this many numbers take the bulk path */
+#define AMF_NUMBER_RUN	16
+
+static int
+AMF_DecodeNumberRun(AMFObject *obj, const char *pBuffer, int nSize,
+		    int nArrayLen, AMFArena *arena)
+{
+  double vals[256];
+  int i, n, done = 0;
+  AMFObjectProperty *props;
+
+  if (arena)
+    props = AMFArena_Alloc(arena, nArrayLen * sizeof(AMFObjectProperty));
+  else				/* AMF_AddProp grows in steps of 16 */
+    props = malloc(((nArrayLen + 15) & ~15) * sizeof(AMFObjectProperty));
+  if (!props)
+    return -1;
+  while (done < nArrayLen)
+    {
+      n = nArrayLen - done < 256 ? nArrayLen - done : 256;
+      if (AMF_DecodeNumberArray(pBuffer + done * 9, nSize - done * 9, n, vals) == -1)
+	{
+	  /* not all numbers, the caller decodes one by one */
+	  if (!arena)
+	    free(props);
+	  return -1;
+	}
+      for (i = 0; i < n; i++)
+	{
+	  AMFObjectProperty *prop = &props[done + i];
+	  prop->p_name.av_val = NULL;
+	  prop->p_name.av_len = 0;
+	  prop->p_type = AMF_NUMBER;
+	  prop->p_vu.p_number = vals[i];
+	  prop->p_UTCoffset = 0;
+	}
+      done += n;
+    }
+  obj->o_props = props;
+  obj->o_num = nArrayLen;
+  return nArrayLen * 9;
+}
+
+static int
+AMF_DecodeArrayIn(AMFObject *obj, const char *pBuffer, int nSize,
+		  int nArrayLen, int bDecodeName, AMFArena *arena)
 {
   int nOriginalSize = nSize;
   int bError = FALSE;
+  int nCap = 0, nRes;
 
   obj->o_num = 0;
   obj->o_props = NULL;
+  if (!bDecodeName && nArrayLen >= AMF_NUMBER_RUN && nArrayLen <= nSize / 9
+      && pBuffer[0] == AMF_NUMBER && pBuffer[(nArrayLen - 1) * 9] == AMF_NUMBER)
+    {
+      /* keyframe times/filepositions, decode the numbers in bulk */
+      nRes = AMF_DecodeNumberRun(obj, pBuffer, nSize, nArrayLen, arena);
+      if (nRes != -1)
+	return nRes;
+    }
+  if (arena && nArrayLen > 0)
+    {
+      /* every element takes at least one byte */
+      nCap = nArrayLen < nSize ? nArrayLen : nSize;
+      obj->o_props = AMFArena_Alloc(arena, nCap * sizeof(AMFObjectProperty));
+      if (!obj->o_props)
+	return -1;
+    }
   while (nArrayLen > 0)
     {
       AMFObjectProperty prop;
-      int nRes;
       nArrayLen--;
 
       if (nSize <= 0)
@@ -1010,7 +1601,7 @@ AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize,
 	  bError = TRUE;
 	  break;
 	}
-      nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
+      nRes = AMFProp_DecodeIn(&prop, pBuffer, nSize, bDecodeName, arena);
       if (nRes == -1)
 	{
 	  bError = TRUE;
@@ -1020,7 +1611,11 @@ AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize,
 	{
 	  nSize -= nRes;
 	  pBuffer += nRes;
-	  AMF_AddProp(obj, &prop);
+	  if (!AMF_AddPropIn(obj, &prop, &nCap, arena))
+	    {
+	      bError = TRUE;
+	      break;
+	    }
 	}
     }
   if (bError)
@@ -1032,155 +1627,59 @@ AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize,
 int
 AMF3_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bAMFData)
 {
-  int nOriginalSize = nSize;
-  int32_t ref;
-  int len;
+  AMFObjectProperty prop;
+  AMF3Refs refs;
+  int nRes;
 
   obj->o_num = 0;
   obj->o_props = NULL;
+  if (nSize <= 0 || !pBuffer)
+    return -1;
+
+  memset(&refs, 0, sizeof(refs));
+  memset(&prop, 0, sizeof(prop));
   if (bAMFData)
     {
       if (*pBuffer != AMF3_OBJECT)
-	RTMP_Log(RTMP_LOGERROR,
-	    "AMF3 Object encapsulated in AMF stream does not start with AMF3_OBJECT!");
-      pBuffer++;
-      nSize--;
-    }
-
-  ref = 0;
-  len = AMF3ReadInteger(pBuffer, &ref);
-  pBuffer += len;
-  nSize -= len;
-
-  if ((ref & 1) == 0)
-    {				/* object reference, 0xxx */
-      uint32_t objectIndex = (ref >> 1);
-
-      RTMP_Log(RTMP_LOGDEBUG, "Object reference, index: %d", objectIndex);
-    }
-  else				/* object instance */
-    {
-      int32_t classRef = (ref >> 1);
-
-      AMF3ClassDef cd = { {0, 0}
-      };
-      AMFObjectProperty prop;
-
-      if ((classRef & 0x1) == 0)
-	{			/* class reference */
-	  uint32_t classIndex = (classRef >> 1);
-	  RTMP_Log(RTMP_LOGDEBUG, "Class reference: %d", classIndex);
-	}
-      else
-	{
-	  int32_t classExtRef = (classRef >> 1);
-	  int i, cdnum;
-
-	  cd.cd_externalizable = (classExtRef & 0x1) == 1;
-	  cd.cd_dynamic = ((classExtRef >> 1) & 0x1) == 1;
-
-	  cdnum = classExtRef >> 2;
-
-	  /* class name */
-
-	  len = AMF3ReadString(pBuffer, &cd.cd_name);
-	  nSize -= len;
-	  pBuffer += len;
-
-	  /*std::string str = className; */
-
-	  RTMP_Log(RTMP_LOGDEBUG,
-	      "Class name: %s, externalizable: %d, dynamic: %d, classMembers: %d",
-	      cd.cd_name.av_val, cd.cd_externalizable, cd.cd_dynamic,
-	      cd.cd_num);
-
-	  for (i = 0; i < cdnum; i++)
-	    {
-	      AVal memberName;
-	      if (nSize <=0)
-		{
-invalid:
-		  RTMP_Log(RTMP_LOGDEBUG, "%s, invalid class encoding!",
-		    __FUNCTION__);
-		  return nOriginalSize;
-		}
-	      len = AMF3ReadString(pBuffer, &memberName);
-	      RTMP_Log(RTMP_LOGDEBUG, "Member: %s", memberName.av_val);
-	      AMF3CD_AddProp(&cd, &memberName);
-	      nSize -= len;
-	      pBuffer += len;
-	    }
-	}
-
-      /* add as referencable object */
-
-      if (cd.cd_externalizable)
 	{
-	  int nRes;
-	  AVal name = AVC("DEFAULT_ATTRIBUTE");
-
-	  RTMP_Log(RTMP_LOGDEBUG, "Externalizable, TODO check");
-
-	  nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, FALSE);
-	  if (nRes == -1)
-	    RTMP_Log(RTMP_LOGDEBUG, "%s, failed to decode AMF3 property!",
-		__FUNCTION__);
-	  else
-	    {
-	      nSize -= nRes;
-	      pBuffer += nRes;
-	    }
-
-	  AMFProp_SetName(&prop, &name);
-	  AMF_AddProp(obj, &prop);
-	}
-      else
-	{
-	  int nRes, i;
-	  for (i = 0; i < cd.cd_num; i++)	/* non-dynamic */
-	    {
-	      if (nSize <=0)
-	        goto invalid;
-	      nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, FALSE);
-	      if (nRes == -1)
-		RTMP_Log(RTMP_LOGDEBUG, "%s, failed to decode AMF3 property!",
-		    __FUNCTION__);
-
-	      AMFProp_SetName(&prop, AMF3CD_GetProp(&cd, i));
-	      AMF_AddProp(obj, &prop);
-
-	      pBuffer += nRes;
-	      nSize -= nRes;
-	    }
-	  if (cd.cd_dynamic)
-	    {
-	      int len = 0;
-
-	      do
-		{
-		  if (nSize <=0)
-		    goto invalid;
-		  nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, TRUE);
-		  AMF_AddProp(obj, &prop);
-
-		  pBuffer += nRes;
-		  nSize -= nRes;
-
-		  len = prop.p_name.av_len;
-		}
-	      while (len > 0);
-	    }
+	  RTMP_Log(RTMP_LOGERROR,
+	      "AMF3 Object encapsulated in AMF stream does not start with AMF3_OBJECT!");
+	  return -1;
 	}
-      RTMP_Log(RTMP_LOGDEBUG, "class object!");
+      nRes = AMF3_DecodeValue(&refs, &prop, pBuffer, nSize);
     }
-  return nOriginalSize - nSize;
+  else
+    nRes = AMF3_DecodeObject(&refs, &prop, pBuffer, nSize);
+  AMF3Refs_Free(&refs);
+  if (nRes < 0)
+    return -1;
+  *obj = prop.p_vu.p_object;
+  return nRes;
 }
 
 int
 AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
+{
+  return AMF_DecodeIn(obj, pBuffer, nSize, bDecodeName, NULL);
+}
+
+/* Like AMF_Decode, but the property arrays come from the arena and strings
+ * keep pointing into pBuffer. Release with AMFArena_Reset, never AMF_Reset.
+ * Returns -1 on AMF3 content, decode such messages with AMF_Decode. */
+int
+AMF_DecodeArena(AMFObject *obj, const char *pBuffer, int nSize,
+		int bDecodeName, AMFArena *arena)
+{
+  return AMF_DecodeIn(obj, pBuffer, nSize, bDecodeName, arena);
+}
+
+static int
+AMF_DecodeIn(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName,
+	     AMFArena *arena)
 {
   int nOriginalSize = nSize;
   int bError = FALSE;		/* if there is an error while decoding - try to at least find the end mark AMF_OBJECT_END */
+  int nCap = 0;
 
   obj->o_num = 0;
   obj->o_props = NULL;
@@ -1205,7 +1704,7 @@ AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
 	  continue;
 	}
 
-      nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
+      nRes = AMFProp_DecodeIn(&prop, pBuffer, nSize, bDecodeName, arena);
       if (nRes == -1)
 	{
 	  bError = TRUE;
@@ -1220,7 +1719,11 @@ AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
 	      break;
 	    }
 	  pBuffer += nRes;
-	  AMF_AddProp(obj, &prop);
+	  if (!AMF_AddPropIn(obj, &prop, &nCap, arena))
+	    {
+	      bError = TRUE;
+	      break;
+	    }
 	}
     }
 
@@ -1239,6 +1742,633 @@ AMF_AddProp(AMFObject *obj, const AMFObjectProperty *prop)
   memcpy(&obj->o_props[obj->o_num++], prop, sizeof(AMFObjectProperty));
 }
 
+static int
+AMF_AddPropIn(AMFObject *obj, const AMFObjectProperty *prop, int *nCap,
+	      AMFArena *arena)
+{
+  if (!arena)
+    {
+      AMF_AddProp(obj, prop);
+      return TRUE;
+    }
+  if (obj->o_num == *nCap)
+    {
+      /* the old array stays in the arena until the next reset */
+      int cap = *nCap ? *nCap * 2 : 8;
+      AMFObjectProperty *props = AMFArena_Alloc(arena, cap * sizeof(AMFObjectProperty));
+      if (!props)
+	return FALSE;
+      if (obj->o_num)
+	memcpy(props, obj->o_props, obj->o_num * sizeof(AMFObjectProperty));
+      obj->o_props = props;
+      *nCap = cap;
+    }
+  memcpy(&obj->o_props[obj->o_num++], prop, sizeof(AMFObjectProperty));
+  return TRUE;
+}
+
+/* Arena */
+
+typedef struct AMFArenaChunk
+{
+  struct AMFArenaChunk *ac_next;
+} AMFArenaChunk;
+
+#define AMF_ARENA_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+#define AMF_ARENA_MIN	4096
+
+/* buf is an optional first block owned by the caller, e.g. on the stack */
+void
+AMFArena_Init(AMFArena *arena, void *buf, size_t size)
+{
+  size_t skip = (8 - ((size_t)buf & 7)) & 7;
+  memset(arena, 0, sizeof(*arena));
+  if (buf && size > skip)
+    {
+      arena->a_buf = (char *)buf + skip;
+      arena->a_size = size - skip;
+    }
+}
+
+void *
+AMFArena_Alloc(AMFArena *arena, size_t size)
+{
+  void *ptr;
+  size = AMF_ARENA_ALIGN(size);
+  arena->a_total += size;
+  if (arena->a_used + size <= arena->a_size)
+    {
+      ptr = arena->a_buf + arena->a_used;
+      arena->a_used += size;
+      return ptr;
+    }
+  /* overflow chunk, folded into the main block on the next reset */
+  {
+    AMFArenaChunk *chunk = malloc(AMF_ARENA_ALIGN(sizeof(AMFArenaChunk)) + size);
+    if (!chunk)
+      return NULL;
+    chunk->ac_next = arena->a_chunks;
+    arena->a_chunks = chunk;
+    return (char *)chunk + AMF_ARENA_ALIGN(sizeof(AMFArenaChunk));
+  }
+}
+
+void
+AMFArena_Reset(AMFArena *arena)
+{
+  while (arena->a_chunks)
+    {
+      AMFArenaChunk *next = arena->a_chunks->ac_next;
+      free(arena->a_chunks);
+      arena->a_chunks = next;
+    }
+  if (arena->a_total > arena->a_size)
+    {
+      /* size the block for the largest message seen so far */
+      size_t size = arena->a_total < AMF_ARENA_MIN ? AMF_ARENA_MIN : arena->a_total;
+      char *buf = malloc(size);
+      if (buf)
+	{
+	  if (arena->a_owned)
+	    free(arena->a_buf);
+	  arena->a_buf = buf;
+	  arena->a_size = size;
+	  arena->a_owned = TRUE;
+	}
+    }
+  arena->a_used = 0;
+  arena->a_total = 0;
+}
+
+void
+AMFArena_Free(AMFArena *arena)
+{
+  /* not Reset, it may grow the block just to free it */
+  while (arena->a_chunks)
+    {
+      AMFArenaChunk *next = arena->a_chunks->ac_next;
+      free(arena->a_chunks);
+      arena->a_chunks = next;
+    }
+  if (arena->a_owned)
+    free(arena->a_buf);
+  memset(arena, 0, sizeof(*arena));
+}
+
+/* Property index */
+
+static unsigned int
+AMF_HashName(const AVal *name)
+{
+  unsigned int hash = 2166136261u;	/* fnv-1a */
+  int i;
+  for (i = 0; i < name->av_len; i++)
+    hash = (hash ^ (unsigned char)name->av_val[i]) * 16777619u;
+  return hash;
+}
+
+int
+AMF_IndexObject(AMFPropIndex *idx, AMFObject *obj, AMFArena *arena)
+{
+  int size = 8, n;
+  while (size < obj->o_num * 2)
+    size <<= 1;
+  idx->pi_obj = obj;
+  idx->pi_mask = size - 1;
+  idx->pi_slots = AMFArena_Alloc(arena, size * sizeof(int));
+  if (!idx->pi_slots)
+    return FALSE;
+  memset(idx->pi_slots, 0, size * sizeof(int));
+  for (n = 0; n < obj->o_num; n++)
+    {
+      unsigned int slot = AMF_HashName(&obj->o_props[n].p_name) & idx->pi_mask;
+      while (idx->pi_slots[slot])
+	{
+	  /* keep the first of duplicate names, as AMF_GetProp */
+	  if (AVMATCH(&obj->o_props[idx->pi_slots[slot] - 1].p_name, &obj->o_props[n].p_name))
+	    break;
+	  slot = (slot + 1) & idx->pi_mask;
+	}
+      if (!idx->pi_slots[slot])
+	idx->pi_slots[slot] = n + 1;
+    }
+  return TRUE;
+}
+
+AMFObjectProperty *
+AMF_IndexGetProp(AMFPropIndex *idx, const AVal *name)
+{
+  unsigned int slot = AMF_HashName(name) & idx->pi_mask;
+  while (idx->pi_slots[slot])
+    {
+      AMFObjectProperty *prop = &idx->pi_obj->o_props[idx->pi_slots[slot] - 1];
+      if (AVMATCH(&prop->p_name, name))
+	return prop;
+      slot = (slot + 1) & idx->pi_mask;
+    }
+  return (AMFObjectProperty *)&AMFProp_Invalid;
+}
+
+/* Encode builder */
+
+void
+AMFBuilder_Init(AMFBuilder *b, void *buf, size_t size, size_t head)
+{
+  b->ab_buf = buf;
+  b->ab_size = buf ? size : 0;
+  b->ab_head = head;
+  b->ab_len = 0;
+  b->ab_owned = FALSE;
+  b->ab_err = FALSE;
+  if (b->ab_size < head)
+    {
+      b->ab_buf = NULL;
+      b->ab_size = 0;
+      AMFBuilder_Grow(b, 0);
+    }
+}
+
+char *
+AMFBuilder_Grow(AMFBuilder *b, size_t n)
+{
+  char *p;
+  if (b->ab_err)
+    return NULL;
+  if (b->ab_head + b->ab_len + n > b->ab_size || !b->ab_buf)
+    {
+      size_t size = b->ab_size ? b->ab_size * 2 : 256;
+      char *buf;
+      while (size < b->ab_head + b->ab_len + n)
+	size *= 2;
+      if (size > AMF_BUILDER_MAX)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, message too large: %lu bytes", __FUNCTION__,
+	      (unsigned long)(b->ab_len + n));
+	  b->ab_err = TRUE;
+	  return NULL;
+	}
+      if (b->ab_owned)
+	buf = realloc(b->ab_buf, size);
+      else if ((buf = malloc(size)) && b->ab_buf)
+	memcpy(buf, b->ab_buf, b->ab_head + b->ab_len);
+      if (!buf)
+	{
+	  b->ab_err = TRUE;
+	  return NULL;
+	}
+      b->ab_buf = buf;
+      b->ab_size = size;
+      b->ab_owned = TRUE;
+    }
+  p = b->ab_buf + b->ab_head + b->ab_len;
+  b->ab_len += n;
+  return p;
+}
+
+void
+AMFBuilder_Append(AMFBuilder *b, const void *data, size_t n)
+{
+  char *p = AMFBuilder_Grow(b, n);
+  if (p)
+    memcpy(p, data, n);
+}
+
+void
+AMFBuilder_Marker(AMFBuilder *b, AMFDataType type)
+{
+  char *p = AMFBuilder_Grow(b, 1);
+  if (p)
+    *p = type;
+}
+
+void
+AMFBuilder_String(AMFBuilder *b, const AVal *str)
+{
+  int hlen = str->av_len < 65536 ? 3 : 5;
+  char *p = AMFBuilder_Grow(b, hlen + str->av_len);
+  if (!p)
+    return;
+  if (hlen == 3)
+    {
+      *p++ = AMF_STRING;
+      p = AMF_EncodeInt16(p, p + 2, str->av_len);
+    }
+  else
+    {
+      *p++ = AMF_LONG_STRING;
+      p = AMF_EncodeInt32(p, p + 4, str->av_len);
+    }
+  memcpy(p, str->av_val, str->av_len);
+}
+
+void
+AMFBuilder_Number(AMFBuilder *b, double dVal)
+{
+  char *p = AMFBuilder_Grow(b, 9);
+  if (p)
+    AMF_EncodeNumber(p, p + 9, dVal);
+}
+
+void
+AMFBuilder_Boolean(AMFBuilder *b, int bVal)
+{
+  char *p = AMFBuilder_Grow(b, 2);
+  if (p)
+    AMF_EncodeBoolean(p, p + 2, bVal);
+}
+
+void
+AMFBuilder_Name(AMFBuilder *b, const AVal *name)
+{
+  char *p = AMFBuilder_Grow(b, 2 + name->av_len);
+  if (p)
+    {
+      AMF_EncodeInt16(p, p + 2, name->av_len);
+      memcpy(p + 2, name->av_val, name->av_len);
+    }
+}
+
+void
+AMFBuilder_NamedString(AMFBuilder *b, const AVal *name, const AVal *value)
+{
+  AMFBuilder_Name(b, name);
+  AMFBuilder_String(b, value);
+}
+
+void
+AMFBuilder_NamedNumber(AMFBuilder *b, const AVal *name, double dVal)
+{
+  AMFBuilder_Name(b, name);
+  AMFBuilder_Number(b, dVal);
+}
+
+void
+AMFBuilder_NamedBoolean(AMFBuilder *b, const AVal *name, int bVal)
+{
+  AMFBuilder_Name(b, name);
+  AMFBuilder_Boolean(b, bVal);
+}
+
+void
+AMFBuilder_ObjectEnd(AMFBuilder *b)
+{
+  char *p = AMFBuilder_Grow(b, 3);
+  if (p)
+    AMF_EncodeInt24(p, p + 3, AMF_OBJECT_END);
+}
+
+/* the types AMFProp_Encode writes, anything else fails at any size */
+static int
+AMFProp_Encodable(const AMFObjectProperty *prop)
+{
+  int n;
+  switch (prop->p_type)
+    {
+    case AMF_NUMBER:
+    case AMF_BOOLEAN:
+    case AMF_STRING:
+    case AMF_NULL:
+      return TRUE;
+    case AMF_OBJECT:
+    case AMF_ECMA_ARRAY:
+    case AMF_STRICT_ARRAY:
+      for (n = 0; n < prop->p_vu.p_object.o_num; n++)
+	if (!AMFProp_Encodable(&prop->p_vu.p_object.o_props[n]))
+	  return FALSE;
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+void
+AMFBuilder_Prop(AMFBuilder *b, AMFObjectProperty *prop)
+{
+  size_t room = 64;
+  char *p, *end;
+
+  if (!AMFProp_Encodable(prop))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, cannot encode type %d", __FUNCTION__, prop->p_type);
+      b->ab_err = TRUE;
+      return;
+    }
+  /* the encoded size is not known up front, retry with more room */
+  for (;;)
+    {
+      if (!(p = AMFBuilder_Grow(b, room)))
+	return;
+      end = AMFProp_Encode(prop, p, p + room);
+      b->ab_len -= room;
+      if (end)
+	{
+	  b->ab_len += end - p;
+	  return;
+	}
+      room = b->ab_size - b->ab_head - b->ab_len + 1;
+    }
+}
+
+char *
+AMFBuilder_Data(AMFBuilder *b)
+{
+  return b->ab_buf ? b->ab_buf + b->ab_head : NULL;
+}
+
+void
+AMFBuilder_Free(AMFBuilder *b)
+{
+  if (b->ab_owned)
+    free(b->ab_buf);
+  b->ab_buf = NULL;
+  b->ab_size = 0;
+  b->ab_len = 0;
+  b->ab_owned = FALSE;
+}
+
+/* Cursor reader */
+
+void
+AMFCursor_Init(AMFCursor *cur, const char *pBuffer, int nSize)
+{
+  cur->c_cur = pBuffer;
+  cur->c_end = pBuffer + (nSize > 0 ? nSize : 0);
+  cur->c_err = FALSE;
+}
+
+static int
+AMFCursor_Need(AMFCursor *cur, unsigned int n)
+{
+  if (cur->c_err || (unsigned int)(cur->c_end - cur->c_cur) < n)
+    {
+      cur->c_err = TRUE;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+AMFDataType
+AMFCursor_PeekType(AMFCursor *cur)
+{
+  if (cur->c_err || cur->c_cur >= cur->c_end)
+    return AMF_INVALID;
+  return (AMFDataType)(unsigned char)*cur->c_cur;
+}
+
+int
+AMFCursor_NextName(AMFCursor *cur, AVal *name)
+{
+  unsigned int len;
+  name->av_val = NULL;
+  name->av_len = 0;
+  if (!AMFCursor_Need(cur, 3))
+    return FALSE;
+  len = AMF_DecodeInt16(cur->c_cur);
+  if (len == 0 && cur->c_cur[2] == AMF_OBJECT_END)
+    {
+      cur->c_cur += 3;
+      return FALSE;
+    }
+  if (!AMFCursor_Need(cur, 2 + len))
+    return FALSE;
+  AMF_DecodeString(cur->c_cur, name);
+  cur->c_cur += 2 + len;
+  return TRUE;
+}
+
+/* AMF3 values have no length prefix, they are decoded to be stepped over */
+static int
+AMFCursor_GetAMF3(AMFCursor *cur, AMFObjectProperty *prop)
+{
+  int nRes = AMF3Prop_Decode(prop, cur->c_cur + 1, cur->c_end - cur->c_cur - 1,
+			     FALSE);
+  if (nRes < 0)
+    {
+      cur->c_err = TRUE;
+      return FALSE;
+    }
+  cur->c_cur += 1 + nRes;
+  return TRUE;
+}
+
+int
+AMFCursor_Skip(AMFCursor *cur)
+{
+  AMFDataType type = AMFCursor_PeekType(cur);
+  AVal name;
+  unsigned int n;
+
+  if (type == AMF_INVALID)
+    {
+      cur->c_err = TRUE;
+      return FALSE;
+    }
+  cur->c_cur++;
+  switch (type)
+    {
+    case AMF_NUMBER:
+      n = 8;
+      break;
+    case AMF_BOOLEAN:
+      n = 1;
+      break;
+    case AMF_STRING:
+      if (!AMFCursor_Need(cur, 2))
+	return FALSE;
+      n = 2 + AMF_DecodeInt16(cur->c_cur);
+      break;
+    case AMF_LONG_STRING:
+    case AMF_XML_DOC:
+      if (!AMFCursor_Need(cur, 4))
+	return FALSE;
+      n = AMF_DecodeInt32(cur->c_cur);
+      if (n > 0xfffffffbu)
+	{
+	  cur->c_err = TRUE;
+	  return FALSE;
+	}
+      n += 4;
+      break;
+    case AMF_DATE:
+      n = 10;
+      break;
+    case AMF_NULL:
+    case AMF_UNDEFINED:
+    case AMF_UNSUPPORTED:
+      n = 0;
+      break;
+    case AMF_REFERENCE:
+      n = 2;
+      break;
+    case AMF_TYPED_OBJECT:
+      /* class name, then the members as in an object */
+      if (!AMFCursor_Need(cur, 2))
+	return FALSE;
+      n = 2 + AMF_DecodeInt16(cur->c_cur);
+      if (!AMFCursor_Need(cur, n))
+	return FALSE;
+      cur->c_cur += n;
+      /* fall through */
+    case AMF_OBJECT:
+    case AMF_ECMA_ARRAY:
+      if (type == AMF_ECMA_ARRAY)
+	{
+	  if (!AMFCursor_Need(cur, 4))
+	    return FALSE;
+	  cur->c_cur += 4;
+	}
+      while (AMFCursor_NextName(cur, &name))
+	if (!AMFCursor_Skip(cur))
+	  return FALSE;
+      return !cur->c_err;
+    case AMF_STRICT_ARRAY:
+      if (!AMFCursor_Need(cur, 4))
+	return FALSE;
+      n = AMF_DecodeInt32(cur->c_cur);
+      cur->c_cur += 4;
+      while (n--)
+	if (!AMFCursor_Skip(cur))
+	  return FALSE;
+      return TRUE;
+    case AMF_AVMPLUS:
+      {
+	AMFObjectProperty prop;
+	cur->c_cur--;
+	if (!AMFCursor_GetAMF3(cur, &prop))
+	  return FALSE;
+	AMFProp_Reset(&prop);
+	return TRUE;
+      }
+    default:
+      /* reserved markers carry no length */
+      cur->c_err = TRUE;
+      return FALSE;
+    }
+  if (!AMFCursor_Need(cur, n))
+    return FALSE;
+  cur->c_cur += n;
+  return TRUE;
+}
+
+int
+AMFCursor_GetString(AMFCursor *cur, AVal *str)
+{
+  AMFDataType type = AMFCursor_PeekType(cur);
+  const char *start = cur->c_cur;
+
+  str->av_val = NULL;
+  str->av_len = 0;
+  if (type == AMF_AVMPLUS)
+    {
+      AMFObjectProperty prop;
+      if (!AMFCursor_GetAMF3(cur, &prop))
+	return FALSE;
+      if (prop.p_type == AMF_STRING)
+	*str = prop.p_vu.p_aval;
+      AMFProp_Reset(&prop);
+      return str->av_val != NULL;
+    }
+  if (!AMFCursor_Skip(cur))
+    return FALSE;
+  if (type == AMF_STRING)
+    AMF_DecodeString(start + 1, str);
+  else if (type == AMF_LONG_STRING)
+    AMF_DecodeLongString(start + 1, str);
+  else
+    return FALSE;
+  return TRUE;
+}
+
+int
+AMFCursor_GetNumber(AMFCursor *cur, double *val)
+{
+  AMFDataType type = AMFCursor_PeekType(cur);
+  const char *start = cur->c_cur;
+
+  *val = 0.;
+  if (type == AMF_AVMPLUS)
+    {
+      AMFObjectProperty prop;
+      int ret;
+      if (!AMFCursor_GetAMF3(cur, &prop))
+	return FALSE;
+      ret = prop.p_type == AMF_NUMBER || prop.p_type == AMF_BOOLEAN ||
+	prop.p_type == AMF_DATE;
+      if (ret)
+	*val = prop.p_vu.p_number;
+      AMFProp_Reset(&prop);
+      return ret;
+    }
+  if (!AMFCursor_Skip(cur))
+    return FALSE;
+  if (type == AMF_NUMBER || type == AMF_DATE)
+    *val = AMF_DecodeNumber(start + 1);
+  else if (type == AMF_BOOLEAN)
+    *val = (double)AMF_DecodeBoolean(start + 1);
+  else
+    return FALSE;
+  return TRUE;
+}
+
+int
+AMFCursor_EnterObject(AMFCursor *cur)
+{
+  AMFDataType type = AMFCursor_PeekType(cur);
+  if (type == AMF_OBJECT)
+    {
+      cur->c_cur++;
+      return TRUE;
+    }
+  if (type == AMF_ECMA_ARRAY && AMFCursor_Need(cur, 5))
+    {
+      cur->c_cur += 5;
+      return TRUE;
+    }
+  if (type != AMF_INVALID)
+    AMFCursor_Skip(cur);
+  return FALSE;
+}
+
 int
 AMF_CountProp(AMFObject *obj)
 {
@@ -1309,3 +2439,353 @@ AMF3CD_GetProp(AMF3ClassDef *cd, int nIndex)
     return (AVal *)&AV_empty;
   return &cd->cd_props[nIndex];
 }
+
+/* AMF3 encoder */
+
+void
+AMF3Enc_Init(AMF3Encoder *e, AMFBuilder *out)
+{
+  memset(e, 0, sizeof(*e));
+  e->e_out = out;
+}
+
+void
+AMF3Enc_Reset(AMF3Encoder *e)
+{
+  AMFBuilder *out = e->e_out;
+  int i;
+  for (i = 0; i < e->e_ntraits; i++)
+    free(e->e_traits[i].cd_props);
+  free(e->e_traits);
+  free(e->e_strings);
+  free(e->e_slots);
+  AMF3Enc_Init(e, out);
+}
+
+void
+AMF3Enc_Free(AMF3Encoder *e)
+{
+  AMF3Enc_Reset(e);
+}
+
+static void
+AMF3Enc_U29(AMF3Encoder *e, uint32_t v)
+{
+  char *p;
+  v &= 0x1fffffff;
+  if (v < 0x80)
+    {
+      if ((p = AMFBuilder_Grow(e->e_out, 1)))
+	p[0] = v;
+    }
+  else if (v < 0x4000)
+    {
+      if ((p = AMFBuilder_Grow(e->e_out, 2)))
+	{
+	  p[0] = (v >> 7) | 0x80;
+	  p[1] = v & 0x7f;
+	}
+    }
+  else if (v < 0x200000)
+    {
+      if ((p = AMFBuilder_Grow(e->e_out, 3)))
+	{
+	  p[0] = (v >> 14) | 0x80;
+	  p[1] = ((v >> 7) & 0x7f) | 0x80;
+	  p[2] = v & 0x7f;
+	}
+    }
+  else if ((p = AMFBuilder_Grow(e->e_out, 4)))
+    {
+      p[0] = (v >> 22) | 0x80;
+      p[1] = ((v >> 15) & 0x7f) | 0x80;
+      p[2] = ((v >> 8) & 0x7f) | 0x80;
+      p[3] = v & 0xff;
+    }
+}
+
+static void
+AMF3Enc_Marker(AMF3Encoder *e, AMF3DataType type)
+{
+  char c = type;
+  AMFBuilder_Append(e->e_out, &c, 1);
+}
+
+/* string table lookup, -1 if not sent yet */
+static int
+AMF3Enc_FindString(AMF3Encoder *e, const AVal *str)
+{
+  unsigned int i;
+  if (!e->e_slots)
+    return -1;
+  for (i = AMF_HashName(str) & e->e_mask; e->e_slots[i];
+       i = (i + 1) & e->e_mask)
+    if (AVMATCH(&e->e_strings[e->e_slots[i] - 1], str))
+      return e->e_slots[i] - 1;
+  return -1;
+}
+
+static void
+AMF3Enc_AddString(AMF3Encoder *e, const AVal *str)
+{
+  int n = e->e_nstrings, i;
+
+  if (!(n & 0x0f))
+    {
+      AVal *strings = realloc(e->e_strings, (n + 16) * sizeof(AVal));
+      if (!strings)
+	return;
+      e->e_strings = strings;
+    }
+  if ((n + 1) * 2 > e->e_mask + 1)
+    {
+      int mask = e->e_mask ? e->e_mask * 2 + 1 : 31;
+      int *slots = calloc(mask + 1, sizeof(int));
+      if (!slots)
+	return;
+      free(e->e_slots);
+      e->e_slots = slots;
+      e->e_mask = mask;
+      for (i = 0; i < n; i++)
+	{
+	  unsigned int j = AMF_HashName(&e->e_strings[i]) & mask;
+	  while (slots[j])
+	    j = (j + 1) & mask;
+	  slots[j] = i + 1;
+	}
+    }
+  e->e_strings[n] = *str;
+  i = AMF_HashName(str) & e->e_mask;
+  while (e->e_slots[i])
+    i = (i + 1) & e->e_mask;
+  e->e_slots[i] = n + 1;
+  e->e_nstrings++;
+}
+
+/* U29S, the string must stay valid until the next reset */
+static void
+AMF3Enc_Str(AMF3Encoder *e, const AVal *str)
+{
+  int idx;
+  if (!str->av_len)
+    {
+      AMF3Enc_U29(e, 1);
+      return;
+    }
+  if ((idx = AMF3Enc_FindString(e, str)) >= 0)
+    {
+      AMF3Enc_U29(e, idx << 1);
+      return;
+    }
+  AMF3Enc_AddString(e, str);
+  AMF3Enc_U29(e, (str->av_len << 1) | 1);
+  AMFBuilder_Append(e->e_out, str->av_val, str->av_len);
+}
+
+/* marker, then 8 bytes in network order */
+static void
+AMF3Enc_Number64(AMF3Encoder *e, AMF3DataType type, int bRef, double dVal)
+{
+  char *p = AMFBuilder_Grow(e->e_out, bRef + 9);
+  if (!p)
+    return;
+  /* the AMF0 marker lands on p[bRef] and is overwritten below */
+  AMF_EncodeNumber(p + bRef, p + bRef + 9, dVal);
+  p[0] = type;
+  if (bRef)
+    p[1] = 1;			/* inline value, never a reference */
+}
+
+void
+AMF3Enc_Null(AMF3Encoder *e)
+{
+  AMF3Enc_Marker(e, AMF3_NULL);
+}
+
+void
+AMF3Enc_Boolean(AMF3Encoder *e, int bVal)
+{
+  AMF3Enc_Marker(e, bVal ? AMF3_TRUE : AMF3_FALSE);
+}
+
+void
+AMF3Enc_Integer(AMF3Encoder *e, int32_t nVal)
+{
+  if (nVal < AMF3_INTEGER_MIN || nVal > AMF3_INTEGER_MAX)
+    {
+      AMF3Enc_Double(e, nVal);
+      return;
+    }
+  AMF3Enc_Marker(e, AMF3_INTEGER);
+  AMF3Enc_U29(e, (uint32_t)nVal);
+}
+
+void
+AMF3Enc_Double(AMF3Encoder *e, double dVal)
+{
+  AMF3Enc_Number64(e, AMF3_DOUBLE, FALSE, dVal);
+}
+
+/* integral values in the U29 range go out as the shorter integer type */
+void
+AMF3Enc_Number(AMF3Encoder *e, double dVal)
+{
+  if (dVal >= AMF3_INTEGER_MIN && dVal <= AMF3_INTEGER_MAX &&
+      dVal == (double)(int32_t)dVal && (dVal != 0 || 1 / dVal > 0))
+    AMF3Enc_Integer(e, (int32_t)dVal);
+  else
+    AMF3Enc_Double(e, dVal);
+}
+
+void
+AMF3Enc_String(AMF3Encoder *e, const AVal *str)
+{
+  AMF3Enc_Marker(e, AMF3_STRING);
+  AMF3Enc_Str(e, str);
+}
+
+void
+AMF3Enc_Date(AMF3Encoder *e, double dVal)
+{
+  AMF3Enc_Number64(e, AMF3_DATE, TRUE, dVal);
+}
+
+void
+AMF3Enc_ByteArray(AMF3Encoder *e, const char *data, int len)
+{
+  AMF3Enc_Marker(e, AMF3_BYTE_ARRAY);
+  AMF3Enc_U29(e, ((uint32_t)len << 1) | 1);
+  AMFBuilder_Append(e->e_out, data, len);
+}
+
+/* index of a sent trait with the same class and sealed members, or -1 */
+static int
+AMF3Enc_FindTrait(AMF3Encoder *e, const AVal *className, AMFObject *obj,
+		  int nMembers)
+{
+  int i, j, k;
+  for (i = 0; i < e->e_ntraits; i++)
+    {
+      AMF3ClassDef *cd = &e->e_traits[i];
+      if (cd->cd_num != nMembers || cd->cd_name.av_len != className->av_len ||
+	  (className->av_len && !AVMATCH(&cd->cd_name, className)))
+	continue;
+      for (j = k = 0; j < obj->o_num; j++)
+	{
+	  if (!obj->o_props[j].p_name.av_len)
+	    continue;
+	  if (!AVMATCH(&cd->cd_props[k], &obj->o_props[j].p_name))
+	    break;
+	  k++;
+	}
+      if (j == obj->o_num)
+	return i;
+    }
+  return -1;
+}
+
+/* Sealed object, the named properties are the trait members. The names
+ * must stay valid until the next reset. */
+void
+AMF3Enc_Object(AMF3Encoder *e, const AVal *className, AMFObject *obj)
+{
+  AMF3ClassDef cd;
+  int i, n = 0, idx;
+
+  for (i = 0; i < obj->o_num; i++)
+    if (obj->o_props[i].p_name.av_len)
+      n++;
+  AMF3Enc_Marker(e, AMF3_OBJECT);
+  if ((idx = AMF3Enc_FindTrait(e, className, obj, n)) >= 0)
+    AMF3Enc_U29(e, ((uint32_t)idx << 2) | 1);
+  else
+    {
+      AMF3Enc_U29(e, ((uint32_t)n << 4) | 3);
+      AMF3Enc_Str(e, className);
+      memset(&cd, 0, sizeof(cd));
+      cd.cd_name = *className;
+      for (i = 0; i < obj->o_num; i++)
+	if (obj->o_props[i].p_name.av_len)
+	  {
+	    AMF3Enc_Str(e, &obj->o_props[i].p_name);
+	    AMF3CD_AddProp(&cd, &obj->o_props[i].p_name);
+	  }
+      if (!(e->e_ntraits & 0x0f))
+	{
+	  AMF3ClassDef *traits = realloc(e->e_traits,
+	    (e->e_ntraits + 16) * sizeof(AMF3ClassDef));
+	  if (!traits)
+	    {
+	      free(cd.cd_props);
+	      e->e_out->ab_err = TRUE;
+	      return;
+	    }
+	  e->e_traits = traits;
+	}
+      e->e_traits[e->e_ntraits++] = cd;
+    }
+  for (i = 0; i < obj->o_num; i++)
+    if (obj->o_props[i].p_name.av_len)
+      AMF3Enc_Prop(e, &obj->o_props[i]);
+}
+
+/* named properties form the associative part, unnamed ones the dense part */
+static void
+AMF3Enc_Array(AMF3Encoder *e, AMFObject *obj)
+{
+  int i, n = 0;
+
+  for (i = 0; i < obj->o_num; i++)
+    if (!obj->o_props[i].p_name.av_len)
+      n++;
+  AMF3Enc_Marker(e, AMF3_ARRAY);
+  AMF3Enc_U29(e, ((uint32_t)n << 1) | 1);
+  for (i = 0; i < obj->o_num; i++)
+    if (obj->o_props[i].p_name.av_len)
+      {
+	AMF3Enc_Str(e, &obj->o_props[i].p_name);
+	AMF3Enc_Prop(e, &obj->o_props[i]);
+      }
+  AMF3Enc_U29(e, 1);
+  for (i = 0; i < obj->o_num; i++)
+    if (!obj->o_props[i].p_name.av_len)
+      AMF3Enc_Prop(e, &obj->o_props[i]);
+}
+
+/* Encodes the value of prop, its name is left to the container */
+void
+AMF3Enc_Prop(AMF3Encoder *e, AMFObjectProperty *prop)
+{
+  switch (prop->p_type)
+    {
+    case AMF_NUMBER:
+      AMF3Enc_Number(e, prop->p_vu.p_number);
+      break;
+    case AMF_BOOLEAN:
+      AMF3Enc_Boolean(e, prop->p_vu.p_number != 0.0);
+      break;
+    case AMF_STRING:
+    case AMF_LONG_STRING:
+      AMF3Enc_String(e, &prop->p_vu.p_aval);
+      break;
+    case AMF_NULL:
+      AMF3Enc_Null(e);
+      break;
+    case AMF_UNDEFINED:
+      AMF3Enc_Marker(e, AMF3_UNDEFINED);
+      break;
+    case AMF_DATE:
+      AMF3Enc_Date(e, prop->p_vu.p_number);
+      break;
+    case AMF_OBJECT:
+      AMF3Enc_Object(e, &AV_empty, &prop->p_vu.p_object);
+      break;
+    case AMF_ECMA_ARRAY:
+    case AMF_STRICT_ARRAY:
+      AMF3Enc_Array(e, &prop->p_vu.p_object);
+      break;
+    default:
+      RTMP_Log(RTMP_LOGERROR, "%s, invalid type. %d", __FUNCTION__, prop->p_type);
+      e->e_out->ab_err = TRUE;
+    }
+}
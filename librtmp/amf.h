@@ -25,6 +25,7 @@
  *  http://www.gnu.org/copyleft/lgpl.html
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef TRUE
@@ -51,7 +52,9 @@ extern "C"
   typedef enum
   { AMF3_UNDEFINED = 0, AMF3_NULL, AMF3_FALSE, AMF3_TRUE,
     AMF3_INTEGER, AMF3_DOUBLE, AMF3_STRING, AMF3_XML_DOC, AMF3_DATE,
-    AMF3_ARRAY, AMF3_OBJECT, AMF3_XML, AMF3_BYTE_ARRAY
+    AMF3_ARRAY, AMF3_OBJECT, AMF3_XML, AMF3_BYTE_ARRAY,
+    AMF3_VECTOR_INT, AMF3_VECTOR_UINT, AMF3_VECTOR_DOUBLE,
+    AMF3_VECTOR_OBJECT, AMF3_DICTIONARY
   } AMF3DataType;
 
   typedef struct AVal
@@ -83,6 +86,45 @@ extern "C"
     int16_t p_UTCoffset;
   } AMFObjectProperty;
 
+  /* Bump allocator for one decoded message, AMFArena_Reset frees it all */
+  typedef struct AMFArena
+  {
+    char *a_buf;
+    size_t a_size;
+    size_t a_used;
+    size_t a_total;		/* bytes handed out since the last reset */
+    struct AMFArenaChunk *a_chunks;	/* overflow, freed on reset */
+    int a_owned;			/* a_buf was allocated by the arena */
+  } AMFArena;
+
+  /* Open addressing name -> property table over one object */
+  typedef struct AMFPropIndex
+  {
+    AMFObject *pi_obj;
+    int *pi_slots;		/* property index + 1, 0 is empty */
+    int pi_mask;
+  } AMFPropIndex;
+
+  /* Forward-only reader, values are read or skipped in place */
+  typedef struct AMFCursor
+  {
+    const char *c_cur;
+    const char *c_end;
+    int c_err;			/* truncated data or a value without a length */
+  } AMFCursor;
+
+  /* Growable encode buffer. ab_head bytes stay free in front of the data,
+   * e.g. for an RTMP chunk header. Starts on an optional caller block. */
+  typedef struct AMFBuilder
+  {
+    char *ab_buf;
+    size_t ab_head;
+    size_t ab_len;		/* encoded bytes after the headroom */
+    size_t ab_size;
+    int ab_owned;		/* ab_buf was allocated by the builder */
+    int ab_err;			/* out of memory, later appends are dropped */
+  } AMFBuilder;
+
   char *AMF_EncodeString(char *output, char *outend, const AVal * str);
   char *AMF_EncodeNumber(char *output, char *outend, double dVal);
   char *AMF_EncodeInt16(char *output, char *outend, short nVal);
@@ -109,8 +151,12 @@ extern "C"
 
   int AMF_Decode(AMFObject * obj, const char *pBuffer, int nSize,
 		 int bDecodeName);
+  int AMF_DecodeArena(AMFObject * obj, const char *pBuffer, int nSize,
+		      int bDecodeName, AMFArena * arena);
   int AMF_DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
 		      int nArrayLen, int bDecodeName);
+  int AMF_DecodeNumberArray(const char *pBuffer, int nSize, int nArrayLen,
+			    double *out);
   int AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize,
 		  int bDecodeName);
   void AMF_Dump(AMFObject * obj);
@@ -142,6 +188,40 @@ extern "C"
   int AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer,
 		     int nSize, int bDecodeName);
 
+  void AMFArena_Init(AMFArena * arena, void *buf, size_t size);
+  void *AMFArena_Alloc(AMFArena * arena, size_t size);
+  void AMFArena_Reset(AMFArena * arena);
+  void AMFArena_Free(AMFArena * arena);
+
+  int AMF_IndexObject(AMFPropIndex * idx, AMFObject * obj, AMFArena * arena);
+  AMFObjectProperty *AMF_IndexGetProp(AMFPropIndex * idx, const AVal * name);
+
+  void AMFBuilder_Init(AMFBuilder * b, void *buf, size_t size, size_t head);
+  char *AMFBuilder_Grow(AMFBuilder * b, size_t n);
+  void AMFBuilder_Append(AMFBuilder * b, const void *data, size_t n);
+  void AMFBuilder_Marker(AMFBuilder * b, AMFDataType type);
+  void AMFBuilder_String(AMFBuilder * b, const AVal * str);
+  void AMFBuilder_Number(AMFBuilder * b, double dVal);
+  void AMFBuilder_Boolean(AMFBuilder * b, int bVal);
+  void AMFBuilder_Name(AMFBuilder * b, const AVal * name);
+  void AMFBuilder_NamedString(AMFBuilder * b, const AVal * name, const AVal * value);
+  void AMFBuilder_NamedNumber(AMFBuilder * b, const AVal * name, double dVal);
+  void AMFBuilder_NamedBoolean(AMFBuilder * b, const AVal * name, int bVal);
+  void AMFBuilder_ObjectEnd(AMFBuilder * b);
+  void AMFBuilder_Prop(AMFBuilder * b, AMFObjectProperty * prop);
+  char *AMFBuilder_Data(AMFBuilder * b);
+  void AMFBuilder_Free(AMFBuilder * b);
+
+  /* The Get/Enter calls consume the next value even when its type does not
+   * match, they return FALSE then. NextName returns FALSE at the object end. */
+  void AMFCursor_Init(AMFCursor * cur, const char *pBuffer, int nSize);
+  AMFDataType AMFCursor_PeekType(AMFCursor * cur);
+  int AMFCursor_Skip(AMFCursor * cur);
+  int AMFCursor_GetString(AMFCursor * cur, AVal * str);
+  int AMFCursor_GetNumber(AMFCursor * cur, double *val);
+  int AMFCursor_EnterObject(AMFCursor * cur);
+  int AMFCursor_NextName(AMFCursor * cur, AVal * name);
+
   void AMFProp_Dump(AMFObjectProperty * prop);
   void AMFProp_Reset(AMFObjectProperty * prop);
 
@@ -157,6 +237,33 @@ extern "C"
   void AMF3CD_AddProp(AMF3ClassDef * cd, AVal * prop);
   AVal *AMF3CD_GetProp(AMF3ClassDef * cd, int idx);
 
+  /* AMF3 writer on a builder. Strings and object traits seen since the
+   * last reset are sent as references, reset at each AMF_AVMPLUS switch. */
+  typedef struct AMF3Encoder
+  {
+    AMFBuilder *e_out;
+    AVal *e_strings;
+    int e_nstrings;
+    int *e_slots;		/* string index + 1, 0 is empty */
+    int e_mask;
+    AMF3ClassDef *e_traits;
+    int e_ntraits;
+  } AMF3Encoder;
+
+  void AMF3Enc_Init(AMF3Encoder * e, AMFBuilder * out);
+  void AMF3Enc_Reset(AMF3Encoder * e);
+  void AMF3Enc_Free(AMF3Encoder * e);
+  void AMF3Enc_Null(AMF3Encoder * e);
+  void AMF3Enc_Boolean(AMF3Encoder * e, int bVal);
+  void AMF3Enc_Integer(AMF3Encoder * e, int32_t nVal);
+  void AMF3Enc_Double(AMF3Encoder * e, double dVal);
+  void AMF3Enc_Number(AMF3Encoder * e, double dVal);
+  void AMF3Enc_String(AMF3Encoder * e, const AVal * str);
+  void AMF3Enc_Date(AMF3Encoder * e, double dVal);
+  void AMF3Enc_ByteArray(AMF3Encoder * e, const char *data, int len);
+  void AMF3Enc_Object(AMF3Encoder * e, const AVal * className, AMFObject * obj);
+  void AMF3Enc_Prop(AMF3Encoder * e, AMFObjectProperty * prop);
+
 #ifdef __cplusplus
 }
 #endif
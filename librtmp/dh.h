@@ -181,12 +181,66 @@ typedef BIGNUM * MP_t;
 #define MP_setbin(u,buf,len)	BN_bn2bin(u,buf)
 #define MP_getbin(u,buf,len)	u = BN_bin2bn(buf,len,0)
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
 #define MDH	DH
 #define MDH_new()	DH_new()
 #define MDH_free(dh)	DH_free(dh)
 #define MDH_generate_key(dh)	DH_generate_key(dh)
 #define MDH_compute_key(secret, seclen, pub, dh)	DH_compute_key(secret, pub, dh)
 
+#else	/* DH is opaque since 1.1.0 */
+typedef struct MDH {
+  MP_t p;
+  MP_t g;
+  MP_t pub_key;
+  MP_t priv_key;
+  long length;
+  DH *dh;
+} MDH;
+
+#define MDH_new()	calloc(1,sizeof(MDH))
+#define MDH_free(vp)	do {MDH *_dh = vp; DH_free(_dh->dh); BN_free(_dh->p); BN_free(_dh->g); BN_free(_dh->pub_key); BN_free(_dh->priv_key); free(_dh);} while(0)
+
+static int MDH_generate_key(MDH *dh)
+{
+  const BIGNUM *pub, *priv;
+  BIGNUM *p, *g;
+
+  if (!dh->dh)
+    {
+      dh->dh = DH_new();
+      p = BN_dup(dh->p);
+      g = BN_dup(dh->g);
+      if (!dh->dh || !p || !g || !DH_set0_pqg(dh->dh, p, NULL, g))
+	{
+	  BN_free(p);
+	  BN_free(g);
+	  return 0;
+	}
+    }
+  else
+    {
+      /* regenerate: drop the rejected pair so a fresh one is made */
+      DH *fresh = DHparams_dup(dh->dh);
+      if (!fresh)
+	return 0;
+      DH_free(dh->dh);
+      dh->dh = fresh;
+    }
+  /* newer releases want a private key shorter than p */
+  if (dh->length < BN_num_bits(dh->p))
+    DH_set_length(dh->dh, dh->length);
+  if (!DH_generate_key(dh->dh))
+    return 0;
+  DH_get0_key(dh->dh, &pub, &priv);
+  dh->pub_key = BN_dup(pub);
+  dh->priv_key = BN_dup(priv);
+  return dh->pub_key && dh->priv_key;
+}
+
+#define MDH_compute_key(secret, seclen, pub, dh)	DH_compute_key(secret, pub, (dh)->dh)
+#endif
+
 #endif
 
 #include "log.h"
@@ -244,26 +298,66 @@ failed:
   return ret;
 }
 
+/* P1024 and Q1024 parsed once, read-only afterwards */
+static MP_t DHGroupP, DHGroupQ;
+static RTMP_MUTEX DHLock = RTMP_MUTEX_INIT;
+
+static int
+DHGroupInit(void)
+{
+  size_t res = 1;
+
+  MutexLock(&DHLock);
+  if (!DHGroupQ)
+    {
+      MP_t p = NULL, q = NULL;
+
+      MP_gethex(p, P1024, res);	/* prime P1024, see dhgroups.h */
+      if (res)
+	{
+	  MP_gethex(q, Q1024, res);
+	  if (res)
+	    {
+	      DHGroupP = p;
+	      DHGroupQ = q;
+	    }
+	  else
+	    {
+	      MP_free(p);
+	      if (q)
+		{
+		  MP_free(q);
+		}
+	    }
+	}
+      else if (p)
+	{
+	  MP_free(p);
+	}
+    }
+  MutexUnlock(&DHLock);
+  return res != 0;
+}
+
 static MDH *
 DHInit(int nKeyBits)
 {
-  size_t res;
-  MDH *dh = MDH_new();
+  MDH *dh;
 
+  if (!DHGroupInit())
+    return 0;
+
+  dh = MDH_new();
   if (!dh)
     goto failed;
 
   MP_new(dh->g);
+  MP_new(dh->p);
 
-  if (!dh->g)
+  if (!dh->g || !dh->p)
     goto failed;
 
-  MP_gethex(dh->p, P1024, res);	/* prime P1024, see dhgroups.h */
-  if (!res)
-    {
-      goto failed;
-    }
-
+  MP_set(dh->p, DHGroupP);
   MP_set_w(dh->g, 2);	/* base 2 */
 
   dh->length = nKeyBits;
@@ -285,27 +379,130 @@ DHGenerateKey(MDH *dh)
 
   while (!res)
     {
-      MP_t q1 = NULL;
-
       if (!MDH_generate_key(dh))
 	return 0;
 
-      MP_gethex(q1, Q1024, res);
-      assert(res);
-
-      res = isValidPublicKey(dh->pub_key, dh->p, q1);
+      /* our own key only needs the range check, y^q mod p is for the peer */
+      res = isValidPublicKey(dh->pub_key, dh->p, NULL);
       if (!res)
 	{
 	  MP_free(dh->pub_key);
 	  MP_free(dh->priv_key);
 	  dh->pub_key = dh->priv_key = 0;
 	}
-
-      MP_free(q1);
     }
   return 1;
 }
 
+/* Keypairs are generated ahead of time by a background thread so that a
+ * handshake only has to take one. RTMP_DH_POOL is the number kept ready.
+ */
+#ifndef RTMP_DH_POOL
+#define RTMP_DH_POOL	8
+#endif
+#ifdef USE_POLARSSL	/* havege state is shared with TLS and not thread safe */
+#undef RTMP_DH_POOL
+#define RTMP_DH_POOL	0
+#endif
+
+#if RTMP_DH_POOL > 0
+static MDH *DHPool[RTMP_DH_POOL];
+static int DHPoolCount;
+static int DHPoolFilling;
+
+#ifdef _WIN32
+static DWORD WINAPI
+#else
+static void *
+#endif
+DHPoolFill(void *arg)
+{
+  int full = FALSE;
+
+  while (!full)
+    {
+      MDH *dh = DHInit(1024);
+      if (dh && !DHGenerateKey(dh))
+	{
+	  MDH_free(dh);
+	  dh = NULL;
+	}
+
+      MutexLock(&DHLock);
+      if (!dh)
+	full = TRUE;
+      else if (DHPoolCount < RTMP_DH_POOL)
+	{
+	  DHPool[DHPoolCount++] = dh;
+	  dh = NULL;
+	}
+      if (DHPoolCount == RTMP_DH_POOL)
+	full = TRUE;
+      if (full)
+	DHPoolFilling = FALSE;
+      MutexUnlock(&DHLock);
+
+      if (dh)
+	MDH_free(dh);
+    }
+  return 0;
+}
+
+/* called with DHLock held */
+static void
+DHPoolRefill(void)
+{
+  int ok;
+
+  if (DHPoolFilling || DHPoolCount == RTMP_DH_POOL)
+    return;
+#ifdef _WIN32
+  {
+    HANDLE th = CreateThread(NULL, 0, DHPoolFill, NULL, 0, NULL);
+    ok = th != NULL;
+    if (ok)
+      CloseHandle(th);
+  }
+#else
+  {
+    pthread_t th;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ok = pthread_create(&th, &attr, DHPoolFill, NULL) == 0;
+    pthread_attr_destroy(&attr);
+  }
+#endif
+  if (ok)
+    DHPoolFilling = TRUE;
+}
+#endif
+
+/* a keypair ready for DHGetPublicKey, generated inline when the pool is empty */
+static MDH *
+DHTakeKey(void)
+{
+  MDH *dh = NULL;
+
+#if RTMP_DH_POOL > 0
+  MutexLock(&DHLock);
+  if (DHPoolCount)
+    dh = DHPool[--DHPoolCount];
+  DHPoolRefill();
+  MutexUnlock(&DHLock);
+  if (dh)
+    return dh;
+#endif
+
+  dh = DHInit(1024);
+  if (dh && !DHGenerateKey(dh))
+    {
+      MDH_free(dh);
+      dh = NULL;
+    }
+  return dh;
+}
+
 /* fill pubkey with the public key in BIG ENDIAN order
  * 00 00 00 00 00 x1 x2 x3 .....
  */
@@ -350,26 +547,21 @@ static int
 DHComputeSharedSecretKey(MDH *dh, uint8_t *pubkey, size_t nPubkeyLen,
 			 uint8_t *secret)
 {
-  MP_t q1 = NULL, pubkeyBn = NULL;
-  size_t len;
+  MP_t pubkeyBn = NULL;
   int res;
 
-  if (!dh || !secret || nPubkeyLen >= INT_MAX)
+  if (!dh || !secret || nPubkeyLen >= INT_MAX || !DHGroupInit())
     return -1;
 
   MP_getbin(pubkeyBn, pubkey, nPubkeyLen);
   if (!pubkeyBn)
     return -1;
 
-  MP_gethex(q1, Q1024, len);
-  assert(len);
-
-  if (isValidPublicKey(pubkeyBn, dh->p, q1))
+  if (isValidPublicKey(pubkeyBn, dh->p, DHGroupQ))
     res = MDH_compute_key(secret, nPubkeyLen, pubkeyBn, dh);
   else
     res = -1;
 
-  MP_free(q1);
   MP_free(pubkeyBn);
 
   return res;
@@ -30,10 +30,11 @@
 #ifndef SHA256_DIGEST_LENGTH
 #define SHA256_DIGEST_LENGTH	32
 #endif
-#define HMAC_CTX	sha2_context
-#define HMAC_setup(ctx, key, len)	sha2_hmac_starts(&ctx, (unsigned char *)key, len, 0)
-#define HMAC_crunch(ctx, buf, len)	sha2_hmac_update(&ctx, buf, len)
-#define HMAC_finish(ctx, dig, dlen)	dlen = SHA256_DIGEST_LENGTH; sha2_hmac_finish(&ctx, dig)
+#define SHA256_CTX_T	sha2_context
+#define SHA256_setup(ctx)	sha2_starts(&ctx, 0)
+#define SHA256_crunch(ctx, buf, len)	sha2_update(&ctx, (unsigned char *)buf, len)
+#define SHA256_finish(ctx, dig)	sha2_finish(&ctx, dig)
+#define HMAC_oneshot(key, klen, buf, len, dig)	sha2_hmac((unsigned char *)key, klen, (unsigned char *)buf, len, dig, 0)
 
 typedef arc4_context *	RC4_handle;
 #define RC4_alloc(h)	*h = malloc(sizeof(arc4_context))
@@ -48,12 +49,10 @@ typedef arc4_context *	RC4_handle;
 #ifndef SHA256_DIGEST_LENGTH
 #define SHA256_DIGEST_LENGTH	32
 #endif
-#undef HMAC_CTX
-#define HMAC_CTX	struct hmac_sha256_ctx
-#define HMAC_setup(ctx, key, len)	hmac_sha256_set_key(&ctx, len, key)
-#define HMAC_crunch(ctx, buf, len)	hmac_sha256_update(&ctx, len, buf)
-#define HMAC_finish(ctx, dig, dlen)	dlen = SHA256_DIGEST_LENGTH; hmac_sha256_digest(&ctx, SHA256_DIGEST_LENGTH, dig)
-#define HMAC_close(ctx)
+#define SHA256_CTX_T	struct sha256_ctx
+#define SHA256_setup(ctx)	sha256_init(&ctx)
+#define SHA256_crunch(ctx, buf, len)	sha256_update(&ctx, len, buf)
+#define SHA256_finish(ctx, dig)	sha256_digest(&ctx, SHA256_DIGEST_LENGTH, dig)
 
 typedef struct arcfour_ctx*	RC4_handle;
 #define RC4_alloc(h)	*h = malloc(sizeof(struct arcfour_ctx))
@@ -69,9 +68,11 @@ typedef struct arcfour_ctx*	RC4_handle;
 #if OPENSSL_VERSION_NUMBER < 0x0090800 || !defined(SHA256_DIGEST_LENGTH)
 #error Your OpenSSL is too old, need 0.9.8 or newer with SHA256
 #endif
-#define HMAC_setup(ctx, key, len)	HMAC_CTX_init(&ctx); HMAC_Init_ex(&ctx, key, len, EVP_sha256(), 0)
-#define HMAC_crunch(ctx, buf, len)	HMAC_Update(&ctx, buf, len)
-#define HMAC_finish(ctx, dig, dlen)	HMAC_Final(&ctx, dig, &dlen); HMAC_CTX_cleanup(&ctx)
+#define SHA256_CTX_T	SHA256_CTX
+#define SHA256_setup(ctx)	SHA256_Init(&ctx)
+#define SHA256_crunch(ctx, buf, len)	SHA256_Update(&ctx, buf, len)
+#define SHA256_finish(ctx, dig)	SHA256_Final(dig, &ctx)
+#define HMAC_oneshot(key, klen, buf, len, dig)	HMAC(EVP_sha256(), key, klen, buf, len, dig, NULL)
 
 typedef RC4_KEY *	RC4_handle;
 #define RC4_alloc(h)	*h = malloc(sizeof(RC4_KEY))
@@ -110,30 +111,94 @@ static const uint8_t GenuineFPKey[] = {
     0x31, 0xAE
 };				/* 62 */
 
+/* HMAC-SHA256 with the key already absorbed, per RFC 2104 */
+typedef struct HMACKey
+{
+  SHA256_CTX_T inner;	/* state after key ^ ipad */
+  SHA256_CTX_T outer;	/* state after key ^ opad */
+} HMACKey;
+
+static void
+HMACKeySetup(HMACKey *hk, const uint8_t *key, size_t keylen)
+{
+  uint8_t pad[64], hashed[SHA256_DIGEST_LENGTH];
+  size_t i;
+
+  if (keylen > sizeof(pad))
+    {
+      SHA256_CTX_T ctx;
+      SHA256_setup(ctx);
+      SHA256_crunch(ctx, key, keylen);
+      SHA256_finish(ctx, hashed);
+      key = hashed;
+      keylen = SHA256_DIGEST_LENGTH;
+    }
+
+  memset(pad, 0x36, sizeof(pad));
+  for (i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+  SHA256_setup(hk->inner);
+  SHA256_crunch(hk->inner, pad, sizeof(pad));
+
+  memset(pad, 0x5c, sizeof(pad));
+  for (i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+  SHA256_setup(hk->outer);
+  SHA256_crunch(hk->outer, pad, sizeof(pad));
+}
+
+/* digest of buf1 followed by buf2, the key states are only copied */
+static void
+HMACKeyDigest(const HMACKey *hk, const uint8_t *buf1, size_t len1,
+	      const uint8_t *buf2, size_t len2, uint8_t *digest)
+{
+  SHA256_CTX_T ctx = hk->inner;
+
+  SHA256_crunch(ctx, buf1, len1);
+  if (len2)
+    SHA256_crunch(ctx, buf2, len2);
+  SHA256_finish(ctx, digest);
+
+  ctx = hk->outer;
+  SHA256_crunch(ctx, digest, SHA256_DIGEST_LENGTH);
+  SHA256_finish(ctx, digest);
+}
+
+static void
+HMACsha256(const uint8_t *message, size_t messageLen, const uint8_t *key,
+	   size_t keylen, uint8_t *digest)
+{
+#ifdef HMAC_oneshot
+  HMAC_oneshot(key, keylen, message, messageLen, digest);
+#else
+  HMACKey hk;
+
+  HMACKeySetup(&hk, key, keylen);
+  HMACKeyDigest(&hk, message, messageLen, NULL, 0, digest);
+#endif
+}
+
 static void InitRC4Encryption
   (uint8_t * secretKey,
    uint8_t * pubKeyIn,
    uint8_t * pubKeyOut, RC4_handle *rc4keyIn, RC4_handle *rc4keyOut)
 {
   uint8_t digest[SHA256_DIGEST_LENGTH];
-  unsigned int digestLen = 0;
-  HMAC_CTX ctx;
+  HMACKey hk;
 
   RC4_alloc(rc4keyIn);
   RC4_alloc(rc4keyOut);
 
-  HMAC_setup(ctx, secretKey, 128);
-  HMAC_crunch(ctx, pubKeyIn, 128);
-  HMAC_finish(ctx, digest, digestLen);
+  /* both keys come from the same secret */
+  HMACKeySetup(&hk, secretKey, 128);
+  HMACKeyDigest(&hk, pubKeyIn, 128, NULL, 0, digest);
 
   RTMP_Log(RTMP_LOGDEBUG, "RC4 Out Key: ");
   RTMP_LogHex(RTMP_LOGDEBUG, digest, 16);
 
   RC4_setkey(*rc4keyOut, 16, digest);
 
-  HMAC_setup(ctx, secretKey, 128);
-  HMAC_crunch(ctx, pubKeyOut, 128);
-  HMAC_finish(ctx, digest, digestLen);
+  HMACKeyDigest(&hk, pubKeyOut, 128, NULL, 0, digest);
 
   RTMP_Log(RTMP_LOGDEBUG, "RC4 In Key: ");
   RTMP_LogHex(RTMP_LOGDEBUG, digest, 16);
@@ -261,42 +326,47 @@ GetDigestOffset1(uint8_t *handshake, unsigned int len)
 static getoff *digoff[] = {GetDigestOffset1, GetDigestOffset2};
 static getoff *dhoff[] = {GetDHOffset1, GetDHOffset2};
 
-static void
-HMACsha256(const uint8_t *message, size_t messageLen, const uint8_t *key,
-	   size_t keylen, uint8_t *digest)
-{
-  unsigned int digestLen;
-  HMAC_CTX ctx;
-
-  HMAC_setup(ctx, key, keylen);
-  HMAC_crunch(ctx, message, messageLen);
-  HMAC_finish(ctx, digest, digestLen);
+/* the Genuine keys never change, their HMAC states are prepared once */
+enum { GENUINE_FP_30, GENUINE_FP, GENUINE_FMS_36, GENUINE_FMS, GENUINE_KEYS };
+static HMACKey GenuineKeys[GENUINE_KEYS];
+static int GenuineKeysReady;
+static RTMP_MUTEX GenuineKeysLock = RTMP_MUTEX_INIT;
 
-  assert(digestLen == 32);
+static const HMACKey *
+GenuineKey(int which)
+{
+  MutexLock(&GenuineKeysLock);
+  if (!GenuineKeysReady)
+    {
+      HMACKeySetup(&GenuineKeys[GENUINE_FP_30], GenuineFPKey, 30);
+      HMACKeySetup(&GenuineKeys[GENUINE_FP], GenuineFPKey,
+		   sizeof(GenuineFPKey));
+      HMACKeySetup(&GenuineKeys[GENUINE_FMS_36], GenuineFMSKey, 36);
+      HMACKeySetup(&GenuineKeys[GENUINE_FMS], GenuineFMSKey,
+		   sizeof(GenuineFMSKey));
+      GenuineKeysReady = TRUE;
+    }
+  MutexUnlock(&GenuineKeysLock);
+  return &GenuineKeys[which];
 }
 
+/* the digest covers the whole signature except the digest itself */
 static void
 CalculateDigest(unsigned int digestPos, uint8_t *handshakeMessage,
-		const uint8_t *key, size_t keyLen, uint8_t *digest)
+		const HMACKey *key, uint8_t *digest)
 {
-  const int messageLen = RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH;
-  uint8_t message[RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH];
-
-  memcpy(message, handshakeMessage, digestPos);
-  memcpy(message + digestPos,
-	 &handshakeMessage[digestPos + SHA256_DIGEST_LENGTH],
-	 messageLen - digestPos);
-
-  HMACsha256(message, messageLen, key, keyLen, digest);
+  HMACKeyDigest(key, handshakeMessage, digestPos,
+		&handshakeMessage[digestPos + SHA256_DIGEST_LENGTH],
+		RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH - digestPos, digest);
 }
 
 static int
-VerifyDigest(unsigned int digestPos, uint8_t *handshakeMessage, const uint8_t *key,
-	     size_t keyLen)
+VerifyDigest(unsigned int digestPos, uint8_t *handshakeMessage,
+	     const HMACKey *key)
 {
   uint8_t calcDigest[SHA256_DIGEST_LENGTH];
 
-  CalculateDigest(digestPos, handshakeMessage, key, keyLen, calcDigest);
+  CalculateDigest(digestPos, handshakeMessage, key, calcDigest);
 
   return memcmp(&handshakeMessage[digestPos], calcDigest,
 		SHA256_DIGEST_LENGTH) == 0;
@@ -671,17 +741,37 @@ static void bf_setkey(const unsigned char *kp, int keybytes, bf_key *key)
   }
 }
 
+/* expanded on first use, each schedule costs 521 block encryptions */
+static bf_key *rtmpe9_sched[16];
+static RTMP_MUTEX rtmpe9_lock = RTMP_MUTEX_INIT;
+
 static void rtmpe9_sig(uint8_t *in, uint8_t *out, int keyid)
 {
   uint32_t d[2];
-  bf_key key;
+  bf_key tmp, *key;
 
-  bf_setkey(rtmpe9_keys[keyid], KEYBYTES, &key);
+  MutexLock(&rtmpe9_lock);
+  key = rtmpe9_sched[keyid];
+  if (!key)
+    {
+      key = malloc(sizeof(bf_key));
+      if (key)
+	{
+	  bf_setkey(rtmpe9_keys[keyid], KEYBYTES, key);
+	  rtmpe9_sched[keyid] = key;
+	}
+    }
+  MutexUnlock(&rtmpe9_lock);
+  if (!key)
+    {
+      key = &tmp;
+      bf_setkey(rtmpe9_keys[keyid], KEYBYTES, key);
+    }
 
   /* input is little-endian */
   d[0] = in[0] | (in[1] << 8) | (in[2] << 16) | (in[3] << 24);
   d[1] = in[4] | (in[5] << 8) | (in[6] << 16) | (in[7] << 24);
-  bf_enc(d, &key);
+  bf_enc(d, key);
   out[0] = d[0] & 0xff;
   out[1] = (d[0] >> 8) & 0xff;
   out[2] = (d[0] >> 16) & 0xff;
@@ -768,11 +858,11 @@ HandShake(RTMP * r, int FP9HandShake)
     {
       if (encrypted)
 	{
-	  /* generate Diffie-Hellmann parameters */
-	  r->Link.dh = DHInit(1024);
+	  /* take a Diffie-Hellmann keypair, usually generated ahead of time */
+	  r->Link.dh = DHTakeKey();
 	  if (!r->Link.dh)
 	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
 		  __FUNCTION__);
 	      return FALSE;
 	    }
@@ -780,13 +870,6 @@ HandShake(RTMP * r, int FP9HandShake)
 	  dhposClient = getdh(clientsig, RTMP_SIG_SIZE);
 	  RTMP_Log(RTMP_LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposClient);
 
-	  if (!DHGenerateKey(r->Link.dh))
-	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-		  __FUNCTION__);
-	      return FALSE;
-	    }
-
 	  if (!DHGetPublicKey(r->Link.dh, &clientsig[dhposClient], 128))
 	    {
 	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't write public key!", __FUNCTION__);
@@ -798,7 +881,7 @@ HandShake(RTMP * r, int FP9HandShake)
       RTMP_Log(RTMP_LOGDEBUG, "%s: Client digest offset: %d", __FUNCTION__,
 	  digestPosClient);
 
-      CalculateDigest(digestPosClient, clientsig, GenuineFPKey, 30,
+      CalculateDigest(digestPosClient, clientsig, GenuineKey(GENUINE_FP_30),
 		      &clientsig[digestPosClient]);
 
       RTMP_Log(RTMP_LOGDEBUG, "%s: Initial client digest: ", __FUNCTION__);
@@ -850,7 +933,8 @@ HandShake(RTMP * r, int FP9HandShake)
       /* we have to use this signature now to find the correct algorithms for getting the digest and DH positions */
       int digestPosServer = getdig(serversig, RTMP_SIG_SIZE);
 
-      if (!VerifyDigest(digestPosServer, serversig, GenuineFMSKey, 36))
+      if (!VerifyDigest(digestPosServer, serversig,
+			GenuineKey(GENUINE_FMS_36)))
 	{
 	  RTMP_Log(RTMP_LOGWARNING, "Trying different position for server digest!");
 	  offalg ^= 1;
@@ -858,7 +942,8 @@ HandShake(RTMP * r, int FP9HandShake)
 	  getdh  = dhoff[offalg];
 	  digestPosServer = getdig(serversig, RTMP_SIG_SIZE);
 
-	  if (!VerifyDigest(digestPosServer, serversig, GenuineFMSKey, 36))
+	  if (!VerifyDigest(digestPosServer, serversig,
+			    GenuineKey(GENUINE_FMS_36)))
 	    {
 	      RTMP_Log(RTMP_LOGERROR, "Couldn't verify the server digest");	/* continuing anyway will probably fail */
 	      return FALSE;
@@ -919,8 +1004,8 @@ HandShake(RTMP * r, int FP9HandShake)
       /* calculate response now */
       signatureResp = reply+RTMP_SIG_SIZE-SHA256_DIGEST_LENGTH;
 
-      HMACsha256(&serversig[digestPosServer], SHA256_DIGEST_LENGTH,
-		 GenuineFPKey, sizeof(GenuineFPKey), digestResp);
+      HMACKeyDigest(GenuineKey(GENUINE_FP), &serversig[digestPosServer],
+		    SHA256_DIGEST_LENGTH, NULL, 0, digestResp);
       HMACsha256(reply, RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH, digestResp,
 		 SHA256_DIGEST_LENGTH, signatureResp);
 
@@ -968,6 +1053,14 @@ HandShake(RTMP * r, int FP9HandShake)
   if (!WriteN(r, (char *)reply, RTMP_SIG_SIZE))
     return FALSE;
 
+  /* without a digest to verify, S2 can wait until connect is sent */
+  if (!FP9HandShake && (r->Link.lFlags & RTMP_LF_PIPE) &&
+      !(r->Link.protocol & RTMP_FEATURE_HTTP))
+    {
+      r->m_bHandshakePending = TRUE;
+      return TRUE;
+    }
+
   /* 2nd part of handshake */
   if (ReadN(r, (char *)serversig, RTMP_SIG_SIZE) != RTMP_SIG_SIZE)
     return FALSE;
@@ -994,8 +1087,8 @@ HandShake(RTMP * r, int FP9HandShake)
 	     SHA256_DIGEST_LENGTH);
 
       /* verify server response */
-      HMACsha256(&clientsig[digestPosClient], SHA256_DIGEST_LENGTH,
-		 GenuineFMSKey, sizeof(GenuineFMSKey), digest);
+      HMACKeyDigest(GenuineKey(GENUINE_FMS), &clientsig[digestPosClient],
+		    SHA256_DIGEST_LENGTH, NULL, 0, digest);
       HMACsha256(serversig, RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH, digest,
 		 SHA256_DIGEST_LENGTH, signature);
 
@@ -1156,11 +1249,11 @@ SHandShake(RTMP * r)
     {
       if (encrypted)
 	{
-	  /* generate Diffie-Hellmann parameters */
-	  r->Link.dh = DHInit(1024);
+	  /* take a Diffie-Hellmann keypair, usually generated ahead of time */
+	  r->Link.dh = DHTakeKey();
 	  if (!r->Link.dh)
 	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
 		  __FUNCTION__);
 	      return FALSE;
 	    }
@@ -1168,13 +1261,6 @@ SHandShake(RTMP * r)
 	  dhposServer = getdh(serversig, RTMP_SIG_SIZE);
 	  RTMP_Log(RTMP_LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposServer);
 
-	  if (!DHGenerateKey(r->Link.dh))
-	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-		  __FUNCTION__);
-	      return FALSE;
-	    }
-
 	  if (!DHGetPublicKey
 	      (r->Link.dh, (uint8_t *) &serversig[dhposServer], 128))
 	    {
@@ -1187,7 +1273,7 @@ SHandShake(RTMP * r)
       RTMP_Log(RTMP_LOGDEBUG, "%s: Server digest offset: %d", __FUNCTION__,
 	  digestPosServer);
 
-      CalculateDigest(digestPosServer, serversig, GenuineFMSKey, 36,
+      CalculateDigest(digestPosServer, serversig, GenuineKey(GENUINE_FMS_36),
 		      &serversig[digestPosServer]);
 
       RTMP_Log(RTMP_LOGDEBUG, "%s: Initial server digest: ", __FUNCTION__);
@@ -1217,7 +1303,8 @@ SHandShake(RTMP * r)
       /* we have to use this signature now to find the correct algorithms for getting the digest and DH positions */
       int digestPosClient = getdig(clientsig, RTMP_SIG_SIZE);
 
-      if (!VerifyDigest(digestPosClient, clientsig, GenuineFPKey, 30))
+      if (!VerifyDigest(digestPosClient, clientsig,
+			GenuineKey(GENUINE_FP_30)))
 	{
 	  RTMP_Log(RTMP_LOGWARNING, "Trying different position for client digest!");
 	  offalg ^= 1;
@@ -1226,7 +1313,8 @@ SHandShake(RTMP * r)
 
 	  digestPosClient = getdig(clientsig, RTMP_SIG_SIZE);
 
-	  if (!VerifyDigest(digestPosClient, clientsig, GenuineFPKey, 30))
+	  if (!VerifyDigest(digestPosClient, clientsig,
+			    GenuineKey(GENUINE_FP_30)))
 	    {
 	      RTMP_Log(RTMP_LOGERROR, "Couldn't verify the client digest");	/* continuing anyway will probably fail */
 	      return FALSE;
@@ -1281,8 +1369,8 @@ SHandShake(RTMP * r)
       /* calculate response now */
       signatureResp = clientsig+RTMP_SIG_SIZE-SHA256_DIGEST_LENGTH;
 
-      HMACsha256(&clientsig[digestPosClient], SHA256_DIGEST_LENGTH,
-		 GenuineFMSKey, sizeof(GenuineFMSKey), digestResp);
+      HMACKeyDigest(GenuineKey(GENUINE_FMS), &clientsig[digestPosClient],
+		    SHA256_DIGEST_LENGTH, NULL, 0, digestResp);
       HMACsha256(clientsig, RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH, digestResp,
 		 SHA256_DIGEST_LENGTH, signatureResp);
 #ifdef FP10
@@ -1345,8 +1433,8 @@ SHandShake(RTMP * r)
 	     SHA256_DIGEST_LENGTH);
 
       /* verify client response */
-      HMACsha256(&serversig[digestPosServer], SHA256_DIGEST_LENGTH,
-		 GenuineFPKey, sizeof(GenuineFPKey), digest);
+      HMACKeyDigest(GenuineKey(GENUINE_FP), &serversig[digestPosServer],
+		    SHA256_DIGEST_LENGTH, NULL, 0, digest);
       HMACsha256(clientsig, RTMP_SIG_SIZE - SHA256_DIGEST_LENGTH, digest,
 		 SHA256_DIGEST_LENGTH, signature);
 #ifdef FP10
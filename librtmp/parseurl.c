@@ -92,7 +92,18 @@ parsehost:
 	ques  = strchr(p, '?');
 	slash = strchr(p, '/');
 
-	{
+	if(*p == '[') {
+		/* IPv6 literal, rtmp://[::1]:1935/app */
+		char *rb = strchr(p, ']');
+		if(!rb || (slash && slash < rb)) {
+			RTMP_Log(RTMP_LOGWARNING, "Unterminated IPv6 address in URL!");
+			return FALSE;
+		}
+		host->av_val = p+1;
+		host->av_len = rb-p-1;
+		RTMP_Log(RTMP_LOGDEBUG, "Parsed host    : %.*s", host->av_len, host->av_val);
+		p = rb+1;
+	} else {
 	int hostlen;
 	if(slash)
 		hostlen = slash - p;
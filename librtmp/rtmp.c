@@ -108,8 +108,17 @@ typedef enum {
   RTMPT_OPEN=0, RTMPT_SEND, RTMPT_IDLE, RTMPT_CLOSE
 } RTMPTCmd;
 
+#define RTMPT_HEADROOM	512	/* room for the request line and headers */
+#define RTMPT_FLUSH_SIZE	(64*1024)	/* queued payload that goes out while corked */
+#define RTMPT_POLL_UNIT	5	/* ms per step of the server's polling hint */
+#define RTMPT_POLL_MAX	250	/* ms, longest pause before an idle poll */
+#define RTMPT_POLL_BUSY	10	/* ms, longest pause during setup or with replies due */
+
+enum { HTTP_STATUS = 0, HTTP_HEADERS, HTTP_BODY };
+
 static int DumpMetaData(AMFObject *obj);
 static int HandShake(RTMP *r, int FP9HandShake);
+static int HandShakeFinish(RTMP *r);
 static int SocksNegotiate(RTMP *r);
 
 static int SendConnectPacket(RTMP *r, RTMPPacket *cp);
@@ -118,6 +127,12 @@ static int SendCheckBWResult(RTMP *r, double txn);
 static int SendDeleteStream(RTMP *r, double dStreamId);
 static int SendFCSubscribe(RTMP *r, AVal *subscribepath);
 static int SendPlay(RTMP *r);
+static int SendPlaylist(RTMP *r);
+static int SendReleaseStream(RTMP *r);
+static int SendFCPublish(RTMP *r);
+static int SendPublish(RTMP *r);
+static void SendStreamSetup(RTMP *r);
+static void SendStreamStart(RTMP *r);
 static int SendBytesReceived(RTMP *r);
 static int SendUsherToken(RTMP *r, AVal *usherToken);
 
@@ -139,7 +154,12 @@ static int WriteN(RTMP *r, const char *buffer, int n);
 
 static void DecodeTEA(AVal *key, AVal *text);
 
-static int HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len);
+static int HTTP_Post(RTMP *r, RTMPTCmd cmd);
+static int HTTP_Queue(RTMP *r, const char *buf, int len);
+static int HTTP_Flush(RTMP *r);
+static void HTTP_Cork(RTMP *r);
+static int HTTP_Uncork(RTMP *r);
+static int HTTP_IdleWait(RTMP *r);
 static int HTTP_read(RTMP *r, int fill);
 
 static void CloseInternal(RTMP *r, int reconnect);
@@ -224,6 +244,204 @@ RTMP_LibVersion()
   return RTMP_LIB_VERSION;
 }
 
+#if defined(CRYPTO) && !defined(NO_SSL) && !defined(USE_POLARSSL)
+#define RTMP_TLS_SLOTS	16
+#define RTMP_TLS_TTL	3600	/* s, servers rarely honour a session for longer */
+
+/* Client sessions kept for resumption, one per host and port, shared by
+ * all RTMP objects. PolarSSL keeps its single session in RTMP_TLS_ctx. */
+typedef struct RTMPTLSEntry
+{
+  char te_host[256];
+  int te_port;
+  int te_once;			/* TLS 1.3 ticket, not offered twice (RFC 8446 C.4) */
+  time_t te_expires;
+#ifdef USE_GNUTLS
+  gnutls_datum_t te_data;
+#else
+  SSL_SESSION *te_sess;
+#endif
+} RTMPTLSEntry;
+
+static RTMPTLSEntry TLSCache[RTMP_TLS_SLOTS];
+static RTMP_MUTEX TLSLock = RTMP_MUTEX_INIT;
+
+static void
+TLSEntryClear(RTMPTLSEntry *e)
+{
+#ifdef USE_GNUTLS
+  if (e->te_data.data)
+    gnutls_free(e->te_data.data);
+#else
+  if (e->te_sess)
+    SSL_SESSION_free(e->te_sess);
+#endif
+  memset(e, 0, sizeof(*e));
+}
+
+static int
+TLSHostName(RTMP *r, char *host, int size)
+{
+  int len = r->Link.hostname.av_len;
+  if (len <= 0 || len >= size)
+    return FALSE;
+  memcpy(host, r->Link.hostname.av_val, len);
+  host[len] = '\0';
+  return TRUE;
+}
+
+/* called with TLSLock held, reuses the host's slot, else an expired or
+ * the oldest one */
+static RTMPTLSEntry *
+TLSCacheSlot(const char *host, int port)
+{
+  RTMPTLSEntry *slot = &TLSCache[0];
+  int i;
+
+  for (i = 0; i < RTMP_TLS_SLOTS; i++)
+    {
+      RTMPTLSEntry *e = &TLSCache[i];
+      if (e->te_port == port && !strcasecmp(e->te_host, host))
+	{
+	  slot = e;
+	  break;
+	}
+      if (e->te_expires < slot->te_expires)
+	slot = e;
+    }
+  TLSEntryClear(slot);
+  strcpy(slot->te_host, host);
+  slot->te_port = port;
+  slot->te_expires = time(NULL) + RTMP_TLS_TTL;
+  return slot;
+}
+
+/* sets SNI and offers a cached session before TLS_connect */
+static void
+TLSCacheResume(RTMP *r)
+{
+  struct in6_addr a6;
+  char host[256];
+  time_t now = time(NULL);
+  int i;
+
+  if (!TLSHostName(r, host, sizeof(host)))
+    return;
+  /* RFC 6066 forbids literal addresses as server names */
+  if (inet_pton(AF_INET, host, &a6) != 1 && inet_pton(AF_INET6, host, &a6) != 1)
+    {
+#ifdef USE_GNUTLS
+      gnutls_server_name_set(r->m_sb.sb_ssl, GNUTLS_NAME_DNS, host, strlen(host));
+#else
+      SSL_set_tlsext_host_name(r->m_sb.sb_ssl, host);
+#endif
+    }
+#ifndef USE_GNUTLS
+  SSL_set_app_data(r->m_sb.sb_ssl, r);	/* for TLSNewSession */
+#endif
+
+  MutexLock(&TLSLock);
+  for (i = 0; i < RTMP_TLS_SLOTS; i++)
+    {
+      RTMPTLSEntry *e = &TLSCache[i];
+      if (e->te_expires > now && e->te_port == r->Link.port &&
+	  !strcasecmp(e->te_host, host))
+	{
+#ifdef USE_GNUTLS
+	  gnutls_session_set_data(r->m_sb.sb_ssl, e->te_data.data,
+				  e->te_data.size);
+#else
+	  SSL_set_session(r->m_sb.sb_ssl, e->te_sess);
+#endif
+	  if (e->te_once)
+	    TLSEntryClear(e);
+	  break;
+	}
+    }
+  MutexUnlock(&TLSLock);
+}
+
+#ifdef USE_GNUTLS
+#define TLS_resumed(s)	gnutls_session_is_resumed(s)
+
+/* TLS 1.2 sessions are known after the handshake, TLS 1.3 tickets arrive
+ * later and are picked up on close */
+static void
+TLSCacheSave(RTMP *r, int closing)
+{
+  gnutls_session_t s = r->m_sb.sb_ssl;
+  gnutls_datum_t data;
+  RTMPTLSEntry *e;
+  char host[256];
+  int once = FALSE;
+
+  if (!TLSHostName(r, host, sizeof(host)))
+    return;
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+  if (gnutls_protocol_get_version(s) == GNUTLS_TLS1_3)
+    {
+      /* without a ticket gnutls_session_get_data2 would wait for one */
+      if (!closing || !(gnutls_session_get_flags(s) & GNUTLS_SFLAGS_SESSION_TICKET))
+	return;
+      once = TRUE;
+    }
+  else
+#endif
+  if (closing || gnutls_session_is_resumed(s))
+    return;
+
+  if (gnutls_session_get_data2(s, &data) < 0)
+    return;
+  MutexLock(&TLSLock);
+  e = TLSCacheSlot(host, r->Link.port);
+  e->te_data = data;
+  e->te_once = once;
+  MutexUnlock(&TLSLock);
+}
+
+#else
+#define TLS_resumed(s)	SSL_session_reused(s)
+#define TLSCacheSave(r, closing)
+
+/* new session callback, for TLS 1.3 also run for tickets after the handshake */
+static int
+TLSNewSession(SSL *ssl, SSL_SESSION *sess)
+{
+  RTMP *r = SSL_get_app_data(ssl);
+  RTMPTLSEntry *e;
+  char host[256];
+
+  if (!r || !TLSHostName(r, host, sizeof(host)))
+    return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (!SSL_SESSION_is_resumable(sess))
+    return 0;
+#endif
+  MutexLock(&TLSLock);
+  e = TLSCacheSlot(host, r->Link.port);
+  e->te_sess = sess;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  e->te_once = SSL_SESSION_get_protocol_version(sess) >= TLS1_3_VERSION;
+#endif
+  MutexUnlock(&TLSLock);
+  return 1;			/* the cache keeps the reference */
+}
+#endif
+#endif
+
+void
+RTMP_FlushTLSCache(void)
+{
+#if defined(CRYPTO) && !defined(NO_SSL) && !defined(USE_POLARSSL)
+  int i;
+
+  MutexLock(&TLSLock);
+  for (i = 0; i < RTMP_TLS_SLOTS; i++)
+    TLSEntryClear(&TLSCache[i]);
+  MutexUnlock(&TLSLock);
+#endif
+}
+
 void
 RTMP_TLS_Init()
 {
@@ -251,6 +469,10 @@ RTMP_TLS_Init()
   RTMP_TLS_ctx = SSL_CTX_new(SSLv23_method());
   SSL_CTX_set_options(RTMP_TLS_ctx, SSL_OP_ALL);
   SSL_CTX_set_default_verify_paths(RTMP_TLS_ctx);
+  /* sessions go to TLSCache, keyed by host rather than by SSL_CTX */
+  SSL_CTX_set_session_cache_mode(RTMP_TLS_ctx,
+      SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(RTMP_TLS_ctx, TLSNewSession);
 #endif
 #endif
 }
@@ -581,6 +803,10 @@ static struct urlopt {
   	"Key for SecureToken response" },
   { AVC("swfVfy"),    OFF(Link.lFlags),        OPT_BOOL, RTMP_LF_SWFV,
   	"Perform SWF Verification" },
+  { AVC("pipeline"),  OFF(Link.lFlags),        OPT_BOOL, RTMP_LF_PIPE,
+  	"Send stream setup commands without waiting for replies" },
+  { AVC("fastopen"),  OFF(Link.lFlags),        OPT_BOOL, RTMP_LF_TFO,
+  	"Send the first handshake bytes in the TCP SYN" },
   { AVC("swfAge"),    OFF(Link.swfAge),        OPT_INT, 0,
   	"Number of days to use cached SWF hash" },
   { AVC("start"),     OFF(Link.seekTime),      OPT_INT, 0,
@@ -591,6 +817,12 @@ static struct urlopt {
   	"Buffer time in milliseconds" },
   { AVC("timeout"),   OFF(Link.timeout),       OPT_INT, 0,
   	"Session timeout in seconds" },
+  { AVC("connTimeout"), OFF(Link.connTimeout), OPT_INT, 0,
+  	"TCP connect timeout in milliseconds" },
+  { AVC("hsTimeout"), OFF(Link.hsTimeout),     OPT_INT, 0,
+  	"Handshake timeout in milliseconds" },
+  { AVC("cmdTimeout"), OFF(Link.cmdTimeout),   OPT_INT, 0,
+  	"Timeout in milliseconds until play or publish starts" },
   { AVC("pubUser"),   OFF(Link.pubUser),       OPT_STR, 0,
         "Publisher username" },
   { AVC("pubPasswd"), OFF(Link.pubPasswd),     OPT_STR, 0,
@@ -828,13 +1060,15 @@ int RTMP_SetupURL(RTMP *r, char *url)
     	    }
     	  else
     	    {
+    	      int v6 = memchr(r->Link.hostname.av_val, ':',
+			      r->Link.hostname.av_len) != NULL;
     	      len = r->Link.hostname.av_len + r->Link.app.av_len +
-    		  sizeof("rtmpte://:65535/");
+    		  sizeof("rtmpte://[]:65535/");
 	      r->Link.tcUrl.av_val = malloc(len);
 	      r->Link.tcUrl.av_len = snprintf(r->Link.tcUrl.av_val, len,
-		"%s://%.*s:%d/%.*s",
-		RTMPProtocolStringsLower[r->Link.protocol],
-		r->Link.hostname.av_len, r->Link.hostname.av_val,
+		"%s://%s%.*s%s:%d/%.*s",
+		RTMPProtocolStringsLower[r->Link.protocol], v6 ? "[" : "",
+		r->Link.hostname.av_len, r->Link.hostname.av_val, v6 ? "]" : "",
 		r->Link.port,
 		r->Link.app.av_len, r->Link.app.av_val);
 	      r->Link.lFlags |= RTMP_LF_FTCU;
@@ -866,212 +1100,779 @@ int RTMP_SetupURL(RTMP *r, char *url)
   return TRUE;
 }
 
-static int
-add_addr_info(struct sockaddr_in *service, AVal *host, int port)
-{
-  char *hostname;
-  int ret = TRUE;
-  if (host->av_val[host->av_len])
-    {
-      hostname = malloc(host->av_len+1);
-      memcpy(hostname, host->av_val, host->av_len);
-      hostname[host->av_len] = '\0';
-    }
-  else
-    {
-      hostname = host->av_val;
-    }
+#define RTMP_MAX_ADDRS	8	/* resolved addresses tried per host */
+#define RTMP_DNS_SLOTS	16
+#define RTMP_DNS_TTL	60	/* getaddrinfo hides record TTLs, keep entries a minute */
+#define RTMP_CONNECT_DELAY	250	/* ms before the next attempt, RFC 8305 */
+#define RTMP_PREDICTED_STREAM_ID	1	/* first createStream result on a connection */
 
-  service->sin_addr.s_addr = inet_addr(hostname);
-  if (service->sin_addr.s_addr == INADDR_NONE)
-    {
-      struct hostent *host = gethostbyname(hostname);
-      if (host == NULL || host->h_addr == NULL)
-	{
-	  RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s)", hostname);
-	  ret = FALSE;
-	  goto finish;
-	}
-      service->sin_addr = *(struct in_addr *)host->h_addr;
-    }
+typedef struct RTMPAddr
+{
+  struct sockaddr_storage ra_addr;
+  socklen_t ra_len;
+} RTMPAddr;
 
-  service->sin_port = htons(port);
-finish:
-  if (hostname != host->av_val)
-    free(hostname);
-  return ret;
+typedef struct RTMPDNSEntry
+{
+  char de_host[256];
+  int de_family;		/* lookup restriction, AF_UNSPEC for both */
+  time_t de_expires;
+  int de_num;
+  RTMPAddr de_addrs[RTMP_MAX_ADDRS];	/* port 0 */
+} RTMPDNSEntry;
+
+static RTMPDNSEntry DNSCache[RTMP_DNS_SLOTS];
+static RTMP_MUTEX DNSLock = RTMP_MUTEX_INIT;
+
+static uint32_t
+ClockMillis(void)
+{
+#ifdef _WIN32
+  return GetTickCount();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
 }
 
-int
-RTMP_Connect0(RTMP *r, struct sockaddr * service)
+struct RTMPCancel
 {
-  int on = 1;
-  r->m_sb.sb_timedout = FALSE;
-  r->m_pausing = 0;
-  r->m_fDuration = 0.0;
+  volatile int rc_cancelled;
+#ifndef _WIN32
+  int rc_pipe[2];		/* written on cancel to wake poll() */
+#endif
+};
 
-  r->m_sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (r->m_sb.sb_socket != -1)
-    {
-      if (connect(r->m_sb.sb_socket, service, sizeof(struct sockaddr)) < 0)
-	{
-	  int err = GetSockError();
-	  RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)",
-	      __FUNCTION__, err, strerror(err));
-	  RTMP_Close(r);
-	  return FALSE;
-	}
+#define RTMP_POLL_CANCELLED	-2
+#ifdef _WIN32
+#define RTMP_CANCEL_SLICE	50	/* ms between cancel checks, no pipe to poll */
+#endif
 
-      if (r->Link.socksport)
-	{
-	  RTMP_Log(RTMP_LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
-	  if (!SocksNegotiate(r))
-	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
-	      RTMP_Close(r);
-	      return FALSE;
-	    }
-	}
-    }
-  else
+RTMPCancel *
+RTMP_CancelAlloc(void)
+{
+  RTMPCancel *c = calloc(1, sizeof(RTMPCancel));
+  if (!c)
+    return NULL;
+#ifndef _WIN32
+  if (pipe(c->rc_pipe) < 0)
     {
-      RTMP_Log(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
-	  GetSockError());
-      return FALSE;
+      RTMP_Log(RTMP_LOGERROR, "%s, pipe failed. %d (%s)", __FUNCTION__,
+	  errno, strerror(errno));
+      free(c);
+      return NULL;
     }
+  SetSockNonBlock(c->rc_pipe[0], 1);
+  SetSockNonBlock(c->rc_pipe[1], 1);
+#endif
+  return c;
+}
 
-  /* set timeout */
-  {
-    SET_RCVTIMEO(tv, r->Link.timeout);
-    if (setsockopt
-        (r->m_sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv)))
-      {
-        RTMP_Log(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!",
-	    __FUNCTION__, r->Link.timeout);
-      }
-  }
-
-  setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
-
-  return TRUE;
+void
+RTMP_CancelFree(RTMPCancel *c)
+{
+  if (!c)
+    return;
+#ifndef _WIN32
+  close(c->rc_pipe[0]);
+  close(c->rc_pipe[1]);
+#endif
+  free(c);
 }
 
-int
-RTMP_TLS_Accept(RTMP *r, void *ctx)
+void
+RTMP_Cancel(RTMPCancel *c)
 {
-#if defined(CRYPTO) && !defined(NO_SSL)
-  TLS_server(ctx, r->m_sb.sb_ssl);
-  TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
-  if (TLS_accept(r->m_sb.sb_ssl) < 0)
+  c->rc_cancelled = TRUE;
+#ifndef _WIN32
+  if (write(c->rc_pipe[1], "", 1) < 0)
     {
-      RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
-      return FALSE;
+      /* pipe already full, poll() sees it readable anyway */
     }
-  return TRUE;
-#else
-  return FALSE;
 #endif
 }
 
-int
-RTMP_Connect1(RTMP *r, RTMPPacket *cp)
+void
+RTMP_CancelReset(RTMPCancel *c)
 {
-  if (r->Link.protocol & RTMP_FEATURE_SSL)
-    {
-#if defined(CRYPTO) && !defined(NO_SSL)
-      TLS_client(RTMP_TLS_ctx, r->m_sb.sb_ssl);
-      TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
-      if (TLS_connect(r->m_sb.sb_ssl) < 0)
-	{
-	  RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
-	  RTMP_Close(r);
-	  return FALSE;
-	}
-#else
-      RTMP_Log(RTMP_LOGERROR, "%s, no SSL/TLS support", __FUNCTION__);
-      RTMP_Close(r);
-      return FALSE;
-
+#ifndef _WIN32
+  char buf[64];
+  while (read(c->rc_pipe[0], buf, sizeof(buf)) > 0)
+    ;
 #endif
-    }
-  if (r->Link.protocol & RTMP_FEATURE_HTTP)
-    {
-      r->m_msgCounter = 1;
-      r->m_clientID.av_val = NULL;
-      r->m_clientID.av_len = 0;
-      HTTP_Post(r, RTMPT_OPEN, "", 1);
-      if (HTTP_read(r, 1) != 0)
-	{
-	  r->m_msgCounter = 0;
-	  RTMP_Log(RTMP_LOGDEBUG, "%s, Could not connect for handshake", __FUNCTION__);
-	  RTMP_Close(r);
-	  return 0;
-	}
-      r->m_msgCounter = 0;
-    }
-  RTMP_Log(RTMP_LOGDEBUG, "%s, ... connected, handshaking", __FUNCTION__);
-  if (!HandShake(r, TRUE))
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, handshake failed.", __FUNCTION__);
-      RTMP_Close(r);
-      return FALSE;
-    }
-  RTMP_Log(RTMP_LOGDEBUG, "%s, handshaked", __FUNCTION__);
-
-  if (!SendConnectPacket(r, cp))
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, RTMP connect failed.", __FUNCTION__);
-      RTMP_Close(r);
-      return FALSE;
-    }
-  return TRUE;
+  c->rc_cancelled = FALSE;
 }
 
 int
-RTMP_Connect(RTMP *r, RTMPPacket *cp)
+RTMP_IsCancelled(RTMPCancel *c)
 {
-  struct sockaddr_in service;
-  if (!r->Link.hostname.av_len)
-    return FALSE;
+  return c && c->rc_cancelled;
+}
 
-  memset(&service, 0, sizeof(struct sockaddr_in));
-  service.sin_family = AF_INET;
+void
+RTMP_SetCancel(RTMP *r, RTMPCancel *c)
+{
+  r->m_sb.sb_cancel = c;
+}
 
-  if (r->Link.socksport)
+/* poll() that also returns RTMP_POLL_CANCELLED once c fires. fds needs
+ * room for one entry past nfds. ms < 0 waits without a limit. */
+static int
+PollCancel(struct pollfd *fds, int nfds, int ms, RTMPCancel *c)
+{
+  int rc;
+
+  if (!c)
+    return poll(fds, nfds, ms);
+  if (c->rc_cancelled)
+    return RTMP_POLL_CANCELLED;
+#ifdef _WIN32
+  for (;;)
     {
-      /* Connect via SOCKS */
-      if (!add_addr_info(&service, &r->Link.sockshost, r->Link.socksport))
-	return FALSE;
+      int slice = ms < 0 || ms > RTMP_CANCEL_SLICE ? RTMP_CANCEL_SLICE : ms;
+      rc = poll(fds, nfds, slice);
+      if (c->rc_cancelled)
+	return RTMP_POLL_CANCELLED;
+      if (rc != 0 || ms == slice)
+	return rc;
+      if (ms > 0)
+	ms -= slice;
     }
-  else
+#else
+  fds[nfds].fd = c->rc_pipe[0];
+  fds[nfds].events = POLLIN;
+  fds[nfds].revents = 0;
+  rc = poll(fds, nfds + 1, ms);
+  if (c->rc_cancelled)
+    return RTMP_POLL_CANCELLED;
+  return rc;
+#endif
+}
+
+/* starts a phase that must finish within ms, 0 for no limit */
+static void
+SetDeadline(RTMPSockBuf *sb, int ms)
+{
+  sb->sb_deadline = 0;
+  if (ms > 0)
     {
-      /* Connect directly */
-      if (!add_addr_info(&service, &r->Link.hostname, r->Link.port))
-	return FALSE;
+      sb->sb_deadline = ClockMillis() + ms;
+      if (!sb->sb_deadline)
+	sb->sb_deadline = 1;
     }
+}
 
-  if (!RTMP_Connect0(r, (struct sockaddr *)&service))
-    return FALSE;
-
-  r->m_bSendCounter = TRUE;
-
-  return RTMP_Connect1(r, cp);
+void
+RTMP_SetDeadline(RTMP *r, int ms)
+{
+  r->m_sb.sb_timedout = FALSE;
+  SetDeadline(&r->m_sb, ms);
 }
 
 static int
-SocksNegotiate(RTMP *r)
+DNSCacheGet(const char *hostname, int family, RTMPAddr *addrs, int max)
 {
-  unsigned long addr;
-  struct sockaddr_in service;
-  memset(&service, 0, sizeof(struct sockaddr_in));
+  time_t now = time(NULL);
+  int i, n = 0;
 
-  add_addr_info(&service, &r->Link.hostname, r->Link.port);
-  addr = htonl(service.sin_addr.s_addr);
+  MutexLock(&DNSLock);
+  for (i = 0; i < RTMP_DNS_SLOTS; i++)
+    {
+      RTMPDNSEntry *e = &DNSCache[i];
+      if (e->de_num && e->de_family == family && e->de_expires > now &&
+	  !strcasecmp(e->de_host, hostname))
+	{
+	  n = e->de_num < max ? e->de_num : max;
+	  memcpy(addrs, e->de_addrs, n * sizeof(RTMPAddr));
+	  break;
+	}
+    }
+  MutexUnlock(&DNSLock);
+  return n;
+}
 
-  {
-    char packet[] = {
-      4, 1,			/* SOCKS 4, connect */
-      (r->Link.port >> 8) & 0xFF,
+/* replaces the same host, else an expired or the oldest slot */
+static void
+DNSCachePut(const char *hostname, int family, const RTMPAddr *addrs, int num)
+{
+  RTMPDNSEntry *slot = &DNSCache[0];
+  int i;
+
+  MutexLock(&DNSLock);
+  for (i = 0; i < RTMP_DNS_SLOTS; i++)
+    {
+      RTMPDNSEntry *e = &DNSCache[i];
+      if (e->de_family == family && !strcasecmp(e->de_host, hostname))
+	{
+	  slot = e;
+	  break;
+	}
+      if (e->de_expires < slot->de_expires)
+	slot = e;
+    }
+  strcpy(slot->de_host, hostname);
+  slot->de_family = family;
+  slot->de_expires = time(NULL) + RTMP_DNS_TTL;
+  slot->de_num = num;
+  memcpy(slot->de_addrs, addrs, num * sizeof(RTMPAddr));
+  MutexUnlock(&DNSLock);
+}
+
+void
+RTMP_FlushDNSCache(void)
+{
+  MutexLock(&DNSLock);
+  memset(DNSCache, 0, sizeof(DNSCache));
+  MutexUnlock(&DNSLock);
+}
+
+#ifndef _WIN32
+/* A lookup running on its own thread. Whoever of caller and worker lets
+ * go last frees it, so a caller that gave up does not wait for it. */
+typedef struct RTMPLookup
+{
+  char rl_host[256];
+  struct addrinfo rl_hints;
+  struct addrinfo *rl_res;
+  int rl_err;
+  int rl_refs;			/* under DNSLock */
+  int rl_pipe[2];		/* readable once rl_err and rl_res are set */
+} RTMPLookup;
+
+static void
+LookupRelease(RTMPLookup *l)
+{
+  int refs;
+
+  MutexLock(&DNSLock);
+  refs = --l->rl_refs;
+  MutexUnlock(&DNSLock);
+  if (refs)
+    return;
+  if (l->rl_res)
+    freeaddrinfo(l->rl_res);
+  close(l->rl_pipe[0]);
+  close(l->rl_pipe[1]);
+  free(l);
+}
+
+static void *
+LookupThread(void *arg)
+{
+  RTMPLookup *l = arg;
+
+  l->rl_err = getaddrinfo(l->rl_host, NULL, &l->rl_hints, &l->rl_res);
+  if (write(l->rl_pipe[1], "", 1) < 0)
+    {
+      /* the caller only polls for it */
+    }
+  LookupRelease(l);
+  return NULL;
+}
+#endif
+
+/* getaddrinfo bounded like a connect: the cancel handle and the connect
+ * timeout end the wait, while the lookup itself cannot be stopped and
+ * finishes on a detached thread. Literals are converted in place. */
+static int
+LookupHost(RTMP *r, const char *hostname, const struct addrinfo *hints,
+	   struct addrinfo **res)
+{
+  struct addrinfo numeric = *hints;
+#ifndef _WIN32
+  RTMPLookup *l;
+  pthread_t tid;
+  int limit = r->Link.connTimeout > 0 ? r->Link.connTimeout : r->Link.timeout * 1000;
+#endif
+
+  numeric.ai_flags |= AI_NUMERICHOST;
+  if (!getaddrinfo(hostname, NULL, &numeric, res))
+    return 0;
+#ifndef _WIN32
+  l = calloc(1, sizeof(RTMPLookup));
+  if (l && pipe(l->rl_pipe) == 0)
+    {
+      strcpy(l->rl_host, hostname);
+      l->rl_hints = *hints;
+      l->rl_refs = 2;
+      if (pthread_create(&tid, NULL, LookupThread, l) == 0)
+	{
+	  struct pollfd fds[2];
+	  int err, rc;
+
+	  pthread_detach(tid);
+	  fds[0].fd = l->rl_pipe[0];
+	  fds[0].events = POLLIN;
+	  fds[0].revents = 0;
+	  rc = PollCancel(fds, 1, limit > 0 ? limit : -1, r->m_sb.sb_cancel);
+	  if (rc > 0)
+	    {
+	      err = l->rl_err;
+	      *res = l->rl_res;
+	      l->rl_res = NULL;
+	    }
+	  else
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "%s, lookup of %s %s", __FUNCTION__, hostname,
+		  rc == RTMP_POLL_CANCELLED ? "cancelled" : rc == 0 ? "timed out" : "failed");
+	      err = EAI_AGAIN;
+	      *res = NULL;
+	    }
+	  LookupRelease(l);
+	  return err;
+	}
+      close(l->rl_pipe[0]);
+      close(l->rl_pipe[1]);
+    }
+  free(l);
+#endif
+  /* no worker, wait for it here */
+  return getaddrinfo(hostname, NULL, hints, res);
+}
+
+/* Resolves host to at most max addresses. The address families alternate,
+ * starting with the family getaddrinfo put first, as RFC 8305 orders them.
+ * family restricts the lookup, AF_UNSPEC for both. Returns the count. */
+static int
+ResolveHost(RTMP *r, const AVal *host, int port, int family, RTMPAddr *addrs, int max)
+{
+  char hostname[256];
+  int i, n;
+
+  if (host->av_len >= (int)sizeof(hostname))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, hostname too long", __FUNCTION__);
+      return 0;
+    }
+  memcpy(hostname, host->av_val, host->av_len);
+  hostname[host->av_len] = '\0';
+
+  n = DNSCacheGet(hostname, family, addrs, max);
+  if (!n)
+    {
+      struct addrinfo hints, *res, *ai;
+      RTMPAddr found[2][RTMP_MAX_ADDRS], all[RTMP_MAX_ADDRS];
+      int nfound[2] = { 0, 0 }, first = -1, err, f;
+
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = family;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_protocol = IPPROTO_TCP;
+      err = LookupHost(r, hostname, &hints, &res);
+      if (err)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s) %s",
+	      hostname, gai_strerror(err));
+	  return 0;
+	}
+      for (ai = res; ai; ai = ai->ai_next)
+	{
+	  if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+	    continue;
+	  f = ai->ai_family == AF_INET6;
+	  if (first < 0)
+	    first = f;
+	  if (nfound[f] == RTMP_MAX_ADDRS || ai->ai_addrlen > sizeof(struct sockaddr_storage))
+	    continue;
+	  memcpy(&found[f][nfound[f]].ra_addr, ai->ai_addr, ai->ai_addrlen);
+	  found[f][nfound[f]++].ra_len = ai->ai_addrlen;
+	}
+      freeaddrinfo(res);
+      if (first < 0)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s) no address",
+	      hostname);
+	  return 0;
+	}
+      for (i = 0; n < RTMP_MAX_ADDRS && (i < nfound[0] || i < nfound[1]); i++)
+	{
+	  if (i < nfound[first])
+	    all[n++] = found[first][i];
+	  if (i < nfound[!first] && n < RTMP_MAX_ADDRS)
+	    all[n++] = found[!first][i];
+	}
+      DNSCachePut(hostname, family, all, n);
+      if (n > max)
+	n = max;
+      memcpy(addrs, all, n * sizeof(RTMPAddr));
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      if (addrs[i].ra_addr.ss_family == AF_INET6)
+	((struct sockaddr_in6 *)&addrs[i].ra_addr)->sin6_port = htons(port);
+      else
+	((struct sockaddr_in *)&addrs[i].ra_addr)->sin_port = htons(port);
+    }
+  return n;
+}
+
+/* With a cookie cached for the server connect() returns at once and the
+ * SYN leaves with the first write. Without one it is a plain connect that
+ * asks for a cookie. Servers or paths that drop SYN data are handled by
+ * the kernel, which retransmits the SYN bare. */
+static void
+SetFastOpen(int s)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+  int on = 1;
+  if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (char *)&on, sizeof(on)))
+    RTMP_Log(RTMP_LOGDEBUG, "%s, TCP_FASTOPEN_CONNECT unsupported. %d",
+	__FUNCTION__, GetSockError());
+#else
+  RTMP_Log(RTMP_LOGDEBUG, "%s, no TCP Fast Open on this platform", __FUNCTION__);
+#endif
+}
+
+/* Happy eyeballs: a new attempt starts every RTMP_CONNECT_DELAY ms, or as
+ * soon as one fails, while the earlier ones stay pending. The first to
+ * complete wins. Returns the connected blocking socket or -1. */
+static int
+ConnectAddrs(RTMP *r, const RTMPAddr *addrs, int num)
+{
+  int socks[RTMP_MAX_ADDRS];
+  int next = 0, pending = 0, fd = -1, i, j;
+  int limit = r->Link.connTimeout > 0 ? r->Link.connTimeout : r->Link.timeout * 1000;
+  uint32_t start = ClockMillis(), now, nextStart = start;
+
+  for (;;)
+    {
+      struct pollfd fds[RTMP_MAX_ADDRS + 1];
+      int idx[RTMP_MAX_ADDRS];
+      int nfds = 0, wait, err, rc;
+
+      now = ClockMillis();
+      if (next < num && (int)(now - nextStart) >= 0)
+	{
+	  int s = socket(addrs[next].ra_addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	  socks[next] = -1;
+	  nextStart = now + RTMP_CONNECT_DELAY;
+	  if (s == -1)
+	    {
+	      RTMP_Log(RTMP_LOGDEBUG, "%s, failed to create socket. Error: %d",
+		  __FUNCTION__, GetSockError());
+	      nextStart = now;
+	    }
+	  else
+	    {
+	      SetSockNonBlock(s, 1);
+	      if (r->Link.lFlags & RTMP_LF_TFO)
+		SetFastOpen(s);
+	      if (connect(s, (struct sockaddr *)&addrs[next].ra_addr, addrs[next].ra_len) == 0)
+		{
+		  fd = s;
+		  /* only a deferred fast open connect completes immediately */
+		  r->m_bFastOpen = (r->Link.lFlags & RTMP_LF_TFO) != 0;
+		  if (r->m_bFastOpen)
+		    RTMP_Log(RTMP_LOGDEBUG, "%s, address %d deferred to the first write",
+			__FUNCTION__, next);
+		}
+	      else if (SockInProgress(GetSockError()))
+		{
+		  socks[next] = s;
+		  pending++;
+		}
+	      else
+		{
+		  err = GetSockError();
+		  RTMP_Log(RTMP_LOGDEBUG, "%s, connect attempt %d failed. %d (%s)",
+		      __FUNCTION__, next, err, strerror(err));
+		  closesocket(s);
+		  nextStart = now;
+		}
+	    }
+	  next++;
+	  if (fd != -1)
+	    break;
+	  continue;
+	}
+      if (!pending)
+	break;
+      wait = limit - (int)(now - start);
+      if (wait <= 0)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, connect timed out after %d ms",
+	      __FUNCTION__, limit);
+	  break;
+	}
+      if (next < num && (int)(nextStart - now) < wait)
+	wait = nextStart - now;
+
+      for (i = 0; i < next; i++)
+	if (socks[i] != -1)
+	  {
+	    fds[nfds].fd = socks[i];
+	    fds[nfds].events = POLLOUT;
+	    fds[nfds].revents = 0;
+	    idx[nfds++] = i;
+	  }
+      rc = PollCancel(fds, nfds, wait, r->m_sb.sb_cancel);
+      if (rc == RTMP_POLL_CANCELLED)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, connect cancelled", __FUNCTION__);
+	  break;
+	}
+      if (rc < 0)
+	{
+	  err = GetSockError();
+	  if (err == EINTR && !RTMP_ctrlC)
+	    continue;
+	  RTMP_Log(RTMP_LOGERROR, "%s, poll failed. %d (%s)", __FUNCTION__,
+	      err, strerror(err));
+	  break;
+	}
+      for (j = 0; j < nfds && fd == -1; j++)
+	{
+	  socklen_t len = sizeof(err);
+	  if (!fds[j].revents)
+	    continue;
+	  i = idx[j];
+	  err = 0;
+	  if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (char *)&err, &len) < 0)
+	    err = GetSockError();
+	  if (!err)
+	    {
+	      fd = socks[i];
+	      socks[i] = -1;
+	      RTMP_Log(RTMP_LOGDEBUG, "%s, connected to address %d after %u ms",
+		  __FUNCTION__, i, ClockMillis() - start);
+	      break;
+	    }
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, connect attempt %d failed. %d (%s)",
+	      __FUNCTION__, i, err, strerror(err));
+	  closesocket(socks[i]);
+	  socks[i] = -1;
+	  pending--;
+	  nextStart = ClockMillis();
+	}
+      if (fd != -1)
+	break;
+    }
+
+  for (i = 0; i < next && i < num; i++)
+    if (socks[i] != -1)
+      closesocket(socks[i]);
+  if (fd == -1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket.", __FUNCTION__);
+      return -1;
+    }
+  SetSockNonBlock(fd, 0);
+  return fd;
+}
+
+/* SOCKS negotiation and socket options once the TCP connection is up */
+static int
+ConnectSetup(RTMP *r)
+{
+  int on = 1;
+
+  /* set timeout, before SOCKS so its replies are bounded too */
+  {
+    SET_RCVTIMEO(tv, r->Link.timeout);
+    if (setsockopt
+        (r->m_sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv)))
+      {
+        RTMP_Log(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!",
+	    __FUNCTION__, r->Link.timeout);
+      }
+    /* a stalled peer must not block writes forever either */
+    setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+  }
+  r->m_sb.sb_rcvtimeo = r->Link.timeout * 1000;
+
+  setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+
+  if (r->Link.socksport)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
+      if (!SocksNegotiate(r))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
+	  RTMP_Close(r);
+	  return FALSE;
+	}
+    }
+
+  return TRUE;
+}
+
+int
+RTMP_Connect0(RTMP *r, struct sockaddr * service)
+{
+  RTMPAddr addr;
+
+  r->m_sb.sb_timedout = FALSE;
+  r->m_pausing = 0;
+  r->m_fDuration = 0.0;
+
+  addr.ra_len = service->sa_family == AF_INET6 ?
+    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  memcpy(&addr.ra_addr, service, addr.ra_len);
+  r->m_sb.sb_socket = ConnectAddrs(r, &addr, 1);
+  if (r->m_sb.sb_socket == -1)
+    return FALSE;
+
+  return ConnectSetup(r);
+}
+
+int
+RTMP_TLS_Accept(RTMP *r, void *ctx)
+{
+#if defined(CRYPTO) && !defined(NO_SSL)
+  TLS_server(ctx, r->m_sb.sb_ssl);
+  TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
+  if (TLS_accept(r->m_sb.sb_ssl) < 0)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
+      return FALSE;
+    }
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+int
+RTMP_Connect1(RTMP *r, RTMPPacket *cp)
+{
+  SetDeadline(&r->m_sb, r->Link.hsTimeout > 0 ? r->Link.hsTimeout :
+	      r->Link.timeout * 1000);
+  if (r->Link.protocol & RTMP_FEATURE_SSL)
+    {
+#if defined(CRYPTO) && !defined(NO_SSL)
+      TLS_client(RTMP_TLS_ctx, r->m_sb.sb_ssl);
+      TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
+#ifndef USE_POLARSSL
+      TLSCacheResume(r);
+#endif
+      if (TLS_connect(r->m_sb.sb_ssl) < 0)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
+	  RTMP_Close(r);
+	  return FALSE;
+	}
+#ifndef USE_POLARSSL
+      RTMP_Log(RTMP_LOGDEBUG, "%s, TLS session %s", __FUNCTION__,
+	  TLS_resumed(r->m_sb.sb_ssl) ? "resumed" : "negotiated");
+      TLSCacheSave(r, FALSE);
+#endif
+#else
+      RTMP_Log(RTMP_LOGERROR, "%s, no SSL/TLS support", __FUNCTION__);
+      RTMP_Close(r);
+      return FALSE;
+
+#endif
+    }
+  if (r->Link.protocol & RTMP_FEATURE_HTTP)
+    {
+      r->m_msgCounter = 1;
+      r->m_clientID.av_val = NULL;
+      r->m_clientID.av_len = 0;
+      if (HTTP_Post(r, RTMPT_OPEN) < 0 || HTTP_read(r, 1) != 0)
+	{
+	  r->m_msgCounter = 0;
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, Could not connect for handshake", __FUNCTION__);
+	  RTMP_Close(r);
+	  return 0;
+	}
+      r->m_msgCounter = 0;
+    }
+  RTMP_Log(RTMP_LOGDEBUG, "%s, ... connected, handshaking", __FUNCTION__);
+  if (!HandShake(r, TRUE))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, handshake failed.", __FUNCTION__);
+      RTMP_Close(r);
+      return FALSE;
+    }
+  RTMP_Log(RTMP_LOGDEBUG, "%s, handshaked", __FUNCTION__);
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+  if (r->m_bFastOpen)
+    {
+      struct tcp_info ti;
+      socklen_t len = sizeof(ti);
+      if (!getsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_INFO, (char *)&ti, &len))
+	RTMP_Log(RTMP_LOGDEBUG, "%s, SYN data %s", __FUNCTION__,
+	    (ti.tcpi_options & TCPI_OPT_SYN_DATA) ? "accepted" : "not accepted");
+    }
+#endif
+
+  HTTP_Cork(r);
+  if (!SendConnectPacket(r, cp))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, RTMP connect failed.", __FUNCTION__);
+      RTMP_Close(r);
+      return FALSE;
+    }
+  /* a secure token must be answered before the stream setup */
+  if ((r->Link.lFlags & RTMP_LF_PIPE) && !r->Link.token.av_len && !r->m_bHold)
+    {
+      SendStreamSetup(r);
+      /* servers hand out stream ids from 1 on a new connection */
+      r->m_stream_id = RTMP_PREDICTED_STREAM_ID;
+      r->m_bStreamPredicted = TRUE;
+      SendStreamStart(r);
+    }
+  if (!HTTP_Uncork(r))
+    return FALSE;
+  if (r->m_bHandshakePending && !HandShakeFinish(r))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, handshake failed.", __FUNCTION__);
+      RTMP_Close(r);
+      return FALSE;
+    }
+  r->m_sb.sb_deadline = 0;
+  return TRUE;
+}
+
+int
+RTMP_Connect(RTMP *r, RTMPPacket *cp)
+{
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  int num;
+
+  if (!r->Link.hostname.av_len)
+    return FALSE;
+
+  if (r->Link.socksport)
+    /* Connect via SOCKS */
+    num = ResolveHost(r, &r->Link.sockshost, r->Link.socksport, AF_UNSPEC,
+		      addrs, RTMP_MAX_ADDRS);
+  else
+    /* Connect directly */
+    num = ResolveHost(r, &r->Link.hostname, r->Link.port, AF_UNSPEC,
+		      addrs, RTMP_MAX_ADDRS);
+  if (!num)
+    return FALSE;
+
+  r->m_sb.sb_timedout = FALSE;
+  r->m_pausing = 0;
+  r->m_fDuration = 0.0;
+  r->m_sb.sb_socket = ConnectAddrs(r, addrs, num);
+  if (r->m_sb.sb_socket == -1 || !ConnectSetup(r))
+    return FALSE;
+
+  r->m_bSendCounter = TRUE;
+
+  return RTMP_Connect1(r, cp);
+}
+
+static int
+SocksNegotiate(RTMP *r)
+{
+  unsigned long addr;
+  RTMPAddr service;
+
+  /* SOCKS 4 only takes an IPv4 address */
+  if (!ResolveHost(r, &r->Link.hostname, r->Link.port, AF_INET, &service, 1))
+    return FALSE;
+  addr = htonl(((struct sockaddr_in *)&service.ra_addr)->sin_addr.s_addr);
+
+  {
+    char packet[] = {
+      4, 1,			/* SOCKS 4, connect */
+      (r->Link.port >> 8) & 0xFF,
       (r->Link.port) & 0xFF,
       (char)(addr >> 24) & 0xFF, (char)(addr >> 16) & 0xFF,
       (char)(addr >> 8) & 0xFF, (char)addr & 0xFF,
@@ -1108,6 +1909,7 @@ RTMP_ConnectStream(RTMP *r, int seekTime)
 
   r->m_mediaChannel = 0;
 
+  SetDeadline(&r->m_sb, r->Link.cmdTimeout);
   while (!r->m_bPlaying && RTMP_IsConnected(r) && RTMP_ReadPacket(r, &packet))
     {
       if (RTMPPacket_IsReady(&packet))
@@ -1127,8 +1929,80 @@ RTMP_ConnectStream(RTMP *r, int seekTime)
 	  RTMPPacket_Free(&packet);
 	}
     }
+  r->m_sb.sb_deadline = 0;
+
+  return r->m_bPlaying;
+}
+
+int
+RTMP_ConnectIdle(RTMP *r, RTMPPacket *cp)
+{
+  RTMPPacket packet = { 0 };
+
+  r->m_bHold = TRUE;
+  if (!RTMP_Connect(r, cp))
+    return FALSE;
+
+  SetDeadline(&r->m_sb, r->Link.cmdTimeout > 0 ? r->Link.cmdTimeout :
+	      r->Link.timeout * 1000);
+  /* a rejected connect leaves no call to wait for */
+  while (!r->m_bConnected && r->m_numCalls && RTMP_IsConnected(r) &&
+	 RTMP_ReadPacket(r, &packet))
+    {
+      if (RTMPPacket_IsReady(&packet))
+	{
+	  RTMP_ClientPacket(r, &packet);
+	  RTMPPacket_Free(&packet);
+	}
+    }
+  r->m_sb.sb_deadline = 0;
 
-  return r->m_bPlaying;
+  if (!r->m_bConnected)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, no connect result", __FUNCTION__);
+      RTMP_Close(r);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Publishes or plays playpath, NULL keeps the URL's, on a connection from
+ * RTMP_ConnectIdle. With RTMP_LF_PIPE the whole setup goes out at once. */
+int
+RTMP_StartStream(RTMP *r, const AVal *playpath)
+{
+  if (!r->m_bHold || !r->m_bConnected || !RTMP_IsConnected(r))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, not an idle connection", __FUNCTION__);
+      return FALSE;
+    }
+
+  if (playpath)
+    {
+      char *pp = malloc(playpath->av_len + 1);
+      if (!pp)
+	return FALSE;
+      memcpy(pp, playpath->av_val, playpath->av_len);
+      pp[playpath->av_len] = '\0';
+      free(r->Link.playpath0.av_val);
+      r->Link.playpath0.av_val = pp;
+      r->Link.playpath0.av_len = playpath->av_len;
+      r->Link.playpath = r->Link.playpath0;
+    }
+
+  r->m_bHold = FALSE;
+  HTTP_Cork(r);
+  SendStreamSetup(r);
+  if (r->Link.lFlags & RTMP_LF_PIPE)
+    {
+      /* no stream was created on this connection yet */
+      r->m_stream_id = RTMP_PREDICTED_STREAM_ID;
+      r->m_bStreamPredicted = TRUE;
+      SendStreamStart(r);
+    }
+  if (!HTTP_Uncork(r))
+    return FALSE;
+  return RTMP_ConnectStream(r, 0);
 }
 
 int
@@ -1290,29 +2164,14 @@ RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
       break;
 
     case RTMP_PACKET_TYPE_FLEX_MESSAGE:
-      /* flex message */
-      {
-	RTMP_Log(RTMP_LOGDEBUG,
-	    "%s, flex message, size %u bytes, not fully supported",
-	    __FUNCTION__, packet->m_nBodySize);
-	/*RTMP_LogHex(packet.m_body, packet.m_nBodySize); */
-
-	/* some DEBUG code */
-#if 0
-	   RTMP_LIB_AMFObject obj;
-	   int nRes = obj.Decode(packet.m_body+1, packet.m_nBodySize-1);
-	   if(nRes < 0) {
-	   RTMP_Log(RTMP_LOGERROR, "%s, error decoding AMF3 packet", __FUNCTION__);
-	   /*return; */
-	   }
-
-	   obj.Dump();
-#endif
+      /* flex message, an invoke after a format byte, values may be AMF3 */
+      RTMP_Log(RTMP_LOGDEBUG, "%s, flex message, size %u bytes",
+	  __FUNCTION__, packet->m_nBodySize);
+      if (packet->m_nBodySize > 1 &&
+	  HandleInvoke(r, packet->m_body + 1, packet->m_nBodySize - 1) == 1)
+	bHasMediaPacket = 2;
+      break;
 
-	if (HandleInvoke(r, packet->m_body + 1, packet->m_nBodySize - 1) == 1)
-	  bHasMediaPacket = 2;
-	break;
-      }
     case RTMP_PACKET_TYPE_INFO:
       /* metadata (notify) */
       RTMP_Log(RTMP_LOGDEBUG, "%s, received: notify %u bytes", __FUNCTION__,
@@ -1405,35 +2264,30 @@ ReadN(RTMP *r, char *buffer, int n)
       int nBytes = 0, nRead;
       if (r->Link.protocol & RTMP_FEATURE_HTTP)
         {
-	  int refill = 0;
 	  while (!r->m_resplen)
 	    {
-	      int ret;
-	      if (r->m_sb.sb_size < 13 || refill)
-	        {
-		  if (!r->m_unackd)
-		    HTTP_Post(r, RTMPT_IDLE, "", 1);
-		  if (RTMPSockBuf_Fill(&r->m_sb) < 1)
-		    {
-		      if (!r->m_sb.sb_timedout)
-		        RTMP_Close(r);
-		      return 0;
-		    }
-		}
-	      if ((ret = HTTP_read(r, 0)) == -1)
+	      int ret = HTTP_read(r, 0);
+	      if (ret == 0)
+		continue;
+	      if (ret == -1)
 		{
 		  RTMP_Log(RTMP_LOGDEBUG, "%s, No valid HTTP response found", __FUNCTION__);
 		  RTMP_Close(r);
 		  return 0;
 		}
-              else if (ret == -2)
-                {
-                  refill = 1;
-                }
-              else
-                {
-                  refill = 0;
-                }
+	      /* nothing outstanding, ask for data after the server's pause */
+	      if (!r->m_unackd &&
+		  (!HTTP_IdleWait(r) || HTTP_Post(r, RTMPT_IDLE) < 0))
+		{
+		  RTMP_Close(r);
+		  return 0;
+		}
+	      if (RTMPSockBuf_Fill(&r->m_sb) < 1)
+		{
+		  if (!r->m_sb.sb_timedout)
+		    RTMP_Close(r);
+		  return 0;
+		}
 	    }
 	  if (r->m_resplen && !r->m_sb.sb_size)
 	    RTMPSockBuf_Fill(&r->m_sb);
@@ -1517,14 +2371,26 @@ WriteN(RTMP *r, const char *buffer, int n)
     }
 #endif
 
-  while (n > 0)
+  if (r->Link.protocol & RTMP_FEATURE_HTTP)
+    {
+      /* queued, the POST goes out once nothing holds it back */
+      if (HTTP_Queue(r, ptr, n) &&
+	  ((r->m_httpCork && r->m_httpOutLen < RTMPT_FLUSH_SIZE) ||
+	   HTTP_Flush(r)))
+	n = 0;
+      else
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, RTMPT send error %d (%d bytes)",
+	      __FUNCTION__, GetSockError(), n);
+	  RTMP_Close(r);
+	}
+    }
+
+  while (n > 0 && !(r->Link.protocol & RTMP_FEATURE_HTTP))
     {
       int nBytes;
 
-      if (r->Link.protocol & RTMP_FEATURE_HTTP)
-        nBytes = HTTP_Post(r, RTMPT_SEND, ptr, n);
-      else
-        nBytes = RTMPSockBuf_Send(&r->m_sb, ptr, n);
+      nBytes = RTMPSockBuf_Send(&r->m_sb, ptr, n);
       /*RTMP_Log(RTMP_LOGDEBUG, "%s: %d\n", __FUNCTION__, nBytes); */
 
       if (nBytes < 0)
@@ -1564,126 +2430,130 @@ SAVC(flashVer);
 SAVC(swfUrl);
 SAVC(pageUrl);
 SAVC(tcUrl);
-SAVC(fpad);
-SAVC(capabilities);
 SAVC(audioCodecs);
 SAVC(videoCodecs);
-SAVC(videoFunction);
 SAVC(objectEncoding);
 SAVC(secureToken);
 SAVC(secureTokenResponse);
 SAVC(type);
 SAVC(nonprivate);
 
+/* Invoke prefix laid out at compile time: the method name, a number
+ * marker for the transaction id patched in per call, then the marker
+ * opening the command object. Method names are shorter than 256 bytes. */
+#define INVOKE_TEMPLATE(name, obj) \
+  static const struct { char s[3]; char v[sizeof(#name) - 1]; char txn[9]; char o; } \
+  tpl_##name = { { AMF_STRING, 0, sizeof(#name) - 1 }, #name, { AMF_NUMBER }, obj }
+
+#define INVOKE_BEGIN(b, name, txn) \
+  BeginInvoke(b, &tpl_##name, (const char *)&tpl_##name.o - (const char *)&tpl_##name + 1, txn)
+
+static void
+BeginInvoke(AMFBuilder *b, const void *tpl, size_t len, double txn)
+{
+  char *p = AMFBuilder_Grow(b, len);
+  if (p)
+    {
+      memcpy(p, tpl, len);
+      AMF_EncodeNumber(p + len - 10, p + len - 1, txn);
+    }
+}
+
+/* Sends the invoke encoded in b and releases the builder */
 static int
-SendConnectPacket(RTMP *r, RTMPPacket *cp)
+SendMessage(RTMP *r, AMFBuilder *b, int packetType, int channel, int headerType,
+	    int streamId, int queue)
 {
   RTMPPacket packet;
-  char pbuf[4096], *pend = pbuf + sizeof(pbuf);
-  char *enc;
-
-  if (cp)
-    return RTMP_SendPacket(r, cp, TRUE);
+  int ret;
 
-  packet.m_nChannel = 0x03;	/* control channel (invoke) */
-  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
-  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
+  if (b->ab_err)
+    {
+      AMFBuilder_Free(b);
+      return FALSE;
+    }
+  packet.m_nChannel = channel;
+  packet.m_headerType = headerType;
+  packet.m_packetType = packetType;
   packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = 0;
+  packet.m_nInfoField2 = streamId;
   packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+  packet.m_body = AMFBuilder_Data(b);
+  packet.m_nBodySize = b->ab_len;
 
-  enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_connect);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_OBJECT;
+  ret = RTMP_SendPacket(r, &packet, queue);
+  AMFBuilder_Free(b);
+  return ret;
+}
 
-  enc = AMF_EncodeNamedString(enc, pend, &av_app, &r->Link.app);
-  if (!enc)
-    return FALSE;
+static int
+SendInvoke(RTMP *r, AMFBuilder *b, int channel, int headerType, int streamId, int queue)
+{
+  return SendMessage(r, b, RTMP_PACKET_TYPE_INVOKE, channel, headerType,
+		     streamId, queue);
+}
+
+INVOKE_TEMPLATE(connect, AMF_OBJECT);
+
+/* Constant members of a player's connect object, pre-encoded:
+ * fpad: false, capabilities: 15 */
+static const char connectPlayHead[] =
+  "\x00\x04" "fpad" "\x01\x00"
+  "\x00\x0c" "capabilities" "\x00\x40\x2e\x00\x00\x00\x00\x00\x00";
+
+/* videoFunction: 1, and the Enhanced RTMP FourCC codecs we can demux,
+ * fourCcList: ["hvc1", "av01", "Opus"] */
+static const char connectPlayTail[] =
+  "\x00\x0d" "videoFunction" "\x00\x3f\xf0\x00\x00\x00\x00\x00\x00"
+  "\x00\x0a" "fourCcList" "\x0a\x00\x00\x00\x03"
+  "\x02\x00\x04" "hvc1" "\x02\x00\x04" "av01" "\x02\x00\x04" "Opus";
+
+static int
+SendConnectPacket(RTMP *r, RTMPPacket *cp)
+{
+  AMFBuilder b;
+  char pbuf[1024];
+  int i;
+
+  if (cp)
+    return RTMP_SendPacket(r, cp, TRUE);
+
+  AMFBuilder_Init(&b, pbuf, sizeof(pbuf), RTMP_MAX_HEADER_SIZE);
+  INVOKE_BEGIN(&b, connect, ++r->m_numInvokes);
+  AMFBuilder_NamedString(&b, &av_app, &r->Link.app);
   if (r->Link.protocol & RTMP_FEATURE_WRITE)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_type, &av_nonprivate);
-      if (!enc)
-	return FALSE;
-    }
+    AMFBuilder_NamedString(&b, &av_type, &av_nonprivate);
   if (r->Link.flashVer.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_flashVer, &r->Link.flashVer);
-      if (!enc)
-	return FALSE;
-    }
+    AMFBuilder_NamedString(&b, &av_flashVer, &r->Link.flashVer);
   if (r->Link.swfUrl.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_swfUrl, &r->Link.swfUrl);
-      if (!enc)
-	return FALSE;
-    }
+    AMFBuilder_NamedString(&b, &av_swfUrl, &r->Link.swfUrl);
   if (r->Link.tcUrl.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_tcUrl, &r->Link.tcUrl);
-      if (!enc)
-	return FALSE;
-    }
+    AMFBuilder_NamedString(&b, &av_tcUrl, &r->Link.tcUrl);
   if (!(r->Link.protocol & RTMP_FEATURE_WRITE))
     {
-      enc = AMF_EncodeNamedBoolean(enc, pend, &av_fpad, FALSE);
-      if (!enc)
-	return FALSE;
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_capabilities, 15.0);
-      if (!enc)
-	return FALSE;
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_audioCodecs, r->m_fAudioCodecs);
-      if (!enc)
-	return FALSE;
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_videoCodecs, r->m_fVideoCodecs);
-      if (!enc)
-	return FALSE;
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_videoFunction, 1.0);
-      if (!enc)
-	return FALSE;
+      AMFBuilder_Append(&b, connectPlayHead, sizeof(connectPlayHead) - 1);
+      AMFBuilder_NamedNumber(&b, &av_audioCodecs, r->m_fAudioCodecs);
+      AMFBuilder_NamedNumber(&b, &av_videoCodecs, r->m_fVideoCodecs);
+      AMFBuilder_Append(&b, connectPlayTail, sizeof(connectPlayTail) - 1);
       if (r->Link.pageUrl.av_len)
-	{
-	  enc = AMF_EncodeNamedString(enc, pend, &av_pageUrl, &r->Link.pageUrl);
-	  if (!enc)
-	    return FALSE;
-	}
+	AMFBuilder_NamedString(&b, &av_pageUrl, &r->Link.pageUrl);
     }
   if (r->m_fEncoding != 0.0 || r->m_bSendEncoding)
     {	/* AMF0, AMF3 not fully supported yet */
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_objectEncoding, r->m_fEncoding);
-      if (!enc)
-	return FALSE;
+      AMFBuilder_NamedNumber(&b, &av_objectEncoding, r->m_fEncoding);
     }
-  if (enc + 3 >= pend)
-    return FALSE;
-  *enc++ = 0;
-  *enc++ = 0;			/* end of object - 0x00 0x00 0x09 */
-  *enc++ = AMF_OBJECT_END;
+  AMFBuilder_ObjectEnd(&b);
 
   /* add auth string */
   if (r->Link.auth.av_len)
     {
-      enc = AMF_EncodeBoolean(enc, pend, r->Link.lFlags & RTMP_LF_AUTH);
-      if (!enc)
-	return FALSE;
-      enc = AMF_EncodeString(enc, pend, &r->Link.auth);
-      if (!enc)
-	return FALSE;
-    }
-  if (r->Link.extras.o_num)
-    {
-      int i;
-      for (i = 0; i < r->Link.extras.o_num; i++)
-	{
-	  enc = AMFProp_Encode(&r->Link.extras.o_props[i], enc, pend);
-	  if (!enc)
-	    return FALSE;
-	}
+      AMFBuilder_Boolean(&b, r->Link.lFlags & RTMP_LF_AUTH);
+      AMFBuilder_String(&b, &r->Link.auth);
     }
-  packet.m_nBodySize = enc - packet.m_body;
+  for (i = 0; i < r->Link.extras.o_num; i++)
+    AMFBuilder_Prop(&b, &r->Link.extras.o_props[i]);
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return SendInvoke(r, &b, 0x03, RTMP_PACKET_SIZE_LARGE, 0, TRUE);
 }
 
 #if 0				/* unused */
@@ -1720,30 +2590,45 @@ SendBGHasStream(RTMP *r, double dId, AVal *playpath)
 #endif
 
 SAVC(createStream);
+INVOKE_TEMPLATE(createStream, AMF_NULL);
 
 int
 RTMP_SendCreateStream(RTMP *r)
 {
-  RTMPPacket packet;
-  char pbuf[256], *pend = pbuf + sizeof(pbuf);
-  char *enc;
-
-  packet.m_nChannel = 0x03;	/* control channel (invoke) */
-  packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
-  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
-  packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = 0;
-  packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+  AMFBuilder b;
+  char pbuf[64];
 
-  enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_createStream);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;		/* NULL */
+  AMFBuilder_Init(&b, pbuf, sizeof(pbuf), RTMP_MAX_HEADER_SIZE);
+  INVOKE_BEGIN(&b, createStream, ++r->m_numInvokes);
+  return SendInvoke(r, &b, 0x03, RTMP_PACKET_SIZE_MEDIUM, 0, TRUE);
+}
 
-  packet.m_nBodySize = enc - packet.m_body;
+/* Invoke as a flex message: format byte, AMF0 method, transaction id and
+ * null command object, then each argument switched to AMF3 */
+int
+RTMP_SendFlexInvoke(RTMP *r, const AVal *method, AMFObjectProperty *args,
+		    int nArgs)
+{
+  AMFBuilder b;
+  AMF3Encoder enc;
+  char pbuf[512];
+  int i;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  AMFBuilder_Init(&b, pbuf, sizeof(pbuf), RTMP_MAX_HEADER_SIZE);
+  AMFBuilder_Append(&b, "", 1);
+  AMFBuilder_String(&b, method);
+  AMFBuilder_Number(&b, ++r->m_numInvokes);
+  AMFBuilder_Marker(&b, AMF_NULL);
+  AMF3Enc_Init(&enc, &b);
+  for (i = 0; i < nArgs; i++)
+    {
+      AMFBuilder_Marker(&b, AMF_AVMPLUS);
+      AMF3Enc_Prop(&enc, &args[i]);
+      AMF3Enc_Reset(&enc);
+    }
+  AMF3Enc_Free(&enc);
+  return SendMessage(r, &b, RTMP_PACKET_TYPE_FLEX_MESSAGE, 0x03,
+		     RTMP_PACKET_SIZE_MEDIUM, 0, TRUE);
 }
 
 SAVC(FCSubscribe);
@@ -1774,111 +2659,18 @@ SendFCSubscribe(RTMP *r, AVal *subscribepath)
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
-}
-
-/* Justin.tv specific authentication */
-static const AVal av_NetStream_Authenticate_UsherToken = AVC("NetStream.Authenticate.UsherToken");
-
-static int
-SendUsherToken(RTMP *r, AVal *usherToken)
-{
-  RTMPPacket packet;
-  char pbuf[1024], *pend = pbuf + sizeof(pbuf);
-  char *enc;
-  packet.m_nChannel = 0x03;	/* control channel (invoke) */
-  packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
-  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
-  packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = 0;
-  packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
-
-  RTMP_Log(RTMP_LOGDEBUG, "UsherToken: %s", usherToken->av_val);
-  enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_NetStream_Authenticate_UsherToken);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, usherToken);
-
-  if (!enc)
-    return FALSE;
-
-  packet.m_nBodySize = enc - packet.m_body;
-
-  return RTMP_SendPacket(r, &packet, FALSE);
-}
-/******************************************/
-
-SAVC(releaseStream);
-
-static int
-SendReleaseStream(RTMP *r)
-{
-  RTMPPacket packet;
-  char pbuf[1024], *pend = pbuf + sizeof(pbuf);
-  char *enc;
-
-  packet.m_nChannel = 0x03;	/* control channel (invoke) */
-  packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
-  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
-  packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = 0;
-  packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
-
- enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_releaseStream);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-  if (!enc)
-    return FALSE;
-
-  packet.m_nBodySize = enc - packet.m_body;
-
-  return RTMP_SendPacket(r, &packet, FALSE);
-}
-
-SAVC(FCPublish);
-
-static int
-SendFCPublish(RTMP *r)
-{
-  RTMPPacket packet;
-  char pbuf[1024], *pend = pbuf + sizeof(pbuf);
-  char *enc;
-
-  packet.m_nChannel = 0x03;	/* control channel (invoke) */
-  packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
-  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
-  packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = 0;
-  packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
-
-  enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_FCPublish);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-  if (!enc)
-    return FALSE;
-
-  packet.m_nBodySize = enc - packet.m_body;
-
-  return RTMP_SendPacket(r, &packet, FALSE);
+  return RTMP_SendPacket(r, &packet, TRUE);
 }
 
-SAVC(FCUnpublish);
+/* Justin.tv specific authentication */
+static const AVal av_NetStream_Authenticate_UsherToken = AVC("NetStream.Authenticate.UsherToken");
 
 static int
-SendFCUnpublish(RTMP *r)
+SendUsherToken(RTMP *r, AVal *usherToken)
 {
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
   char *enc;
-
   packet.m_nChannel = 0x03;	/* control channel (invoke) */
   packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
   packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
@@ -1887,11 +2679,13 @@ SendFCUnpublish(RTMP *r)
   packet.m_hasAbsTimestamp = 0;
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
+  RTMP_Log(RTMP_LOGDEBUG, "UsherToken: %s", usherToken->av_val);
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_FCUnpublish);
+  enc = AMF_EncodeString(enc, pend, &av_NetStream_Authenticate_UsherToken);
   enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
   *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+  enc = AMF_EncodeString(enc, pend, usherToken);
+
   if (!enc)
     return FALSE;
 
@@ -1899,42 +2693,68 @@ SendFCUnpublish(RTMP *r)
 
   return RTMP_SendPacket(r, &packet, FALSE);
 }
+/******************************************/
+
+INVOKE_TEMPLATE(releaseStream, AMF_NULL);
+
+static int
+SendReleaseStream(RTMP *r)
+{
+  AMFBuilder b;
+  char pbuf[512];
+
+  AMFBuilder_Init(&b, pbuf, sizeof(pbuf), RTMP_MAX_HEADER_SIZE);
+  INVOKE_BEGIN(&b, releaseStream, ++r->m_numInvokes);
+  AMFBuilder_String(&b, &r->Link.playpath);
+  return SendInvoke(r, &b, 0x03, RTMP_PACKET_SIZE_MEDIUM, 0, FALSE);
+}
+
+INVOKE_TEMPLATE(FCPublish, AMF_NULL);
+
+static int
+SendFCPublish(RTMP *r)
+{
+  AMFBuilder b;
+  char pbuf[512];
+
+  AMFBuilder_Init(&b, pbuf, sizeof(pbuf), RTMP_MAX_HEADER_SIZE);
+  INVOKE_BEGIN(&b, FCPublish, ++r->m_numInvokes);
+  AMFBuilder_String(&b, &r->Link.playpath);
+  return SendInvoke(r, &b, 0x03, RTMP_PACKET_SIZE_MEDIUM, 0, FALSE);
+}
+
+INVOKE_TEMPLATE(FCUnpublish, AMF_NULL);
+
+static int
+SendFCUnpublish(RTMP *r)
+{
+  AMFBuilder b;
+  char pbuf[512];
+
+  AMFBuilder_Init(&b, pbuf, sizeof(pbuf), RTMP_MAX_HEADER_SIZE);
+  INVOKE_BEGIN(&b, FCUnpublish, ++r->m_numInvokes);
+  AMFBuilder_String(&b, &r->Link.playpath);
+  return SendInvoke(r, &b, 0x03, RTMP_PACKET_SIZE_MEDIUM, 0, FALSE);
+}
 
 SAVC(publish);
 SAVC(live);
 SAVC(record);
 
+INVOKE_TEMPLATE(publish, AMF_NULL);
+
 static int
 SendPublish(RTMP *r)
 {
-  RTMPPacket packet;
-  char pbuf[1024], *pend = pbuf + sizeof(pbuf);
-  char *enc;
-
-  packet.m_nChannel = 0x04;	/* source channel (invoke) */
-  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
-  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
-  packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = r->m_stream_id;
-  packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
-
-  enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_publish);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-  if (!enc)
-    return FALSE;
+  AMFBuilder b;
+  char pbuf[512];
 
+  AMFBuilder_Init(&b, pbuf, sizeof(pbuf), RTMP_MAX_HEADER_SIZE);
+  INVOKE_BEGIN(&b, publish, ++r->m_numInvokes);
+  AMFBuilder_String(&b, &r->Link.playpath);
   /* FIXME: should we choose live based on Link.lFlags & RTMP_LF_LIVE? */
-  enc = AMF_EncodeString(enc, pend, &av_live);
-  if (!enc)
-    return FALSE;
-
-  packet.m_nBodySize = enc - packet.m_body;
-
-  return RTMP_SendPacket(r, &packet, TRUE);
+  AMFBuilder_String(&b, &av_live);
+  return SendInvoke(r, &b, 0x04, RTMP_PACKET_SIZE_LARGE, r->m_stream_id, TRUE);
 }
 
 SAVC(deleteStream);
@@ -2907,32 +3727,156 @@ static const AVal av_NetStream_Publish_Start = AVC("NetStream.Publish.Start");
 static const AVal av_NetConnection_Connect_Rejected =
 AVC("NetConnection.Connect.Rejected");
 
+/* Full decode for the debug log, only done when the level shows it */
+static void
+DumpMessage(const char *body, unsigned int nBodySize)
+{
+  char arenaBuf[2048];
+  AMFArena arena;
+  AMFObject obj;
+
+  AMFArena_Init(&arena, arenaBuf, sizeof(arenaBuf));
+  if (AMF_DecodeArena(&obj, body, nBodySize, FALSE, &arena) >= 0)
+    AMF_Dump(&obj);
+  else if (AMF_Decode(&obj, body, nBodySize, FALSE) >= 0)
+    {
+      AMF_Dump(&obj);
+      AMF_Reset(&obj);
+    }
+  AMFArena_Free(&arena);
+}
+
+/* Reads code, level and description from the info object of an
+ * onStatus or _error, skipping the other members */
+static void
+ReadInfoObject(AMFCursor *cur, AVal *code, AVal *level, AVal *description)
+{
+  AVal name, *dst;
+
+  code->av_val = level->av_val = description->av_val = NULL;
+  code->av_len = level->av_len = description->av_len = 0;
+  if (AMFCursor_PeekType(cur) == AMF_AVMPLUS)
+    {
+      /* AMF3 has no lengths to skip by, decode it and index the names */
+      AMFObjectProperty prop;
+      AMFObject obj;
+      AMFPropIndex idx;
+      AMFArena arena;
+      char arenaBuf[512];
+      if (AMFProp_Decode(&prop, cur->c_cur, cur->c_end - cur->c_cur, FALSE) < 0)
+	return;
+      AMFProp_GetObject(&prop, &obj);
+      AMFArena_Init(&arena, arenaBuf, sizeof(arenaBuf));
+      if (AMF_IndexObject(&idx, &obj, &arena))
+	{
+	  AMFProp_GetString(AMF_IndexGetProp(&idx, &av_code), code);
+	  AMFProp_GetString(AMF_IndexGetProp(&idx, &av_level), level);
+	  AMFProp_GetString(AMF_IndexGetProp(&idx, &av_description), description);
+	}
+      AMFArena_Free(&arena);
+      AMFProp_Reset(&prop);
+      return;
+    }
+  if (!AMFCursor_EnterObject(cur))
+    return;
+  while (AMFCursor_NextName(cur, &name))
+    {
+      if (AVMATCH(&name, &av_code))
+	dst = code;
+      else if (AVMATCH(&name, &av_level))
+	dst = level;
+      else if (AVMATCH(&name, &av_description))
+	dst = description;
+      else
+	dst = NULL;
+      /* first of duplicate names wins, as AMF_GetProp */
+      if (dst && !dst->av_val)
+	AMFCursor_GetString(cur, dst);
+      else if (!AMFCursor_Skip(cur))
+	break;
+    }
+}
+
+/* Commands after the connect reply, up to createStream */
+static void
+SendStreamSetup(RTMP *r)
+{
+  HTTP_Cork(r);
+  if (r->Link.protocol & RTMP_FEATURE_WRITE)
+    {
+      SendReleaseStream(r);
+      SendFCPublish(r);
+    }
+  else
+    {
+      RTMP_SendServerBW(r);
+      RTMP_SendCtrl(r, 3, 0, 300);
+    }
+  RTMP_SendCreateStream(r);
+
+  if (!(r->Link.protocol & RTMP_FEATURE_WRITE))
+    {
+      /* Authenticate on Justin.tv legacy servers before sending FCSubscribe */
+      if (r->Link.usherToken.av_len)
+        SendUsherToken(r, &r->Link.usherToken);
+      /* Send the FCSubscribe if live stream or if subscribepath is set */
+      if (r->Link.subscribepath.av_len)
+        SendFCSubscribe(r, &r->Link.subscribepath);
+      else if (r->Link.lFlags & RTMP_LF_LIVE)
+        SendFCSubscribe(r, &r->Link.playpath);
+    }
+  HTTP_Uncork(r);
+}
+
+/* publish or play on m_stream_id */
+static void
+SendStreamStart(RTMP *r)
+{
+  HTTP_Cork(r);
+  if (r->Link.protocol & RTMP_FEATURE_WRITE)
+    {
+      SendPublish(r);
+    }
+  else
+    {
+      if (r->Link.lFlags & RTMP_LF_PLST)
+        SendPlaylist(r);
+      SendPlay(r);
+      RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS);
+    }
+  HTTP_Uncork(r);
+}
+
 /* Returns 0 for OK/Failed/error, 1 for 'Stop or Complete' */
 static int
 HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 {
-  AMFObject obj;
+  AMFCursor cur;
   AVal method;
   double txn;
-  int ret = 0, nRes;
-  if (body[0] != 0x02)		/* make sure it is a string method name we start with */
+  int ret = 0;
+  /* make sure it is a string method name we start with, flex messages may
+   * switch to AMF3 for it */
+  if (!nBodySize || (body[0] != AMF_STRING && body[0] != AMF_AVMPLUS))
     {
       RTMP_Log(RTMP_LOGWARNING, "%s, Sanity failed. no string method in invoke packet",
 	  __FUNCTION__);
       return 0;
     }
 
-  nRes = AMF_Decode(&obj, body, nBodySize, FALSE);
-  if (nRes < 0)
+  if (RTMP_debuglevel >= RTMP_LOGDEBUG)
+    DumpMessage(body, nBodySize);
+
+  /* method name and transaction id first, handlers read or skip the rest */
+  AMFCursor_Init(&cur, body, nBodySize);
+  if (!AMFCursor_GetString(&cur, &method))
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
       return 0;
     }
-
-  AMF_Dump(&obj);
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-  txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
-  RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%s>", __FUNCTION__, method.av_val);
+  AMFCursor_GetNumber(&cur, &txn);
+  RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%.*s>", __FUNCTION__,
+      method.av_len, method.av_val);
 
   if (AVMATCH(&method, &av__result))
     {
@@ -2959,51 +3903,49 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	{
 	  if (r->Link.token.av_len)
 	    {
+	      /* the token may sit anywhere in the reply, search all of it */
+	      AMFObject obj;
 	      AMFObjectProperty p;
-	      if (RTMP_FindFirstMatchingProperty(&obj, &av_secureToken, &p))
+	      if (AMF_Decode(&obj, body, nBodySize, FALSE) >= 0)
 		{
-		  DecodeTEA(&r->Link.token, &p.p_vu.p_aval);
-		  SendSecureTokenResponse(r, &p.p_vu.p_aval);
+		  if (RTMP_FindFirstMatchingProperty(&obj, &av_secureToken, &p))
+		    {
+		      DecodeTEA(&r->Link.token, &p.p_vu.p_aval);
+		      SendSecureTokenResponse(r, &p.p_vu.p_aval);
+		    }
+		  AMF_Reset(&obj);
 		}
 	    }
-	  if (r->Link.protocol & RTMP_FEATURE_WRITE)
-	    {
-	      SendReleaseStream(r);
-	      SendFCPublish(r);
-	    }
-	  else
-	    {
-	      RTMP_SendServerBW(r);
-	      RTMP_SendCtrl(r, 3, 0, 300);
-	    }
-	  RTMP_SendCreateStream(r);
-
-	  if (!(r->Link.protocol & RTMP_FEATURE_WRITE))
-	    {
-	      /* Authenticate on Justin.tv legacy servers before sending FCSubscribe */
-	      if (r->Link.usherToken.av_len)
-	        SendUsherToken(r, &r->Link.usherToken);
-	      /* Send the FCSubscribe if live stream or if subscribepath is set */
-	      if (r->Link.subscribepath.av_len)
-	        SendFCSubscribe(r, &r->Link.subscribepath);
-	      else if (r->Link.lFlags & RTMP_LF_LIVE)
-	        SendFCSubscribe(r, &r->Link.playpath);
-	    }
+	  r->m_bConnected = TRUE;
+	  /* a pipelined connect sent the setup along with it */
+	  if (!r->m_bStreamPredicted && !r->m_bHold)
+	    SendStreamSetup(r);
 	}
       else if (AVMATCH(&methodInvoked, &av_createStream))
 	{
-	  r->m_stream_id = (int)AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
-
-	  if (r->Link.protocol & RTMP_FEATURE_WRITE)
+	  double streamId;
+	  AMFCursor_Skip(&cur);
+	  AMFCursor_GetNumber(&cur, &streamId);
+	  if (!r->m_bStreamPredicted)
 	    {
-	      SendPublish(r);
+	      r->m_stream_id = (int)streamId;
+	      SendStreamStart(r);
 	    }
 	  else
 	    {
-	      if (r->Link.lFlags & RTMP_LF_PLST)
-	        SendPlaylist(r);
-	      SendPlay(r);
-	      RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS);
+	      r->m_bStreamPredicted = FALSE;
+	      if ((int)streamId != r->m_stream_id)
+		{
+		  RTMP_Log(RTMP_LOGWARNING, "%s, got stream id %d, predicted %d, restarting",
+		      __FUNCTION__, (int)streamId, r->m_stream_id);
+		  /* the reply to the early publish/play is for the wrong stream */
+		  for (i = r->m_numCalls - 1; i >= 0; i--)
+		    if (AVMATCH(&r->m_methodCalls[i].name, &av_publish) ||
+			AVMATCH(&r->m_methodCalls[i].name, &av_play))
+		      AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
+		  r->m_stream_id = (int)streamId;
+		  SendStreamStart(r);
+		}
 	    }
 	}
       else if (AVMATCH(&methodInvoked, &av_play) ||
@@ -3074,12 +4016,9 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 
           if (AVMATCH(&methodInvoked, &av_connect))
             {
-              AMFObject obj2;
               AVal code, level, description;
-              AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_description, -1), &description);
+              AMFCursor_Skip(&cur);
+              ReadInfoObject(&cur, &code, &level, &description);
               RTMP_Log(RTMP_LOGDEBUG, "%s, error description: %s", __FUNCTION__, description.av_val);
               /* if PublisherAuth returns 1, then reconnect */
               if (PublisherAuth(r, &description) == 1)
@@ -3106,11 +4045,9 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
     }
   else if (AVMATCH(&method, &av_onStatus))
     {
-      AMFObject obj2;
-      AVal code, level;
-      AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
+      AVal code, level, description;
+      AMFCursor_Skip(&cur);
+      ReadInfoObject(&cur, &code, &level, &description);
 
       RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %s", __FUNCTION__, code.av_val);
       if (AVMATCH(&code, &av_NetStream_Failed)
@@ -3192,7 +4129,6 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 
     }
 leave:
-  AMF_Reset(&obj);
   return ret;
 }
 
@@ -3306,38 +4242,66 @@ HandleMetadata(RTMP *r, char *body, unsigned int len)
   /* also keep duration or filesize to make a nice progress bar */
 
   AMFObject obj;
+  AMFObjectProperty prop, *pDuration;
+  AMFPropIndex idx;
+  AMFCursor cur;
   AVal metastring;
   int ret = FALSE;
+  char arenaBuf[4096];
+  AMFArena arena;
+  int heapObj = FALSE;
 
-  int nRes = AMF_Decode(&obj, body, len, FALSE);
+  if (RTMP_debuglevel >= RTMP_LOGDEBUG)
+    DumpMessage(body, len);
+
+  /* only onMetaData is kept, other notifies need no decode */
+  AMFCursor_Init(&cur, body, len);
+  if (!AMFCursor_GetString(&cur, &metastring) || !AVMATCH(&metastring, &av_onMetaData))
+    return FALSE;
+
+  AMFArena_Init(&arena, arenaBuf, sizeof(arenaBuf));
+  int nRes = AMF_DecodeArena(&obj, body, len, FALSE, &arena);
+  if (nRes < 0)
+    {
+      heapObj = TRUE;
+      nRes = AMF_Decode(&obj, body, len, FALSE);
+    }
   if (nRes < 0)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
+      AMFArena_Free(&arena);
       return FALSE;
     }
 
-  AMF_Dump(&obj);
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &metastring);
-
-  if (AVMATCH(&metastring, &av_onMetaData))
+  /* Show metadata */
+  if (RTMP_debuglevel >= RTMP_LOGINFO)
     {
-      AMFObjectProperty prop;
-      /* Show metadata */
       RTMP_Log(RTMP_LOGINFO, "Metadata:");
       DumpMetaData(&obj);
-      if (RTMP_FindFirstMatchingProperty(&obj, &av_duration, &prop))
-	{
-	  r->m_fDuration = prop.p_vu.p_number;
-	  /*RTMP_Log(RTMP_LOGDEBUG, "Set duration: %.2f", m_fDuration); */
-	}
-      /* Search for audio or video tags */
-      if (RTMP_FindPrefixProperty(&obj, &av_video, &prop))
-        r->m_read.dataType |= 1;
-      if (RTMP_FindPrefixProperty(&obj, &av_audio, &prop))
-        r->m_read.dataType |= 4;
-      ret = TRUE;
-    }
-  AMF_Reset(&obj);
+    }
+  /* duration is a member of the metadata object, look it up by name
+   * there and only search nested objects when it is not */
+  pDuration = NULL;
+  if (obj.o_num > 1 && (obj.o_props[1].p_type == AMF_OBJECT || obj.o_props[1].p_type == AMF_ECMA_ARRAY)
+      && AMF_IndexObject(&idx, &obj.o_props[1].p_vu.p_object, &arena))
+    pDuration = AMF_IndexGetProp(&idx, &av_duration);
+  if (pDuration && pDuration->p_type != AMF_INVALID)
+    r->m_fDuration = pDuration->p_vu.p_number;
+  else if (RTMP_FindFirstMatchingProperty(&obj, &av_duration, &prop))
+    {
+      r->m_fDuration = prop.p_vu.p_number;
+      /*RTMP_Log(RTMP_LOGDEBUG, "Set duration: %.2f", m_fDuration); */
+    }
+  /* Search for audio or video tags */
+  if (RTMP_FindPrefixProperty(&obj, &av_video, &prop))
+    r->m_read.dataType |= 1;
+  if (RTMP_FindPrefixProperty(&obj, &av_audio, &prop))
+    r->m_read.dataType |= 4;
+  ret = TRUE;
+
+  if (heapObj)
+    AMF_Reset(&obj);
+  AMFArena_Free(&arena);
   return ret;
 }
 
@@ -3793,6 +4757,13 @@ HandShake(RTMP *r, int FP9HandShake)
   if (!WriteN(r, serversig, RTMP_SIG_SIZE))
     return FALSE;
 
+  if ((r->Link.lFlags & RTMP_LF_PIPE) && !(r->Link.protocol & RTMP_FEATURE_HTTP))
+    {
+      /* S2 is read once the connect command is on its way */
+      r->m_bHandshakePending = TRUE;
+      return TRUE;
+    }
+
   if (ReadN(r, serversig, RTMP_SIG_SIZE) != RTMP_SIG_SIZE)
     return FALSE;
 
@@ -3901,9 +4872,8 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
   int hSize, cSize;
   char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
   uint32_t t;
-  char *buffer, *tbuf = NULL, *toff = NULL;
+  char *buffer;
   int nChunkSize;
-  int tlen;
 
   if (packet->m_nChannel >= r->m_channelsAllocatedOut)
     {
@@ -3921,6 +4891,10 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     }
 
   prevPacket = r->m_vecChannelsOut[packet->m_nChannel];
+  /* a timestamp delta can't go backwards, e.g. audio pts interleaved with
+   * video dts on one channel; resend the absolute timestamp instead */
+  if (prevPacket && packet->m_nTimeStamp < prevPacket->m_nTimeStamp)
+    packet->m_headerType = RTMP_PACKET_SIZE_LARGE;
   if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
     {
       /* compress a bit by using the prev packet's attributes */
@@ -4020,18 +4994,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
   RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_sb.sb_socket,
       nSize);
   /* send all chunks in one HTTP request */
-  if (r->Link.protocol & RTMP_FEATURE_HTTP)
-    {
-      int chunks = (nSize+nChunkSize-1) / nChunkSize;
-      if (chunks > 1)
-        {
-	  tlen = chunks * (cSize + 1) + nSize + hSize;
-	  tbuf = malloc(tlen);
-	  if (!tbuf)
-	    return FALSE;
-	  toff = tbuf;
-	}
-    }
+  HTTP_Cork(r);
   while (nSize + hSize)
     {
       int wrote;
@@ -4041,16 +5004,11 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 
       RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)header, hSize);
       RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)buffer, nChunkSize);
-      if (tbuf)
-        {
-	  memcpy(toff, header, nChunkSize + hSize);
-	  toff += nChunkSize + hSize;
-	}
-      else
-        {
-	  wrote = WriteN(r, header, nChunkSize + hSize);
-	  if (!wrote)
-	    return FALSE;
+      wrote = WriteN(r, header, nChunkSize + hSize);
+      if (!wrote)
+	{
+	  HTTP_Uncork(r);
+	  return FALSE;
 	}
       nSize -= nChunkSize;
       buffer += nChunkSize;
@@ -4085,21 +5043,18 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
             }
 	}
     }
-  if (tbuf)
-    {
-      int wrote = WriteN(r, tbuf, toff-tbuf);
-      free(tbuf);
-      tbuf = NULL;
-      if (!wrote)
-        return FALSE;
-    }
+  if (!HTTP_Uncork(r))
+    return FALSE;
 
   /* we invoked a remote method */
-  if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE)
+  if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE ||
+      packet->m_packetType == RTMP_PACKET_TYPE_FLEX_MESSAGE)
     {
       AVal method;
       char *ptr;
-      ptr = packet->m_body + 1;
+      /* a flex message starts with a format byte */
+      ptr = packet->m_body + 1 +
+	(packet->m_packetType == RTMP_PACKET_TYPE_FLEX_MESSAGE);
       AMF_DecodeString(ptr, &method);
       RTMP_Log(RTMP_LOGDEBUG, "Invoking %s", method.av_val);
       /* keep it in call queue till result arrives */
@@ -4117,6 +5072,17 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
   return TRUE;
 }
 
+/* Reads the S2 a pipelined handshake left unread. The plain handshake only
+ * logs a signature mismatch, so it is not checked here. */
+static int
+HandShakeFinish(RTMP *r)
+{
+  char serversig[RTMP_SIG_SIZE];
+
+  r->m_bHandshakePending = FALSE;
+  return ReadN(r, serversig, RTMP_SIG_SIZE) == RTMP_SIG_SIZE;
+}
+
 int
 RTMP_Serve(RTMP *r)
 {
@@ -4134,6 +5100,8 @@ CloseInternal(RTMP *r, int reconnect)
 {
   int i;
 
+  /* a burst cut short still goes out ahead of the goodbye */
+  r->m_httpCork = 0;
   if (RTMP_IsConnected(r))
     {
       if (r->m_stream_id > 0)
@@ -4146,11 +5114,15 @@ CloseInternal(RTMP *r, int reconnect)
 	}
       if (r->m_clientID.av_val)
         {
-	  HTTP_Post(r, RTMPT_CLOSE, "", 1);
+	  HTTP_Post(r, RTMPT_CLOSE);
 	  free(r->m_clientID.av_val);
 	  r->m_clientID.av_val = NULL;
 	  r->m_clientID.av_len = 0;
 	}
+#if defined(CRYPTO) && !defined(NO_SSL) && !defined(USE_POLARSSL)
+      if (r->m_sb.sb_ssl)
+	TLSCacheSave(r, TRUE);
+#endif
       RTMPSockBuf_Close(&r->m_sb);
     }
 
@@ -4205,11 +5177,23 @@ CloseInternal(RTMP *r, int reconnect)
   r->m_numInvokes = 0;
 
   r->m_bPlaying = FALSE;
+  r->m_bHandshakePending = FALSE;
+  r->m_bStreamPredicted = FALSE;
+  r->m_bHold = FALSE;
+  r->m_bConnected = FALSE;
+  r->m_bFastOpen = FALSE;
   r->m_sb.sb_size = 0;
+  r->m_sb.sb_deadline = 0;
 
   r->m_msgCounter = 0;
   r->m_resplen = 0;
   r->m_unackd = 0;
+  free(r->m_httpOut);
+  r->m_httpOut = NULL;
+  r->m_httpOutLen = 0;
+  r->m_httpOutSize = 0;
+  r->m_httpState = HTTP_STATUS;
+  r->m_httpIdle = FALSE;
 
   if (r->Link.lFlags & RTMP_LF_FTCU && !reconnect)
     {
@@ -4255,10 +5239,52 @@ RTMPSockBuf_Fill(RTMPSockBuf *sb)
 
   if (!sb->sb_size)
     sb->sb_start = sb->sb_buf;
+  else if (sb->sb_start + sb->sb_size > sb->sb_buf + sizeof(sb->sb_buf) / 2)
+    {
+      /* a partial message near the end, make room behind it */
+      memmove(sb->sb_buf, sb->sb_start, sb->sb_size);
+      sb->sb_start = sb->sb_buf;
+    }
 
   while (1)
     {
       nBytes = sizeof(sb->sb_buf) - 1 - sb->sb_size - (sb->sb_start - sb->sb_buf);
+      /* TLS may hold decrypted bytes the socket no longer shows */
+      if (!sb->sb_ssl && (sb->sb_deadline || sb->sb_cancel))
+	{
+	  struct pollfd fds[2];
+	  int wait = sb->sb_rcvtimeo > 0 ? sb->sb_rcvtimeo : -1, rc;
+
+	  if (sb->sb_deadline)
+	    {
+	      int left = (int)(sb->sb_deadline - ClockMillis());
+	      if (left < 0)
+		left = 0;
+	      if (wait < 0 || left < wait)
+		wait = left;
+	    }
+	  fds[0].fd = sb->sb_socket;
+	  fds[0].events = POLLIN;
+	  fds[0].revents = 0;
+	  rc = PollCancel(fds, 1, wait, sb->sb_cancel);
+	  if (rc == RTMP_POLL_CANCELLED)
+	    {
+	      RTMP_Log(RTMP_LOGDEBUG, "%s, cancelled", __FUNCTION__);
+	      return -1;
+	    }
+	  if (rc < 0)
+	    {
+	      if (GetSockError() == EINTR && !RTMP_ctrlC)
+		continue;
+	      return -1;
+	    }
+	  if (rc == 0)
+	    {
+	      RTMP_Log(RTMP_LOGDEBUG, "%s, timed out after %d ms", __FUNCTION__, wait);
+	      sb->sb_timedout = TRUE;
+	      return 0;
+	    }
+	}
 #if defined(CRYPTO) && !defined(NO_SSL)
       if (sb->sb_ssl)
 	{
@@ -4403,12 +5429,15 @@ DecodeTEA(AVal *key, AVal *text)
   free(out);
 }
 
+/* Sends one request, the header goes into the RTMPT_HEADROOM bytes in
+ * front of body so that both leave in a single write. */
 static int
-HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
+HTTP_Send(RTMP *r, RTMPTCmd cmd, char *body, int len)
 {
-  char hbuf[512];
+  char hbuf[RTMPT_HEADROOM], *start;
+  int v6 = memchr(r->Link.hostname.av_val, ':', r->Link.hostname.av_len) != NULL;
   int hlen = snprintf(hbuf, sizeof(hbuf), "POST /%s%s/%d HTTP/1.1\r\n"
-    "Host: %.*s:%d\r\n"
+    "Host: %s%.*s%s:%d\r\n"
     "Accept: */*\r\n"
     "User-Agent: Shockwave Flash\r\n"
     "Connection: Keep-Alive\r\n"
@@ -4416,79 +5445,210 @@ HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
     "Content-type: application/x-fcs\r\n"
     "Content-length: %d\r\n\r\n", RTMPT_cmds[cmd],
     r->m_clientID.av_val ? r->m_clientID.av_val : "",
-    r->m_msgCounter, r->Link.hostname.av_len, r->Link.hostname.av_val,
-    r->Link.port, len);
-  RTMPSockBuf_Send(&r->m_sb, hbuf, hlen);
-  hlen = RTMPSockBuf_Send(&r->m_sb, buf, len);
+    r->m_msgCounter, v6 ? "[" : "", r->Link.hostname.av_len,
+    r->Link.hostname.av_val, v6 ? "]" : "", r->Link.port, len);
+  int sent = 0, total;
+
+  if (hlen < 0 || hlen >= (int)sizeof(hbuf))
+    return -1;
+  start = body - hlen;
+  memcpy(start, hbuf, hlen);
+  total = hlen + len;
+  while (sent < total)
+    {
+      int rc = RTMPSockBuf_Send(&r->m_sb, start + sent, total - sent);
+      if (rc <= 0)
+	{
+	  if (rc < 0 && GetSockError() == EINTR && !RTMP_ctrlC)
+	    continue;
+	  return -1;
+	}
+      sent += rc;
+    }
   r->m_msgCounter++;
   r->m_unackd++;
-  return hlen;
+  return len;
 }
 
+/* open, idle and close carry a single zero byte */
 static int
-HTTP_read(RTMP *r, int fill)
+HTTP_Post(RTMP *r, RTMPTCmd cmd)
 {
-  char *ptr;
-  int hlen;
-
-restart:
-  if (fill)
-    RTMPSockBuf_Fill(&r->m_sb);
-  if (r->m_sb.sb_size < 13) {
-    if (fill)
-      goto restart;
-    return -2;
-  }
-  if (strncmp(r->m_sb.sb_start, "HTTP/1.1 200 ", 13))
-    return -1;
-  r->m_sb.sb_start[r->m_sb.sb_size] = '\0';
-  if (!strstr(r->m_sb.sb_start, "\r\n\r\n")) {
-    if (fill)
-      goto restart;
-    return -2;
-  }
+  char req[RTMPT_HEADROOM + 1];
 
-  ptr = r->m_sb.sb_start + sizeof("HTTP/1.1 200");
-  while ((ptr = strstr(ptr, "Content-"))) {
-    if (!strncasecmp(ptr+8, "length:", 7)) break;
-    ptr += 8;
-  }
-  if (!ptr)
-    return -1;
-  hlen = atoi(ptr+16);
-  ptr = strstr(ptr+16, "\r\n\r\n");
-  if (!ptr)
-    return -1;
-  ptr += 4;
-  if (ptr + (r->m_clientID.av_val ? 1 : hlen) > r->m_sb.sb_start + r->m_sb.sb_size)
+  req[RTMPT_HEADROOM] = '\0';
+  return HTTP_Send(r, cmd, req + RTMPT_HEADROOM, 1);
+}
+
+static int
+HTTP_Queue(RTMP *r, const char *buf, int len)
+{
+  if (r->m_httpOutLen + len > r->m_httpOutSize)
     {
-      if (fill)
-        goto restart;
-      return -2;
+      int size = r->m_httpOutSize ? r->m_httpOutSize : 4096;
+      char *out;
+
+      while (size < r->m_httpOutLen + len)
+	size *= 2;
+      out = realloc(r->m_httpOut, RTMPT_HEADROOM + size);
+      if (!out)
+	return FALSE;
+      r->m_httpOut = out;
+      r->m_httpOutSize = size;
     }
-  r->m_sb.sb_size -= ptr - r->m_sb.sb_start;
-  r->m_sb.sb_start = ptr;
-  r->m_unackd--;
+  memcpy(r->m_httpOut + RTMPT_HEADROOM + r->m_httpOutLen, buf, len);
+  r->m_httpOutLen += len;
+  return TRUE;
+}
+
+/* everything queued goes out as one send request */
+static int
+HTTP_Flush(RTMP *r)
+{
+  int len = r->m_httpOutLen;
+
+  if (!len)
+    return TRUE;
+  r->m_httpOutLen = 0;
+  return HTTP_Send(r, RTMPT_SEND, r->m_httpOut + RTMPT_HEADROOM, len) == len;
+}
+
+/* Writes between HTTP_Cork and HTTP_Uncork share one POST. Calls nest, a
+ * close in between drops whatever was queued. */
+static void
+HTTP_Cork(RTMP *r)
+{
+  r->m_httpCork++;
+}
 
-  if (!r->m_clientID.av_val)
+static int
+HTTP_Uncork(RTMP *r)
+{
+  if (r->m_httpCork > 0 && --r->m_httpCork > 0)
+    return TRUE;
+  if (HTTP_Flush(r))
+    return TRUE;
+  RTMP_Log(RTMP_LOGERROR, "%s, RTMPT send error %d", __FUNCTION__,
+      GetSockError());
+  RTMP_Close(r);
+  return FALSE;
+}
+
+/* The first byte of each response hints how long an idle client should
+ * wait before polling again, servers raise it while they have nothing to
+ * send. Data in the last response means poll right away. Until the
+ * stream runs, or while a command reply is due, the pause stays short. */
+static int
+HTTP_IdleWait(RTMP *r)
+{
+  struct pollfd fds[2];
+  int ms;
+
+  if (!r->m_httpIdle || r->m_polling <= 0)
+    return TRUE;
+  ms = r->m_polling * RTMPT_POLL_UNIT;
+  if (ms > RTMPT_POLL_MAX)
+    ms = RTMPT_POLL_MAX;
+  if ((r->m_numCalls || !r->m_bPlaying) && ms > RTMPT_POLL_BUSY)
+    ms = RTMPT_POLL_BUSY;
+  if (r->m_sb.sb_deadline)
+    {
+      int left = (int)(r->m_sb.sb_deadline - ClockMillis());
+      if (left < ms)
+	ms = left < 0 ? 0 : left;
+    }
+  /* nothing is outstanding, so this only ends early on cancel */
+  fds[0].fd = r->m_sb.sb_socket;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  return PollCancel(fds, 1, ms, r->m_sb.sb_cancel) != RTMP_POLL_CANCELLED;
+}
+
+/* Parses a response as it arrives. Header lines are consumed once they
+ * are complete, so no byte is looked at twice across refills.
+ * Returns 0 with the response read up to its data, -2 for more input,
+ * -1 for a bad response. */
+static int
+HTTP_read(RTMP *r, int fill)
+{
+  for (;;)
     {
-      r->m_clientID.av_len = hlen;
-      r->m_clientID.av_val = malloc(hlen+1);
+      char *ptr = r->m_sb.sb_start, *eol = NULL;
+      int len, need;
+
+      if (r->m_httpState != HTTP_BODY)
+	{
+	  if (r->m_sb.sb_size)
+	    eol = memchr(ptr, '\n', r->m_sb.sb_size);
+	  if (!eol)
+	    goto more;
+	  len = eol + 1 - ptr;
+	  if (r->m_httpState == HTTP_STATUS)
+	    {
+	      if (len < 13 || strncmp(ptr, "HTTP/1.1 200 ", 13))
+		return -1;
+	      r->m_httpState = HTTP_HEADERS;
+	      r->m_httpLen = -1;
+	    }
+	  else if (len <= 2)
+	    {
+	      /* blank line, headers done */
+	      if (r->m_httpLen < 1)
+		return -1;
+	      r->m_httpState = HTTP_BODY;
+	    }
+	  else if (len > 15 && !strncasecmp(ptr, "Content-length:", 15))
+	    {
+	      char *p = ptr + 15;
+	      int n = 0;
+
+	      while (p < eol && (*p == ' ' || *p == '\t'))
+		p++;
+	      if (p == eol || *p < '0' || *p > '9')
+		return -1;
+	      while (p < eol && *p >= '0' && *p <= '9' && n < 0x10000000)
+		n = n * 10 + *p++ - '0';
+	      r->m_httpLen = n;
+	    }
+	  r->m_sb.sb_start += len;
+	  r->m_sb.sb_size -= len;
+	  continue;
+	}
+
+      /* the open reply is the session id, others lead with the poll hint */
+      need = r->m_clientID.av_val ? 1 : r->m_httpLen;
+      if (r->m_sb.sb_size < need)
+	goto more;
+
+      r->m_httpState = HTTP_STATUS;
+      r->m_unackd--;
       if (!r->m_clientID.av_val)
-        return -1;
-      r->m_clientID.av_val[0] = '/';
-      memcpy(r->m_clientID.av_val+1, ptr, hlen-1);
-      r->m_clientID.av_val[hlen] = 0;
-      r->m_sb.sb_size = 0;
-    }
-  else
-    {
-      r->m_polling = *ptr++;
-      r->m_resplen = hlen - 1;
-      r->m_sb.sb_start++;
-      r->m_sb.sb_size--;
+	{
+	  r->m_clientID.av_len = r->m_httpLen;
+	  r->m_clientID.av_val = malloc(r->m_httpLen + 1);
+	  if (!r->m_clientID.av_val)
+	    return -1;
+	  r->m_clientID.av_val[0] = '/';
+	  memcpy(r->m_clientID.av_val + 1, ptr, r->m_httpLen - 1);
+	  r->m_clientID.av_val[r->m_httpLen] = 0;
+	  r->m_sb.sb_size = 0;
+	}
+      else
+	{
+	  r->m_polling = *ptr;
+	  r->m_resplen = r->m_httpLen - 1;
+	  r->m_httpIdle = !r->m_resplen;
+	  r->m_sb.sb_start++;
+	  r->m_sb.sb_size--;
+	}
+      return 0;
+
+    more:
+      if (!fill)
+	return -2;
+      if (RTMPSockBuf_Fill(&r->m_sb) < 1)
+	return -1;
     }
-  return 0;
 }
 
 #define MAX_IGNORED_FRAMES	50
@@ -4530,7 +5690,10 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
       r->m_read.dataType |= (((packet.m_packetType == RTMP_PACKET_TYPE_AUDIO) << 2) |
 			     (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO));
 
-      if (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO && nPacketLen <= 5)
+      /* an enhanced rtmp ExVideoTagHeader packet can be just the 5 byte
+       * header + FourCC, e.g. SequenceEnd */
+      if (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO && nPacketLen <= 5
+          && !(nPacketLen == 5 && (packetBody[0] & 0x80)))
 	{
 	  RTMP_Log(RTMP_LOGDEBUG, "ignoring too small video packet: size: %d",
 	      nPacketLen);
@@ -5091,8 +6254,8 @@ fail:
 
 static const AVal av_setDataFrame = AVC("@setDataFrame");
 
-int
-RTMP_Write(RTMP *r, const char *buf, int size)
+static int
+WriteFLV(RTMP *r, const char *buf, int size)
 {
   RTMPPacket *pkt = &r->m_write;
   char *pend, *enc;
@@ -5177,3 +6340,16 @@ RTMP_Write(RTMP *r, const char *buf, int size)
     }
   return size+s2;
 }
+
+/* all tags in buf share one POST on RTMPT */
+int
+RTMP_Write(RTMP *r, const char *buf, int size)
+{
+  int ret;
+
+  HTTP_Cork(r);
+  ret = WriteFLV(r, buf, size);
+  if (!HTTP_Uncork(r))
+    return -1;
+  return ret;
+}
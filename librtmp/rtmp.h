@@ -132,6 +132,9 @@ extern "C"
     char sb_buf[RTMP_BUFFER_CACHE_SIZE];	/* data read from socket */
     int sb_timedout;
     void *sb_ssl;
+    struct RTMPCancel *sb_cancel;	/* reads also return when it fires */
+    uint32_t sb_deadline;	/* ms clock value ending the current phase, 0 for none */
+    int sb_rcvtimeo;		/* ms a single read may wait */
   } RTMPSockBuf;
 
   void RTMPPacket_Reset(RTMPPacket *p);
@@ -172,12 +175,17 @@ extern "C"
 #define RTMP_LF_BUFX	0x0010	/* toggle stream on BufferEmpty msg */
 #define RTMP_LF_FTCU	0x0020	/* free tcUrl on close */
 #define RTMP_LF_FAPU	0x0040	/* free app on close */
+#define RTMP_LF_PIPE	0x0080	/* send stream setup without waiting for replies */
+#define RTMP_LF_TFO	0x0100	/* TCP Fast Open, the first write rides in the SYN */
     int lFlags;
 
     int swfAge;
 
     int protocol;
     int timeout;		/* connection timeout in seconds */
+    int connTimeout;		/* ms for the TCP connect, 0 uses timeout */
+    int hsTimeout;		/* ms for the handshake, 0 uses timeout */
+    int cmdTimeout;		/* ms from connect until play/publish starts, 0 for none */
 
     int pFlags;			/* unused, but kept to avoid breaking ABI */
 
@@ -253,6 +261,11 @@ extern "C"
     uint8_t m_bPlaying;
     uint8_t m_bSendEncoding;
     uint8_t m_bSendCounter;
+    uint8_t m_bHandshakePending;	/* S2 still unread, pipelined connect */
+    uint8_t m_bStreamPredicted;	/* publish/play sent before createStream result */
+    uint8_t m_bHold;		/* no stream setup after connect, see RTMP_ConnectIdle */
+    uint8_t m_bConnected;	/* connect result received */
+    uint8_t m_bFastOpen;	/* TCP connect deferred to the first write */
 
     int m_numInvokes;
     int m_numCalls;
@@ -275,6 +288,13 @@ extern "C"
     int m_resplen;
     int m_unackd;
     AVal m_clientID;
+    char *m_httpOut;		/* queued payload, RTMPT_HEADROOM bytes in */
+    int m_httpOutLen;
+    int m_httpOutSize;
+    int m_httpCork;		/* open HTTP_Cork calls, the POST waits for 0 */
+    int m_httpState;		/* response parser state */
+    int m_httpLen;		/* Content-Length of the response being parsed */
+    int m_httpIdle;		/* the last response carried no data */
 
     RTMP_READ m_read;
     RTMPPacket m_write;
@@ -310,6 +330,22 @@ extern "C"
 			int dStop, int bLiveStream, long int timeout);
 
   int RTMP_Connect(RTMP *r, RTMPPacket *cp);
+  void RTMP_FlushDNSCache(void);
+  /* drops the TLS sessions kept for resuming rtmps/rtmpts reconnects */
+  void RTMP_FlushTLSCache(void);
+
+  /* A cancel handle aborts a pending connect, handshake or read of every
+   * RTMP it is set on. RTMP_Cancel may be called from any thread. */
+  typedef struct RTMPCancel RTMPCancel;
+  RTMPCancel *RTMP_CancelAlloc(void);
+  void RTMP_CancelFree(RTMPCancel *c);
+  void RTMP_Cancel(RTMPCancel *c);
+  void RTMP_CancelReset(RTMPCancel *c);
+  int RTMP_IsCancelled(RTMPCancel *c);
+  void RTMP_SetCancel(RTMP *r, RTMPCancel *c);
+  /* reads fail with RTMP_IsTimedout set once ms have passed, 0 clears it */
+  void RTMP_SetDeadline(RTMP *r, int ms);
+
   struct sockaddr;
   int RTMP_Connect0(RTMP *r, struct sockaddr *svc);
   int RTMP_Connect1(RTMP *r, RTMPPacket *cp);
@@ -326,6 +362,10 @@ extern "C"
   int RTMP_ToggleStream(RTMP *r);
 
   int RTMP_ConnectStream(RTMP *r, int seekTime);
+  /* Connects and waits for the connect result without creating a stream,
+   * so a pooled connection can later start one in a single round trip. */
+  int RTMP_ConnectIdle(RTMP *r, RTMPPacket *cp);
+  int RTMP_StartStream(RTMP *r, const AVal *playpath);
   int RTMP_ReconnectStream(RTMP *r, int seekTime);
   void RTMP_DeleteStream(RTMP *r);
   int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet);
@@ -360,6 +400,8 @@ extern "C"
   int RTMPSockBuf_Close(RTMPSockBuf *sb);
 
   int RTMP_SendCreateStream(RTMP *r);
+  int RTMP_SendFlexInvoke(RTMP *r, const AVal *method,
+			  AMFObjectProperty *args, int nArgs);
   int RTMP_SendSeek(RTMP *r, int dTime);
   int RTMP_SendServerBW(RTMP *r);
   int RTMP_SendClientBW(RTMP *r);
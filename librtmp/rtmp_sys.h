@@ -41,6 +41,13 @@
 #define sleep(n)	Sleep(n*1000)
 #define msleep(n)	Sleep(n)
 #define SET_RCVTIMEO(tv,s)	int tv = s*1000
+#define SetSockNonBlock(s,on)	do { u_long nb = on; ioctlsocket(s, FIONBIO, &nb); } while (0)
+#define SockInProgress(e)	((e) == WSAEWOULDBLOCK)
+#define poll(f,n,t)	WSAPoll(f,n,t)
+#define RTMP_MUTEX	SRWLOCK
+#define RTMP_MUTEX_INIT	SRWLOCK_INIT
+#define MutexLock(m)	AcquireSRWLockExclusive(m)
+#define MutexUnlock(m)	ReleaseSRWLockExclusive(m)
 #else /* !_WIN32 */
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -50,12 +57,21 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #define GetSockError()	errno
 #define SetSockError(e)	errno = e
 #undef closesocket
 #define closesocket(s)	close(s)
 #define msleep(n)	usleep(n*1000)
 #define SET_RCVTIMEO(tv,s)	struct timeval tv = {s,0}
+#define SetSockNonBlock(s,on)	fcntl(s, F_SETFL, (on) ? fcntl(s, F_GETFL) | O_NONBLOCK : fcntl(s, F_GETFL) & ~O_NONBLOCK)
+#define SockInProgress(e)	((e) == EINPROGRESS)
+#define RTMP_MUTEX	pthread_mutex_t
+#define RTMP_MUTEX_INIT	PTHREAD_MUTEX_INITIALIZER
+#define MutexLock(m)	pthread_mutex_lock(m)
+#define MutexUnlock(m)	pthread_mutex_unlock(m)
 #endif
 
 #include "rtmp.h"
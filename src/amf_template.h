@@ -0,0 +1,61 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  amf_template.h
+ *    Description:  amf0 names and strings encoded at compile time
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef AMF_TEMPLATE_H
+#define AMF_TEMPLATE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "amf.h"
+
+// Pre-encoded amf0 bytes for a literal. As a property name: 2 byte length
+// and the chars. As a string value: AMF_STRING marker first.
+template <size_t N, bool VALUE>
+struct amf_template {
+    char bytes[N + 1 + VALUE]; // N - 1 chars, 2 length bytes, marker
+    constexpr amf_template(const char (&str)[N]) : bytes()
+    {
+        size_t i = 0;
+        if (VALUE) {
+            bytes[i++] = AMF_STRING;
+        }
+        bytes[i++] = (char)((N - 1) >> 8);
+        bytes[i++] = (char)((N - 1) & 0xff);
+        for (size_t j = 0; j + 1 < N; j++) {
+            bytes[i++] = str[j];
+        }
+    }
+};
+
+#define AMF_NAME(var, str) static constexpr amf_template<sizeof(str), false> var(str)
+#define AMF_STRING_VALUE(var, str) static constexpr amf_template<sizeof(str), true> var(str)
+
+template <size_t N, bool VALUE>
+static inline void amf_put(AMFBuilder *b, const amf_template<N, VALUE> &tpl)
+{
+    AMFBuilder_Append(b, tpl.bytes, sizeof(tpl.bytes));
+}
+
+// constant name, variable number
+template <size_t N>
+static inline void amf_put_number(AMFBuilder *b, const amf_template<N, false> &name, double val)
+{
+    char *p = AMFBuilder_Grow(b, sizeof(name.bytes) + 9);
+    if (p) {
+        memcpy(p, name.bytes, sizeof(name.bytes));
+        AMF_EncodeNumber(p + sizeof(name.bytes), p + sizeof(name.bytes) + 9, val);
+    }
+}
+
+#endif
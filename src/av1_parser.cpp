@@ -0,0 +1,217 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  av1_parser.cpp
+ *    Description:  av1 obu reader and sequence header parser
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <string.h>
+
+#include "av1_parser.h"
+#include "bitreader.h"
+
+static int read_leb128(const uint8_t *buf, int size, uint64_t *value)
+{
+    int i;
+    *value = 0;
+    for (i = 0; i < 8 && i < size; i++) {
+        *value |= (uint64_t)(buf[i] & 0x7f) << (i * 7);
+        if (!(buf[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+int av1_read_obu(uint8_t *buf, int size, struct av1_obu *obu)
+{
+    int header_len = 1;
+    uint64_t payload_size;
+
+    if (size < 1 || (buf[0] & 0x80)) { // forbidden bit
+        return -1;
+    }
+    obu->type = (buf[0] >> 3) & 0x0f;
+    if (buf[0] & 0x04) { // obu_extension_flag
+        header_len++;
+    }
+    if (buf[0] & 0x02) { // obu_has_size_field
+        int n = read_leb128(buf + header_len, size - header_len, &payload_size);
+        if (n < 0) {
+            return -1;
+        }
+        header_len += n;
+    } else {
+        payload_size = size - header_len;
+    }
+    if (header_len > size || payload_size > (uint64_t)(size - header_len)) {
+        return -1;
+    }
+    obu->data = buf;
+    obu->payload = buf + header_len;
+    obu->payload_size = (int)payload_size;
+    obu->size = header_len + (int)payload_size;
+    return obu->size;
+}
+
+static uint32_t read_uvlc(struct bit_reader *br)
+{
+    int zeros = 0;
+    while (!br_read1(br)) {
+        if (br->overrun || ++zeros >= 32) {
+            return 0xffffffff;
+        }
+    }
+    return br_read(br, zeros) + (uint32_t)((1ULL << zeros) - 1);
+}
+
+static void parse_color_config(struct bit_reader *br, struct av1_seq_info *info)
+{
+    int bit_depth = 8;
+    info->high_bitdepth = br_read1(br);
+    if (info->seq_profile == 2 && info->high_bitdepth) {
+        info->twelve_bit = br_read1(br);
+        bit_depth = info->twelve_bit ? 12 : 10;
+    } else if (info->high_bitdepth) {
+        bit_depth = 10;
+    }
+    info->mono_chrome = info->seq_profile == 1 ? 0 : br_read1(br);
+
+    int color_primaries = 2, transfer = 2, matrix = 2;
+    if (br_read1(br)) { // color_description_present_flag
+        color_primaries = br_read(br, 8);
+        transfer = br_read(br, 8);
+        matrix = br_read(br, 8);
+    }
+    if (info->mono_chrome) {
+        br_read1(br); // color_range
+        info->chroma_subsampling_x = 1;
+        info->chroma_subsampling_y = 1;
+        return;
+    }
+    if (color_primaries == 1 && transfer == 13 && matrix == 0) { // srgb
+        info->chroma_subsampling_x = 0;
+        info->chroma_subsampling_y = 0;
+    } else {
+        br_read1(br); // color_range
+        if (info->seq_profile == 0) {
+            info->chroma_subsampling_x = 1;
+            info->chroma_subsampling_y = 1;
+        } else if (info->seq_profile == 1) {
+            info->chroma_subsampling_x = 0;
+            info->chroma_subsampling_y = 0;
+        } else if (bit_depth == 12) {
+            info->chroma_subsampling_x = br_read1(br);
+            info->chroma_subsampling_y = info->chroma_subsampling_x ? br_read1(br) : 0;
+        } else {
+            info->chroma_subsampling_x = 1;
+            info->chroma_subsampling_y = 0;
+        }
+        if (info->chroma_subsampling_x && info->chroma_subsampling_y) {
+            info->chroma_sample_position = br_read(br, 2);
+        }
+    }
+}
+
+int av1_parse_sequence_header(const uint8_t *payload, int size, struct av1_seq_info *info)
+{
+    struct bit_reader br;
+    int i;
+
+    br_init(&br, payload, size);
+    memset(info, 0, sizeof(*info));
+
+    info->seq_profile = br_read(&br, 3);
+    br_read1(&br); // still_picture
+    info->reduced_still_picture_header = br_read1(&br);
+    if (info->reduced_still_picture_header) {
+        info->seq_level_idx_0 = br_read(&br, 5);
+    } else {
+        int decoder_model_info_present = 0, buffer_delay_length = 0;
+        if (br_read1(&br)) { // timing_info_present_flag
+            uint32_t num_units = br_read(&br, 32);
+            uint32_t time_scale = br_read(&br, 32);
+            uint32_t ticks_per_picture = 1;
+            if (br_read1(&br)) { // equal_picture_interval
+                ticks_per_picture = read_uvlc(&br) + 1;
+            }
+            if (num_units && ticks_per_picture) {
+                info->framerate = (double)time_scale / ((double)num_units * ticks_per_picture);
+            }
+            decoder_model_info_present = br_read1(&br);
+            if (decoder_model_info_present) {
+                buffer_delay_length = br_read(&br, 5) + 1;
+                br_read(&br, 32); // num_units_in_decoding_tick
+                br_read(&br, 10); // buffer_removal_time_length, frame_presentation_time_length
+            }
+        }
+        int initial_display_delay_present = br_read1(&br);
+        int operating_points = br_read(&br, 5) + 1;
+        for (i = 0; i < operating_points && !br.overrun; i++) {
+            br_read(&br, 12); // operating_point_idc
+            int level = br_read(&br, 5);
+            int tier = level > 7 ? br_read1(&br) : 0;
+            if (i == 0) {
+                info->seq_level_idx_0 = level;
+                info->seq_tier_0 = tier;
+            }
+            if (decoder_model_info_present && br_read1(&br)) {
+                br_skip(&br, 2 * buffer_delay_length + 1);
+            }
+            if (initial_display_delay_present && br_read1(&br)) {
+                br_read(&br, 4);
+            }
+        }
+    }
+
+    int width_bits = br_read(&br, 4) + 1;
+    int height_bits = br_read(&br, 4) + 1;
+    info->width = br_read(&br, width_bits) + 1;
+    info->height = br_read(&br, height_bits) + 1;
+
+    if (!info->reduced_still_picture_header && br_read1(&br)) { // frame_id_numbers_present_flag
+        br_read(&br, 7);
+    }
+    br_read(&br, 3); // use_128x128_superblock, enable_filter_intra, enable_intra_edge_filter
+    if (!info->reduced_still_picture_header) {
+        br_read(&br, 4); // interintra, masked compound, warped motion, dual filter
+        int enable_order_hint = br_read1(&br);
+        if (enable_order_hint) {
+            br_read(&br, 2); // enable_jnt_comp, enable_ref_frame_mvs
+        }
+        int force_screen_content_tools = 2;
+        if (!br_read1(&br)) { // seq_choose_screen_content_tools
+            force_screen_content_tools = br_read1(&br);
+        }
+        if (force_screen_content_tools > 0 && !br_read1(&br)) { // seq_choose_integer_mv
+            br_read1(&br); // seq_force_integer_mv
+        }
+        if (enable_order_hint) {
+            br_read(&br, 3); // order_hint_bits_minus_1
+        }
+    }
+    br_read(&br, 3); // enable_superres, enable_cdef, enable_restoration
+    parse_color_config(&br, info);
+
+    return br.overrun ? -1 : 0;
+}
+
+int av1_is_keyframe(struct av1_obu *obu, struct av1_seq_info *info)
+{
+    if (obu->type != AV1_OBU_FRAME && obu->type != AV1_OBU_FRAME_HEADER) {
+        return 0;
+    }
+    if (info->reduced_still_picture_header) {
+        return 1;
+    }
+    if (obu->payload_size < 1 || (obu->payload[0] & 0x80)) { // show_existing_frame
+        return 0;
+    }
+    return ((obu->payload[0] >> 5) & 0x03) == 0; // frame_type == KEY_FRAME
+}
@@ -0,0 +1,59 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  av1_parser.h
+ *    Description:  av1 obu reader and sequence header parser
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef AV1_PARSER_H
+#define AV1_PARSER_H
+
+#include <stdint.h>
+
+#define AV1_OBU_SEQUENCE_HEADER     1
+#define AV1_OBU_TEMPORAL_DELIMITER  2
+#define AV1_OBU_FRAME_HEADER        3
+#define AV1_OBU_TILE_GROUP          4
+#define AV1_OBU_METADATA            5
+#define AV1_OBU_FRAME               6
+#define AV1_OBU_PADDING             15
+
+struct av1_obu {
+    int type;
+    uint8_t *data;          // obu header
+    int size;               // header + payload
+    uint8_t *payload;
+    int payload_size;
+};
+
+struct av1_seq_info {
+    int seq_profile;
+    int seq_level_idx_0;
+    int seq_tier_0;
+    int high_bitdepth;
+    int twelve_bit;
+    int mono_chrome;
+    int chroma_subsampling_x;
+    int chroma_subsampling_y;
+    int chroma_sample_position;
+    int reduced_still_picture_header;
+    int width;
+    int height;
+    double framerate; // 0 if no timing info
+};
+
+// Read one obu of a low overhead bitstream. Returns bytes consumed or -1.
+int av1_read_obu(uint8_t *buf, int size, struct av1_obu *obu);
+
+int av1_parse_sequence_header(const uint8_t *payload, int size, struct av1_seq_info *info);
+
+// frame or frame header obu starting a key frame
+int av1_is_keyframe(struct av1_obu *obu, struct av1_seq_info *info);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  avc_parser.cpp
+ *    Description:  h264 nal helpers and sequence parameter set parser
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <string.h>
+#include <limits.h>
+
+#include "avc_parser.h"
+#include "bitreader.h"
+
+#define AVC_MAX_SPS_SIZE 1024
+
+uint8_t *avc_find_startcode(uint8_t *buffer, int total, int *startcode_len)
+{
+    uint8_t *buf = buffer;
+    uint8_t *end = buffer + total;
+    while (end - buf >= 3) {
+        if (buf[2] > 1) {
+            buf += 3;
+        } else if (buf[1]) {
+            buf += 2;
+        } else if (buf[0] || buf[2] != 1) {
+            buf++;
+        } else {
+            // 00 00 01, widen to 00 00 00 01 when possible
+            if (buf > buffer && buf[-1] == 0) {
+                *startcode_len = 4;
+                return buf - 1;
+            }
+            *startcode_len = 3;
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+int avc_nal_to_rbsp(const uint8_t *src, int size, uint8_t *dst)
+{
+    int i, zeros = 0, len = 0;
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && src[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+        dst[len++] = src[i];
+    }
+    return len;
+}
+
+static void skip_scaling_list(struct bit_reader *br, int size)
+{
+    int last = 8, next = 8, j;
+    for (j = 0; j < size; j++) {
+        if (next != 0) {
+            next = (last + br_read_se(br) + 256) % 256;
+        }
+        last = next == 0 ? last : next;
+    }
+}
+
+// bit rate of the first cpb, INT_MAX when it does not fit
+static int parse_hrd(struct bit_reader *br)
+{
+    int cpb_cnt = br_read_ue(br) + 1;
+    int bit_rate_scale = br_read(br, 4);
+    uint64_t bitrate = 0;
+    int i;
+    br_read(br, 4); // cpb_size_scale
+    for (i = 0; i < cpb_cnt && !br->overrun; i++) {
+        uint32_t value = br_read_ue(br);
+        br_read_ue(br); // cpb_size_value_minus1
+        br_read1(br);   // cbr_flag
+        if (i == 0) {
+            bitrate = ((uint64_t)value + 1) << (6 + bit_rate_scale);
+        }
+    }
+    br_read(br, 20); // delay/length fields, 4 x u(5)
+    return bitrate > INT_MAX ? INT_MAX : (int)bitrate;
+}
+
+static void parse_vui(struct bit_reader *br, struct avc_sps_info *info)
+{
+    if (br_read1(br)) { // aspect_ratio_info_present_flag
+        if (br_read(br, 8) == 255) { // Extended_SAR
+            br_read(br, 32);
+        }
+    }
+    if (br_read1(br)) { // overscan_info_present_flag
+        br_read1(br);
+    }
+    if (br_read1(br)) { // video_signal_type_present_flag
+        br_read(br, 4);
+        if (br_read1(br)) { // colour_description_present_flag
+            br_read(br, 24);
+        }
+    }
+    if (br_read1(br)) { // chroma_loc_info_present_flag
+        br_read_ue(br);
+        br_read_ue(br);
+    }
+    if (br_read1(br)) { // timing_info_present_flag
+        uint32_t num_units_in_tick = br_read(br, 32);
+        uint32_t time_scale = br_read(br, 32);
+        br_read1(br); // fixed_frame_rate_flag
+        if (num_units_in_tick) {
+            info->framerate = (double)time_scale / (2.0 * num_units_in_tick);
+        }
+    }
+    int nal_hrd = br_read1(br);
+    if (nal_hrd) {
+        info->bitrate = parse_hrd(br);
+    }
+    if (br_read1(br)) { // vcl_hrd_parameters_present_flag
+        int bitrate = parse_hrd(br);
+        if (!nal_hrd) {
+            info->bitrate = bitrate;
+        }
+    }
+}
+
+int avc_parse_sps(const uint8_t *nal, int size, struct avc_sps_info *info)
+{
+    uint8_t rbsp[AVC_MAX_SPS_SIZE];
+    struct bit_reader br;
+    int i, len;
+
+    if (size < 4 || (nal[0] & 0x1f) != AVC_NAL_SPS) {
+        return -1;
+    }
+    if (size > AVC_MAX_SPS_SIZE) {
+        size = AVC_MAX_SPS_SIZE;
+    }
+    len = avc_nal_to_rbsp(nal + 1, size - 1, rbsp);
+    br_init(&br, rbsp, len);
+    memset(info, 0, sizeof(*info));
+
+    info->profile_idc = br_read(&br, 8);
+    info->constraint_flags = br_read(&br, 8);
+    info->level_idc = br_read(&br, 8);
+    info->sps_id = br_read_ue(&br);
+    info->chroma_format_idc = 1;
+    info->bit_depth_luma = 8;
+    info->bit_depth_chroma = 8;
+
+    int separate_colour_plane = 0;
+    switch (info->profile_idc) {
+    case 100: case 110: case 122: case 244: case 44:
+    case 83: case 86: case 118: case 128: case 138:
+    case 139: case 134: case 135:
+        info->chroma_format_idc = br_read_ue(&br);
+        if (info->chroma_format_idc == 3) {
+            separate_colour_plane = br_read1(&br);
+        }
+        info->bit_depth_luma = br_read_ue(&br) + 8;
+        info->bit_depth_chroma = br_read_ue(&br) + 8;
+        br_read1(&br); // qpprime_y_zero_transform_bypass_flag
+        if (br_read1(&br)) { // seq_scaling_matrix_present_flag
+            int lists = info->chroma_format_idc != 3 ? 8 : 12;
+            for (i = 0; i < lists; i++) {
+                if (br_read1(&br)) {
+                    skip_scaling_list(&br, i < 6 ? 16 : 64);
+                }
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    br_read_ue(&br); // log2_max_frame_num_minus4
+    int poc_type = br_read_ue(&br);
+    if (poc_type == 0) {
+        br_read_ue(&br); // log2_max_pic_order_cnt_lsb_minus4
+    } else if (poc_type == 1) {
+        br_read1(&br);   // delta_pic_order_always_zero_flag
+        br_read_se(&br); // offset_for_non_ref_pic
+        br_read_se(&br); // offset_for_top_to_bottom_field
+        int cycle = br_read_ue(&br);
+        for (i = 0; i < cycle && !br.overrun; i++) {
+            br_read_se(&br);
+        }
+    }
+    br_read_ue(&br); // max_num_ref_frames
+    br_read1(&br);   // gaps_in_frame_num_value_allowed_flag
+
+    int width_mbs = br_read_ue(&br) + 1;
+    int height_map_units = br_read_ue(&br) + 1;
+    int frame_mbs_only = br_read1(&br);
+    if (!frame_mbs_only) {
+        br_read1(&br); // mb_adaptive_frame_field_flag
+    }
+    br_read1(&br); // direct_8x8_inference_flag
+
+    int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    if (br_read1(&br)) { // frame_cropping_flag
+        crop_left = br_read_ue(&br);
+        crop_right = br_read_ue(&br);
+        crop_top = br_read_ue(&br);
+        crop_bottom = br_read_ue(&br);
+    }
+
+    int crop_unit_x = 1, crop_unit_y = 2 - frame_mbs_only;
+    if (!separate_colour_plane && info->chroma_format_idc) {
+        int sub_width = info->chroma_format_idc == 3 ? 1 : 2;
+        int sub_height = info->chroma_format_idc == 1 ? 2 : 1;
+        crop_unit_x = sub_width;
+        crop_unit_y = sub_height * (2 - frame_mbs_only);
+    }
+    info->width = width_mbs * 16 - crop_unit_x * (crop_left + crop_right);
+    info->height = (2 - frame_mbs_only) * height_map_units * 16 - crop_unit_y * (crop_top + crop_bottom);
+
+    if (br_read1(&br)) { // vui_parameters_present_flag
+        parse_vui(&br, info);
+    }
+
+    // the rbsp stop bit is never read, running past it means a truncated or corrupt sps
+    if (br.overrun || info->width <= 0 || info->height <= 0) {
+        return -1;
+    }
+    return 0;
+}
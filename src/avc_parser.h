@@ -0,0 +1,50 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  avc_parser.h
+ *    Description:  h264 nal helpers and sequence parameter set parser
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef AVC_PARSER_H
+#define AVC_PARSER_H
+
+#include <stdint.h>
+
+#define AVC_NAL_SLICE 1
+#define AVC_NAL_IDR   5
+#define AVC_NAL_SEI   6
+#define AVC_NAL_SPS   7
+#define AVC_NAL_PPS   8
+#define AVC_NAL_AUD   9
+
+struct avc_sps_info {
+    int profile_idc;
+    int constraint_flags;
+    int level_idc;
+    int sps_id;
+    int chroma_format_idc;
+    int bit_depth_luma;
+    int bit_depth_chroma;
+    int width;
+    int height;
+    double framerate; // 0 if vui has no timing info
+    int bitrate;      // bits per second from hrd, 0 if absent, at most INT_MAX
+};
+
+// Find next start code in [buffer, buffer + total). Returns NULL if none.
+uint8_t *avc_find_startcode(uint8_t *buffer, int total, int *startcode_len);
+
+// Strip emulation prevention bytes (00 00 03). dst must hold size bytes.
+int avc_nal_to_rbsp(const uint8_t *src, int size, uint8_t *dst);
+
+// nal points at the nal header byte (no start code). Returns 0 on success,
+// -1 when the sps is truncated or malformed.
+int avc_parse_sps(const uint8_t *nal, int size, struct avc_sps_info *info);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  bitreader.h
+ *    Description:  msb-first bit reader with a 64-bit cache, exp-golomb helpers
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef BITREADER_H
+#define BITREADER_H
+
+#include <stdint.h>
+
+struct bit_reader {
+    const uint8_t *cur;
+    const uint8_t *end;
+    uint64_t cache;  // next bits, msb aligned
+    int bits;        // valid bits in cache
+    int overrun;     // set when more bits were consumed than available
+};
+
+static inline void br_init(struct bit_reader *br, const uint8_t *data, int size)
+{
+    br->cur = data;
+    br->end = data + size;
+    br->cache = 0;
+    br->bits = 0;
+    br->overrun = 0;
+}
+
+static inline void br_refill(struct bit_reader *br)
+{
+    // fast path: load 8 bytes at once and keep the whole bytes that fit
+    if (br->end - br->cur >= 8) {
+        uint64_t v = ((uint64_t)br->cur[0] << 56) | ((uint64_t)br->cur[1] << 48)
+                   | ((uint64_t)br->cur[2] << 40) | ((uint64_t)br->cur[3] << 32)
+                   | ((uint64_t)br->cur[4] << 24) | ((uint64_t)br->cur[5] << 16)
+                   | ((uint64_t)br->cur[6] << 8) | (uint64_t)br->cur[7];
+        int take = (64 - br->bits) >> 3;
+        br->cache |= v >> br->bits;
+        br->cur += take;
+        br->bits += take << 3;
+        if (br->bits < 64) {
+            br->cache &= ~0ULL << (64 - br->bits); // drop the partial byte
+        }
+        return;
+    }
+    while (br->bits <= 56 && br->cur < br->end) {
+        br->cache |= (uint64_t)(*br->cur++) << (56 - br->bits);
+        br->bits += 8;
+    }
+}
+
+// n in [0, 32]
+static inline uint32_t br_read(struct bit_reader *br, int n)
+{
+    uint32_t v;
+    if (n == 0) {
+        return 0;
+    }
+    if (br->bits < n) {
+        br_refill(br);
+        if (br->bits < n) {
+            br->overrun = 1;
+            br->bits = n; // missing bits read as zero
+        }
+    }
+    v = (uint32_t)(br->cache >> (64 - n));
+    br->cache <<= n;
+    br->bits -= n;
+    return v;
+}
+
+static inline uint32_t br_read1(struct bit_reader *br)
+{
+    return br_read(br, 1);
+}
+
+static inline void br_skip(struct bit_reader *br, int n)
+{
+    while (n > 32) {
+        br_read(br, 32);
+        n -= 32;
+    }
+    br_read(br, n);
+}
+
+// ue(v): count leading zeros in the cache instead of looping bit by bit
+static inline uint32_t br_read_ue(struct bit_reader *br)
+{
+    int zeros;
+    if (br->bits < 32) {
+        br_refill(br);
+    }
+    if (br->cache == 0) {
+        br->overrun = 1;
+        br->cache = 0;
+        br->bits = 0;
+        return 0;
+    }
+    zeros = __builtin_clzll(br->cache);
+    if (zeros > 31) {
+        br->overrun = 1;
+        return 0;
+    }
+    br_read(br, zeros);
+    return br_read(br, zeros + 1) - 1;
+}
+
+static inline int32_t br_read_se(struct bit_reader *br)
+{
+    uint32_t v = br_read_ue(br);
+    return (v & 1) ? (int32_t)((v + 1) >> 1) : -(int32_t)(v >> 1);
+}
+
+// bits consumed so far
+static inline int br_pos(struct bit_reader *br, const uint8_t *start)
+{
+    return (int)((br->cur - start) << 3) - br->bits;
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  dvr_ring.cpp
+ *    Description:  time shift ring of flv tags in a memory mapped file
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "dvr_ring.h"
+#include "flvmux_api.h"
+
+#include "log_print.h"
+#define TAG "DVR"
+
+// The writer frees room by moving tail before it touches the bytes and
+// publishes tags by moving head after. Readers copy first and compare tail
+// after, like a seqlock: a tag they saw below tail may have been torn.
+//
+// A tag never wraps. When it does not fit before the end of the ring a zero
+// type byte marks the rest of the lap as padding, so every lap starts with a tag.
+
+#define DVR_TAG_SIZE(len) (FLV_TAG_HEAD_LEN + (uint64_t)(len) + FLV_PRE_TAG_LEN)
+
+static uint64_t ring_load(const uint64_t *val)
+{
+    return __atomic_load_n(val, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t ring_serial; // makes file names unique within the process
+
+struct dvr_ring *dvr_ring_open(const char *dir, const char *name, uint64_t size, int seconds)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct dvr_ring *ring = (struct dvr_ring *)calloc(1, sizeof(struct dvr_ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->size = (size + page - 1) / page * page;
+    ring->key_cap = seconds * 1000 / DVR_KEY_SPACING + 64;
+    ring->map_size = ring->size + ((uint64_t)ring->key_cap * sizeof(struct dvr_key) + page - 1) / page * page;
+
+    // never an existing file or link, it may be another ring's or not ours
+    int fd = -1;
+    for (int retry = 0; fd < 0 && retry < 16; retry++) {
+        int len = snprintf(ring->path, sizeof(ring->path), "%s/", dir);
+        for (const char *p = name; *p && len < (int)sizeof(ring->path) - 32; p++) {
+            ring->path[len++] = *p == '/' ? '_' : *p;
+        }
+        snprintf(ring->path + len, sizeof(ring->path) - len, ".%d.%u.dvr", (int)getpid(),
+                 __atomic_fetch_add(&ring_serial, 1, __ATOMIC_RELAXED));
+        fd = open(ring->path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd < 0 || ftruncate(fd, ring->map_size) < 0) {
+        log_print(TAG, "%s: %s\n", ring->path, strerror(errno));
+        if (fd >= 0) {
+            unlink(ring->path);
+            close(fd);
+        }
+        free(ring);
+        return NULL;
+    }
+    void *map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        log_print(TAG, "map %s: %s\n", ring->path, strerror(errno));
+        map = NULL;
+    }
+    // the pages stay with the map, nobody else gets to the file
+    unlink(ring->path);
+    close(fd);
+    if (!map) {
+        free(ring);
+        return NULL;
+    }
+    ring->map = (uint8_t *)map;
+    ring->data = ring->map;
+    ring->keys = (struct dvr_key *)(ring->map + ring->size);
+    return ring;
+}
+
+void dvr_ring_close(struct dvr_ring *ring)
+{
+    munmap(ring->map, ring->map_size);
+    free(ring);
+}
+
+// pos is a tag or the padding at the end of a lap, the writer's own bytes
+static uint64_t ring_next(struct dvr_ring *ring, uint64_t pos)
+{
+    uint64_t off = pos % ring->size;
+    const uint8_t *p = ring->data + off;
+    if (p[0] == 0) {
+        return pos + ring->size - off;
+    }
+    return pos + DVR_TAG_SIZE((p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+int dvr_ring_write(struct dvr_ring *ring, int type, uint32_t ts, const uint8_t *body, uint32_t len, int key)
+{
+    uint64_t n = DVR_TAG_SIZE(len);
+    if (type == 0 || n > ring->size / 4) {
+        return -1;
+    }
+    uint64_t pos = ring->head;
+    uint64_t off = pos % ring->size;
+    uint64_t pad = ring->size - off < n ? ring->size - off : 0;
+
+    // free the bytes first, readers still in them find out when they check
+    uint64_t tail = ring->tail;
+    while (pos + pad + n - tail > ring->size) {
+        tail = ring_next(ring, tail);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (pad) {
+        ring->data[off] = 0;
+        pos += pad;
+        off = 0;
+    }
+    uint8_t *p = ring->data + off;
+    p[0] = type;
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+    p[4] = ts >> 16;
+    p[5] = ts >> 8;
+    p[6] = ts;
+    p[7] = ts >> 24;
+    p[8] = p[9] = p[10] = 0;
+    memcpy(p + FLV_TAG_HEAD_LEN, body, len);
+    p += FLV_TAG_HEAD_LEN + len;
+    uint32_t tag_size = FLV_TAG_HEAD_LEN + len;
+    p[0] = tag_size >> 24;
+    p[1] = tag_size >> 16;
+    p[2] = tag_size >> 8;
+    p[3] = tag_size;
+    __atomic_store_n(&ring->head, pos + n, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->last_ts, ts, __ATOMIC_RELEASE);
+
+    if (key && (ring->key_count == 0 || ts - ring->key_ts >= DVR_KEY_SPACING || ts < ring->key_ts)) {
+        // readers never use the oldest slot, it is the one written next
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        struct dvr_key *slot = &ring->keys[ring->key_count % ring->key_cap];
+        slot->pos = pos;
+        slot->ts = ts;
+        __atomic_store_n(&ring->key_count, ring->key_count + 1, __ATOMIC_RELEASE);
+        ring->key_ts = ts;
+    }
+    return 0;
+}
+
+// a new publisher, the old timeline is of no use
+void dvr_ring_reset(struct dvr_ring *ring)
+{
+    __atomic_store_n(&ring->tail, ring->head, __ATOMIC_RELEASE);
+}
+
+int dvr_ring_check(struct dvr_ring *ring, uint64_t pos)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) <= pos ? 0 : -1;
+}
+
+int dvr_ring_seek(struct dvr_ring *ring, uint32_t ts, uint32_t window_ms, uint64_t *pos, uint32_t *key_ts)
+{
+    uint32_t last_ts = __atomic_load_n(&ring->last_ts, __ATOMIC_ACQUIRE);
+    uint32_t min_ts = window_ms && last_ts > window_ms ? last_ts - window_ms : 0;
+
+    for (int retry = 0; retry < 4; retry++) {
+        uint64_t count = ring_load(&ring->key_count);
+        uint64_t first = count >= ring->key_cap ? count - ring->key_cap + 1 : 0;
+        uint64_t tail = ring_load(&ring->tail);
+        uint64_t found = count;
+        struct dvr_key key = { 0, 0, 0 };
+
+        // newest first, stop at what was overwritten
+        for (uint64_t i = count; i-- > first;) {
+            struct dvr_key entry = ring->keys[i % ring->key_cap];
+            if (entry.pos < tail || entry.ts < min_ts) {
+                break;
+            }
+            found = i;
+            key = entry;
+            if (entry.ts <= ts) {
+                break;
+            }
+        }
+        if (found == count) {
+            return -1;
+        }
+        // the slot may have been rewritten while it was read
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        count = __atomic_load_n(&ring->key_count, __ATOMIC_RELAXED);
+        if (count >= ring->key_cap && found < count - ring->key_cap + 1) {
+            continue;
+        }
+        if (dvr_ring_check(ring, key.pos) < 0) {
+            continue;
+        }
+        *pos = key.pos;
+        *key_ts = key.ts;
+        return 0;
+    }
+    return -1;
+}
+
+int dvr_ring_peek(struct dvr_ring *ring, uint64_t pos, struct dvr_tag *tag)
+{
+    for (;;) {
+        if (pos < ring_load(&ring->tail)) {
+            return -1;
+        }
+        uint64_t head = ring_load(&ring->head);
+        if (pos >= head) {
+            return 0;
+        }
+        uint64_t off = pos % ring->size;
+        const uint8_t *p = ring->data + off;
+        if (p[0] == 0) {
+            if (dvr_ring_check(ring, pos) < 0) {
+                return -1;
+            }
+            pos += ring->size - off;
+            continue;
+        }
+        tag->type = p[0];
+        tag->len = (p[1] << 16) | (p[2] << 8) | p[3];
+        tag->ts = (p[4] << 16) | (p[5] << 8) | p[6] | ((uint32_t)p[7] << 24);
+        tag->body = p + FLV_TAG_HEAD_LEN;
+        tag->next = pos + DVR_TAG_SIZE(tag->len);
+        if (dvr_ring_check(ring, pos) < 0) {
+            return -1;
+        }
+        if (off + DVR_TAG_SIZE(tag->len) > ring->size || tag->next > head) {
+            log_print(TAG, "%s: bad tag at %llu\n", ring->path, (unsigned long long)pos);
+            return -1;
+        }
+        return 1;
+    }
+}
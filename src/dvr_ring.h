@@ -0,0 +1,74 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  dvr_ring.h
+ *    Description:  time shift ring of flv tags in a memory mapped file
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef DVR_RING_H
+#define DVR_RING_H
+
+#include <stdint.h>
+
+#define DVR_KEY_SPACING 500 // ms, keyframes closer than this to the last indexed one are not indexed
+
+struct dvr_key {
+    uint64_t pos;
+    uint32_t ts;
+    uint32_t reserved;
+};
+
+// One writer appends flv tags, any number of readers walk them without a lock.
+// Positions only grow, the tag at pos lives at data + pos % size until the
+// writer wraps over it. Readers learn that from dvr_ring_check and go back
+// to a keyframe. Tags and index are file pages, not heap.
+struct dvr_ring {
+    char path[1024];       // the file the map came from, already unlinked
+    uint8_t *map;
+    uint64_t map_size;
+    uint8_t *data;         // the circular part of the map
+    uint64_t size;
+    struct dvr_key *keys;  // keyframe index behind it
+    uint32_t key_cap;
+    uint32_t key_ts;       // writer only, ts of the last indexed keyframe
+
+    // written by the writer, loaded atomically by readers
+    uint64_t head;         // end of the written tags
+    uint64_t tail;         // oldest tag not overwritten
+    uint64_t key_count;    // keyframes indexed so far
+    uint32_t last_ts;
+};
+
+struct dvr_tag {
+    int type;
+    uint32_t ts;
+    const uint8_t *body; // into the map, only good until dvr_ring_check fails
+    uint32_t len;
+    uint64_t next;
+};
+
+// size bytes of tags plus an index for seconds of keyframes, in a new file
+// in dir that is unlinked as soon as it is mapped.
+struct dvr_ring *dvr_ring_open(const char *dir, const char *name, uint64_t size, int seconds);
+void dvr_ring_close(struct dvr_ring *ring);
+
+// writer
+int dvr_ring_write(struct dvr_ring *ring, int type, uint32_t ts, const uint8_t *body, uint32_t len, int key);
+void dvr_ring_reset(struct dvr_ring *ring);
+
+// readers
+// The last keyframe at or before ts that is at most window_ms older than the
+// newest tag, else the oldest keyframe in the window. -1 - none indexed
+int dvr_ring_seek(struct dvr_ring *ring, uint32_t ts, uint32_t window_ms, uint64_t *pos, uint32_t *key_ts);
+// 1 - tag at pos, 0 - pos is the head, -1 - pos was overwritten
+int dvr_ring_peek(struct dvr_ring *ring, uint64_t pos, struct dvr_tag *tag);
+// 0 - the tag at pos was not overwritten while its body was in use
+int dvr_ring_check(struct dvr_ring *ring, uint64_t pos);
+
+#endif
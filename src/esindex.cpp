@@ -0,0 +1,594 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  esindex.cpp
+ *    Description:  parallel frame index of annex-b and adts files with sidecar cache
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esindex_api.h"
+#include "avc_parser.h"
+#include "hevc_parser.h"
+#include "mapped_file.h"
+
+#include "log_print.h"
+#define TAG "ESINDEX"
+
+#define ESINDEX_MAGIC "ESIX"
+#define ESINDEX_VERSION 1
+#define ESINDEX_HEADER_SIZE 40
+#define ESINDEX_MIN_RANGE (8 * 1024 * 1024)
+#define ESINDEX_RANGES_PER_THREAD 4
+#define ADTS_HEADER_SIZE 7
+#define ADTS_SYNC_FRAMES 3 // consecutive headers needed to trust a sync word
+
+// start code found while scanning one range
+struct nal_record {
+    uint64_t pos;   // of the 00 00 01
+    uint8_t hdr[3]; // nal header and the byte that holds first_mb / first_slice
+};
+
+struct scan_range {
+    uint64_t begin;
+    uint64_t end;
+    void *items; // nal_record for annex-b, esindex_entry for adts
+    int64_t count;
+    int64_t capacity;
+    int error;
+};
+
+struct scan_job {
+    const uint8_t *data;
+    uint64_t size;
+    int type;
+    struct scan_range *ranges;
+    int range_count;
+    int next; // next range to scan, shared by the workers
+};
+
+static void *range_add(struct scan_range *range, int item_size)
+{
+    if (range->count == range->capacity) {
+        int64_t capacity = range->capacity ? range->capacity * 2 : 4096;
+        void *items = realloc(range->items, capacity * item_size);
+        if (!items) {
+            range->error = 1;
+            return NULL;
+        }
+        range->items = items;
+        range->capacity = capacity;
+    }
+    return (uint8_t *)range->items + range->count++ * item_size;
+}
+
+// avc_find_startcode takes an int length, walk large ranges in windows
+static const uint8_t *find_startcode(const uint8_t *p, const uint8_t *end, int *startcode_len)
+{
+    while (p < end) {
+        int64_t left = end - p;
+        int window = left > (1 << 30) ? (1 << 30) : (int)left;
+        uint8_t *sc = avc_find_startcode((uint8_t *)p, window, startcode_len);
+        if (sc || window == left) {
+            return sc;
+        }
+        p += window - 3;
+    }
+    return NULL;
+}
+
+static void scan_annexb(struct scan_job *job, struct scan_range *range)
+{
+    const uint8_t *data = job->data;
+    // a start code may straddle the range end, it belongs to the range it starts in
+    const uint8_t *limit = data + (range->end + 2 < job->size ? range->end + 2 : job->size);
+    const uint8_t *p = data + range->begin;
+    int sc_len;
+
+    while ((p = find_startcode(p, limit, &sc_len)) != NULL) {
+        uint64_t pos = (p - data) + sc_len - 3;
+        if (pos >= range->end) {
+            break;
+        }
+        struct nal_record *nal = (struct nal_record *)range_add(range, sizeof(struct nal_record));
+        if (!nal) {
+            return;
+        }
+        nal->pos = pos;
+        for (int i = 0; i < 3; i++) {
+            nal->hdr[i] = pos + 3 + i < job->size ? data[pos + 3 + i] : 0;
+        }
+        p = data + pos + 3;
+    }
+}
+
+static uint32_t adts_frame_len(const uint8_t *data, uint64_t size, uint64_t pos)
+{
+    const uint8_t *p = data + pos;
+    if (pos + ADTS_HEADER_SIZE > size || p[0] != 0xff || (p[1] & 0xf6) != 0xf0 || ((p[2] >> 2) & 0x0f) > 12) {
+        return 0;
+    }
+    uint32_t len = ((p[3] & 0x03) << 11) | (p[4] << 3) | (p[5] >> 5);
+    if (len < ADTS_HEADER_SIZE || pos + len > size) {
+        return 0;
+    }
+    return len;
+}
+
+// 0xfff also shows up inside payloads, only trust a chain of headers
+static int adts_synced(const uint8_t *data, uint64_t size, uint64_t pos)
+{
+    for (int i = 0; i < ADTS_SYNC_FRAMES; i++) {
+        if (pos == size && i > 0) {
+            return 1;
+        }
+        uint32_t len = adts_frame_len(data, size, pos);
+        if (!len) {
+            return 0;
+        }
+        pos += len;
+    }
+    return 1;
+}
+
+// walk frames from pos until one starts at or after end. Returns that position.
+static uint64_t walk_adts(const uint8_t *data, uint64_t size, uint64_t pos, uint64_t end,
+                          struct scan_range *out, const struct scan_range *stop)
+{
+    while (pos < end && !out->error) {
+        uint32_t len = adts_frame_len(data, size, pos);
+        if (!len || (out->count == 0 && !adts_synced(data, size, pos))) {
+            // resync
+            pos++;
+            while (pos < end && !adts_synced(data, size, pos)) {
+                pos++;
+            }
+            continue;
+        }
+        if (stop && stop->count > 0) {
+            // joined the chain found by the next range's own scan
+            int64_t lo = 0, hi = stop->count - 1;
+            const struct esindex_entry *items = (const struct esindex_entry *)stop->items;
+            while (lo <= hi) {
+                int64_t mid = (lo + hi) / 2;
+                if (items[mid].pos == pos) {
+                    return pos;
+                }
+                if (items[mid].pos < pos) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+        }
+        struct esindex_entry *entry = (struct esindex_entry *)range_add(out, sizeof(struct esindex_entry));
+        if (!entry) {
+            break;
+        }
+        entry->pos = pos;
+        entry->size = len;
+        entry->flags = ESINDEX_FLAG_KEY;
+        pos += len;
+    }
+    return pos;
+}
+
+static void scan_adts(struct scan_job *job, struct scan_range *range)
+{
+    walk_adts(job->data, job->size, range->begin, range->end, range, NULL);
+}
+
+static void *scan_worker(void *arg)
+{
+    struct scan_job *job = (struct scan_job *)arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->range_count) {
+        if (job->type == ESINDEX_TYPE_ADTS) {
+            scan_adts(job, &job->ranges[i]);
+        } else {
+            scan_annexb(job, &job->ranges[i]);
+        }
+    }
+    return NULL;
+}
+
+static struct esindex_entry *index_add(struct esindex *index, int64_t *capacity)
+{
+    if (index->count == *capacity) {
+        int64_t cap = *capacity ? *capacity * 2 : 4096;
+        struct esindex_entry *entries = (struct esindex_entry *)realloc(index->entries, cap * sizeof(struct esindex_entry));
+        if (!entries) {
+            return NULL;
+        }
+        index->entries = entries;
+        *capacity = cap;
+    }
+    return &index->entries[index->count++];
+}
+
+// does this nal start a new access unit once vcl nals were seen (H.264 7.4.1.2.3, H.265 7.4.2.4.4)
+static int nal_starts_au(const uint8_t *hdr, int hevc, int *vcl, int *key)
+{
+    if (hevc) {
+        int type = HEVC_NAL_TYPE(hdr[0]);
+        *vcl = type < 32;
+        *key = type >= HEVC_NAL_BLA_W_LP && type <= HEVC_NAL_IRAP_END;
+        if (*vcl) {
+            return hdr[2] & 0x80; // first_slice_segment_in_pic_flag
+        }
+        return (type >= HEVC_NAL_VPS && type <= HEVC_NAL_AUD) || type == 39
+               || (type >= 41 && type <= 44) || (type >= 48 && type <= 55);
+    }
+    int type = hdr[0] & 0x1f;
+    *vcl = type >= AVC_NAL_SLICE && type <= AVC_NAL_IDR;
+    *key = type == AVC_NAL_IDR;
+    if (*vcl) {
+        return hdr[1] & 0x80; // first_mb_in_slice == 0
+    }
+    return (type >= AVC_NAL_SEI && type <= AVC_NAL_AUD) || (type >= 14 && type <= 18);
+}
+
+// group the start codes of all ranges into access units, in file order
+static int stitch_annexb(struct scan_job *job, struct esindex *index)
+{
+    int hevc = job->type == ESINDEX_TYPE_HEVC;
+    int64_t capacity = 0;
+    struct esindex_entry *au = NULL;
+    int seen_vcl = 0;
+
+    for (int r = 0; r < job->range_count; r++) {
+        struct nal_record *nals = (struct nal_record *)job->ranges[r].items;
+        for (int64_t i = 0; i < job->ranges[r].count; i++) {
+            int vcl, key;
+            // include the leading zero of a 4 byte start code
+            uint64_t pos = nals[i].pos > 0 && job->data[nals[i].pos - 1] == 0 ? nals[i].pos - 1 : nals[i].pos;
+            int starts = nal_starts_au(nals[i].hdr, hevc, &vcl, &key);
+            if (!au || (seen_vcl && starts)) {
+                if (au) {
+                    au->size = (uint32_t)(pos - au->pos);
+                }
+                au = index_add(index, &capacity);
+                if (!au) {
+                    return -1;
+                }
+                au->pos = pos;
+                au->flags = 0;
+                seen_vcl = 0;
+            }
+            seen_vcl |= vcl;
+            if (key && !(au->flags & ESINDEX_FLAG_KEY)) {
+                au->flags |= ESINDEX_FLAG_KEY;
+                index->keyframes++;
+            }
+        }
+    }
+    if (au) {
+        au->size = (uint32_t)(job->size - au->pos);
+    }
+    return 0;
+}
+
+// each range synced on its own; where a range started on a false sync word,
+// continue the previous chain until it meets the range's entries
+static int stitch_adts(struct scan_job *job, struct esindex *index)
+{
+    int64_t capacity = 0;
+    uint64_t expect = 0;
+
+    for (int r = 0; r < job->range_count; r++) {
+        struct scan_range *range = &job->ranges[r];
+        struct esindex_entry *items = (struct esindex_entry *)range->items;
+        int64_t first = 0;
+
+        if (r > 0 && (range->count == 0 || items[0].pos != expect)) {
+            struct scan_range fix;
+            memset(&fix, 0, sizeof(fix));
+            fix.count = 1; // prev chain is already synced
+            uint64_t pos = walk_adts(job->data, job->size, expect, range->end, &fix, range);
+            struct esindex_entry *fixed = (struct esindex_entry *)fix.items;
+            for (int64_t i = 0; fixed && i + 1 < fix.count; i++) {
+                struct esindex_entry *entry = index_add(index, &capacity);
+                if (!entry) {
+                    free(fix.items);
+                    return -1;
+                }
+                *entry = fixed[i + 1];
+            }
+            free(fix.items);
+            if (fix.error) {
+                return -1;
+            }
+            while (first < range->count && items[first].pos < pos) {
+                first++;
+            }
+            expect = pos;
+        }
+        for (int64_t i = first; i < range->count; i++) {
+            struct esindex_entry *entry = index_add(index, &capacity);
+            if (!entry) {
+                return -1;
+            }
+            *entry = items[i];
+            expect = items[i].pos + items[i].size;
+        }
+    }
+    index->keyframes = index->count;
+    return 0;
+}
+
+struct esindex *esindex_build(const char *path, int type, int threads)
+{
+    struct mapped_file file;
+    if (mapped_file_open(&file, path, MADV_WILLNEED) < 0) {
+        log_print(TAG, "open %s failed\n", path);
+        return NULL;
+    }
+
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        threads = threads > 0 ? threads : 1;
+    }
+    uint64_t range_size = file.size / ((uint64_t)threads * ESINDEX_RANGES_PER_THREAD) + 1;
+    if (range_size < ESINDEX_MIN_RANGE) {
+        range_size = ESINDEX_MIN_RANGE;
+    }
+
+    struct scan_job job;
+    memset(&job, 0, sizeof(job));
+    job.data = file.data;
+    job.size = file.size;
+    job.type = type;
+    job.range_count = (int)((file.size + range_size - 1) / range_size);
+    job.ranges = (struct scan_range *)calloc(job.range_count, sizeof(struct scan_range));
+    struct esindex *index = (struct esindex *)calloc(1, sizeof(struct esindex));
+    if (!job.ranges || !index) {
+        goto fail;
+    }
+    for (int i = 0; i < job.range_count; i++) {
+        job.ranges[i].begin = i * range_size;
+        job.ranges[i].end = i == job.range_count - 1 ? file.size : (i + 1) * range_size;
+    }
+
+    {
+        // the calling thread is one of the workers
+        int workers = threads < job.range_count ? threads : job.range_count;
+        pthread_t *tids = (pthread_t *)calloc(workers, sizeof(pthread_t));
+        int started = 0;
+        for (int i = 1; tids && i < workers; i++) {
+            if (pthread_create(&tids[started], NULL, scan_worker, &job) == 0) {
+                started++;
+            }
+        }
+        scan_worker(&job);
+        for (int i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        free(tids);
+    }
+    for (int i = 0; i < job.range_count; i++) {
+        if (job.ranges[i].error) {
+            goto fail;
+        }
+    }
+
+    index->type = type;
+    index->file_size = file.size;
+    if ((type == ESINDEX_TYPE_ADTS ? stitch_adts(&job, index) : stitch_annexb(&job, index)) < 0) {
+        goto fail;
+    }
+    log_print(TAG, "%s: %lld frames %lld keyframes, %d ranges on %d threads\n", path,
+              (long long)index->count, (long long)index->keyframes, job.range_count, threads);
+
+    for (int i = 0; i < job.range_count; i++) {
+        free(job.ranges[i].items);
+    }
+    free(job.ranges);
+    mapped_file_close(&file);
+    return index;
+fail:
+    if (job.ranges) {
+        for (int i = 0; i < job.range_count; i++) {
+            free(job.ranges[i].items);
+        }
+        free(job.ranges);
+    }
+    esindex_free(index);
+    mapped_file_close(&file);
+    return NULL;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    int shift = 0;
+    *v = 0;
+    while (p < end && shift < 64) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static uint8_t *put_be(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--) {
+        *p++ = (uint8_t)(v >> (i * 8));
+    }
+    return p;
+}
+
+static uint64_t get_be(const uint8_t *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// magic, version, type, file size, mtime (s, ns), count, then per frame
+// varint(gap to the previous frame end) varint(size << 1 | key)
+static uint8_t *put_header(uint8_t *p, struct esindex *index, struct stat *st)
+{
+    memcpy(p, ESINDEX_MAGIC, 4);
+    p[4] = ESINDEX_VERSION;
+    p[5] = (uint8_t)index->type;
+    p[6] = p[7] = 0;
+    p = put_be(p + 8, index->file_size, 8);
+    p = put_be(p, (uint64_t)st->st_mtim.tv_sec, 8);
+    p = put_be(p, (uint64_t)st->st_mtim.tv_nsec, 8);
+    return put_be(p, (uint64_t)index->count, 8);
+}
+
+int esindex_save(struct esindex *index, const char *path)
+{
+    char idx_path[1100];
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+
+    uint8_t *buf = (uint8_t *)malloc(ESINDEX_HEADER_SIZE + index->count * 15);
+    if (!buf) {
+        return -1;
+    }
+    uint8_t *p = put_header(buf, index, &st);
+    uint64_t prev_end = 0;
+    for (int64_t i = 0; i < index->count; i++) {
+        struct esindex_entry *e = &index->entries[i];
+        p = put_varint(p, e->pos - prev_end);
+        p = put_varint(p, ((uint64_t)e->size << 1) | (e->flags & ESINDEX_FLAG_KEY));
+        prev_end = e->pos + e->size;
+    }
+
+    // write to a temp file and rename so readers never see half an index
+    char tmp_path[1110];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    int ret = -1;
+    if (fp) {
+        size_t len = p - buf;
+        ret = fwrite(buf, 1, len, fp) == len ? 0 : -1;
+        if (fclose(fp) != 0) {
+            ret = -1;
+        }
+        if (ret == 0 && rename(tmp_path, idx_path) < 0) {
+            ret = -1;
+        }
+        if (ret < 0) {
+            unlink(tmp_path);
+        }
+    }
+    if (ret < 0) {
+        log_print(TAG, "write %s failed, errno:%d\n", idx_path, errno);
+    }
+    free(buf);
+    return ret;
+}
+
+static struct esindex *esindex_load(const char *path, int type)
+{
+    char idx_path[1100];
+    struct stat st;
+    struct mapped_file file;
+    if (stat(path, &st) < 0) {
+        return NULL;
+    }
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    if (mapped_file_open(&file, idx_path, MADV_SEQUENTIAL) < 0) {
+        return NULL;
+    }
+
+    const uint8_t *p = file.data;
+    const uint8_t *end = file.data + file.size;
+    struct esindex *index = NULL;
+    if (file.size < ESINDEX_HEADER_SIZE || memcmp(p, ESINDEX_MAGIC, 4) || p[4] != ESINDEX_VERSION || p[5] != type
+        || get_be(p + 8, 8) != (uint64_t)st.st_size || get_be(p + 16, 8) != (uint64_t)st.st_mtim.tv_sec
+        || get_be(p + 24, 8) != (uint64_t)st.st_mtim.tv_nsec) {
+        goto stale;
+    }
+    index = (struct esindex *)calloc(1, sizeof(struct esindex));
+    if (!index) {
+        goto stale;
+    }
+    index->type = type;
+    index->file_size = st.st_size;
+    index->count = (int64_t)get_be(p + 32, 8);
+    if (index->count < 0 || (uint64_t)index->count > file.size) { // at least 2 bytes per frame
+        goto stale;
+    }
+    index->entries = (struct esindex_entry *)malloc((index->count + 1) * sizeof(struct esindex_entry));
+    if (!index->entries) {
+        goto stale;
+    }
+    p += ESINDEX_HEADER_SIZE;
+    {
+        uint64_t prev_end = 0, gap, size_key;
+        for (int64_t i = 0; i < index->count; i++) {
+            p = get_varint(p, end, &gap);
+            p = p ? get_varint(p, end, &size_key) : NULL;
+            if (!p) {
+                goto stale;
+            }
+            struct esindex_entry *e = &index->entries[i];
+            e->pos = prev_end + gap;
+            e->size = (uint32_t)(size_key >> 1);
+            e->flags = (uint32_t)(size_key & ESINDEX_FLAG_KEY);
+            index->keyframes += e->flags & ESINDEX_FLAG_KEY;
+            prev_end = e->pos + e->size;
+            if (prev_end > index->file_size) {
+                goto stale;
+            }
+        }
+    }
+    mapped_file_close(&file);
+    return index;
+stale:
+    esindex_free(index);
+    mapped_file_close(&file);
+    return NULL;
+}
+
+struct esindex *esindex_open(const char *path, int type, int threads)
+{
+    struct esindex *index = esindex_load(path, type);
+    if (index) {
+        return index;
+    }
+    index = esindex_build(path, type, threads);
+    if (index) {
+        esindex_save(index, path);
+    }
+    return index;
+}
+
+void esindex_free(struct esindex *index)
+{
+    if (index) {
+        free(index->entries);
+        free(index);
+    }
+}
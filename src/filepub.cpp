@@ -0,0 +1,376 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  filepub.cpp
+ *    Description:  publish a flv file or an annex-b/adts pair in real time
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <time.h>
+
+#include "filepub_api.h"
+#include "flvmux_api.h"
+#include "rtmp_api.h"
+#include "rtmp.h"
+#include "avc_parser.h"
+#include "hevc_parser.h"
+#include "esindex_api.h"
+#include "mapped_file.h"
+
+#include "log_print.h"
+#define TAG "FILEPUB"
+
+#define FILEPUB_DEFAULT_FRAMERATE 25.0
+#define FILEPUB_DEFAULT_DELTA 40 // ms between passes when no gap was seen
+#define FILEPUB_MAX_SLEEP 100 // ms, bounds filepub_stop latency
+
+static const AVal av_setDataFrame = AVC("@setDataFrame");
+static const AVal av_onMetaData = AVC("onMetaData");
+
+static const int adts_sample_rates[16] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0, 0, 0
+};
+
+static int64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int es_open(struct filepub_es *es, const char *path, int type, int threads)
+{
+    struct mapped_file file;
+    memset(es, 0, sizeof(*es));
+    es->fd = -1;
+    es->tags.fd = -1;
+    if (!path[0]) {
+        return 0;
+    }
+    if (mapped_file_open(&file, path, MADV_SEQUENTIAL) < 0) {
+        log_print(TAG, "open %s failed\n", path);
+        return -1;
+    }
+    es->fd = file.fd;
+    es->data = file.data;
+    es->size = file.size;
+    es->index = esindex_open(path, type, threads);
+    return es->index ? 0 : -1;
+}
+
+static void es_close(struct filepub_es *es)
+{
+    struct mapped_file file = {es->fd, es->data, es->size};
+    mapped_file_close(&file);
+    esindex_free(es->index);
+    free(es->tags.data);
+    memset(es, 0, sizeof(*es));
+    es->fd = -1;
+}
+
+static void es_set_tags(struct filepub_es *es, uint8_t *data, uint32_t size)
+{
+    free(es->tags.data);
+    es->tags.data = data;
+    es->tags.size = size;
+    es->tags.pos = 0;
+}
+
+static int es_next_frame(struct filepub_es *es, uint8_t **frame, uint32_t *frame_size)
+{
+    if (es->next >= es->index->count) {
+        return -1;
+    }
+    struct esindex_entry *entry = &es->index->entries[es->next++];
+    *frame = es->data + entry->pos;
+    *frame_size = entry->size;
+    return 0;
+}
+
+// mux the next frame of one elementary stream into es->tags
+static int es_fill(struct filepub_context *handle, struct filepub_es *es, int video)
+{
+    struct flvmux_packet in, out;
+    while (es->tags.pos >= es->tags.size) {
+        memset(&in, 0, sizeof(in));
+        memset(&out, 0, sizeof(out));
+        int ret;
+        if (video) {
+            double fps = handle->mux->video_info.framerate;
+            if (fps <= 0) {
+                fps = handle->para.framerate > 0 ? handle->para.framerate : FILEPUB_DEFAULT_FRAMERATE;
+            }
+            if (es_next_frame(es, &in.data, &in.size) < 0) {
+                return -1;
+            }
+            in.pts = in.dts = (int64_t)(es->count * 1000.0 / fps + 0.5);
+            in.type = 0;
+            ret = flvmux_setup_video_frame(handle->mux, &in, &out);
+            es->count++;
+        } else {
+            if (es_next_frame(es, &in.data, &in.size) < 0) {
+                return -1;
+            }
+            int sample_rate = adts_sample_rates[(in.data[2] >> 2) & 0x0f];
+            int samples = 1024 * ((in.data[6] & 0x03) + 1);
+            if (sample_rate != es->sample_rate) {
+                // keep the running timestamp when the rate changes
+                es->base_ts = es->sample_rate ? es->base_ts + es->count * 1000 / es->sample_rate : 0;
+                es->count = 0;
+                es->sample_rate = sample_rate;
+            }
+            in.pts = in.dts = es->base_ts + es->count * 1000 / es->sample_rate;
+            in.type = 1;
+            ret = flvmux_setup_audio_frame(handle->mux, &in, &out);
+            es->count += samples;
+        }
+        if (ret > 0) {
+            es_set_tags(es, out.data, (uint32_t)ret);
+        } else {
+            free(out.data);
+        }
+    }
+    return 0;
+}
+
+// pick the earlier of the next audio and video tags
+static int es_read_tag(struct filepub_context *handle, struct flvreader_tag *tag)
+{
+    struct flvreader_tag vtag, atag;
+    int has_v = handle->video.data && es_fill(handle, &handle->video, 1) == 0;
+    int has_a = handle->audio.data && es_fill(handle, &handle->audio, 0) == 0;
+    uint64_t vpos = handle->video.tags.pos;
+
+    has_v = has_v && flvreader_read_tag(&handle->video.tags, &vtag) == 0;
+    has_a = has_a && handle->audio.tags.pos < handle->audio.tags.size;
+    if (has_v && has_a) {
+        uint64_t apos = handle->audio.tags.pos;
+        if (flvreader_read_tag(&handle->audio.tags, &atag) == 0 && atag.ts <= vtag.ts) {
+            handle->video.tags.pos = vpos;
+            *tag = atag;
+            return 0;
+        }
+        handle->audio.tags.pos = apos;
+    } else if (has_a) {
+        return flvreader_read_tag(&handle->audio.tags, tag);
+    }
+    if (has_v) {
+        *tag = vtag;
+        return 0;
+    }
+    return -1;
+}
+
+static int read_tag(struct filepub_context *handle, struct flvreader_tag *tag)
+{
+    if (handle->flv) {
+        return flvreader_read_tag(handle->flv, tag);
+    }
+    return es_read_tag(handle, tag);
+}
+
+static void rewind_source(struct filepub_context *handle)
+{
+    if (handle->flv) {
+        flvreader_rewind(handle->flv);
+        return;
+    }
+    // the muxer keeps its config, so sequence headers are not repeated
+    handle->video.next = handle->video.count = 0;
+    handle->audio.next = handle->audio.count = handle->audio.base_ts = 0;
+    es_set_tags(&handle->video, NULL, 0);
+    es_set_tags(&handle->audio, NULL, 0);
+}
+
+static int is_metadata(struct flvreader_tag *tag)
+{
+    return tag->size >= 3 + (uint32_t)av_onMetaData.av_len && tag->body[0] == AMF_STRING
+           && !memcmp(tag->body + 3, av_onMetaData.av_val, av_onMetaData.av_len);
+}
+
+// RTMP_SendPacket writes the chunk headers in front of and inside the body,
+// so the read only mapping is copied into a reused buffer with header room.
+static int send_tag(struct filepub_context *handle, struct flvreader_tag *tag, uint32_t ts)
+{
+    RTMP *rtmp = (RTMP *)handle->rtmp->rtmp;
+    uint32_t extra = tag->type == RTMP_PACKET_TYPE_INFO ? 2 + av_setDataFrame.av_len + 1 : 0;
+    uint32_t need = RTMP_MAX_HEADER_SIZE + extra + tag->size;
+    RTMPPacket packet;
+
+    if (need > handle->send_buf_size) {
+        uint8_t *buf = (uint8_t *)realloc(handle->send_buf, need);
+        if (!buf) {
+            return -1;
+        }
+        handle->send_buf = buf;
+        handle->send_buf_size = need;
+    }
+    memset(&packet, 0, sizeof(packet));
+    packet.m_body = (char *)handle->send_buf + RTMP_MAX_HEADER_SIZE;
+    char *enc = packet.m_body;
+    if (extra) {
+        enc = AMF_EncodeString(enc, enc + extra + tag->size, &av_setDataFrame);
+    }
+    memcpy(enc, tag->body, tag->size);
+
+    packet.m_nChannel = 0x04; // source channel, as RTMP_Write
+    packet.m_packetType = tag->type;
+    packet.m_nBodySize = extra + tag->size;
+    packet.m_nTimeStamp = ts;
+    packet.m_nInfoField2 = rtmp->m_stream_id;
+    packet.m_headerType = handle->packets_sent ? RTMP_PACKET_SIZE_MEDIUM : RTMP_PACKET_SIZE_LARGE;
+    if (!RTMP_SendPacket(rtmp, &packet, FALSE)) {
+        log_print(TAG, "send failed, type:%d ts:%u\n", tag->type, ts);
+        return -1;
+    }
+    handle->packets_sent++;
+    return 0;
+}
+
+struct filepub_context *filepub_open(struct filepub_para *para, struct rtmp_context *rtmp)
+{
+    struct filepub_context *handle = (struct filepub_context *)malloc(sizeof(struct filepub_context));
+    if (!handle) {
+        return NULL;
+    }
+    memset(handle, 0, sizeof(struct filepub_context));
+    memcpy(&handle->para, para, sizeof(struct filepub_para));
+    handle->rtmp = rtmp;
+    handle->video.fd = handle->audio.fd = -1;
+
+    if (para->path[0]) {
+        handle->flv = flvreader_open(para->path);
+        if (!handle->flv) {
+            goto fail;
+        }
+    } else {
+        int vtype = para->vfmt == FLVMUX_VFMT_HEVC ? ESINDEX_TYPE_HEVC : ESINDEX_TYPE_H264;
+        if (es_open(&handle->video, para->video_path, vtype, para->index_threads) < 0
+            || es_open(&handle->audio, para->audio_path, ESINDEX_TYPE_ADTS, para->index_threads) < 0) {
+            goto fail;
+        }
+        struct flvmux_para mux_para;
+        memset(&mux_para, 0, sizeof(mux_para));
+        mux_para.has_video = handle->video.data != NULL;
+        mux_para.has_audio = handle->audio.data != NULL;
+        mux_para.vfmt = para->vfmt;
+        mux_para.afmt = FLVMUX_AFMT_AAC;
+        if (!mux_para.has_video && !mux_para.has_audio) {
+            goto fail;
+        }
+        handle->mux = flvmux_open(&mux_para);
+        if (!handle->mux) {
+            goto fail;
+        }
+        // onMetaData from the muxer goes out first
+        uint8_t *header = (uint8_t *)malloc(handle->mux->header_size);
+        if (!header) {
+            goto fail;
+        }
+        memcpy(header, handle->mux->header, handle->mux->header_size);
+        es_set_tags(handle->audio.data ? &handle->audio : &handle->video, header, handle->mux->header_size);
+    }
+    log_print(TAG, "FILEPUB Open ok\n");
+    return handle;
+fail:
+    log_print(TAG, "FILEPUB Open fail\n");
+    filepub_close(handle);
+    return NULL;
+}
+
+int filepub_step(struct filepub_context *handle)
+{
+    int64_t now = monotonic_ms();
+    while (!__atomic_load_n(&handle->stop, __ATOMIC_RELAXED)) {
+        struct flvreader_tag *tag = &handle->tag;
+        if (!handle->tag_ready) {
+            if (read_tag(handle, tag) < 0) {
+                if (!handle->para.loop || !handle->pass_started) {
+                    return -1;
+                }
+                rewind_source(handle);
+                handle->loop_offset = handle->last_ts + (handle->last_delta ? handle->last_delta : FILEPUB_DEFAULT_DELTA);
+                handle->pass_started = 0;
+                handle->loops++;
+                continue;
+            }
+            if (tag->type == RTMP_PACKET_TYPE_INFO && is_metadata(tag) && handle->loops > 0) {
+                continue; // once per stream is enough
+            }
+            if (!handle->pass_started && tag->type != RTMP_PACKET_TYPE_INFO) {
+                handle->pass_base = tag->ts;
+                handle->pass_started = 1;
+            }
+            handle->tag_ready = 1;
+        }
+
+        uint32_t ts = handle->loop_offset;
+        if (handle->pass_started && tag->ts > handle->pass_base) {
+            ts += tag->ts - handle->pass_base;
+        }
+        if (!handle->clock_started) {
+            handle->clock_base = now;
+            handle->ts_base = ts;
+            handle->clock_started = 1;
+        }
+        // schedule against the first timestamp, so sleeping never accumulates error
+        int64_t due = handle->clock_base + (int64_t)ts - handle->ts_base;
+        if (due > now + FILEPUB_MAX_WAIT || now - due > FILEPUB_MAX_LATE) {
+            log_print(TAG, "rebase clock, ts:%u late:%lld ms\n", ts, (long long)(now - due));
+            handle->clock_base = now;
+            handle->ts_base = ts;
+            due = now;
+        }
+        if (due > now) {
+            return (int)(due - now);
+        }
+
+        if (send_tag(handle, tag, ts) < 0) {
+            return -1;
+        }
+        handle->tag_ready = 0;
+        if (ts > handle->last_ts) {
+            handle->last_delta = ts - handle->last_ts;
+            handle->last_ts = ts;
+        }
+    }
+    return -1;
+}
+
+int filepub_run(struct filepub_context *handle)
+{
+    while (!__atomic_load_n(&handle->stop, __ATOMIC_RELAXED)) {
+        int wait = filepub_step(handle);
+        if (wait < 0) {
+            break;
+        }
+        if (wait > 0) {
+            usleep((wait > FILEPUB_MAX_SLEEP ? FILEPUB_MAX_SLEEP : wait) * 1000);
+        }
+    }
+    return 0;
+}
+
+void filepub_stop(struct filepub_context *handle)
+{
+    __atomic_store_n(&handle->stop, 1, __ATOMIC_RELAXED);
+}
+
+int filepub_close(struct filepub_context *handle)
+{
+    if (!handle) {
+        return 0;
+    }
+    flvreader_close(handle->flv);
+    es_close(&handle->video);
+    es_close(&handle->audio);
+    flvmux_close(handle->mux);
+    free(handle->send_buf);
+    free(handle);
+    return 0;
+}
@@ -0,0 +1,427 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  flvfile.cpp
+ *    Description:  buffered flv file recorder with keyframe index
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "flvfile_api.h"
+#include "flvmux_api.h"
+#include "rtmp.h"
+
+#include "log_print.h"
+#define TAG "FLVFILE"
+
+#define FLV_FILE_HEADER_LEN 13
+#define AUDIO_INDEX_INTERVAL 1000 // ms
+#define PADDING_OVERHEAD (2 + 8 + 1 + 4) // "_padding" long string without payload
+
+static const AVal av_onMetaData = AVC("onMetaData");
+static const AVal av_duration = AVC("duration");
+static const AVal av_filesize = AVC("filesize");
+static const AVal av_lasttimestamp = AVC("lasttimestamp");
+static const AVal av_lastkeyframetimestamp = AVC("lastkeyframetimestamp");
+static const AVal av_keyframes = AVC("keyframes");
+static const AVal av_times = AVC("times");
+static const AVal av_filepositions = AVC("filepositions");
+static const AVal av_padding = AVC("_padding");
+
+static int index_add(struct flvfile_index *idx, double time, double pos)
+{
+    if (idx->count == idx->capacity) {
+        int capacity = idx->capacity ? idx->capacity * 2 : 256;
+        double *times = (double *)realloc(idx->times, capacity * sizeof(double));
+        if (!times) {
+            return -1;
+        }
+        idx->times = times;
+        double *positions = (double *)realloc(idx->positions, capacity * sizeof(double));
+        if (!positions) {
+            return -1;
+        }
+        idx->positions = positions;
+        idx->capacity = capacity;
+    }
+    idx->times[idx->count] = time;
+    idx->positions[idx->count] = pos;
+    idx->count++;
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *data, int size)
+{
+    while (size > 0) {
+        ssize_t ret = write(fd, data, size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static int buffer_flush(struct flvfile_context *handle)
+{
+    if (handle->buffer_pos > 0 && write_all(handle->fd, handle->buffer, handle->buffer_pos) < 0) {
+        log_print(TAG, "write %s failed, errno:%d\n", handle->para.path, errno);
+        handle->error = 1;
+        return -1;
+    }
+    handle->buffer_pos = 0;
+    return 0;
+}
+
+// tags are gathered into the aligned buffer and written out one full buffer at a time
+static int buffer_append(struct flvfile_context *handle, const uint8_t *data, int size)
+{
+    handle->file_pos += size;
+    while (size > 0) {
+        int len = handle->buffer_size - handle->buffer_pos;
+        if (len > size) {
+            len = size;
+        }
+        memcpy(handle->buffer + handle->buffer_pos, data, len);
+        handle->buffer_pos += len;
+        data += len;
+        size -= len;
+        if (handle->buffer_pos == handle->buffer_size && buffer_flush(handle) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int is_metadata_tag(const uint8_t *body, uint32_t size)
+{
+    return size >= 3 + (uint32_t)av_onMetaData.av_len && body[0] == AMF_STRING
+           && body[1] == 0 && body[2] == av_onMetaData.av_len
+           && !memcmp(body + 3, av_onMetaData.av_val, av_onMetaData.av_len);
+}
+
+static int is_managed_prop(AVal *name)
+{
+    return AVMATCH(name, &av_duration) || AVMATCH(name, &av_filesize)
+           || AVMATCH(name, &av_lasttimestamp) || AVMATCH(name, &av_lastkeyframetimestamp)
+           || AVMATCH(name, &av_keyframes) || AVMATCH(name, &av_padding);
+}
+
+static char *encode_index_array(char *output, char *outend, const AVal *name, double *values, int count, int step)
+{
+    int i, n = (count + step - 1) / step;
+    if (!output || output + 2 + name->av_len + 5 > outend) {
+        return NULL;
+    }
+    output = AMF_EncodeInt16(output, outend, name->av_len);
+    memcpy(output, name->av_val, name->av_len);
+    output += name->av_len;
+    *output++ = AMF_STRICT_ARRAY;
+    output = AMF_EncodeInt32(output, outend, n);
+    for (i = 0; i < count && output; i += step) {
+        output = AMF_EncodeNumber(output, outend, values[i]);
+    }
+    return output;
+}
+
+// onMetaData body of exactly size bytes, padded with a "_padding" string.
+// Keeps every step-th index entry. Returns 0 or -1 when it does not fit.
+static int build_metadata(struct flvfile_context *handle, struct flvfile_index *idx, int step, char *out, int size)
+{
+    char *output = out;
+    char *outend = out + size;
+    char *count_pos;
+    int count = 0;
+    AMFObject obj;
+    int decoded = 0;
+
+    output = AMF_EncodeString(output, outend, &av_onMetaData);
+    if (!output) {
+        return -1;
+    }
+    *output++ = AMF_ECMA_ARRAY;
+    count_pos = output;
+    output = AMF_EncodeInt32(output, outend, 0);
+
+    if (handle->metadata
+        && AMF_Decode(&obj, (const char *)handle->metadata, handle->metadata_size, FALSE) >= 0) {
+        decoded = 1;
+        AMFObjectProperty *prop = AMF_GetProp(&obj, NULL, 1);
+        if (prop->p_type == AMF_ECMA_ARRAY || prop->p_type == AMF_OBJECT) {
+            int i, n = AMF_CountProp(&prop->p_vu.p_object);
+            for (i = 0; i < n && output; i++) {
+                AMFObjectProperty *item = AMF_GetProp(&prop->p_vu.p_object, NULL, i);
+                if (is_managed_prop(&item->p_name)) {
+                    continue;
+                }
+                output = AMFProp_Encode(item, output, outend);
+                count++;
+            }
+        }
+    }
+
+    if (decoded) {
+        AMF_Reset(&obj);
+    }
+    // the AMF_EncodeNamed* helpers do not accept a NULL output
+    if (!output) {
+        return -1;
+    }
+
+    double duration = handle->last_ts / 1000.0;
+    output = AMF_EncodeNamedNumber(output, outend, &av_duration, duration);
+    if (output) {
+        output = AMF_EncodeNamedNumber(output, outend, &av_filesize, (double)handle->file_pos);
+    }
+    if (output) {
+        output = AMF_EncodeNamedNumber(output, outend, &av_lasttimestamp, duration);
+    }
+    if (output) {
+        output = AMF_EncodeNamedNumber(output, outend, &av_lastkeyframetimestamp, handle->last_keyframe_ts / 1000.0);
+    }
+    count += 4;
+    if (idx && idx->count > 0 && output && output + 2 + av_keyframes.av_len + 1 <= outend) {
+        output = AMF_EncodeInt16(output, outend, av_keyframes.av_len);
+        memcpy(output, av_keyframes.av_val, av_keyframes.av_len);
+        output += av_keyframes.av_len;
+        *output++ = AMF_OBJECT;
+        output = encode_index_array(output, outend, &av_times, idx->times, idx->count, step);
+        output = encode_index_array(output, outend, &av_filepositions, idx->positions, idx->count, step);
+        if (output) {
+            output = AMF_EncodeInt24(output, outend, AMF_OBJECT_END);
+        }
+        count++;
+    }
+    if (!output || outend - output < PADDING_OVERHEAD + 3) {
+        return -1;
+    }
+
+    int pad = (int)(outend - output) - PADDING_OVERHEAD - 3;
+    output = AMF_EncodeInt16(output, outend, av_padding.av_len);
+    memcpy(output, av_padding.av_val, av_padding.av_len);
+    output += av_padding.av_len;
+    *output++ = AMF_LONG_STRING;
+    output = AMF_EncodeInt32(output, outend, pad);
+    memset(output, ' ', pad);
+    output += pad;
+    AMF_EncodeInt24(output, outend, AMF_OBJECT_END);
+    AMF_EncodeInt32(count_pos, outend, count + 1);
+    return 0;
+}
+
+// whole reserved script tag: tag header, body of index_reserve bytes, previous tag size
+static int build_metadata_tag(struct flvfile_context *handle, uint8_t *out)
+{
+    struct flvfile_index *idx = handle->video_index.count ? &handle->video_index : &handle->audio_index;
+    uint32_t body_len = handle->para.index_reserve;
+    uint8_t *p = out;
+    int step = 1;
+
+    p[0] = 0x12;
+    p[1] = (uint8_t)(body_len >> 16);
+    p[2] = (uint8_t)(body_len >> 8);
+    p[3] = (uint8_t)(body_len);
+    memset(p + 4, 0, 7);
+    // thin the index out rather than moving the whole recording to grow the tag
+    while (build_metadata(handle, idx, step, (char *)p + FLV_TAG_HEAD_LEN, body_len) < 0) {
+        if (step >= idx->count) {
+            if (build_metadata(handle, NULL, 1, (char *)p + FLV_TAG_HEAD_LEN, body_len) < 0) {
+                return -1;
+            }
+            log_print(TAG, "keyframe index dropped, %u bytes reserved\n", body_len);
+            step = 1;
+            break;
+        }
+        step *= 2;
+    }
+    if (step > 1) {
+        log_print(TAG, "keyframe index thinned out by %d to fit %u bytes\n", step, body_len);
+    }
+    p += FLV_TAG_HEAD_LEN + body_len;
+    p[0] = (uint8_t)((body_len + FLV_TAG_HEAD_LEN) >> 24);
+    p[1] = (uint8_t)((body_len + FLV_TAG_HEAD_LEN) >> 16);
+    p[2] = (uint8_t)((body_len + FLV_TAG_HEAD_LEN) >> 8);
+    p[3] = (uint8_t)(body_len + FLV_TAG_HEAD_LEN);
+    return FLV_TAG_HEAD_LEN + body_len + FLV_PRE_TAG_LEN;
+}
+
+struct flvfile_context *flvfile_open(struct flvfile_para *para)
+{
+    struct flvfile_context *handle = (struct flvfile_context *)malloc(sizeof(struct flvfile_context));
+    if (!handle) {
+        return NULL;
+    }
+    memset(handle, 0, sizeof(struct flvfile_context));
+    memcpy(&handle->para, para, sizeof(struct flvfile_para));
+    if (handle->para.buffer_size <= 0) {
+        handle->para.buffer_size = FLVFILE_DEFAULT_BUFFER_SIZE;
+    }
+    if (handle->para.index_reserve <= 0) {
+        handle->para.index_reserve = FLVFILE_DEFAULT_INDEX_RESERVE;
+    } else if (handle->para.index_reserve < FLVFILE_MIN_INDEX_RESERVE) {
+        handle->para.index_reserve = FLVFILE_MIN_INDEX_RESERVE;
+    }
+    handle->buffer_size = (handle->para.buffer_size + FLVFILE_ALIGN - 1) & ~(FLVFILE_ALIGN - 1);
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (handle->para.direct_io) {
+        flags |= O_DIRECT;
+    }
+#endif
+    handle->fd = open(handle->para.path, flags, 0644);
+    if (handle->fd < 0) {
+        log_print(TAG, "open %s failed, errno:%d\n", handle->para.path, errno);
+        free(handle);
+        return NULL;
+    }
+    if (posix_memalign((void **)&handle->buffer, FLVFILE_ALIGN, handle->buffer_size)) {
+        close(handle->fd);
+        free(handle);
+        return NULL;
+    }
+
+    // flags are patched on close once the stream types are known
+    static const uint8_t flv_file_header[FLV_FILE_HEADER_LEN] = {'F', 'L', 'V', 0x01, 0x05, 0, 0, 0, 0x09, 0, 0, 0, 0};
+    if (buffer_append(handle, flv_file_header, FLV_FILE_HEADER_LEN) < 0) {
+        flvfile_close(handle);
+        return NULL;
+    }
+
+    // reserve the onMetaData slot so the final index can be written in place
+    int tag_len = FLV_TAG_HEAD_LEN + handle->para.index_reserve + FLV_PRE_TAG_LEN;
+    uint8_t *tag = (uint8_t *)malloc(tag_len);
+    uint64_t metadata_pos = handle->file_pos;
+    if (!tag || build_metadata_tag(handle, tag) < 0 || buffer_append(handle, tag, tag_len) < 0) {
+        free(tag);
+        flvfile_close(handle);
+        return NULL;
+    }
+    // close only rewrites the slot once it is in the file
+    handle->metadata_pos = metadata_pos;
+    free(tag);
+
+    log_print(TAG, "FLVFILE Open ok: %s\n", handle->para.path);
+    return handle;
+}
+
+int flvfile_write(struct flvfile_context *handle, uint8_t *data, int size)
+{
+    uint8_t *p = data;
+    uint8_t *end = data + size;
+
+    if (!handle || handle->error) {
+        return -1;
+    }
+    if (size >= FLV_FILE_HEADER_LEN && !memcmp(p, "FLV", 3)) {
+        p += FLV_FILE_HEADER_LEN;
+    }
+
+    while (end - p >= FLV_TAG_HEAD_LEN) {
+        int type = p[0] & 0x1f;
+        uint32_t body_len = (p[1] << 16) | (p[2] << 8) | p[3];
+        uint32_t ts = (p[4] << 16) | (p[5] << 8) | p[6] | ((uint32_t)p[7] << 24);
+        uint32_t tag_len = FLV_TAG_HEAD_LEN + body_len + FLV_PRE_TAG_LEN;
+        uint8_t *body = p + FLV_TAG_HEAD_LEN;
+        struct flvmux_packet pkt;
+
+        if ((uint32_t)(end - p) < tag_len) {
+            log_print(TAG, "truncated tag, type:%d size:%u left:%d\n", type, body_len, (int)(end - p));
+            return -1;
+        }
+
+        if (type == 0x12 && is_metadata_tag(body, body_len)) {
+            // kept and merged into the reserved slot on close
+            uint8_t *metadata = (uint8_t *)realloc(handle->metadata, body_len);
+            if (metadata) {
+                memcpy(metadata, body, body_len);
+                handle->metadata = metadata;
+                handle->metadata_size = body_len;
+            }
+            p += tag_len;
+            continue;
+        }
+
+        if (type == 0x09) {
+            handle->has_video = 1;
+            if (!flvmux_parse_tag(type, body, body_len, ts, &pkt)
+                && (pkt.flags & FLVMUX_PKT_FLAG_KEY) && !(pkt.flags & FLVMUX_PKT_FLAG_HEADER)) {
+                index_add(&handle->video_index, ts / 1000.0, (double)handle->file_pos);
+                handle->last_keyframe_ts = ts;
+            }
+        } else if (type == 0x08) {
+            struct flvfile_index *idx = &handle->audio_index;
+            handle->has_audio = 1;
+            if (!flvmux_parse_tag(type, body, body_len, ts, &pkt) && !(pkt.flags & FLVMUX_PKT_FLAG_HEADER)
+                && (idx->count == 0 || ts >= idx->times[idx->count - 1] * 1000 + AUDIO_INDEX_INTERVAL)) {
+                index_add(idx, ts / 1000.0, (double)handle->file_pos);
+            }
+        }
+        if (ts > handle->last_ts) {
+            handle->last_ts = ts;
+        }
+
+        if (buffer_append(handle, p, tag_len) < 0) {
+            return -1;
+        }
+        p += tag_len;
+    }
+    return size;
+}
+
+int flvfile_close(struct flvfile_context *handle)
+{
+    int ret = 0;
+    if (!handle) {
+        return 0;
+    }
+
+#ifdef O_DIRECT
+    // the tail is not block sized, finish it and the header patches through the page cache
+    if (handle->para.direct_io) {
+        fcntl(handle->fd, F_SETFL, fcntl(handle->fd, F_GETFL) & ~O_DIRECT);
+    }
+#endif
+    if (buffer_flush(handle) < 0) {
+        ret = -1;
+    }
+
+    if (handle->metadata_pos) {
+        uint8_t flags = (handle->has_audio ? 0x04 : 0) | (handle->has_video ? 0x01 : 0);
+        if (pwrite(handle->fd, &flags, 1, 4) != 1) {
+            ret = -1;
+        }
+        int tag_len = FLV_TAG_HEAD_LEN + handle->para.index_reserve + FLV_PRE_TAG_LEN;
+        uint8_t *tag = (uint8_t *)malloc(tag_len);
+        if (!tag || build_metadata_tag(handle, tag) < 0
+            || pwrite(handle->fd, tag, tag_len, handle->metadata_pos) != tag_len) {
+            log_print(TAG, "rewrite onMetaData failed\n");
+            ret = -1;
+        }
+        free(tag);
+    }
+
+    close(handle->fd);
+    free(handle->buffer);
+    free(handle->metadata);
+    free(handle->video_index.times);
+    free(handle->video_index.positions);
+    free(handle->audio_index.times);
+    free(handle->audio_index.positions);
+    log_print(TAG, "FLVFILE Close: %s size:%llu keyframes:%d\n", handle->para.path,
+              (unsigned long long)handle->file_pos, handle->video_index.count);
+    free(handle);
+    return ret;
+}
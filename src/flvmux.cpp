@@ -16,6 +16,10 @@
 
 #include "flvmux_api.h"
 #include "rtmp.h"
+#include "avc_parser.h"
+#include "hevc_parser.h"
+#include "av1_parser.h"
+#include "amf_template.h"
 
 #include "log_print.h"
 #define TAG "FLVMUX"
@@ -25,15 +29,7 @@
 // @param [in] flag        stream falg
 // @param [in] ts_us       timestamp in us
 // @return             : 0: OK; others: FAILED
-static const AVal av_onMetaData = AVC("onMetaData");
-static const AVal av_duration = AVC("duration");
-static const AVal av_width = AVC("width");
-static const AVal av_height = AVC("height");
-static const AVal av_videocodecid = AVC("videocodecid");
-static const AVal av_avcprofile = AVC("avcprofile");
-static const AVal av_avclevel = AVC("avclevel");
 static const AVal av_videoframerate = AVC("videoframerate");
-static const AVal av_audiocodecid = AVC("audiocodecid");
 static const AVal av_audiosamplerate = AVC("audiosamplerate");
 static const AVal av_audiochannels = AVC("audiochannels");
 static const AVal av_avc1 = AVC("avc1");
@@ -41,6 +37,112 @@ static const AVal av_mp4a  = AVC("mp4a");
 static const AVal av_onPrivateData = AVC("onPrivateData");
 static const AVal av_record = AVC("record");
 
+static uint8_t *put_be32(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t)(val >> 24);
+    p[1] = (uint8_t)(val >> 16);
+    p[2] = (uint8_t)(val >> 8);
+    p[3] = (uint8_t)(val);
+    return p + 4;
+}
+
+static uint8_t *put_tag_header(uint8_t *p, uint8_t type, uint32_t body_len, uint32_t ts)
+{
+    p[0] = type;
+    p[1] = (uint8_t)(body_len >> 16); //data len
+    p[2] = (uint8_t)(body_len >> 8); //data len
+    p[3] = (uint8_t)(body_len); //data len
+    p[4] = (uint8_t)(ts >> 16); //time stamp
+    p[5] = (uint8_t)(ts >> 8); //time stamp
+    p[6] = (uint8_t)(ts); //time stamp
+    p[7] = (uint8_t)(ts >> 24); //time stamp
+    p[8] = 0x00; //stream id 0
+    p[9] = 0x00; //stream id 0
+    p[10] = 0x00; //stream id 0
+    return p + FLV_TAG_HEAD_LEN;
+}
+
+// fnv-1a, used to detect sequence header changes
+#define FNV_OFFSET_BASIS 2166136261u
+static uint32_t flvmux_hash(uint32_t hash, const void *data, int size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (size-- > 0) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    return hash;
+}
+
+// onMetaData names, encoded at compile time
+AMF_STRING_VALUE(tpl_onMetaData, "onMetaData");
+AMF_NAME(tpl_duration, "duration");
+AMF_NAME(tpl_width, "width");
+AMF_NAME(tpl_height, "height");
+AMF_NAME(tpl_videocodecid, "videocodecid");
+AMF_NAME(tpl_avcprofile, "avcprofile");
+AMF_NAME(tpl_avclevel, "avclevel");
+AMF_NAME(tpl_audiocodecid, "audiocodecid");
+AMF_NAME(tpl_framerate, "framerate");
+AMF_NAME(tpl_videodatarate, "videodatarate");
+
+// onMetaData script tag including previous tag size, returns bytes written
+static int gen_metadata_tag(struct flvmux_context *handle, uint8_t *out, int size, uint32_t ts)
+{
+    struct flvmux_video_info *info = &handle->video_info;
+    char buffer[512];
+    AMFBuilder b;
+    int count = 1;
+
+    AMFBuilder_Init(&b, buffer, sizeof(buffer), 0);
+    amf_put(&b, tpl_onMetaData);
+    AMFBuilder_Marker(&b, AMF_ECMA_ARRAY);
+    size_t count_pos = b.ab_len;
+    AMFBuilder_Grow(&b, 4);
+    amf_put_number(&b, tpl_duration, 0.0);
+    if (handle->para.has_video) {
+        uint32_t fourcc = handle->para.vfmt == FLVMUX_VFMT_HEVC ? FLV_FOURCC_HEVC : FLV_FOURCC_AV1;
+        //enhanced rtmp signals the codec by its FourCC
+        amf_put_number(&b, tpl_videocodecid, handle->para.vfmt == FLVMUX_VFMT_H264 ? 7 : fourcc);
+        count++;
+        if (info->width > 0 && info->height > 0) {
+            amf_put_number(&b, tpl_width, info->width);
+            amf_put_number(&b, tpl_height, info->height);
+            count += 2;
+            if (handle->para.vfmt == FLVMUX_VFMT_H264) {
+                amf_put_number(&b, tpl_avcprofile, info->profile);
+                amf_put_number(&b, tpl_avclevel, info->level);
+                count += 2;
+            }
+        }
+        if (info->framerate > 0) {
+            amf_put_number(&b, tpl_framerate, info->framerate);
+            count++;
+        }
+        if (info->bitrate > 0) {
+            amf_put_number(&b, tpl_videodatarate, info->bitrate / 1000.0);
+            count++;
+        }
+    }
+    if (handle->para.has_audio) {
+        amf_put_number(&b, tpl_audiocodecid, handle->para.afmt == FLVMUX_AFMT_OPUS ? FLV_FOURCC_OPUS : 10);
+        count++;
+    }
+    AMFBuilder_ObjectEnd(&b);
+
+    uint32_t body_len = b.ab_len;
+    if (b.ab_err || (int)(body_len + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN) > size) {
+        AMFBuilder_Free(&b);
+        return 0;
+    }
+    char *body = AMFBuilder_Data(&b);
+    AMF_EncodeInt32(body + count_pos, body + count_pos + 4, count);
+    uint8_t *p = put_tag_header(out, 0x12, body_len, ts); //tagtype metadata
+    memcpy(p, body, body_len);
+    p = put_be32(p + body_len, body_len + FLV_TAG_HEAD_LEN);
+    AMFBuilder_Free(&b);
+    return (int)(p - out);
+}
+
 struct flvmux_context *flvmux_open(struct flvmux_para *para)
 {
     struct flvmux_context *handle = (struct flvmux_context *)malloc(sizeof(struct flvmux_context));
@@ -70,39 +172,8 @@ struct flvmux_context *flvmux_open(struct flvmux_para *para)
 #endif
 
     // setup flv header
-    uint32_t body_len;
-    uint32_t offset = 0;
-    uint32_t output_len;
-    char buffer[512];
-    char *output = buffer;
-    char *outend = buffer + sizeof(buffer);
-    char send_buffer[512];
-
-    output = AMF_EncodeString(output, outend, &av_onMetaData);
-    *output++ = AMF_ECMA_ARRAY;
-    output = AMF_EncodeInt32(output, outend, 3);
-    output = AMF_EncodeNamedNumber(output, outend, &av_duration, 0.0);
-    output = AMF_EncodeNamedNumber(output, outend, &av_videocodecid, 7);
-    output = AMF_EncodeNamedNumber(output, outend, &av_audiocodecid, 10);
-    output = AMF_EncodeInt24(output, outend, AMF_OBJECT_END);
-
-    body_len = output - buffer;
-    output_len = body_len + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
-    send_buffer[offset++] = 0x12; //tagtype metadata
-    send_buffer[offset++] = (uint8_t)(body_len >> 16); //data len
-    send_buffer[offset++] = (uint8_t)(body_len >> 8); //data len
-    send_buffer[offset++] = (uint8_t)(body_len); //data len
-    send_buffer[offset++] = (uint8_t)(ts_us >> 16); //time stamp
-    send_buffer[offset++] = (uint8_t)(ts_us >> 8); //time stamp
-    send_buffer[offset++] = (uint8_t)(ts_us); //time stamp
-    send_buffer[offset++] = (uint8_t)(ts_us >> 24); //time stamp
-    send_buffer[offset++] = 0x00; //stream id 0
-    send_buffer[offset++] = 0x00; //stream id 0
-    send_buffer[offset++] = 0x00; //stream id 0
-
-    memcpy(send_buffer + offset, buffer, body_len); //H264 sequence parameter set
-    memcpy(handle->header + handle->header_size, send_buffer, output_len);
-    handle->header_size += output_len;
+    handle->header_size += gen_metadata_tag(handle, handle->header + handle->header_size,
+            sizeof(handle->header) - handle->header_size, (uint32_t)ts_us);
 
     log_print(TAG, "FLVMUX Open ok\n");
     return handle;
@@ -187,7 +258,7 @@ static uint8_t *get_adts(uint32_t *len, uint8_t **offset, uint8_t *start, uint32
     return p;
 }
 
-int flvmux_setup_audio_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
+static int setup_aac_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
 {
     uint32_t audio_ts = (uint32_t)in->pts;
     uint8_t * audio_buf = in->data; 
@@ -208,9 +279,12 @@ PARSE_BEGIN:
     audio_frame = get_adts(&adts_len, &audio_buf_offset, audio_buf, audio_total);
     if (audio_frame == NULL)
         return -1;
+    AudioSpecificConfig config = gen_config(audio_frame);
+    uint32_t config_hash = flvmux_hash(FNV_OFFSET_BASIS, &config, sizeof(config));
     log_print(TAG, "Config:%d \n", handle->audio_config_ok);
-    if (handle->audio_config_ok == 0) {
-        handle->config = gen_config(audio_frame);
+    if (handle->audio_config_ok == 0 || config_hash != handle->audio_config_hash) {
+        handle->config = config;
+        handle->audio_config_hash = config_hash;
         body_len = 2 + 2; //AudioTagHeader + AudioSpecificConfig
         output_len = body_len + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
         output = (char *)malloc(output_len);
@@ -302,6 +376,7 @@ PARSE_BEGIN:
         free(output);
     }
     out->pts = in->pts;
+    out->dts = in->pts;
     out->type = 1;
     log_print(TAG, "Data[%02x %02x %02x %02x]\n", out->data[0], out->data[1], out->data[2], out->data[3]);
     log_print(TAG, "Setup AAC Audio Frame size:%d out->data:%p\n", out->size, out->data);
@@ -309,252 +384,711 @@ PARSE_BEGIN:
     return out->size;
 }
 
-static uint8_t *h264_find_IDR_frame(char *buffer, int total)
+#define AUDIO_PACKET_SEQUENCE_START 0
+#define AUDIO_PACKET_CODED_FRAMES 1
+
+// OpusHead identification header, RFC 7845 section 5.1
+static int gen_opus_head(struct flvmux_context *handle, uint8_t *p)
 {
-    uint8_t *buf = (uint8_t *)buffer;
-    while (total > 4) {
-        if (buf[0] == 0x00 && buf[1] == 0x00 && buf[2] == 0x01) {
-            // Found a NAL unit with 3-byte startcode
-            if (buf[3] & 0x1F == 0x5) {
-                // Found a reference frame, do something with it
-            }
-            break;
-        } else if (buf[0] == 0x00 && buf[1] == 0x00 && buf[2] == 0x00 && buf[3] == 0x01) {
-            // Found a NAL unit with 4-byte startcode
-            if (buf[4] & 0x1F == 0x5) {
-                // Found a reference frame, do something with it
-            }
-            break;
-        }
-        buf++;
-        total--;
+    uint32_t rate = handle->para.audio_sample_rate > 0 ? handle->para.audio_sample_rate : 48000;
+    memcpy(p, "OpusHead", 8);
+    p[8] = 1; //version
+    p[9] = (uint8_t)(handle->para.audio_channels > 0 ? handle->para.audio_channels : 2);
+    p[10] = (uint8_t)(handle->para.audio_pre_skip); //pre-skip, little endian
+    p[11] = (uint8_t)(handle->para.audio_pre_skip >> 8);
+    p[12] = (uint8_t)(rate);
+    p[13] = (uint8_t)(rate >> 8);
+    p[14] = (uint8_t)(rate >> 16);
+    p[15] = (uint8_t)(rate >> 24);
+    p[16] = 0; //output gain
+    p[17] = 0;
+    p[18] = 0; //channel mapping family
+    return 19;
+}
+
+static uint8_t *put_opus_tag(uint8_t *p, int packet_type, uint8_t *data, uint32_t size, uint32_t ts)
+{
+    uint32_t body_len = 5 + size; //ExAudioTagHeader + FourCC
+    p = put_tag_header(p, 0x08, body_len, ts); //tagtype audio
+    *p++ = (9 << 4) | packet_type; //SoundFormat ExHeader + AudioPacketType
+    p = put_be32(p, FLV_FOURCC_OPUS);
+    memcpy(p, data, size);
+    return put_be32(p + size, body_len + FLV_TAG_HEAD_LEN);
+}
+
+// in->data holds one raw opus packet
+static int setup_opus_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
+{
+    uint32_t audio_ts = (uint32_t)in->pts;
+    uint8_t head[19];
+    int head_len = 0;
+    uint32_t config_len = 0;
+
+    if (handle->audio_config_ok == 0) {
+        head_len = gen_opus_head(handle, head);
+        config_len = 5 + head_len + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
+    }
+    out->size = config_len + 5 + in->size + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
+    out->data = (uint8_t *)malloc(out->size);
+    if (!out->data) {
+        return -1;
     }
+    uint8_t *p = out->data;
+    if (config_len > 0) {
+        p = put_opus_tag(p, AUDIO_PACKET_SEQUENCE_START, head, head_len, audio_ts);
+        handle->audio_config_ok = 1;
+    }
+    put_opus_tag(p, AUDIO_PACKET_CODED_FRAMES, in->data, in->size, audio_ts);
+    out->pts = in->pts;
+    out->dts = in->pts;
+    out->type = 1;
+    return (int)out->size;
+}
 
-    if (total <= 4) {
-        return NULL;
+int flvmux_setup_audio_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
+{
+    if (handle->para.afmt == FLVMUX_AFMT_OPUS) {
+        return setup_opus_frame(handle, in, out);
     }
-    return buf;
+    return setup_aac_frame(handle, in, out);
 }
 
-static uint8_t *h264_find_NAL(uint8_t *buffer, int total, int *startcode_len)
+#define FLVMUX_MAX_NALS 256 // units of one access unit, more fail the frame
+
+#define VIDEO_PACKET_SEQUENCE_START 0
+#define VIDEO_PACKET_CODED_FRAMES 1
+#define VIDEO_PACKET_CODED_FRAMES_X 3 // enhanced rtmp, no CompositionTime
+
+struct nal_unit {
+    uint8_t *data; // nal header byte, or obu header for av1
+    int size;
+};
+
+// one access unit ready to be written as flv tags
+struct video_au {
+    struct nal_unit units[FLVMUX_MAX_NALS];
+    int unit_count;
+    int length_prefixed; // nal units get a 4 byte size, av1 obus carry their own
+    int keyframe;
+    uint8_t *config;     // malloc'ed decoder configuration record, NULL if unchanged
+    int config_size;
+    int meta;            // video info changed, emit onMetaData first
+};
+
+static int au_add_unit(struct video_au *au, uint8_t *data, int size)
 {
-    uint8_t *buf = (uint8_t *)buffer;
-    while (total > 4) {
-        
-        if (buf[0] == 0x00 && buf[1] == 0x00 && buf[2] == 0x01) {
-            // Found a NAL unit with 3-byte startcode
-            if (buf[3] & 0x1F == 0x5) {
-                // Found a reference frame, do something with it
-            }
-            *startcode_len = 3;
-            break;
-        } else if (buf[0] == 0x00 && buf[1] == 0x00 && buf[2] == 0x00 && buf[3] == 0x01) {
-            // Found a NAL unit with 4-byte startcode
-            if (buf[4] & 0x1F == 0x5) {
-                // Found a reference frame, do something with it
-            }
-            *startcode_len = 4;
-            break;
+    if (au->unit_count >= FLVMUX_MAX_NALS) {
+        log_print(TAG, "access unit has more than %d units \n", FLVMUX_MAX_NALS);
+        return -1;
+    }
+    au->units[au->unit_count].data = data;
+    au->units[au->unit_count++].size = size;
+    return 0;
+}
+
+// keep the parameter sets carried by this access unit as the current ones
+static void update_param_sets(struct flvmux_param_set *sets, int *count, int max, struct nal_unit *nals, int nal_count)
+{
+    int i;
+    *count = 0;
+    for (i = 0; i < nal_count && *count < max; i++) {
+        if (nals[i].size > FLVMUX_MAX_PARAM_SET_SIZE) {
+            log_print(TAG, "parameter set too large:%d \n", nals[i].size);
+            continue;
         }
-        buf++;
-        total--;
+        memcpy(sets[*count].data, nals[i].data, nals[i].size);
+        sets[*count].size = nals[i].size;
+        (*count)++;
     }
+}
 
-    if (total <= 4) {
-        return NULL;
+static uint32_t hash_param_sets(uint32_t hash, struct flvmux_param_set *sets, int count)
+{
+    int i;
+    hash = flvmux_hash(hash, &count, sizeof(count));
+    for (i = 0; i < count; i++) {
+        hash = flvmux_hash(hash, sets[i].data, sets[i].size);
     }
-    return buf;
+    return hash;
 }
 
-// Complete Frame Process
-int flvmux_setup_video_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
+static uint32_t param_sets_hash(struct flvmux_context *handle)
 {
-    int sps_len = 0;
-    uint8_t *sps_buf = NULL;
-    int frame_len = 0;
-    uint8_t *frame_buf = NULL;
+    uint32_t hash = FNV_OFFSET_BASIS;
+    hash = hash_param_sets(hash, handle->vps, handle->vps_count);
+    hash = hash_param_sets(hash, handle->sps, handle->sps_count);
+    return hash_param_sets(hash, handle->pps, handle->pps_count);
+}
 
-    uint8_t *buf_264 = (uint8_t *)in->data;
-    uint32_t total_264 = (uint32_t)in->size;
-    uint8_t *vbuf_start = buf_264;
-    uint8_t *vbuf_end = buf_264 + total_264;
-    uint8_t *vbuf_off = buf_264;
+// Returns 1 if a new sequence header has to be sent
+static int param_sets_changed(struct flvmux_context *handle)
+{
+    uint32_t config_hash = param_sets_hash(handle);
+    if (handle->video_config_ok && config_hash == handle->video_config_hash) {
+        // inline parameter sets repeat what the receiver already has
+        return 0;
+    }
+    handle->video_config_hash = config_hash;
+    return 1;
+}
 
-    uint8_t *nal, *nal_pps, *nal_frame, *nal_next;
-    uint32_t nal_len, nal_pps_len, nal_frame_len;
+static int update_video_info(struct flvmux_context *handle, struct flvmux_video_info *info)
+{
+    if (info->bitrate <= 0) {
+        info->bitrate = handle->para.video_bitrate;
+    }
+    if (memcmp(info, &handle->video_info, sizeof(*info)) == 0) {
+        return 0;
+    }
+    handle->video_info = *info;
+    log_print(TAG, "video info: %dx%d fps:%.2f profile:%d level:%d bitrate:%d\n",
+              info->width, info->height, info->framerate, info->profile, info->level, info->bitrate);
+    return 1;
+}
 
-    uint8_t *output = NULL;
-    uint32_t body_len;
-    uint32_t output_len;
+static uint8_t *put_param_set(uint8_t *p, struct flvmux_param_set *set)
+{
+    *p++ = (uint8_t)(set->size >> 8); //parameter set length high 8 bits
+    *p++ = (uint8_t)(set->size); //parameter set length low 8 bits
+    memcpy(p, set->data, set->size);
+    return p + set->size;
+}
 
-    uint32_t ts = (uint32_t)in->pts;
-    uint32_t offset = 0;
+// high profiles carry chroma format and bit depth in the record
+static int avc_config_has_ext(struct avc_sps_info *sps)
+{
+    return sps->profile_idc == 100 || sps->profile_idc == 110
+        || sps->profile_idc == 122 || sps->profile_idc == 144;
+}
 
-    int startcode_len = 0;
+// AVCDecoderConfigurationRecord
+static int build_avc_config(struct flvmux_context *handle, struct avc_sps_info *sps, uint8_t *output)
+{
+    uint8_t *p = output;
+    int i;
 
-    log_print(TAG, "Total Pakcet size:%u \n", total_264);
-PARSE_BEGIN:
-    // Find Nal. Maybe SPS
-    offset = 0;
-    log_print(TAG, "Curpos:%d %02x %02x %02x %02x %02x\n", vbuf_off - vbuf_start, vbuf_off[0], vbuf_off[1], vbuf_off[2], vbuf_off[3], vbuf_off[4]);
-    nal = h264_find_NAL(vbuf_off, vbuf_start + total_264 - vbuf_off, &startcode_len);
-    if (nal == NULL) {
-        goto end;
+    *p++ = 0x01; //configurationversion
+    *p++ = (uint8_t)sps->profile_idc; //avcprofileindication
+    *p++ = (uint8_t)sps->constraint_flags; //profilecompatibilty
+    *p++ = (uint8_t)sps->level_idc; //avclevelindication
+    *p++ = 0xff; //reserved + lengthsizeminusone
+    *p++ = 0xe0 | handle->sps_count; //reserved + numofsequenceset
+    for (i = 0; i < handle->sps_count; i++) {
+        p = put_param_set(p, &handle->sps[i]); //H264 sequence parameter set
     }
+    *p++ = (uint8_t)handle->pps_count; //numofpictureset
+    for (i = 0; i < handle->pps_count; i++) {
+        p = put_param_set(p, &handle->pps[i]); //H264 picture parameter set
+    }
+    if (avc_config_has_ext(sps)) {
+        *p++ = 0xfc | (sps->chroma_format_idc & 0x03);
+        *p++ = 0xf8 | ((sps->bit_depth_luma - 8) & 0x07);
+        *p++ = 0xf8 | ((sps->bit_depth_chroma - 8) & 0x07);
+        *p++ = 0x00; //numofsequenceparametersetext
+    }
+    return (int)(p - output);
+}
 
-    vbuf_off = nal + startcode_len;
-    if (nal[startcode_len] == 0x67)  {
+static uint8_t *put_hvcc_array(uint8_t *p, int nal_type, struct flvmux_param_set *sets, int count)
+{
+    int i;
+    *p++ = 0x80 | nal_type; //array_completeness + nal_unit_type
+    *p++ = (uint8_t)(count >> 8); //numNalus
+    *p++ = (uint8_t)(count);
+    for (i = 0; i < count; i++) {
+        p = put_param_set(p, &sets[i]);
+    }
+    return p;
+}
 
-        if (handle->video_config_ok == 1) {
-            log_print(TAG, "I frame configured \n");
-            //return -1;
-        }
+// HEVCDecoderConfigurationRecord
+static int build_hevc_config(struct flvmux_context *handle, struct hevc_sps_info *sps, uint8_t *output)
+{
+    uint8_t *p = output;
 
-        nal_pps = h264_find_NAL(vbuf_off, vbuf_start + total_264 - vbuf_off, &startcode_len);
-        nal_len = nal_pps - nal - 4;
-        log_print(TAG, "nal: %02x %d pos:%d\n", nal[4], nal_len, nal - vbuf_start);
-        vbuf_off = nal_pps + startcode_len;
-        nal_frame = h264_find_NAL(vbuf_off, vbuf_start + total_264 - vbuf_off, &startcode_len);
-        nal_pps_len = nal_frame - nal_pps - 4;
-        log_print(TAG, "pps: %02x %d pos:%d \n", nal_pps[4], nal_pps_len, nal_pps - vbuf_start);
-        vbuf_off = nal_frame;
+    *p++ = 0x01; //configurationversion
+    *p++ = (uint8_t)((sps->profile_space << 6) | (sps->tier_flag << 5) | sps->profile_idc);
+    p = put_be32(p, sps->profile_compatibility_flags);
+    memcpy(p, sps->constraint_indicator_flags, 6);
+    p += 6;
+    *p++ = (uint8_t)sps->level_idc;
+    *p++ = 0xf0; //reserved + min_spatial_segmentation_idc
+    *p++ = 0x00;
+    *p++ = 0xfc; //reserved + parallelismType
+    *p++ = 0xfc | (sps->chroma_format_idc & 0x03);
+    *p++ = 0xf8 | ((sps->bit_depth_luma - 8) & 0x07);
+    *p++ = 0xf8 | ((sps->bit_depth_chroma - 8) & 0x07);
+    *p++ = 0x00; //avgFrameRate
+    *p++ = 0x00;
+    //constantFrameRate + numTemporalLayers + temporalIdNested + lengthSizeMinusOne
+    *p++ = (uint8_t)((sps->max_sub_layers << 3) | (sps->temporal_id_nesting << 2) | 0x03);
+    *p++ = 3; //numOfArrays
+    p = put_hvcc_array(p, HEVC_NAL_VPS, handle->vps, handle->vps_count);
+    p = put_hvcc_array(p, HEVC_NAL_SPS, handle->sps, handle->sps_count);
+    p = put_hvcc_array(p, HEVC_NAL_PPS, handle->pps, handle->pps_count);
+    return (int)(p - output);
+}
 
-        body_len = nal_len + nal_pps_len + 16;
-        output_len = body_len + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
-        output = (uint8_t *)malloc(output_len);
+// AV1CodecConfigurationRecord, sequence header obu kept in sps[0]
+static int build_av1_config(struct flvmux_context *handle, struct av1_seq_info *seq, uint8_t *output)
+{
+    uint8_t *p = output;
 
-        // FLV TAG HEADER
-        output[offset++] = 0x09; //tagtype video
-        output[offset++] = (uint8_t)(body_len >> 16); //data len
-        output[offset++] = (uint8_t)(body_len >> 8); //data len
-        output[offset++] = (uint8_t)(body_len); //data len
-        output[offset++] = (uint8_t)(ts >> 16); //time stamp
-        output[offset++] = (uint8_t)(ts >> 8); //time stamp
-        output[offset++] = (uint8_t)(ts); //time stamp
-        output[offset++] = (uint8_t)(ts >> 24); //time stamp
-        output[offset++] = in->pts; //stream id 0
-        output[offset++] = 0x00; //stream id 0
-        output[offset++] = 0x00; //stream id 0
+    *p++ = 0x81; //marker + version
+    *p++ = (uint8_t)((seq->seq_profile << 5) | seq->seq_level_idx_0);
+    *p++ = (uint8_t)((seq->seq_tier_0 << 7) | (seq->high_bitdepth << 6) | (seq->twelve_bit << 5)
+                     | (seq->mono_chrome << 4) | (seq->chroma_subsampling_x << 3)
+                     | (seq->chroma_subsampling_y << 2) | seq->chroma_sample_position);
+    *p++ = 0x00; //no initial_presentation_delay
+    memcpy(p, handle->sps[0].data, handle->sps[0].size); //configOBUs
+    p += handle->sps[0].size;
+    return (int)(p - output);
+}
 
-        //FLV VideoTagHeader
-        output[offset++] = 0x17; //key frame, AVC
-        output[offset++] = 0x00; //avc sequence header
-        output[offset++] = 0x00; //composit time
-        output[offset++] = 0x00; // composit time
-        output[offset++] = 0x00; //composit time
-
-        //flv VideoTagBody --AVCDecoderCOnfigurationRecord
-        output[offset++] = 0x01; //configurationversion
-        output[offset++] = nal[1]; //avcprofileindication
-        output[offset++] = nal[2]; //profilecompatibilty
-        output[offset++] = nal[3]; //avclevelindication
-        output[offset++] = 0xff; //reserved + lengthsizeminusone
-        output[offset++] = 0xe1; //numofsequenceset
-        output[offset++] = (uint8_t)(nal_len >> 8); //sequence parameter set length high 8 bits
-        output[offset++] = (uint8_t)(nal_len); //sequence parameter set  length low 8 bits
-        memcpy(output + offset, nal + 4, nal_len); //H264 sequence parameter set
-        offset += nal_len;
-        output[offset++] = 0x01; //numofpictureset
-        output[offset++] = (uint8_t)(nal_pps_len >> 8); //picture parameter set length high 8 bits
-        output[offset++] = (uint8_t)(nal_pps_len); //picture parameter set length low 8 bits
-        memcpy(output + offset, nal_pps + 4, nal_pps_len); //H264 picture parameter set
-
-        offset += nal_pps_len;
-        uint32_t fff = body_len + FLV_TAG_HEAD_LEN;
-        output[offset++] = (uint8_t)(fff >> 24); //data len
-        output[offset++] = (uint8_t)(fff >> 16); //data len
-        output[offset++] = (uint8_t)(fff >> 8); //data len
-        output[offset++] = (uint8_t)(fff); //data len
+static uint8_t *alloc_config(struct flvmux_context *handle)
+{
+    int size = 64, i;
+    for (i = 0; i < handle->vps_count; i++) {
+        size += 2 + handle->vps[i].size;
+    }
+    for (i = 0; i < handle->sps_count; i++) {
+        size += 2 + handle->sps[i].size;
+    }
+    for (i = 0; i < handle->pps_count; i++) {
+        size += 2 + handle->pps[i].size;
+    }
+    return (uint8_t *)malloc(size);
+}
 
-        sps_len = output_len;
-        sps_buf = output;
-#if 0
-        out->size = output_len;
-        out->data = (uint8_t *)malloc(output_len);
-        memcpy(out->data, output, output_len);
-        free(output);
-#endif
-        handle->video_config_ok = 1;
-        goto PARSE_BEGIN;
-    } else if (nal[startcode_len] == 0x65 || (nal[startcode_len] & 0x1f) == 0x01) {
-        nal_len = vbuf_end - nal - startcode_len;
-        //log_print(TAG, "nal len:%d \n", nal_len);
-        body_len = nal_len + 5 + 4; //flv VideoTagHeader +  NALU length
-        output_len = body_len + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
-        output = (uint8_t *)malloc(output_len);
-        if (!output) {
-            return -1;
-        }
+static uint32_t video_fourcc(struct flvmux_context *handle)
+{
+    switch (handle->para.vfmt) {
+    case FLVMUX_VFMT_HEVC:
+        return FLV_FOURCC_HEVC;
+    case FLVMUX_VFMT_AV1:
+        return FLV_FOURCC_AV1;
+    default:
+        return 0;
+    }
+}
 
-        // FLV TAG HEADER
-        output[offset++] = 0x09; //tagtype video
-        output[offset++] = (uint8_t)(body_len >> 16); //data len
-        output[offset++] = (uint8_t)(body_len >> 8); //data len
-        output[offset++] = (uint8_t)(body_len); //data len
-        output[offset++] = (uint8_t)(ts >> 16); //time stamp
-        output[offset++] = (uint8_t)(ts >> 8); //time stamp
-        output[offset++] = (uint8_t)(ts); //time stamp
-        output[offset++] = (uint8_t)(ts >> 24); //time stamp
-        output[offset++] = in->pts; //stream id 0
-        output[offset++] = 0x00; //stream id 0
-        output[offset++] = 0x00; //stream id 0
+static int video_tag_header_len(struct flvmux_context *handle, int packet_type)
+{
+    if (handle->para.vfmt == FLVMUX_VFMT_H264) {
+        return 5;
+    }
+    return packet_type == VIDEO_PACKET_CODED_FRAMES && handle->para.vfmt == FLVMUX_VFMT_HEVC ? 8 : 5;
+}
 
-        //FLV VideoTagHeader
-        if(nal[startcode_len] == 0x065) {
-            output[offset++] = 0x17; //key frame, AVC
-            log_print(TAG, "Key frame \n");
+static uint8_t *put_video_tag_header(struct flvmux_context *handle, uint8_t *p, int keyframe, int packet_type, int64_t cts)
+{
+    if (handle->para.vfmt == FLVMUX_VFMT_H264) {
+        *p++ = keyframe ? 0x17 : 0x27; //key frame or not, AVC
+        *p++ = (uint8_t)packet_type; //avc sequence header or nalu
+    } else {
+        //ExVideoTagHeader: IsExHeader + FrameType + PacketType, then FourCC
+        *p++ = 0x80 | ((keyframe ? 1 : 2) << 4) | packet_type;
+        p = put_be32(p, video_fourcc(handle));
+        if (video_tag_header_len(handle, packet_type) == 5) {
+            return p;
         }
-        else
-            output[offset++] = 0x27; //not key frame, AVC
-        output[offset++] = 0x01; //avc sequence header
-        output[offset++] = 0x00; //composit time
-        output[offset++] = 0x00; // composit time
-        output[offset++] = 0x00; //composit time
-
-        output[offset++] = (uint8_t)(nal_len >> 24); //nal length
-        output[offset++] = (uint8_t)(nal_len >> 16); //nal length
-        output[offset++] = (uint8_t)(nal_len >> 8); //nal length
-        output[offset++] = (uint8_t)(nal_len); //nal length
-        memcpy(output + offset, nal + startcode_len, nal_len);
-
-        offset += nal_len;
-        uint32_t fff = body_len + FLV_TAG_HEAD_LEN;
-        output[offset++] = (uint8_t)(fff >> 24); //data len
-        output[offset++] = (uint8_t)(fff >> 16); //data len
-        output[offset++] = (uint8_t)(fff >> 8); //data len
-        output[offset++] = (uint8_t)(fff); //data len
+    }
+    if (cts > 0x7fffff || cts < -0x800000) {
+        log_print(TAG, "composition time out of range:%lld \n", (long long)cts);
+        cts = cts > 0 ? 0x7fffff : -0x800000;
+    }
+    *p++ = (uint8_t)(cts >> 16); //composit time, SI24
+    *p++ = (uint8_t)(cts >> 8); // composit time
+    *p++ = (uint8_t)(cts); //composit time
+    return p;
+}
 
-        frame_len = output_len;
-        frame_buf = output;
-#if 0
-        out->size = output_len;
-        out->data = (uint8_t *)malloc(output_len);
-        memcpy(out->data, output, output_len);
-        free(output);
-#endif
+static int pack_video_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out, struct video_au *au)
+{
+    uint8_t meta_buf[1024];
+    int meta_len = 0;
+    uint32_t config_len = 0, config_body = 0;
+    uint32_t frame_len = 0, frame_body = 0;
+    int packet_type = VIDEO_PACKET_CODED_FRAMES;
+    int i;
+
+    // tag timestamp carries the decode time, presentation offset goes into CompositionTime
+    int64_t dts = in->dts < 0 ? 0 : in->dts;
+    int64_t cts = in->pts - dts;
+    uint32_t ts = (uint32_t)dts;
+
+    if (au->meta) {
+        meta_len = gen_metadata_tag(handle, meta_buf, sizeof(meta_buf), ts);
+    }
+    if (au->config) {
+        config_body = video_tag_header_len(handle, VIDEO_PACKET_SEQUENCE_START) + au->config_size;
+        config_len = config_body + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
+    }
+    if (au->unit_count > 0) {
+        if (handle->para.vfmt == FLVMUX_VFMT_HEVC && cts == 0) {
+            packet_type = VIDEO_PACKET_CODED_FRAMES_X;
+        }
+        frame_body = video_tag_header_len(handle, packet_type);
+        for (i = 0; i < au->unit_count; i++) {
+            frame_body += (au->length_prefixed ? 4 : 0) + au->units[i].size;
+        }
+        frame_len = frame_body + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN;
     }
 
-end:
     out->pts = in->pts;
     out->dts = in->dts;
-    out->size = (uint32_t)(frame_len + sps_len);
+    out->type = 0;
+    out->size = (uint32_t)(meta_len + config_len + frame_len);
+    out->data = NULL;
+    if (out->size == 0) {
+        free(au->config);
+        return 0;
+    }
     out->data = (uint8_t *)malloc(out->size);
     if (!out->data) {
+        free(au->config);
         return -1;
     }
 
-    if (sps_len > 0) {
-        memcpy(out->data, sps_buf, sps_len);
-        free(sps_buf);
+    uint8_t *p = out->data;
+    memcpy(p, meta_buf, meta_len);
+    p += meta_len;
+    if (config_len > 0) {
+        p = put_tag_header(p, 0x09, config_body, ts); //tagtype video
+        p = put_video_tag_header(handle, p, 1, VIDEO_PACKET_SEQUENCE_START, 0);
+        memcpy(p, au->config, au->config_size);
+        p = put_be32(p + au->config_size, config_body + FLV_TAG_HEAD_LEN);
+        free(au->config);
     }
     if (frame_len > 0) {
-        memcpy(out->data + sps_len, frame_buf, frame_len);
-        free(frame_buf);
+        p = put_tag_header(p, 0x09, frame_body, ts); //tagtype video
+        p = put_video_tag_header(handle, p, au->keyframe, packet_type, cts);
+        if (au->keyframe) {
+            log_print(TAG, "Key frame \n");
+        }
+        for (i = 0; i < au->unit_count; i++) {
+            if (au->length_prefixed) {
+                p = put_be32(p, au->units[i].size); //nal length
+            }
+            memcpy(p, au->units[i].data, au->units[i].size);
+            p += au->units[i].size;
+        }
+        p = put_be32(p, frame_body + FLV_TAG_HEAD_LEN);
     }
-    log_print(TAG, "sps:%d frame:%d %u out sp:%p\n", sps_len, frame_len, out->size, out->data);
+    log_print(TAG, "meta:%d sps:%u frame:%u %u out sp:%p\n", meta_len, config_len, frame_len, out->size, out->data);
     return (int)out->size;
 }
 
+// Split annex-b data into nal units; parameter sets go to vps/sps/pps lists
+static int split_annexb(struct flvmux_context *handle, struct flvmux_packet *in, struct video_au *au,
+                         struct nal_unit *vps, int *vps_count, struct nal_unit *sps, int *sps_count,
+                         struct nal_unit *pps, int *pps_count)
+{
+    uint8_t *vbuf_start = (uint8_t *)in->data;
+    uint8_t *vbuf_end = vbuf_start + in->size;
+    int startcode_len = 0, next_startcode_len = 0;
+    int hevc = handle->para.vfmt == FLVMUX_VFMT_HEVC;
+
+    uint8_t *nal = avc_find_startcode(vbuf_start, in->size, &startcode_len);
+    while (nal) {
+        uint8_t *payload = nal + startcode_len;
+        uint8_t *next = avc_find_startcode(payload, vbuf_end - payload, &next_startcode_len);
+        int size = (int)((next ? next : vbuf_end) - payload);
+        nal = next;
+        startcode_len = next_startcode_len;
+        if (size <= 0) {
+            continue;
+        }
+
+        int type = hevc ? HEVC_NAL_TYPE(payload[0]) : (payload[0] & 0x1f);
+        if (hevc && type == HEVC_NAL_VPS) {
+            if (*vps_count < FLVMUX_MAX_VPS) {
+                vps[*vps_count].data = payload;
+                vps[(*vps_count)++].size = size;
+            }
+        } else if (type == (hevc ? HEVC_NAL_SPS : AVC_NAL_SPS)) {
+            if (*sps_count < FLVMUX_MAX_SPS) {
+                sps[*sps_count].data = payload;
+                sps[(*sps_count)++].size = size;
+            }
+        } else if (type == (hevc ? HEVC_NAL_PPS : AVC_NAL_PPS)) {
+            if (*pps_count < FLVMUX_MAX_PPS) {
+                pps[*pps_count].data = payload;
+                pps[(*pps_count)++].size = size;
+            }
+        } else if (type == (hevc ? HEVC_NAL_AUD : AVC_NAL_AUD)) {
+            continue;
+        } else {
+            if (hevc ? (type >= HEVC_NAL_BLA_W_LP && type <= HEVC_NAL_IRAP_END) : type == AVC_NAL_IDR) {
+                au->keyframe = 1;
+            }
+            if (au_add_unit(au, payload, size) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int setup_annexb_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
+{
+    struct video_au au;
+    struct nal_unit vps_nals[FLVMUX_MAX_VPS];
+    struct nal_unit sps_nals[FLVMUX_MAX_SPS];
+    struct nal_unit pps_nals[FLVMUX_MAX_PPS];
+    int vps_count = 0, sps_count = 0, pps_count = 0;
+    int hevc = handle->para.vfmt == FLVMUX_VFMT_HEVC;
+
+    log_print(TAG, "Total Pakcet size:%u \n", in->size);
+    memset(&au, 0, sizeof(au));
+    au.length_prefixed = 1;
+    if (split_annexb(handle, in, &au, vps_nals, &vps_count, sps_nals, &sps_count, pps_nals, &pps_count) < 0) {
+        return -1;
+    }
+
+    if (vps_count > 0) {
+        update_param_sets(handle->vps, &handle->vps_count, FLVMUX_MAX_VPS, vps_nals, vps_count);
+    }
+    if (sps_count > 0) {
+        update_param_sets(handle->sps, &handle->sps_count, FLVMUX_MAX_SPS, sps_nals, sps_count);
+    }
+    if (pps_count > 0) {
+        update_param_sets(handle->pps, &handle->pps_count, FLVMUX_MAX_PPS, pps_nals, pps_count);
+    }
+
+    int complete = handle->sps_count > 0 && handle->pps_count > 0 && (!hevc || handle->vps_count > 0);
+    if ((vps_count > 0 || sps_count > 0 || pps_count > 0) && complete && param_sets_changed(handle)) {
+        struct flvmux_video_info info;
+        memset(&info, 0, sizeof(info));
+        au.config = alloc_config(handle);
+        if (!au.config) {
+            return -1;
+        }
+        if (hevc) {
+            struct hevc_sps_info sps_info;
+            if (hevc_parse_sps(handle->sps[0].data, handle->sps[0].size, &sps_info) < 0) {
+                log_print(TAG, "sps parse failed \n");
+                free(au.config);
+                handle->video_config_ok = 0;
+                return -1;
+            }
+            info.width = sps_info.width;
+            info.height = sps_info.height;
+            info.profile = sps_info.profile_idc;
+            info.level = sps_info.level_idc;
+            au.config_size = build_hevc_config(handle, &sps_info, au.config);
+        } else {
+            struct avc_sps_info sps_info;
+            if (avc_parse_sps(handle->sps[0].data, handle->sps[0].size, &sps_info) < 0) {
+                log_print(TAG, "sps parse failed \n");
+                free(au.config);
+                handle->video_config_ok = 0;
+                return -1;
+            }
+            info.width = sps_info.width;
+            info.height = sps_info.height;
+            info.framerate = sps_info.framerate;
+            info.profile = sps_info.profile_idc;
+            info.level = sps_info.level_idc;
+            info.bitrate = sps_info.bitrate;
+            au.config_size = build_avc_config(handle, &sps_info, au.config);
+        }
+        au.meta = update_video_info(handle, &info);
+        handle->video_config_ok = 1;
+    }
+    return pack_video_frame(handle, in, out, &au);
+}
+
+// in->data holds one temporal unit of obus with size fields
+static int setup_av1_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
+{
+    struct video_au au;
+    struct av1_obu obu;
+    struct nal_unit seq_obu = {NULL, 0};
+    uint8_t *buf = in->data;
+    int left = (int)in->size;
+    int ret;
+
+    memset(&au, 0, sizeof(au));
+    while (left > 0 && (ret = av1_read_obu(buf, left, &obu)) > 0) {
+        if (obu.type == AV1_OBU_SEQUENCE_HEADER) {
+            seq_obu.data = obu.data;
+            seq_obu.size = obu.size;
+        }
+        if (obu.type != AV1_OBU_TEMPORAL_DELIMITER && obu.type != AV1_OBU_PADDING
+                && au_add_unit(&au, obu.data, obu.size) < 0) {
+            return -1;
+        }
+        buf += ret;
+        left -= ret;
+    }
+
+    // the sequence header is parsed when it changes, frames only need the still picture flag
+    if (seq_obu.data) {
+        update_param_sets(handle->sps, &handle->sps_count, 1, &seq_obu, 1);
+        if (handle->sps_count == 0) {
+            handle->av1_seq_ok = 0;
+            handle->video_config_ok = 0;
+        } else if (param_sets_changed(handle)) {
+            struct av1_seq_info seq;
+            memset(&seq, 0, sizeof(seq));
+            if (av1_read_obu(handle->sps[0].data, handle->sps[0].size, &obu) < 0
+                    || av1_parse_sequence_header(obu.payload, obu.payload_size, &seq) < 0) {
+                log_print(TAG, "sequence header parse failed \n");
+                handle->sps_count = 0;
+                handle->av1_seq_ok = 0;
+                handle->video_config_ok = 0;
+                return -1;
+            }
+            handle->av1_seq_ok = 1;
+            handle->av1_still_picture = seq.reduced_still_picture_header;
+
+            struct flvmux_video_info info;
+            memset(&info, 0, sizeof(info));
+            info.width = seq.width;
+            info.height = seq.height;
+            info.framerate = seq.framerate;
+            info.profile = seq.seq_profile;
+            info.level = seq.seq_level_idx_0;
+            au.config = alloc_config(handle);
+            if (!au.config) {
+                return -1;
+            }
+            au.config_size = build_av1_config(handle, &seq, au.config);
+            au.meta = update_video_info(handle, &info);
+            handle->video_config_ok = 1;
+        }
+    }
+    if (handle->av1_seq_ok) {
+        struct av1_seq_info seq;
+        memset(&seq, 0, sizeof(seq));
+        seq.reduced_still_picture_header = handle->av1_still_picture;
+        int i;
+        for (i = 0; i < au.unit_count && !au.keyframe; i++) {
+            struct av1_obu unit;
+            if (av1_read_obu(au.units[i].data, au.units[i].size, &unit) > 0) {
+                au.keyframe = av1_is_keyframe(&unit, &seq);
+            }
+        }
+    }
+    return pack_video_frame(handle, in, out, &au);
+}
+
+// Complete Frame Process
+int flvmux_setup_video_frame(struct flvmux_context *handle, struct flvmux_packet *in, struct flvmux_packet *out)
+{
+    if (handle->para.vfmt == FLVMUX_VFMT_AV1) {
+        return setup_av1_frame(handle, in, out);
+    }
+    return setup_annexb_frame(handle, in, out);
+}
+
+static int get_flv_tag_codec(uint32_t fourcc, int video)
+{
+    if (video) {
+        switch (fourcc) {
+        case FLV_FOURCC_AVC:
+            return FLVMUX_VFMT_H264;
+        case FLV_FOURCC_HEVC:
+        case FLV_FOURCC_HEV1:
+            return FLVMUX_VFMT_HEVC;
+        case FLV_FOURCC_AV1:
+            return FLVMUX_VFMT_AV1;
+        }
+    } else if (fourcc == FLV_FOURCC_OPUS) {
+        return FLVMUX_AFMT_OPUS;
+    }
+    return -1;
+}
+
+int flvmux_parse_tag(int tag_type, uint8_t *body, uint32_t size, uint32_t ts, struct flvmux_packet *out)
+{
+    uint32_t header_len = 0;
+    int32_t cts = 0;
+
+    memset(out, 0, sizeof(*out));
+    out->codec = -1;
+    if (size < 1) {
+        return -1;
+    }
+
+    if (tag_type == 0x09) {
+        out->type = 0;
+        if (body[0] & 0x80) { //ExVideoTagHeader
+            int packet_type = body[0] & 0x0f;
+            if (size < 5) {
+                return -1;
+            }
+            out->codec = get_flv_tag_codec(AMF_DecodeInt32((char *)body + 1), 1);
+            header_len = 5;
+            if (packet_type == VIDEO_PACKET_CODED_FRAMES && out->codec != FLVMUX_VFMT_AV1) {
+                if (size < 8) {
+                    return -1;
+                }
+                cts = (int32_t)(AMF_DecodeInt24((char *)body + 5) << 8) >> 8;
+                header_len = 8;
+            }
+            if (packet_type == VIDEO_PACKET_SEQUENCE_START) {
+                out->flags |= FLVMUX_PKT_FLAG_HEADER;
+            } else if (packet_type != VIDEO_PACKET_CODED_FRAMES && packet_type != VIDEO_PACKET_CODED_FRAMES_X) {
+                out->flags |= FLVMUX_PKT_FLAG_OTHER; // sequence end, metadata, multitrack
+            }
+        } else if ((body[0] & 0x0f) == 7) { //AVC
+            if (size < 5) {
+                return -1;
+            }
+            out->codec = FLVMUX_VFMT_H264;
+            header_len = 5;
+            cts = (int32_t)(AMF_DecodeInt24((char *)body + 2) << 8) >> 8;
+            if (body[1] == 0) {
+                out->flags |= FLVMUX_PKT_FLAG_HEADER;
+            } else if (body[1] != 1) {
+                out->flags |= FLVMUX_PKT_FLAG_OTHER; // end of sequence
+            }
+        } else {
+            header_len = 1;
+        }
+        if (((body[0] >> 4) & 0x07) == 1) {
+            out->flags |= FLVMUX_PKT_FLAG_KEY;
+        }
+    } else if (tag_type == 0x08) {
+        out->type = 1;
+        if ((body[0] >> 4) == 9) { //ExAudioTagHeader
+            if (size < 5) {
+                return -1;
+            }
+            out->codec = get_flv_tag_codec(AMF_DecodeInt32((char *)body + 1), 0);
+            header_len = 5;
+            if ((body[0] & 0x0f) == 0) {
+                out->flags |= FLVMUX_PKT_FLAG_HEADER;
+            } else if ((body[0] & 0x0f) != 1) {
+                out->flags |= FLVMUX_PKT_FLAG_OTHER;
+            }
+        } else if ((body[0] >> 4) == 10) { //AAC
+            if (size < 2) {
+                return -1;
+            }
+            out->codec = FLVMUX_AFMT_AAC;
+            header_len = 2;
+            if (body[1] == 0) {
+                out->flags |= FLVMUX_PKT_FLAG_HEADER;
+            }
+        } else {
+            header_len = 1;
+        }
+    } else if (tag_type == 0x12) {
+        out->type = 2;
+    } else {
+        return -1;
+    }
+
+    out->data = body + header_len;
+    out->size = size - header_len;
+    out->dts = ts;
+    out->pts = (int64_t)ts + cts;
+    return 0;
+}
+
 int flvmux_close(struct flvmux_context *handle)
 {
     if (handle) {
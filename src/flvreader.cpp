@@ -0,0 +1,91 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  flvreader.cpp
+ *    Description:  zero copy flv tag reader over a memory mapped file
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flvreader_api.h"
+#include "flvmux_api.h"
+#include "mapped_file.h"
+
+#include "log_print.h"
+#define TAG "FLVREADER"
+
+struct flvreader_context *flvreader_open(const char *path)
+{
+    struct mapped_file file;
+    if (mapped_file_open(&file, path, MADV_SEQUENTIAL) < 0) {
+        log_print(TAG, "open %s failed\n", path);
+        return NULL;
+    }
+    if (file.size < 13 || memcmp(file.data, "FLV", 3)) {
+        log_print(TAG, "%s is not a flv file\n", path);
+        mapped_file_close(&file);
+        return NULL;
+    }
+
+    struct flvreader_context *handle = (struct flvreader_context *)malloc(sizeof(struct flvreader_context));
+    if (!handle) {
+        mapped_file_close(&file);
+        return NULL;
+    }
+    memset(handle, 0, sizeof(struct flvreader_context));
+    handle->fd = file.fd;
+    handle->data = file.data;
+    handle->size = file.size;
+    handle->has_audio = (file.data[4] & 0x04) != 0;
+    handle->has_video = (file.data[4] & 0x01) != 0;
+    uint32_t header_len = (file.data[5] << 24) | (file.data[6] << 16) | (file.data[7] << 8) | file.data[8];
+    handle->first_tag = (uint64_t)header_len + FLV_PRE_TAG_LEN; // PreviousTagSize0
+    handle->pos = handle->first_tag;
+    return handle;
+}
+
+int flvreader_read_tag(struct flvreader_context *handle, struct flvreader_tag *tag)
+{
+    uint64_t left = handle->size - handle->pos;
+    if (handle->pos >= handle->size || left < FLV_TAG_HEAD_LEN) {
+        return -1;
+    }
+    uint8_t *p = handle->data + handle->pos;
+    uint32_t size = (p[1] << 16) | (p[2] << 8) | p[3];
+    if (left < (uint64_t)FLV_TAG_HEAD_LEN + size) {
+        log_print(TAG, "truncated tag at %llu\n", (unsigned long long)handle->pos);
+        return -1;
+    }
+    tag->type = p[0] & 0x1f;
+    tag->ts = (p[4] << 16) | (p[5] << 8) | p[6] | ((uint32_t)p[7] << 24);
+    tag->body = p + FLV_TAG_HEAD_LEN;
+    tag->size = size;
+    tag->pos = handle->pos;
+    handle->pos += FLV_TAG_HEAD_LEN + size + FLV_PRE_TAG_LEN;
+    return 0;
+}
+
+void flvreader_rewind(struct flvreader_context *handle)
+{
+    handle->pos = handle->first_tag;
+}
+
+int flvreader_close(struct flvreader_context *handle)
+{
+    if (!handle) {
+        return 0;
+    }
+    if (handle->fd >= 0) {
+        struct mapped_file file = {handle->fd, handle->data, handle->size};
+        mapped_file_close(&file);
+    }
+    free(handle);
+    return 0;
+}
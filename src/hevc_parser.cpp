@@ -0,0 +1,107 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  hevc_parser.cpp
+ *    Description:  h265 sequence parameter set parser
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <string.h>
+
+#include "hevc_parser.h"
+#include "avc_parser.h"
+#include "bitreader.h"
+
+#define HEVC_MAX_SPS_SIZE 1024
+
+static void parse_profile_tier_level(struct bit_reader *br, struct hevc_sps_info *info)
+{
+    int sub_layers = info->max_sub_layers - 1;
+    int profile_present[8], level_present[8];
+    int i;
+
+    info->profile_space = br_read(br, 2);
+    info->tier_flag = br_read1(br);
+    info->profile_idc = br_read(br, 5);
+    info->profile_compatibility_flags = br_read(br, 32);
+    for (i = 0; i < 6; i++) {
+        info->constraint_indicator_flags[i] = (uint8_t)br_read(br, 8);
+    }
+    info->level_idc = br_read(br, 8);
+
+    for (i = 0; i < sub_layers; i++) {
+        profile_present[i] = br_read1(br);
+        level_present[i] = br_read1(br);
+    }
+    if (sub_layers > 0) {
+        for (i = sub_layers; i < 8; i++) {
+            br_read(br, 2); // reserved_zero_2bits
+        }
+    }
+    for (i = 0; i < sub_layers; i++) {
+        if (profile_present[i]) {
+            br_skip(br, 88);
+        }
+        if (level_present[i]) {
+            br_read(br, 8);
+        }
+    }
+}
+
+int hevc_parse_sps(const uint8_t *nal, int size, struct hevc_sps_info *info)
+{
+    uint8_t rbsp[HEVC_MAX_SPS_SIZE];
+    struct bit_reader br;
+    int len;
+
+    if (size < 4 || HEVC_NAL_TYPE(nal[0]) != HEVC_NAL_SPS) {
+        return -1;
+    }
+    if (size > HEVC_MAX_SPS_SIZE) {
+        size = HEVC_MAX_SPS_SIZE;
+    }
+    len = avc_nal_to_rbsp(nal + 2, size - 2, rbsp);
+    br_init(&br, rbsp, len);
+    memset(info, 0, sizeof(*info));
+
+    br_read(&br, 4); // sps_video_parameter_set_id
+    info->max_sub_layers = br_read(&br, 3) + 1;
+    info->temporal_id_nesting = br_read1(&br);
+    parse_profile_tier_level(&br, info);
+
+    br_read_ue(&br); // sps_seq_parameter_set_id
+    info->chroma_format_idc = br_read_ue(&br);
+    int separate_colour_plane = 0;
+    if (info->chroma_format_idc == 3) {
+        separate_colour_plane = br_read1(&br);
+    }
+    int width = br_read_ue(&br);
+    int height = br_read_ue(&br);
+    if (br_read1(&br)) { // conformance_window_flag
+        int sub_width = 1, sub_height = 1;
+        if (!separate_colour_plane && (info->chroma_format_idc == 1 || info->chroma_format_idc == 2)) {
+            sub_width = 2;
+            sub_height = info->chroma_format_idc == 1 ? 2 : 1;
+        }
+        int left = br_read_ue(&br);
+        int right = br_read_ue(&br);
+        int top = br_read_ue(&br);
+        int bottom = br_read_ue(&br);
+        width -= sub_width * (left + right);
+        height -= sub_height * (top + bottom);
+    }
+    info->width = width;
+    info->height = height;
+    info->bit_depth_luma = br_read_ue(&br) + 8;
+    info->bit_depth_chroma = br_read_ue(&br) + 8;
+
+    if (br.overrun || info->width <= 0 || info->height <= 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  hevc_parser.h
+ *    Description:  h265 nal types and sequence parameter set parser
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef HEVC_PARSER_H
+#define HEVC_PARSER_H
+
+#include <stdint.h>
+
+#define HEVC_NAL_BLA_W_LP   16
+#define HEVC_NAL_CRA        21
+#define HEVC_NAL_IRAP_END   23
+#define HEVC_NAL_VPS        32
+#define HEVC_NAL_SPS        33
+#define HEVC_NAL_PPS        34
+#define HEVC_NAL_AUD        35
+
+#define HEVC_NAL_TYPE(b) (((b) >> 1) & 0x3f)
+
+struct hevc_sps_info {
+    int profile_space;
+    int tier_flag;
+    int profile_idc;
+    uint32_t profile_compatibility_flags;
+    uint8_t constraint_indicator_flags[6];
+    int level_idc;
+    int max_sub_layers;
+    int temporal_id_nesting;
+    int chroma_format_idc;
+    int bit_depth_luma;
+    int bit_depth_chroma;
+    int width;
+    int height;
+};
+
+// nal points at the two byte nal header (no start code). Returns 0 on success.
+int hevc_parse_sps(const uint8_t *nal, int size, struct hevc_sps_info *info);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  mapped_file.h
+ *    Description:  read only file mapping shared by the file readers
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct mapped_file {
+    int fd;
+    uint8_t *data;
+    uint64_t size;
+};
+
+// Pages come from the page cache, so channels looping the same file share them.
+static inline int mapped_file_open(struct mapped_file *file, const char *path, int advice)
+{
+    struct stat st;
+    file->data = NULL;
+    file->size = 0;
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0) {
+        return -1;
+    }
+    if (fstat(file->fd, &st) < 0 || st.st_size <= 0) {
+        close(file->fd);
+        file->fd = -1;
+        return -1;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (data == MAP_FAILED) {
+        close(file->fd);
+        file->fd = -1;
+        return -1;
+    }
+    madvise(data, st.st_size, advice);
+    file->data = (uint8_t *)data;
+    file->size = st.st_size;
+    return 0;
+}
+
+static inline void mapped_file_close(struct mapped_file *file)
+{
+    if (file->data) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+    }
+    if (file->fd >= 0) {
+        close(file->fd);
+        file->fd = -1;
+    }
+}
+
+#endif
@@ -16,11 +16,46 @@
 
 #include "rtmp.h"
 #include "rtmp_api.h"
+#include "rtmp_pool_api.h"
 #include "flvmux_api.h"
 
 #include "log_print.h"
 #define TAG "RTMP"
 
+// The connection is handshaked and connected already, only the stream
+// setup is left: one round trip with the pipelined publish/play.
+static RTMP *rtmp_open_pooled(struct rtmp_para *para)
+{
+    char url[1024];
+    int protocol;
+    unsigned int port;
+    AVal host, playpath, app;
+
+    RTMP *rtmp = (RTMP *)rtmp_pool_claim(para->pool, para->uri, para->write_enable);
+    if (!rtmp) {
+        return NULL;
+    }
+    snprintf(url, sizeof(url), "%s", para->uri);
+    char *options = strchr(url, ' ');
+    if (options) {
+        *options = '\0';
+    }
+    RTMP_ParseURL(url, &protocol, &host, &port, &playpath, &app);
+    if (para->command_timeout_ms > 0) {
+        rtmp->Link.cmdTimeout = para->command_timeout_ms;
+    }
+    RTMP_SetCancel(rtmp, para->cancel);
+    int ret = RTMP_StartStream(rtmp, &playpath);
+    free(playpath.av_val);
+    if (!ret) {
+        log_print(TAG, "Pooled connection failed, connecting\n");
+        RTMP_Close(rtmp);
+        RTMP_Free(rtmp);
+        return NULL;
+    }
+    return rtmp;
+}
+
 struct rtmp_context *rtmp_open(struct rtmp_para *para)
 {
     struct rtmp_context *handle = (struct rtmp_context *)malloc(sizeof(struct rtmp_context));
@@ -29,6 +64,12 @@ struct rtmp_context *rtmp_open(struct rtmp_para *para)
     }
     memset(handle, 0, sizeof(struct rtmp_context));
     memcpy(&handle->para, para, sizeof(struct rtmp_para));
+    if (para->pool) {
+        handle->rtmp = rtmp_open_pooled(para);
+        if (handle->rtmp) {
+            return handle;
+        }
+    }
     RTMP *rtmp = RTMP_Alloc();
     if (!rtmp) {
         free(handle);
@@ -44,6 +85,22 @@ struct rtmp_context *rtmp_open(struct rtmp_para *para)
     if (para->write_enable) {
         RTMP_EnableWrite(rtmp);
     }
+    if (para->pipeline) {
+        rtmp->Link.lFlags |= RTMP_LF_PIPE;
+    }
+    if (para->fastopen) {
+        rtmp->Link.lFlags |= RTMP_LF_TFO;
+    }
+    if (para->connect_timeout_ms > 0) {
+        rtmp->Link.connTimeout = para->connect_timeout_ms;
+    }
+    if (para->handshake_timeout_ms > 0) {
+        rtmp->Link.hsTimeout = para->handshake_timeout_ms;
+    }
+    if (para->command_timeout_ms > 0) {
+        rtmp->Link.cmdTimeout = para->command_timeout_ms;
+    }
+    RTMP_SetCancel(rtmp, para->cancel);
     ret = RTMP_Connect(rtmp, NULL);
     if (!ret) {
         goto fail;
@@ -68,6 +125,56 @@ int rtmp_read(struct rtmp_context *handle, uint8_t *data, int size)
     return RTMP_Read((struct RTMP*)handle->rtmp, (char *)data, size);
 }
 
+int rtmp_read_packet(struct rtmp_context *handle, struct flvmux_packet *pkt)
+{
+    RTMP *rtmp = (struct RTMP *)handle->rtmp;
+    RTMPPacket *packet = (RTMPPacket *)handle->read_packet;
+
+    if (!packet) {
+        packet = (RTMPPacket *)calloc(1, sizeof(RTMPPacket));
+        if (!packet) {
+            return -1;
+        }
+        handle->read_packet = packet;
+    }
+
+    while (1) {
+        // walk the flv tags of an aggregate message
+        if (packet->m_body && packet->m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO
+                && handle->read_pos + FLV_TAG_HEAD_LEN <= packet->m_nBodySize) {
+            uint8_t *tag = (uint8_t *)packet->m_body + handle->read_pos;
+            uint32_t size = AMF_DecodeInt24((char *)tag + 1);
+            uint32_t ts = AMF_DecodeInt24((char *)tag + 4) | (tag[7] << 24);
+            if (handle->read_pos + FLV_TAG_HEAD_LEN + size > packet->m_nBodySize) {
+                log_print(TAG, "Aggregate tag truncated\n");
+                handle->read_pos = packet->m_nBodySize;
+                continue;
+            }
+            if (handle->read_pos == 0) {
+                handle->read_delta = (int32_t)(packet->m_nTimeStamp - ts);
+            }
+            handle->read_pos += FLV_TAG_HEAD_LEN + size + FLV_PRE_TAG_LEN;
+            if (flvmux_parse_tag(tag[0], tag + FLV_TAG_HEAD_LEN, size, ts + handle->read_delta, pkt) == 0) {
+                return (int)pkt->size;
+            }
+            continue;
+        }
+
+        RTMPPacket_Free(packet);
+        handle->read_pos = 0;
+        if (RTMP_GetNextMediaPacket(rtmp, packet) != 1) {
+            return -1;
+        }
+        if (packet->m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO) {
+            continue;
+        }
+        if (flvmux_parse_tag(packet->m_packetType, (uint8_t *)packet->m_body, packet->m_nBodySize,
+                             packet->m_nTimeStamp, pkt) == 0) {
+            return (int)pkt->size;
+        }
+    }
+}
+
 int rtmp_write(struct rtmp_context *handle, uint8_t *data, int size)
 {
     int ret = 0;
@@ -98,6 +205,10 @@ int rtmp_get_parameter()
 int rtmp_close(struct rtmp_context *handle)
 {
     RTMP *rtmp = (struct RTMP *)handle->rtmp;
+    if (handle->read_packet) {
+        RTMPPacket_Free((RTMPPacket *)handle->read_packet);
+        free(handle->read_packet);
+    }
     RTMP_Close(rtmp);
     RTMP_Free(rtmp);
     free(handle);
@@ -0,0 +1,376 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  rtmp_pool.cpp
+ *    Description:  connected rtmp sessions kept ready per host/port/app
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <poll.h>
+#include <time.h>
+
+#include "rtmp_pool_api.h"
+#include "rtmp.h"
+
+#include "log_print.h"
+#define TAG "RTMP_POOL"
+
+#define RTMP_POOL_TICK 100 // ms between worker rounds
+#define RTMP_POOL_READ_MS 200 // longest wait for the rest of a message an idle connection started
+
+static int64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Connections are shared by protocol, host, port, app and direction. The
+// connect command depends on all of them, the playpath only on the stream.
+static int pool_key_id(const char *uri, int write_enable, char *id, int size)
+{
+    char url[1024];
+    int protocol;
+    unsigned int port;
+    AVal host, playpath, app;
+
+    snprintf(url, sizeof(url), "%s", uri);
+    char *options = strchr(url, ' ');
+    if (options) {
+        *options = '\0';
+    }
+    if (!RTMP_ParseURL(url, &protocol, &host, &port, &playpath, &app)) {
+        return -1;
+    }
+    free(playpath.av_val);
+    if (port == 0) {
+        port = (protocol & RTMP_FEATURE_SSL) ? 443 : (protocol & RTMP_FEATURE_HTTP) ? 80 : 1935;
+    }
+    snprintf(id, size, "%c %d %.*s:%u/%.*s", write_enable ? 'w' : 'r', protocol,
+             host.av_len, host.av_val, port, app.av_len, app.av_val);
+    return 0;
+}
+
+static RTMP *pool_connect(struct rtmp_pool *pool, struct rtmp_pool_key *key)
+{
+    // librtmp keeps pointers into the url, so it lives right behind the
+    // RTMP and RTMP_Free releases both
+    size_t len = strlen(key->uri) + 1;
+    RTMP *rtmp = (RTMP *)calloc(1, sizeof(RTMP) + len);
+    if (!rtmp) {
+        return NULL;
+    }
+    char *url = (char *)(rtmp + 1);
+    memcpy(url, key->uri, len);
+
+    RTMP_Init(rtmp);
+    rtmp->Link.timeout = 10; //10seconds
+    rtmp->Link.lFlags |= RTMP_LF_LIVE | RTMP_LF_PIPE;
+    if (!RTMP_SetupURL(rtmp, url)) {
+        RTMP_Free(rtmp);
+        return NULL;
+    }
+    if (key->write_enable) {
+        RTMP_EnableWrite(rtmp);
+    }
+    RTMP_SetCancel(rtmp, pool->cancel);
+    if (!RTMP_ConnectIdle(rtmp, NULL)) {
+        RTMP_Close(rtmp);
+        RTMP_Free(rtmp);
+        return NULL;
+    }
+    return rtmp;
+}
+
+static void pool_drop(struct rtmp_pool_conn *conn)
+{
+    RTMP_Close((RTMP *)conn->rtmp);
+    RTMP_Free((RTMP *)conn->rtmp);
+    free(conn);
+}
+
+// Handles whatever the server sent and pings when due. Runs unlocked,
+// returns -1 when the connection should be dropped.
+static int pool_check(struct rtmp_pool *pool, struct rtmp_pool_conn *conn)
+{
+    RTMP *rtmp = (RTMP *)conn->rtmp;
+    int64_t now = monotonic_ms();
+
+    // a server that stops mid message must not hold up the other connections
+    RTMP_SetDeadline(rtmp, RTMP_POOL_READ_MS);
+    while (RTMP_IsConnected(rtmp)) {
+        struct pollfd pfd;
+        pfd.fd = RTMP_Socket(rtmp);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (rtmp->m_sb.sb_size <= 0 && poll(&pfd, 1, 0) <= 0) {
+            break;
+        }
+        RTMPPacket packet;
+        memset(&packet, 0, sizeof(packet));
+        if (!RTMP_ReadPacket(rtmp, &packet)) {
+            break;
+        }
+        if (!RTMPPacket_IsReady(&packet)) {
+            continue;
+        }
+        if (packet.m_packetType == RTMP_PACKET_TYPE_CONTROL && packet.m_nBodySize >= 6
+                && AMF_DecodeInt16(packet.m_body) == 7) {
+            conn->ping_sent = 0;
+            conn->last_pong = now;
+        }
+        RTMP_ClientPacket(rtmp, &packet);
+        RTMPPacket_Free(&packet);
+    }
+    int stalled = RTMP_IsTimedout(rtmp);
+    RTMP_SetDeadline(rtmp, 0);
+
+    if (stalled) {
+        log_print(TAG, "idle connection stalled in a message\n");
+        return -1;
+    }
+    if (!RTMP_IsConnected(rtmp)) {
+        log_print(TAG, "idle connection closed by server\n");
+        return -1;
+    }
+    if (conn->ping_sent && now - conn->ping_sent > pool->para.ping_timeout_ms) {
+        log_print(TAG, "idle connection missed its pong\n");
+        return -1;
+    }
+    if (pool->para.max_idle_ms && now - conn->born > pool->para.max_idle_ms) {
+        return -1;
+    }
+    if (!conn->ping_sent && now - conn->last_pong >= pool->para.ping_interval_ms) {
+        if (!RTMP_SendCtrl(rtmp, 6, (uint32_t)now, 0)) {
+            return -1;
+        }
+        conn->ping_sent = now;
+    }
+    return 0;
+}
+
+// called locked, unlocks around network work
+static void pool_refill(struct rtmp_pool *pool, struct rtmp_pool_key *key)
+{
+    int count = 0;
+    struct rtmp_pool_conn *conn;
+
+    for (conn = key->idle; conn; conn = conn->next) {
+        count++;
+    }
+    while (!pool->quit && count + key->opening < pool->para.idle_per_key
+            && monotonic_ms() >= key->retry_at) {
+        key->opening++;
+        pthread_mutex_unlock(&pool->lock);
+        int64_t start = monotonic_ms();
+        RTMP *rtmp = pool_connect(pool, key);
+        conn = rtmp ? (struct rtmp_pool_conn *)calloc(1, sizeof(struct rtmp_pool_conn)) : NULL;
+        if (rtmp && !conn) {
+            RTMP_Close(rtmp);
+            RTMP_Free(rtmp);
+        }
+        pthread_mutex_lock(&pool->lock);
+        key->opening--;
+        if (!conn) {
+            log_print(TAG, "warm up of %s failed\n", key->id);
+            key->retry_at = monotonic_ms() + RTMP_POOL_RETRY_DELAY;
+            break;
+        }
+        conn->rtmp = rtmp;
+        conn->born = monotonic_ms();
+        conn->last_pong = conn->born;
+        conn->round = pool->round;
+        conn->next = key->idle;
+        key->idle = conn;
+        count++;
+        log_print(TAG, "warmed %s in %d ms\n", key->id, (int)(conn->born - start));
+    }
+}
+
+// called locked, each connection is checked unlocked while marked busy
+static void pool_check_key(struct rtmp_pool *pool, struct rtmp_pool_key *key)
+{
+    while (!pool->quit) {
+        struct rtmp_pool_conn *conn, **link;
+        for (link = &key->idle; *link; link = &(*link)->next) {
+            if (!(*link)->busy && (*link)->round != pool->round) {
+                break;
+            }
+        }
+        if (!*link) {
+            break;
+        }
+        conn = *link;
+        conn->busy = 1;
+        conn->round = pool->round;
+        pthread_mutex_unlock(&pool->lock);
+        int ret = pool_check(pool, conn);
+        pthread_mutex_lock(&pool->lock);
+        conn->busy = 0;
+        if (ret < 0) {
+            // claims never take busy entries, it is still listed
+            for (link = &key->idle; *link != conn; link = &(*link)->next) {
+            }
+            *link = conn->next;
+            pool_drop(conn);
+        }
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    struct rtmp_pool *pool = (struct rtmp_pool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        pool->round++;
+        // keys are only ever prepended, the list stays walkable while unlocked
+        for (struct rtmp_pool_key *key = pool->keys; key && !pool->quit; key = key->next) {
+            pool_check_key(pool, key);
+            pool_refill(pool, key);
+        }
+        if (pool->quit) {
+            break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += RTMP_POOL_TICK * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct rtmp_pool *rtmp_pool_create(struct rtmp_pool_para *para)
+{
+    struct rtmp_pool *pool = (struct rtmp_pool *)calloc(1, sizeof(struct rtmp_pool));
+    if (!pool) {
+        return NULL;
+    }
+    memcpy(&pool->para, para, sizeof(struct rtmp_pool_para));
+    if (pool->para.idle_per_key <= 0) {
+        pool->para.idle_per_key = 1;
+    }
+    if (pool->para.ping_interval_ms <= 0) {
+        pool->para.ping_interval_ms = RTMP_POOL_PING_INTERVAL;
+    }
+    if (pool->para.ping_timeout_ms <= 0) {
+        pool->para.ping_timeout_ms = RTMP_POOL_PING_TIMEOUT;
+    }
+    pool->cancel = RTMP_CancelAlloc();
+    if (!pool->cancel) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    if (pthread_create(&pool->worker, NULL, pool_worker, pool) != 0) {
+        log_print(TAG, "worker thread failed\n");
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+        RTMP_CancelFree(pool->cancel);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int rtmp_pool_add(struct rtmp_pool *pool, const char *uri, int write_enable)
+{
+    char id[512];
+    if (strlen(uri) >= sizeof(pool->keys->uri) || pool_key_id(uri, write_enable, id, sizeof(id)) < 0) {
+        log_print(TAG, "bad url %s\n", uri);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    struct rtmp_pool_key *key;
+    for (key = pool->keys; key; key = key->next) {
+        if (!strcmp(key->id, id)) {
+            break;
+        }
+    }
+    if (!key) {
+        key = (struct rtmp_pool_key *)calloc(1, sizeof(struct rtmp_pool_key));
+        if (!key) {
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
+        }
+        strcpy(key->uri, uri);
+        strcpy(key->id, id);
+        key->write_enable = write_enable;
+        key->next = pool->keys;
+        pool->keys = key;
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void *rtmp_pool_claim(struct rtmp_pool *pool, const char *uri, int write_enable)
+{
+    char id[512];
+    RTMP *rtmp = NULL;
+
+    if (pool_key_id(uri, write_enable, id, sizeof(id)) < 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    for (struct rtmp_pool_key *key = pool->keys; key && !rtmp; key = key->next) {
+        if (strcmp(key->id, id)) {
+            continue;
+        }
+        for (struct rtmp_pool_conn **link = &key->idle; *link; link = &(*link)->next) {
+            struct rtmp_pool_conn *conn = *link;
+            if (conn->busy || !RTMP_IsConnected((RTMP *)conn->rtmp)) {
+                continue;
+            }
+            *link = conn->next;
+            rtmp = (RTMP *)conn->rtmp;
+            free(conn);
+            // warm up the replacement now
+            pthread_cond_signal(&pool->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (rtmp) {
+        RTMP_SetCancel(rtmp, NULL);
+    }
+    return rtmp;
+}
+
+void rtmp_pool_destroy(struct rtmp_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    RTMP_Cancel(pool->cancel);
+    pthread_join(pool->worker, NULL);
+
+    while (pool->keys) {
+        struct rtmp_pool_key *key = pool->keys;
+        pool->keys = key->next;
+        while (key->idle) {
+            struct rtmp_pool_conn *conn = key->idle;
+            key->idle = conn->next;
+            pool_drop(conn);
+        }
+        free(key);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    RTMP_CancelFree(pool->cancel);
+    free(pool);
+}
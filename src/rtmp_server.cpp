@@ -0,0 +1,2134 @@
+/*
+ * =====================================================================================
+ *
+ *    Filename   :  rtmp_server.cpp
+ *    Description:  embeddable rtmp ingest/relay server
+ *    Version    :  1.0
+ *    Revision   :  none
+ *    Compiler   :  gcc
+ *    Company    :  dt
+ *
+ * =====================================================================================
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "rtmp_server_api.h"
+#include "flvmux_api.h"
+#include "dvr_ring.h"
+#include "rtmp.h"
+
+#include "log_print.h"
+#define TAG "RTMP_SERVER"
+
+#define SRV_SIG_SIZE 1536
+#define SRV_IN_SIZE (64 * 1024) // read buffer, grows for larger chunks
+#define SRV_READ_ROUNDS 4       // reads per wakeup before other connections get a turn
+#define SRV_ACCEPT_BURST 16
+#define SRV_EVENTS 64
+#define SRV_IOV_MAX 64
+#define SRV_SWEEP 1000          // ms between timeout checks
+#define SRV_WINDOW 2500000      // window ack size and peer bandwidth announced on connect
+#define SRV_MSG_VARIANTS 4      // chunkings shared per message, players mostly agree on one
+#define SRV_DVR_TICK 40         // ms between feeds of time shifted players
+#define SRV_DVR_LEAD 3000       // ms time shifted players are sent ahead of real time
+#define SRV_DVR_BURST 256       // tags per player and feed
+#define SRV_HTTP_HEAD 8192      // longest http request head we read
+#define SRV_MSG_MAX (8 << 20)   // longest message a peer may send
+#define SRV_CHAN_MAX 32         // chunk streams a peer may use at once
+#define SRV_CHAN_BYTES (16 << 20) // message bodies buffered per connection
+
+// chunk stream ids of what we send
+#define SRV_CSID_CTRL  2
+#define SRV_CSID_CMD   3
+#define SRV_CSID_AUDIO 4
+#define SRV_CSID_DATA  5
+#define SRV_CSID_VIDEO 6
+
+enum {
+    CONN_C0C1 = 0,
+    CONN_C2,
+    CONN_OPEN,
+    CONN_HTTP,     // http-flv, reading the request
+    CONN_HTTP_FLV, // answered, tags follow as chunks
+};
+
+// message bytes shared by reference
+struct srv_buf {
+    volatile int refs;
+    uint32_t size;
+    uint8_t *data; // right behind the struct
+};
+
+struct srv_out {
+    struct srv_buf *buf;
+    uint32_t off;
+    uint32_t end; // part of buf to send
+    struct srv_out *next;
+};
+
+// inbound chunk stream
+struct srv_chan {
+    uint32_t csid;
+    uint32_t ts;
+    uint32_t delta;
+    uint32_t len;
+    uint32_t msid;
+    uint8_t type;
+    int ext;       // timestamp field was 0xffffff, every chunk carries the 4 byte value
+    uint8_t *body;
+    uint32_t body_size;
+    uint32_t got;  // bytes of the current message, 0 - between messages
+};
+
+// one relayed message, chunked once per chunk size and stream id in use
+struct srv_msg {
+    int type;
+    uint32_t ts;
+    const uint8_t *body;
+    uint32_t len;
+    int flags;
+    struct {
+        uint32_t chunk;
+        uint32_t msid;
+        struct srv_buf *buf;
+        int players;
+    } variants[SRV_MSG_VARIANTS];
+    int variant_count;
+    struct srv_buf *body_buf; // body by reference, for the gop cache and http players
+    struct srv_buf *flv;      // http chunk size line and tag header, then tag size and chunk end
+    uint32_t flv_head;
+};
+
+// a message since the last keyframe, replayed to players joining
+struct srv_gop_entry {
+    int type;
+    uint32_t ts;
+    int flags;
+    struct srv_buf *body;
+    struct srv_buf *chunked; // as most players got it, NULL when nobody watched
+    uint32_t chunk;
+    uint32_t msid;
+    struct srv_gop_entry *next;
+};
+
+struct srv_conn {
+    int fd;
+    struct rtmp_server_worker *worker; // owner, the only one reading or closing
+    struct srv_conn *prev;
+    struct srv_conn *next;
+    int state;
+    int64_t deadline;  // ms, handshake and connect must be done, 0 - done
+    int64_t last_recv;
+
+    uint8_t *in;
+    uint32_t in_off;
+    uint32_t in_len;
+    uint32_t in_size;
+    struct srv_chan *chans; // in order of first use, not indexed by csid
+    uint32_t chan_count;
+    uint32_t chan_bytes;    // sum of their body_size
+    uint32_t in_chunk;
+    uint32_t in_bytes;
+    uint32_t in_acked;
+    uint32_t in_window; // client asked for acknowledgements every in_window bytes
+
+    // output, any worker may write to a player, everything below under lock
+    pthread_mutex_t lock;
+    struct srv_out *out_head;
+    struct srv_out *out_tail;
+    uint32_t out_bytes;
+    uint32_t out_chunk;
+    int64_t stalled_at; // ms output has been pending since, 0 - drained
+    int epollout;
+    int dead;           // write failed, the owner closes it
+    int wait_key;       // player skips video until a keyframe
+
+    // time shifted player, owner only; dvr is set under the stream lock
+    struct dvr_ring *dvr; // reads here instead of getting the live tags
+    uint64_t dvr_pos;
+    int dvr_lost;         // needs a keyframe at or before dvr_seek first
+    uint32_t dvr_seek;
+    uint32_t dvr_base_ts; // paced at real time from this tag on
+    int64_t dvr_base_ms;
+
+    char app[256];
+    uint32_t last_msid; // handed out by createStream
+    struct rtmp_server_stream *stream;
+    uint32_t msid;      // of the publish or play
+    int publishing;
+    int http;           // http-flv player, gets flv tags instead of rtmp messages
+    struct srv_conn *next_player;
+};
+
+struct rtmp_server_worker {
+    struct rtmp_server *server;
+    pthread_t thread;
+    int epfd;
+    int wake_fd;
+    struct srv_conn *conns;
+    int dvr_players;
+};
+
+struct rtmp_server_stream {
+    char key[512];       // app/name
+    int refs;            // server lock
+    struct rtmp_server *server;
+    pthread_mutex_t lock;
+    struct srv_conn *publisher;
+    int pulling;         // origin pull thread running
+    RTMP *pull;          // its connection once established
+    struct srv_conn *players;
+    struct srv_buf *meta; // onMetaData body
+    struct srv_buf *vhdr; // sequence headers replayed to late joiners
+    struct srv_buf *ahdr;
+    uint32_t last_ts;
+    int has_video;
+    struct srv_gop_entry *gop_head; // starts at a keyframe, or audio of an audio only stream
+    struct srv_gop_entry *gop_tail;
+    uint32_t gop_bytes;
+    struct dvr_ring *dvr; // opened by the first publish, lives as long as the stream
+    struct rtmp_server_stream *next;
+};
+
+static const AVal av_connect = AVC("connect");
+static const AVal av_createStream = AVC("createStream");
+static const AVal av_releaseStream = AVC("releaseStream");
+static const AVal av_FCPublish = AVC("FCPublish");
+static const AVal av_FCUnpublish = AVC("FCUnpublish");
+static const AVal av_getStreamLength = AVC("getStreamLength");
+static const AVal av_publish = AVC("publish");
+static const AVal av_play = AVC("play");
+static const AVal av_seek = AVC("seek");
+static const AVal av_deleteStream = AVC("deleteStream");
+static const AVal av_closeStream = AVC("closeStream");
+static const AVal av_app = AVC("app");
+static const AVal av__result = AVC("_result");
+static const AVal av__error = AVC("_error");
+static const AVal av_onStatus = AVC("onStatus");
+static const AVal av_level = AVC("level");
+static const AVal av_code = AVC("code");
+static const AVal av_description = AVC("description");
+static const AVal av_status = AVC("status");
+static const AVal av_error = AVC("error");
+static const AVal av_fmsVer = AVC("fmsVer");
+static const AVal av_fmsVer_value = AVC("FMS/3,5,7,7009");
+static const AVal av_capabilities = AVC("capabilities");
+static const AVal av_mode = AVC("mode");
+static const AVal av_objectEncoding = AVC("objectEncoding");
+static const AVal av_setDataFrame = AVC("@setDataFrame");
+static const AVal av_onMetaData = AVC("onMetaData");
+static const AVal av_RtmpSampleAccess = AVC("|RtmpSampleAccess");
+
+static int64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct srv_buf *buf_alloc(uint32_t size)
+{
+    struct srv_buf *buf = (struct srv_buf *)malloc(sizeof(struct srv_buf) + size);
+    if (!buf) {
+        return NULL;
+    }
+    buf->refs = 1;
+    buf->size = size;
+    buf->data = (uint8_t *)(buf + 1);
+    return buf;
+}
+
+static struct srv_buf *buf_copy(const uint8_t *data, uint32_t size)
+{
+    struct srv_buf *buf = buf_alloc(size);
+    if (buf) {
+        memcpy(buf->data, data, size);
+    }
+    return buf;
+}
+
+static void buf_unref(struct srv_buf *buf)
+{
+    if (buf && __sync_sub_and_fetch(&buf->refs, 1) == 0) {
+        free(buf);
+    }
+}
+
+static struct srv_buf *buf_ref(struct srv_buf *buf)
+{
+    __sync_fetch_and_add(&buf->refs, 1);
+    return buf;
+}
+
+// One message as chunk stream bytes: a type 0 header, then type 3 continuations.
+// Type 0 only, so the bytes do not depend on what was sent before on csid.
+static struct srv_buf *chunk_message(int csid, int type, uint32_t msid, uint32_t ts,
+                                     const uint8_t *body, uint32_t len, uint32_t chunk)
+{
+    int ext = ts >= 0xffffff;
+    uint32_t chunks = len ? (len + chunk - 1) / chunk : 1;
+    struct srv_buf *buf = buf_alloc(12 + ext * 4 + len + (chunks - 1) * (1 + ext * 4));
+    if (!buf) {
+        return NULL;
+    }
+    char *p = (char *)buf->data;
+    char *end = p + buf->size;
+    *p++ = csid;
+    p = AMF_EncodeInt24(p, end, ext ? 0xffffff : ts);
+    p = AMF_EncodeInt24(p, end, len);
+    *p++ = type;
+    memcpy(p, &msid, 4); // little endian on every target we build for
+    p += 4;
+    if (ext) {
+        p = AMF_EncodeInt32(p, end, ts);
+    }
+    for (uint32_t off = 0; off < len; off += chunk) {
+        uint32_t n = len - off < chunk ? len - off : chunk;
+        if (off) {
+            *p++ = 0xc0 | csid;
+            if (ext) {
+                p = AMF_EncodeInt32(p, end, ts);
+            }
+        }
+        memcpy(p, body + off, n);
+        p += n;
+    }
+    return buf;
+}
+
+static void msg_init(struct srv_msg *msg, int type, uint32_t ts, const uint8_t *body, uint32_t len, int flags)
+{
+    msg->type = type;
+    msg->ts = ts;
+    msg->body = body;
+    msg->len = len;
+    msg->flags = flags;
+    msg->variant_count = 0;
+    msg->body_buf = NULL;
+    msg->flv = NULL;
+}
+
+// buf as the first player with this chunk size and stream id got it
+static void msg_add_variant(struct srv_msg *msg, uint32_t chunk, uint32_t msid, struct srv_buf *buf)
+{
+    if (msg->variant_count < SRV_MSG_VARIANTS) {
+        msg->variants[msg->variant_count].chunk = chunk;
+        msg->variants[msg->variant_count].msid = msid;
+        msg->variants[msg->variant_count].buf = buf_ref(buf);
+        msg->variants[msg->variant_count].players = 1;
+        msg->variant_count++;
+    }
+}
+
+// The chunked bytes of msg for one player, serialized by the first player
+// with this chunk size and stream id and shared with the rest.
+static struct srv_buf *msg_chunks(struct srv_msg *msg, uint32_t chunk, uint32_t msid)
+{
+    for (int i = 0; i < msg->variant_count; i++) {
+        if (msg->variants[i].chunk == chunk && msg->variants[i].msid == msid) {
+            msg->variants[i].players++;
+            return buf_ref(msg->variants[i].buf);
+        }
+    }
+    int csid = msg->type == RTMP_PACKET_TYPE_AUDIO ? SRV_CSID_AUDIO
+               : msg->type == RTMP_PACKET_TYPE_VIDEO ? SRV_CSID_VIDEO : SRV_CSID_DATA;
+    struct srv_buf *buf = chunk_message(csid, msg->type, msid, msg->ts, msg->body, msg->len, chunk);
+    if (buf) {
+        msg_add_variant(msg, chunk, msid, buf);
+    }
+    return buf;
+}
+
+// The body as a buffer others may keep, copied once when it is first needed
+static struct srv_buf *msg_body(struct srv_msg *msg)
+{
+    if (!msg->body_buf) {
+        msg->body_buf = buf_copy(msg->body, msg->len);
+    }
+    return msg->body_buf;
+}
+
+// What http players send around the body: the chunk size line and the flv
+// tag header, then the previous tag size and the chunk end
+static struct srv_buf *msg_flv(struct srv_msg *msg)
+{
+    if (!msg->flv) {
+        char line[16];
+        uint32_t tag_size = FLV_TAG_HEAD_LEN + msg->len;
+        int n = snprintf(line, sizeof(line), "%x\r\n", tag_size + FLV_PRE_TAG_LEN);
+        msg->flv = buf_alloc(n + FLV_TAG_HEAD_LEN + FLV_PRE_TAG_LEN + 2);
+        if (!msg->flv) {
+            return NULL;
+        }
+        char *p = (char *)msg->flv->data;
+        char *end = p + msg->flv->size;
+        memcpy(p, line, n);
+        p += n;
+        *p++ = msg->type;
+        p = AMF_EncodeInt24(p, end, msg->len);
+        p = AMF_EncodeInt24(p, end, msg->ts & 0xffffff);
+        *p++ = msg->ts >> 24;
+        p = AMF_EncodeInt24(p, end, 0);
+        msg->flv_head = n + FLV_TAG_HEAD_LEN;
+        p = AMF_EncodeInt32(p, end, tag_size);
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    return msg->flv;
+}
+
+static void msg_release(struct srv_msg *msg)
+{
+    for (int i = 0; i < msg->variant_count; i++) {
+        buf_unref(msg->variants[i].buf);
+    }
+    msg->variant_count = 0;
+    buf_unref(msg->body_buf);
+    buf_unref(msg->flv);
+    msg->body_buf = msg->flv = NULL;
+}
+
+// called locked
+static int conn_flush(struct srv_conn *conn)
+{
+    while (conn->out_head) {
+        struct iovec iov[SRV_IOV_MAX];
+        int n = 0;
+        for (struct srv_out *o = conn->out_head; o && n < SRV_IOV_MAX; o = o->next, n++) {
+            iov[n].iov_base = o->buf->data + o->off;
+            iov[n].iov_len = o->end - o->off;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            // the owner sees the hangup and closes
+            conn->dead = 1;
+            shutdown(conn->fd, SHUT_RDWR);
+            return -1;
+        }
+        conn->out_bytes -= ret;
+        while (ret > 0) {
+            struct srv_out *o = conn->out_head;
+            uint32_t left = o->end - o->off;
+            if ((uint32_t)ret < left) {
+                o->off += ret;
+                break;
+            }
+            ret -= left;
+            conn->out_head = o->next;
+            buf_unref(o->buf);
+            free(o);
+        }
+        if (!conn->out_head) {
+            conn->out_tail = NULL;
+        }
+    }
+
+    int pending = conn->out_head != NULL;
+    if (pending != conn->epollout) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        if (pending) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.ptr = conn;
+        epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->epollout = pending;
+    }
+    if (!pending) {
+        conn->stalled_at = 0;
+    } else if (!conn->stalled_at) {
+        conn->stalled_at = monotonic_ms();
+    }
+    return 0;
+}
+
+// called locked, takes over the reference
+static int conn_queue_range(struct srv_conn *conn, struct srv_buf *buf, uint32_t off, uint32_t end)
+{
+    struct srv_out *o = (struct srv_out *)malloc(sizeof(struct srv_out));
+    if (!o) {
+        buf_unref(buf);
+        return -1;
+    }
+    o->buf = buf;
+    o->off = off;
+    o->end = end;
+    o->next = NULL;
+    if (conn->out_tail) {
+        conn->out_tail->next = o;
+    } else {
+        conn->out_head = o;
+    }
+    conn->out_tail = o;
+    conn->out_bytes += end - off;
+    return 0;
+}
+
+static int conn_queue(struct srv_conn *conn, struct srv_buf *buf)
+{
+    return conn_queue_range(conn, buf, 0, buf->size);
+}
+
+// called locked, msg as an http chunk holding one flv tag. The body is
+// queued by reference, the same bytes for every http player and the gop cache
+static int conn_queue_flv(struct srv_conn *conn, struct srv_msg *msg)
+{
+    struct srv_buf *body = msg_body(msg);
+    struct srv_buf *flv = msg_flv(msg);
+    if (!body || !flv) {
+        return -1;
+    }
+    if (conn_queue_range(conn, buf_ref(flv), 0, msg->flv_head) < 0
+            || (body->size && conn_queue(conn, buf_ref(body)) < 0)) {
+        return -1;
+    }
+    return conn_queue_range(conn, buf_ref(flv), msg->flv_head, flv->size);
+}
+
+static int conn_send(struct srv_conn *conn, int csid, int type, uint32_t msid, uint32_t ts,
+                     const uint8_t *body, uint32_t len)
+{
+    int ret = -1;
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->dead) {
+        struct srv_buf *buf = chunk_message(csid, type, msid, ts, body, len, conn->out_chunk);
+        if (buf && conn_queue(conn, buf) == 0) {
+            ret = conn_flush(conn);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return ret;
+}
+
+static int send_uint32(struct srv_conn *conn, int type, uint32_t val)
+{
+    char body[4];
+    AMF_EncodeInt32(body, body + 4, val);
+    return conn_send(conn, SRV_CSID_CTRL, type, 0, 0, (uint8_t *)body, 4);
+}
+
+static int send_user_control(struct srv_conn *conn, int event, uint32_t val)
+{
+    char body[6];
+    AMF_EncodeInt16(body, body + 2, event);
+    AMF_EncodeInt32(body + 2, body + 6, val);
+    return conn_send(conn, SRV_CSID_CTRL, RTMP_PACKET_TYPE_CONTROL, 0, 0, (uint8_t *)body, 6);
+}
+
+static int send_amf(struct srv_conn *conn, int csid, int type, uint32_t msid, uint32_t ts, AMFBuilder *b)
+{
+    int ret = -1;
+    if (!b->ab_err) {
+        ret = conn_send(conn, csid, type, msid, ts, (uint8_t *)AMFBuilder_Data(b), b->ab_len);
+    }
+    AMFBuilder_Free(b);
+    return ret;
+}
+
+static int send_status(struct srv_conn *conn, uint32_t msid, int error, const char *code, const char *desc)
+{
+    char pbuf[512];
+    AMFBuilder b;
+    AVal av_code_value = { (char *)code, (int)strlen(code) };
+    AVal av_desc_value = { (char *)desc, (int)strlen(desc) };
+
+    AMFBuilder_Init(&b, pbuf, sizeof(pbuf), 0);
+    AMFBuilder_String(&b, &av_onStatus);
+    AMFBuilder_Number(&b, 0);
+    AMFBuilder_Marker(&b, AMF_NULL);
+    AMFBuilder_Marker(&b, AMF_OBJECT);
+    AMFBuilder_NamedString(&b, &av_level, error ? &av_error : &av_status);
+    AMFBuilder_NamedString(&b, &av_code, &av_code_value);
+    AMFBuilder_NamedString(&b, &av_description, &av_desc_value);
+    AMFBuilder_ObjectEnd(&b);
+    return send_amf(conn, SRV_CSID_CMD, RTMP_PACKET_TYPE_INVOKE, msid, 0, &b);
+}
+
+// _result for the commands that only want an answer
+static int send_result(struct srv_conn *conn, double txn, int has_value, double value)
+{
+    char pbuf[128];
+    AMFBuilder b;
+    AMFBuilder_Init(&b, pbuf, sizeof(pbuf), 0);
+    AMFBuilder_String(&b, &av__result);
+    AMFBuilder_Number(&b, txn);
+    AMFBuilder_Marker(&b, AMF_NULL);
+    if (has_value) {
+        AMFBuilder_Number(&b, value);
+    } else {
+        AMFBuilder_Marker(&b, AMF_UNDEFINED);
+    }
+    return send_amf(conn, SRV_CSID_CMD, RTMP_PACKET_TYPE_INVOKE, 0, 0, &b);
+}
+
+static int send_connect_result(struct srv_conn *conn, double txn, double encoding)
+{
+    char pbuf[512];
+    AMFBuilder b;
+    AVal av_success = AVC("NetConnection.Connect.Success");
+    AVal av_succeeded = AVC("Connection succeeded.");
+
+    AMFBuilder_Init(&b, pbuf, sizeof(pbuf), 0);
+    AMFBuilder_String(&b, &av__result);
+    AMFBuilder_Number(&b, txn);
+    AMFBuilder_Marker(&b, AMF_OBJECT);
+    AMFBuilder_NamedString(&b, &av_fmsVer, &av_fmsVer_value);
+    AMFBuilder_NamedNumber(&b, &av_capabilities, 31);
+    AMFBuilder_NamedNumber(&b, &av_mode, 1);
+    AMFBuilder_ObjectEnd(&b);
+    AMFBuilder_Marker(&b, AMF_OBJECT);
+    AMFBuilder_NamedString(&b, &av_level, &av_status);
+    AMFBuilder_NamedString(&b, &av_code, &av_success);
+    AMFBuilder_NamedString(&b, &av_description, &av_succeeded);
+    AMFBuilder_NamedNumber(&b, &av_objectEncoding, encoding);
+    AMFBuilder_ObjectEnd(&b);
+    return send_amf(conn, SRV_CSID_CMD, RTMP_PACKET_TYPE_INVOKE, 0, 0, &b);
+}
+
+static int send_error(struct srv_conn *conn, double txn)
+{
+    char pbuf[128];
+    AMFBuilder b;
+    AMFBuilder_Init(&b, pbuf, sizeof(pbuf), 0);
+    AMFBuilder_String(&b, &av__error);
+    AMFBuilder_Number(&b, txn);
+    AMFBuilder_Marker(&b, AMF_NULL);
+    AMFBuilder_Marker(&b, AMF_NULL);
+    return send_amf(conn, SRV_CSID_CMD, RTMP_PACKET_TYPE_INVOKE, 0, 0, &b);
+}
+
+static void gop_pop(struct rtmp_server_stream *stream)
+{
+    struct srv_gop_entry *entry = stream->gop_head;
+    stream->gop_head = entry->next;
+    if (!stream->gop_head) {
+        stream->gop_tail = NULL;
+    }
+    stream->gop_bytes -= entry->body->size;
+    buf_unref(entry->body);
+    if (entry->chunked) {
+        buf_unref(entry->chunked);
+    }
+    free(entry);
+}
+
+static void gop_clear(struct rtmp_server_stream *stream)
+{
+    while (stream->gop_head) {
+        gop_pop(stream);
+    }
+}
+
+static struct rtmp_server_stream *stream_get(struct rtmp_server *server, const char *key)
+{
+    struct rtmp_server_stream *stream;
+
+    pthread_mutex_lock(&server->lock);
+    for (stream = server->streams; stream; stream = stream->next) {
+        if (!strcmp(stream->key, key)) {
+            break;
+        }
+    }
+    if (!stream) {
+        stream = (struct rtmp_server_stream *)calloc(1, sizeof(struct rtmp_server_stream));
+        if (stream) {
+            snprintf(stream->key, sizeof(stream->key), "%s", key);
+            stream->server = server;
+            pthread_mutex_init(&stream->lock, NULL);
+            stream->next = server->streams;
+            server->streams = stream;
+        }
+    }
+    if (stream) {
+        stream->refs++;
+    }
+    pthread_mutex_unlock(&server->lock);
+    return stream;
+}
+
+static void stream_put(struct rtmp_server *server, struct rtmp_server_stream *stream)
+{
+    pthread_mutex_lock(&server->lock);
+    if (--stream->refs == 0) {
+        struct rtmp_server_stream **link = &server->streams;
+        while (*link != stream) {
+            link = &(*link)->next;
+        }
+        *link = stream->next;
+        buf_unref(stream->meta);
+        buf_unref(stream->vhdr);
+        buf_unref(stream->ahdr);
+        gop_clear(stream);
+        if (stream->dvr) {
+            dvr_ring_close(stream->dvr);
+        }
+        pthread_mutex_destroy(&stream->lock);
+        free(stream);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+// called with the stream locked
+static void player_media(struct rtmp_server *server, struct srv_conn *conn, struct srv_msg *msg)
+{
+    pthread_mutex_lock(&conn->lock);
+    if (conn->dead) {
+        pthread_mutex_unlock(&conn->lock);
+        return;
+    }
+    // metadata and sequence headers always go out, frames are dropped
+    // while the player lags and video restarts at a keyframe
+    if (!(msg->flags & FLVMUX_PKT_FLAG_HEADER) && msg->type != RTMP_PACKET_TYPE_INFO) {
+        if (conn->out_bytes > (uint32_t)server->para.max_queue) {
+            if (!conn->wait_key) {
+                log_print(TAG, "player on %s lags %u bytes, dropping to the next keyframe\n",
+                          conn->stream->key, conn->out_bytes);
+            }
+            conn->wait_key = 1;
+            pthread_mutex_unlock(&conn->lock);
+            return;
+        }
+        if (msg->type == RTMP_PACKET_TYPE_VIDEO && conn->wait_key) {
+            if (!(msg->flags & FLVMUX_PKT_FLAG_KEY)) {
+                pthread_mutex_unlock(&conn->lock);
+                return;
+            }
+            conn->wait_key = 0;
+        }
+    }
+    if (conn->http) {
+        if (conn_queue_flv(conn, msg) == 0) {
+            conn_flush(conn);
+        } else {
+            // a torn tag would end the stream anyway
+            conn->dead = 1;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    } else {
+        struct srv_buf *buf = msg_chunks(msg, conn->out_chunk, conn->msid);
+        if (buf && conn_queue(conn, buf) == 0) {
+            conn_flush(conn);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void stream_cache(struct srv_buf **slot, const uint8_t *body, uint32_t len)
+{
+    buf_unref(*slot);
+    *slot = buf_copy(body, len);
+}
+
+// called with the stream locked, after msg went out to the players
+static void gop_add(struct rtmp_server *server, struct rtmp_server_stream *stream, struct srv_msg *msg)
+{
+    if (server->para.gop_cache_size < 0 || msg->type == RTMP_PACKET_TYPE_INFO
+            || (msg->flags & (FLVMUX_PKT_FLAG_HEADER | FLVMUX_PKT_FLAG_OTHER))) {
+        return;
+    }
+    if (msg->type == RTMP_PACKET_TYPE_VIDEO) {
+        if (!stream->has_video || (msg->flags & FLVMUX_PKT_FLAG_KEY)) {
+            // a new gop, or the audio kept while the stream looked audio only
+            stream->has_video = 1;
+            gop_clear(stream);
+        }
+        if (!stream->gop_head && !(msg->flags & FLVMUX_PKT_FLAG_KEY)) {
+            return;
+        }
+    } else if (stream->has_video) {
+        if (!stream->gop_head) {
+            return;
+        }
+    } else {
+        if (!server->para.gop_audio_ms) {
+            return;
+        }
+        while (stream->gop_head && (int32_t)(msg->ts - stream->gop_head->ts) >= server->para.gop_audio_ms) {
+            gop_pop(stream);
+        }
+    }
+
+    struct srv_gop_entry *entry = (struct srv_gop_entry *)calloc(1, sizeof(struct srv_gop_entry));
+    struct srv_buf *body = msg_body(msg);
+    if (!entry || !body) {
+        free(entry);
+        gop_clear(stream);
+        return;
+    }
+    entry->body = buf_ref(body);
+    entry->type = msg->type;
+    entry->ts = msg->ts;
+    entry->flags = msg->flags;
+    if (msg->variant_count) {
+        int best = 0;
+        for (int i = 1; i < msg->variant_count; i++) {
+            if (msg->variants[i].players > msg->variants[best].players) {
+                best = i;
+            }
+        }
+        entry->chunked = buf_ref(msg->variants[best].buf);
+        entry->chunk = msg->variants[best].chunk;
+        entry->msid = msg->variants[best].msid;
+    }
+    if (stream->gop_tail) {
+        stream->gop_tail->next = entry;
+    } else {
+        stream->gop_head = entry;
+    }
+    stream->gop_tail = entry;
+    stream->gop_bytes += msg->len;
+
+    if (stream->gop_bytes > (uint32_t)server->para.gop_cache_size) {
+        if (stream->has_video) {
+            // without its keyframe the rest is of no use
+            log_print(TAG, "gop of %s exceeds %d bytes, not cached\n", stream->key, server->para.gop_cache_size);
+            gop_clear(stream);
+        } else {
+            while (stream->gop_bytes > (uint32_t)server->para.gop_cache_size) {
+                gop_pop(stream);
+            }
+        }
+    }
+}
+
+// One audio, video or data message from the publisher or the origin
+static void stream_message(struct rtmp_server *server, struct rtmp_server_stream *stream,
+                           int type, uint32_t ts, const uint8_t *body, uint32_t len)
+{
+    struct flvmux_packet pkt;
+    int flags = 0;
+
+    if (type == RTMP_PACKET_TYPE_FLASH_VIDEO) {
+        // aggregate, relayed as its tags
+        uint32_t pos = 0;
+        int32_t delta = 0;
+        while (pos + FLV_TAG_HEAD_LEN <= len) {
+            const uint8_t *tag = body + pos;
+            uint32_t size = AMF_DecodeInt24((char *)tag + 1);
+            uint32_t tag_ts = AMF_DecodeInt24((char *)tag + 4) | (tag[7] << 24);
+            if (pos + FLV_TAG_HEAD_LEN + size > len) {
+                break;
+            }
+            if (pos == 0) {
+                delta = (int32_t)(ts - tag_ts);
+            }
+            stream_message(server, stream, tag[0] & 0x1f, tag_ts + delta, tag + FLV_TAG_HEAD_LEN, size);
+            pos += FLV_TAG_HEAD_LEN + size + FLV_PRE_TAG_LEN;
+        }
+        return;
+    }
+    if (type != RTMP_PACKET_TYPE_AUDIO && type != RTMP_PACKET_TYPE_VIDEO && type != RTMP_PACKET_TYPE_INFO) {
+        return;
+    }
+    if (type != RTMP_PACKET_TYPE_INFO
+            && flvmux_parse_tag(type, (uint8_t *)body, len, ts, &pkt) == 0) {
+        flags = pkt.flags;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    if (type == RTMP_PACKET_TYPE_INFO) {
+        if (len >= 3 + (uint32_t)av_onMetaData.av_len && body[0] == AMF_STRING
+                && AMF_DecodeInt16((char *)body + 1) == av_onMetaData.av_len
+                && !memcmp(body + 3, av_onMetaData.av_val, av_onMetaData.av_len)) {
+            stream_cache(&stream->meta, body, len);
+        }
+    } else if (flags & FLVMUX_PKT_FLAG_HEADER) {
+        stream_cache(type == RTMP_PACKET_TYPE_VIDEO ? &stream->vhdr : &stream->ahdr, body, len);
+    }
+    stream->last_ts = ts;
+    struct srv_msg msg;
+    msg_init(&msg, type, ts, body, len, flags);
+    for (struct srv_conn *player = stream->players; player; player = player->next_player) {
+        if (!player->dvr) {
+            player_media(server, player, &msg);
+        }
+    }
+    gop_add(server, stream, &msg);
+    if (stream->dvr) {
+        // seeks land on video keyframes, or anywhere in audio only streams
+        int key = !(flags & FLVMUX_PKT_FLAG_HEADER)
+                  && (type == RTMP_PACKET_TYPE_VIDEO ? (flags & FLVMUX_PKT_FLAG_KEY) != 0
+                      : type == RTMP_PACKET_TYPE_AUDIO && !stream->vhdr);
+        dvr_ring_write(stream->dvr, type, ts, body, len, key);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    msg_release(&msg);
+}
+
+// called with the stream locked when the publisher or the origin goes away
+static void stream_unpublished(struct rtmp_server_stream *stream)
+{
+    buf_unref(stream->meta);
+    buf_unref(stream->vhdr);
+    buf_unref(stream->ahdr);
+    stream->meta = stream->vhdr = stream->ahdr = NULL;
+    gop_clear(stream);
+    stream->has_video = 0;
+    for (struct srv_conn *player = stream->players; player; player = player->next_player) {
+        if (!player->http) {
+            send_status(player, player->msid, 0, "NetStream.Play.UnpublishNotify", stream->key);
+        }
+        pthread_mutex_lock(&player->lock);
+        player->wait_key = 1;
+        pthread_mutex_unlock(&player->lock);
+    }
+}
+
+// called with the stream locked when a publisher or the origin starts
+static void stream_published(struct rtmp_server_stream *stream)
+{
+    struct rtmp_server *server = stream->server;
+    if (server->para.dvr_dir[0]) {
+        if (stream->dvr) {
+            dvr_ring_reset(stream->dvr);
+        } else {
+            stream->dvr = dvr_ring_open(server->para.dvr_dir, stream->key,
+                                        (uint64_t)server->para.dvr_size << 20, server->para.dvr_seconds);
+            if (!stream->dvr) {
+                log_print(TAG, "%s has no time shift\n", stream->key);
+            }
+        }
+    }
+    for (struct srv_conn *player = stream->players; player; player = player->next_player) {
+        if (!player->http) {
+            send_status(player, player->msid, 0, "NetStream.Play.PublishNotify", stream->key);
+        }
+    }
+}
+
+static void *stream_pull(void *arg)
+{
+    struct rtmp_server_stream *stream = (struct rtmp_server_stream *)arg;
+    struct rtmp_server *server = stream->server;
+    RTMPPacket packet;
+    char url[2048];
+    int ok = 0;
+
+    memset(&packet, 0, sizeof(packet));
+
+    // librtmp keeps pointers into url, it outlives the connection
+    snprintf(url, sizeof(url), "%s/%s live=1", server->para.origin, stream->key);
+    RTMP *rtmp = RTMP_Alloc();
+    if (rtmp) {
+        RTMP_Init(rtmp);
+        rtmp->Link.timeout = server->para.timeout_ms >= 2000 ? server->para.timeout_ms / 1000 : 1;
+        RTMP_SetCancel(rtmp, server->cancel);
+        ok = RTMP_SetupURL(rtmp, url) && RTMP_Connect(rtmp, NULL) && RTMP_ConnectStream(rtmp, 0);
+    }
+    pthread_mutex_lock(&stream->lock);
+    if (ok && stream->players) {
+        stream->pull = rtmp;
+        stream_published(stream);
+    } else {
+        ok = 0;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    log_print(TAG, ok ? "pulling %s from origin\n" : "origin pull of %s failed\n", stream->key);
+
+    while (ok && !server->quit) {
+        if (RTMP_GetNextMediaPacket(rtmp, &packet) != 1) {
+            break;
+        }
+        // stop with the last player
+        pthread_mutex_lock(&stream->lock);
+        int watched = stream->players != NULL;
+        pthread_mutex_unlock(&stream->lock);
+        if (!watched) {
+            break;
+        }
+        stream_message(server, stream, packet.m_packetType, packet.m_nTimeStamp,
+                       (uint8_t *)packet.m_body, packet.m_nBodySize);
+        RTMPPacket_Free(&packet);
+    }
+    RTMPPacket_Free(&packet);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->pull = NULL;
+    stream->pulling = 0;
+    if (ok) {
+        stream_unpublished(stream);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    if (rtmp) {
+        RTMP_Close(rtmp);
+        RTMP_Free(rtmp);
+    }
+    stream_put(server, stream);
+
+    pthread_mutex_lock(&server->lock);
+    server->pulls--;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+static void stream_start_pull(struct rtmp_server *server, struct rtmp_server_stream *stream)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_mutex_lock(&server->lock);
+    stream->refs++;
+    server->pulls++;
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, stream_pull, stream);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        log_print(TAG, "origin pull thread failed\n");
+        pthread_mutex_lock(&stream->lock);
+        stream->pulling = 0;
+        pthread_mutex_unlock(&stream->lock);
+        stream_put(server, stream);
+        pthread_mutex_lock(&server->lock);
+        server->pulls--;
+        pthread_cond_broadcast(&server->cond);
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+// publish name or play name -> app/name, the query string is not part of it
+static void stream_key(struct srv_conn *conn, const AVal *name, char *key, int size)
+{
+    int len = name->av_len;
+    const char *query = (const char *)memchr(name->av_val, '?', len);
+    if (query) {
+        len = query - name->av_val;
+    }
+    snprintf(key, size, "%s/%.*s", conn->app, len, name->av_val);
+}
+
+static void conn_leave(struct rtmp_server *server, struct srv_conn *conn)
+{
+    struct rtmp_server_stream *stream = conn->stream;
+    if (!stream) {
+        return;
+    }
+    pthread_mutex_lock(&stream->lock);
+    if (stream->publisher == conn) {
+        stream->publisher = NULL;
+        stream_unpublished(stream);
+        log_print(TAG, "%s unpublished\n", stream->key);
+    } else {
+        struct srv_conn **link = &stream->players;
+        while (*link && *link != conn) {
+            link = &(*link)->next_player;
+        }
+        if (*link) {
+            *link = conn->next_player;
+        }
+    }
+    if (conn->dvr) {
+        conn->dvr = NULL;
+        conn->worker->dvr_players--;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    conn->stream = NULL;
+    conn->next_player = NULL;
+    conn->publishing = 0;
+    stream_put(server, stream);
+}
+
+static int conn_publish(struct rtmp_server *server, struct srv_conn *conn, uint32_t msid, const AVal *name)
+{
+    char key[512];
+
+    if (conn->stream) {
+        return send_status(conn, msid, 1, "NetStream.Publish.BadName", "already busy");
+    }
+    stream_key(conn, name, key, sizeof(key));
+    struct rtmp_server_stream *stream = stream_get(server, key);
+    if (!stream) {
+        return -1;
+    }
+    pthread_mutex_lock(&stream->lock);
+    if (stream->publisher || stream->pulling) {
+        pthread_mutex_unlock(&stream->lock);
+        stream_put(server, stream);
+        log_print(TAG, "%s is already published\n", key);
+        return send_status(conn, msid, 1, "NetStream.Publish.BadName", key);
+    }
+    stream->publisher = conn;
+    conn->stream = stream;
+    conn->msid = msid;
+    conn->publishing = 1;
+    stream_published(stream);
+    pthread_mutex_unlock(&stream->lock);
+
+    log_print(TAG, "%s published\n", key);
+    return send_status(conn, msid, 0, "NetStream.Publish.Start", key);
+}
+
+// called with the stream locked, the decoder setup for a player starting at ts
+static void stream_headers(struct rtmp_server *server, struct rtmp_server_stream *stream,
+                           struct srv_conn *conn, uint32_t ts)
+{
+    struct srv_buf *cached[3] = { stream->meta, stream->vhdr, stream->ahdr };
+    int types[3] = { RTMP_PACKET_TYPE_INFO, RTMP_PACKET_TYPE_VIDEO, RTMP_PACKET_TYPE_AUDIO };
+    struct srv_msg msg;
+    for (int i = 0; i < 3; i++) {
+        if (cached[i]) {
+            msg_init(&msg, types[i], ts, cached[i]->data, cached[i]->size, FLVMUX_PKT_FLAG_HEADER);
+            msg.body_buf = buf_ref(cached[i]);
+            player_media(server, conn, &msg);
+            msg_release(&msg);
+        }
+    }
+}
+
+// called with the stream locked, the player leaves the live tags and reads
+// the ring from the keyframe at or before ts on. Audio and video still
+// queued for it are from the old position and go, but not a message half sent
+static void conn_dvr_start(struct srv_conn *conn, struct dvr_ring *ring, uint32_t ts)
+{
+    if (!conn->dvr) {
+        conn->worker->dvr_players++;
+    }
+    conn->dvr = ring;
+    conn->dvr_seek = ts;
+    conn->dvr_lost = 1;
+
+    pthread_mutex_lock(&conn->lock);
+    struct srv_out **link = &conn->out_head;
+    conn->out_tail = NULL;
+    while (*link) {
+        struct srv_out *o = *link;
+        int csid = o->buf->data[0] & 0x3f;
+        if (o->off == 0 && !conn->http && (csid == SRV_CSID_AUDIO || csid == SRV_CSID_VIDEO)) {
+            *link = o->next;
+            conn->out_bytes -= o->end - o->off;
+            buf_unref(o->buf);
+            free(o);
+            continue;
+        }
+        conn->out_tail = o;
+        link = &o->next;
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// called with the stream locked, a time shifted player that caught up with
+// the ring head gets the live tags from the next one on
+static void conn_dvr_stop(struct srv_conn *conn)
+{
+    conn->dvr = NULL;
+    conn->worker->dvr_players--;
+    pthread_mutex_lock(&conn->lock);
+    conn->wait_key = 0;
+    pthread_mutex_unlock(&conn->lock);
+    log_print(TAG, "player on %s is live again\n", conn->stream->key);
+}
+
+// Sends a time shifted player what is due: tags up to SRV_DVR_LEAD ahead of
+// real time, copied from the ring straight into its chunks. While its queue
+// is long the ring waits, a player that falls out of it restarts at the oldest keyframe.
+static void conn_dvr_feed(struct rtmp_server *server, struct srv_conn *conn, int64_t now)
+{
+    struct dvr_ring *ring = conn->dvr;
+    struct dvr_tag tag;
+    uint32_t window = server->para.dvr_seconds * 1000;
+
+    pthread_mutex_lock(&conn->lock);
+    int full = conn->dead || conn->out_bytes > (uint32_t)server->para.max_queue / 4;
+    pthread_mutex_unlock(&conn->lock);
+    if (full) {
+        return;
+    }
+    for (int n = 0; n < SRV_DVR_BURST; n++) {
+        if (conn->dvr_lost) {
+            uint32_t key_ts;
+            if (dvr_ring_seek(ring, conn->dvr_seek, window, &conn->dvr_pos, &key_ts) < 0) {
+                break;
+            }
+            conn->dvr_lost = 0;
+            conn->dvr_base_ts = key_ts;
+            conn->dvr_base_ms = now;
+            pthread_mutex_lock(&conn->stream->lock);
+            stream_headers(server, conn->stream, conn, key_ts);
+            pthread_mutex_unlock(&conn->stream->lock);
+        }
+        int ret = dvr_ring_peek(ring, conn->dvr_pos, &tag);
+        if (ret == 0) {
+            // the ring is written under the stream lock right after the live
+            // fan-out, still at the head there means no live tag is missed
+            pthread_mutex_lock(&conn->stream->lock);
+            if (dvr_ring_peek(ring, conn->dvr_pos, &tag) == 0) {
+                conn_dvr_stop(conn);
+            }
+            pthread_mutex_unlock(&conn->stream->lock);
+            break;
+        }
+        if (ret > 0 && (int32_t)(tag.ts - conn->dvr_base_ts) > now - conn->dvr_base_ms + SRV_DVR_LEAD) {
+            break;
+        }
+        struct srv_buf *buf = NULL;
+        if (ret > 0) {
+            int csid = tag.type == RTMP_PACKET_TYPE_AUDIO ? SRV_CSID_AUDIO
+                       : tag.type == RTMP_PACKET_TYPE_VIDEO ? SRV_CSID_VIDEO : SRV_CSID_DATA;
+            buf = chunk_message(csid, tag.type, conn->msid, tag.ts, tag.body, tag.len, conn->out_chunk);
+        }
+        if (ret < 0 || dvr_ring_check(ring, conn->dvr_pos) < 0) {
+            log_print(TAG, "player on %s fell out of the time shift window\n", conn->stream->key);
+            buf_unref(buf);
+            conn->dvr_seek = 0;
+            conn->dvr_lost = 1;
+            continue;
+        }
+        conn->dvr_pos = tag.next;
+        if (!buf) {
+            break;
+        }
+        pthread_mutex_lock(&conn->lock);
+        conn_queue(conn, buf);
+        pthread_mutex_unlock(&conn->lock);
+    }
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->dead) {
+        conn_flush(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// The player takes over the stream reference and gets what it needs to start
+static void stream_join(struct rtmp_server *server, struct rtmp_server_stream *stream,
+                        struct srv_conn *conn, uint32_t msid, double start)
+{
+    pthread_mutex_lock(&stream->lock);
+    conn->stream = stream;
+    conn->msid = msid;
+    conn->wait_key = 1;
+    conn->next_player = stream->players;
+    stream->players = conn;
+    // start > 0 asks for a position in the stream, the ring has the recent ones.
+    // 0 is what librtmp sends when it is not told live, that stays live
+    int shifted = start > 0 && stream->dvr;
+    if (shifted) {
+        conn_dvr_start(conn, stream->dvr, (uint32_t)start);
+    }
+    // a late joiner gets the decoder setup and the current gop in a burst,
+    // it can start decoding at once instead of waiting for the next keyframe
+    if (!shifted) {
+        stream_headers(server, stream, conn, stream->gop_head ? stream->gop_head->ts : stream->last_ts);
+    }
+    struct srv_msg msg;
+    int burst = 0;
+    for (struct srv_gop_entry *entry = shifted ? NULL : stream->gop_head; entry; entry = entry->next, burst++) {
+        msg_init(&msg, entry->type, entry->ts, entry->body->data, entry->body->size, entry->flags);
+        msg.body_buf = buf_ref(entry->body);
+        if (entry->chunked) {
+            msg_add_variant(&msg, entry->chunk, entry->msid, entry->chunked);
+        }
+        player_media(server, conn, &msg);
+        msg_release(&msg);
+    }
+    int pull = !stream->publisher && !stream->pulling && server->para.origin[0];
+    if (pull) {
+        stream->pulling = 1;
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    if (shifted) {
+        log_print(TAG, "%s played from %u ms\n", stream->key, (uint32_t)start);
+    } else {
+        log_print(TAG, "%s played%s, %d cached tags\n", stream->key, conn->http ? " over http" : "", burst);
+    }
+    if (pull) {
+        stream_start_pull(server, stream);
+    }
+}
+
+static int conn_play(struct rtmp_server *server, struct srv_conn *conn, uint32_t msid, const AVal *name, double start)
+{
+    char key[512];
+    char pbuf[64];
+    AMFBuilder b;
+
+    if (conn->stream) {
+        return send_status(conn, msid, 1, "NetStream.Play.Failed", "already busy");
+    }
+    stream_key(conn, name, key, sizeof(key));
+    struct rtmp_server_stream *stream = stream_get(server, key);
+    if (!stream) {
+        return -1;
+    }
+
+    send_user_control(conn, 0, msid); // StreamBegin
+    send_status(conn, msid, 0, "NetStream.Play.Reset", key);
+    send_status(conn, msid, 0, "NetStream.Play.Start", key);
+    AMFBuilder_Init(&b, pbuf, sizeof(pbuf), 0);
+    AMFBuilder_String(&b, &av_RtmpSampleAccess);
+    AMFBuilder_Boolean(&b, 1);
+    AMFBuilder_Boolean(&b, 1);
+    send_amf(conn, SRV_CSID_DATA, RTMP_PACKET_TYPE_INFO, msid, 0, &b);
+
+    stream_join(server, stream, conn, msid, start);
+    return 0;
+}
+
+// seek of the playing stream, served from the ring like a play with start.
+// librtmp sends it on stream 0, the answers go to the played stream
+static int conn_seek(struct srv_conn *conn, double ms)
+{
+    struct rtmp_server_stream *stream = conn->stream;
+    struct dvr_ring *ring = NULL;
+    uint32_t msid = conn->msid;
+
+    if (!stream || conn->publishing) {
+        return send_status(conn, msid, 1, "NetStream.Seek.Failed", "not playing");
+    }
+    pthread_mutex_lock(&stream->lock);
+    ring = stream->dvr;
+    if (ring) {
+        conn_dvr_start(conn, ring, ms > 0 ? (uint32_t)ms : 0);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    if (!ring) {
+        return send_status(conn, msid, 1, "NetStream.Seek.Failed", "no time shift");
+    }
+    log_print(TAG, "%s seeked to %u ms\n", stream->key, ms > 0 ? (uint32_t)ms : 0);
+    send_user_control(conn, 0, msid); // StreamBegin
+    send_status(conn, msid, 0, "NetStream.Seek.Notify", stream->key);
+    return send_status(conn, msid, 0, "NetStream.Play.Start", stream->key);
+}
+
+static int conn_invoke(struct rtmp_server *server, struct srv_conn *conn, uint32_t msid,
+                       const uint8_t *body, uint32_t len)
+{
+    AMFCursor cur;
+    AVal method, name;
+    double txn = 0;
+
+    AMFCursor_Init(&cur, (const char *)body, len);
+    if (!AMFCursor_GetString(&cur, &method)) {
+        return 0;
+    }
+    AMFCursor_GetNumber(&cur, &txn);
+
+    if (AVMATCH(&method, &av_connect)) {
+        double encoding = 0;
+        if (AMFCursor_EnterObject(&cur)) {
+            while (AMFCursor_NextName(&cur, &name)) {
+                AVal value;
+                if (AVMATCH(&name, &av_app) && AMFCursor_PeekType(&cur) == AMF_STRING) {
+                    AMFCursor_GetString(&cur, &value);
+                    while (value.av_len && value.av_val[value.av_len - 1] == '/') {
+                        value.av_len--;
+                    }
+                    snprintf(conn->app, sizeof(conn->app), "%.*s", value.av_len, value.av_val);
+                } else if (AVMATCH(&name, &av_objectEncoding) && AMFCursor_PeekType(&cur) == AMF_NUMBER) {
+                    AMFCursor_GetNumber(&cur, &encoding);
+                } else if (!AMFCursor_Skip(&cur)) {
+                    break;
+                }
+            }
+        }
+        conn->deadline = 0;
+        send_uint32(conn, RTMP_PACKET_TYPE_SERVER_BW, SRV_WINDOW);
+        char bw[5];
+        AMF_EncodeInt32(bw, bw + 4, SRV_WINDOW);
+        bw[4] = 2; // dynamic
+        conn_send(conn, SRV_CSID_CTRL, RTMP_PACKET_TYPE_CLIENT_BW, 0, 0, (uint8_t *)bw, 5);
+        // chunks queued after the announcement use the new size
+        pthread_mutex_lock(&conn->lock);
+        char cs[4];
+        AMF_EncodeInt32(cs, cs + 4, server->para.chunk_size);
+        struct srv_buf *buf = chunk_message(SRV_CSID_CTRL, RTMP_PACKET_TYPE_CHUNK_SIZE, 0, 0,
+                                            (uint8_t *)cs, 4, conn->out_chunk);
+        if (buf && conn_queue(conn, buf) == 0) {
+            conn->out_chunk = server->para.chunk_size;
+        }
+        pthread_mutex_unlock(&conn->lock);
+        return send_connect_result(conn, txn, encoding);
+    }
+    if (!conn->app[0]) {
+        // nothing but connect before connect, a stream command without a txn closes
+        return txn ? send_error(conn, txn) : -1;
+    }
+    if (AVMATCH(&method, &av_createStream)) {
+        return send_result(conn, txn, 1, ++conn->last_msid);
+    }
+    if (AVMATCH(&method, &av_releaseStream) || AVMATCH(&method, &av_FCPublish)
+            || AVMATCH(&method, &av_getStreamLength)) {
+        return txn ? send_result(conn, txn, 0, 0) : 0;
+    }
+    if (AVMATCH(&method, &av_publish) || AVMATCH(&method, &av_play)) {
+        AMFCursor_Skip(&cur); // null
+        if (!AMFCursor_GetString(&cur, &name) || !name.av_len) {
+            return send_status(conn, msid, 1, "NetStream.Play.StreamNotFound", "no stream name");
+        }
+        if (AVMATCH(&method, &av_publish)) {
+            return conn_publish(server, conn, msid, &name);
+        }
+        double start = -2;
+        AMFCursor_GetNumber(&cur, &start);
+        return conn_play(server, conn, msid, &name, start);
+    }
+    if (AVMATCH(&method, &av_seek)) {
+        double ms = 0;
+        AMFCursor_Skip(&cur); // null
+        AMFCursor_GetNumber(&cur, &ms);
+        return conn_seek(conn, ms);
+    }
+    if (AVMATCH(&method, &av_deleteStream) || AVMATCH(&method, &av_closeStream)
+            || AVMATCH(&method, &av_FCUnpublish)) {
+        double id = msid;
+        if (AVMATCH(&method, &av_deleteStream)) {
+            AMFCursor_Skip(&cur);
+            AMFCursor_GetNumber(&cur, &id);
+        }
+        if (conn->stream && (AVMATCH(&method, &av_FCUnpublish) ? conn->publishing : (uint32_t)id == conn->msid)) {
+            conn_leave(server, conn);
+        }
+        return AVMATCH(&method, &av_FCUnpublish) && txn ? send_result(conn, txn, 0, 0) : 0;
+    }
+    return 0;
+}
+
+static int conn_message(struct rtmp_server *server, struct srv_conn *conn, struct srv_chan *chan)
+{
+    const uint8_t *body = chan->body;
+    uint32_t len = chan->len;
+
+    switch (chan->type) {
+    case RTMP_PACKET_TYPE_CHUNK_SIZE:
+        if (len >= 4) {
+            conn->in_chunk = AMF_DecodeInt32((char *)body) & 0x7fffffff;
+            if (conn->in_chunk == 0) {
+                return -1;
+            }
+        }
+        break;
+    case 0x02: // abort
+        if (len >= 4) {
+            uint32_t csid = AMF_DecodeInt32((char *)body);
+            for (uint32_t i = 0; i < conn->chan_count; i++) {
+                if (conn->chans[i].csid == csid) {
+                    conn->chans[i].got = 0;
+                }
+            }
+        }
+        break;
+    case RTMP_PACKET_TYPE_CONTROL:
+        if (len >= 6 && AMF_DecodeInt16((char *)body) == 6) {
+            // ping request, the pong carries its timestamp back
+            return send_user_control(conn, 7, AMF_DecodeInt32((char *)body + 2));
+        }
+        break;
+    case RTMP_PACKET_TYPE_SERVER_BW:
+        if (len >= 4) {
+            conn->in_window = AMF_DecodeInt32((char *)body);
+        }
+        break;
+    case RTMP_PACKET_TYPE_AUDIO:
+    case RTMP_PACKET_TYPE_VIDEO:
+    case RTMP_PACKET_TYPE_FLASH_VIDEO:
+        if (conn->publishing && chan->msid == conn->msid) {
+            stream_message(server, conn->stream, chan->type, chan->ts, body, len);
+        }
+        break;
+    case RTMP_PACKET_TYPE_FLEX_STREAM_SEND:
+    case RTMP_PACKET_TYPE_INFO:
+        if (chan->type == RTMP_PACKET_TYPE_FLEX_STREAM_SEND && len) {
+            body++;
+            len--;
+        }
+        if (conn->publishing && chan->msid == conn->msid) {
+            // players get onMetaData, not the instruction to set it
+            if (len >= 3 + (uint32_t)av_setDataFrame.av_len && body[0] == AMF_STRING
+                    && AMF_DecodeInt16((char *)body + 1) == av_setDataFrame.av_len
+                    && !memcmp(body + 3, av_setDataFrame.av_val, av_setDataFrame.av_len)) {
+                body += 3 + av_setDataFrame.av_len;
+                len -= 3 + av_setDataFrame.av_len;
+            }
+            stream_message(server, conn->stream, RTMP_PACKET_TYPE_INFO, chan->ts, body, len);
+        }
+        break;
+    case RTMP_PACKET_TYPE_FLEX_MESSAGE:
+        if (len) {
+            return conn_invoke(server, conn, chan->msid, body + 1, len - 1);
+        }
+        break;
+    case RTMP_PACKET_TYPE_INVOKE:
+        return conn_invoke(server, conn, chan->msid, body, len);
+    default:
+        break;
+    }
+    return 0;
+}
+
+static struct srv_chan *conn_chan(struct srv_conn *conn, uint32_t csid)
+{
+    for (uint32_t i = 0; i < conn->chan_count; i++) {
+        if (conn->chans[i].csid == csid) {
+            return &conn->chans[i];
+        }
+    }
+    if (conn->chan_count >= SRV_CHAN_MAX) {
+        log_print(TAG, "fd %d: more than %d chunk streams\n", conn->fd, SRV_CHAN_MAX);
+        return NULL;
+    }
+    struct srv_chan *chans = (struct srv_chan *)realloc(conn->chans, (conn->chan_count + 1) * sizeof(struct srv_chan));
+    if (!chans) {
+        return NULL;
+    }
+    conn->chans = chans;
+    struct srv_chan *chan = &chans[conn->chan_count++];
+    memset(chan, 0, sizeof(struct srv_chan));
+    chan->csid = csid;
+    return chan;
+}
+
+// Consumes one chunk from the read buffer. Returns 1 when it did, 0 when
+// more bytes are needed, -1 on a protocol error.
+static int conn_chunk(struct rtmp_server *server, struct srv_conn *conn)
+{
+    static const uint32_t header_sizes[4] = { 11, 7, 3, 0 };
+    const uint8_t *p = conn->in + conn->in_off;
+    uint32_t avail = conn->in_len - conn->in_off;
+    uint32_t hlen = 1;
+
+    if (avail < 1) {
+        return 0;
+    }
+    uint32_t fmt = p[0] >> 6;
+    uint32_t csid = p[0] & 0x3f;
+    if (csid == 0) {
+        if (avail < 2) {
+            return 0;
+        }
+        csid = p[1] + 64;
+        hlen = 2;
+    } else if (csid == 1) {
+        if (avail < 3) {
+            return 0;
+        }
+        csid = (p[2] << 8) + p[1] + 64;
+        hlen = 3;
+    }
+    const uint8_t *h = p + hlen;
+    hlen += header_sizes[fmt];
+    if (avail < hlen) {
+        return 0;
+    }
+
+    struct srv_chan *chan = conn_chan(conn, csid);
+    if (!chan) {
+        return -1;
+    }
+
+    // nothing is committed until the whole chunk is buffered
+    uint32_t field = fmt <= 2 ? AMF_DecodeInt24((char *)h) : 0;
+    int ext = fmt <= 2 ? field == 0xffffff : chan->ext;
+    if (ext) {
+        if (avail < hlen + 4) {
+            return 0;
+        }
+        if (fmt <= 2) {
+            field = AMF_DecodeInt32((char *)p + hlen);
+        }
+        hlen += 4;
+    }
+    int start = fmt <= 2 || chan->got == 0;
+    uint32_t len = fmt <= 1 ? AMF_DecodeInt24((char *)h + 3) : chan->len;
+    if (len > SRV_MSG_MAX) {
+        log_print(TAG, "fd %d: message of %u bytes\n", conn->fd, len);
+        return -1;
+    }
+    uint32_t got = start ? 0 : chan->got;
+    uint32_t n = len - got < conn->in_chunk ? len - got : conn->in_chunk;
+    if (avail < hlen + n) {
+        return 0;
+    }
+
+    if (start) {
+        if (fmt == 0) {
+            chan->ts = field;
+            chan->delta = 0;
+            memcpy(&chan->msid, h + 7, 4);
+        } else if (fmt <= 2) {
+            chan->delta = field;
+            chan->ts += field;
+        } else {
+            chan->ts += chan->delta;
+        }
+        if (fmt <= 1) {
+            chan->len = len;
+            chan->type = h[6];
+        }
+        if (fmt <= 2) {
+            chan->ext = ext;
+        }
+        if (len > chan->body_size) {
+            if (conn->chan_bytes - chan->body_size + len > SRV_CHAN_BYTES) {
+                log_print(TAG, "fd %d: more than %d bytes of messages buffered\n", conn->fd, SRV_CHAN_BYTES);
+                return -1;
+            }
+            uint8_t *body = (uint8_t *)realloc(chan->body, len);
+            if (!body) {
+                return -1;
+            }
+            conn->chan_bytes += len - chan->body_size;
+            chan->body = body;
+            chan->body_size = len;
+        }
+    }
+    memcpy(chan->body + got, p + hlen, n);
+    chan->got = got + n;
+    conn->in_off += hlen + n;
+    if (chan->got < len) {
+        return 1;
+    }
+    chan->got = 0;
+    return conn_message(server, conn, chan) < 0 ? -1 : 1;
+}
+
+static int conn_handshake(struct srv_conn *conn)
+{
+    const uint8_t *p = conn->in + conn->in_off;
+    uint32_t avail = conn->in_len - conn->in_off;
+
+    if (conn->state == CONN_C0C1) {
+        if (avail < 1 + SRV_SIG_SIZE) {
+            return 0;
+        }
+        if (p[0] != 3) {
+            log_print(TAG, "unsupported handshake type %d\n", p[0]);
+            return -1;
+        }
+        // plain handshake: S1 is ours, S2 echoes C1
+        struct srv_buf *buf = buf_alloc(1 + 2 * SRV_SIG_SIZE);
+        if (!buf) {
+            return -1;
+        }
+        uint8_t *s1 = buf->data + 1;
+        uint32_t seed = (uint32_t)monotonic_ms();
+        buf->data[0] = 3;
+        AMF_EncodeInt32((char *)s1, (char *)s1 + 4, seed);
+        memset(s1 + 4, 0, 4);
+        for (int i = 8; i < SRV_SIG_SIZE; i++) {
+            seed = seed * 1103515245 + 12345;
+            s1[i] = seed >> 16;
+        }
+        memcpy(s1 + SRV_SIG_SIZE, p + 1, SRV_SIG_SIZE);
+        pthread_mutex_lock(&conn->lock);
+        int ret = conn_queue(conn, buf) == 0 ? conn_flush(conn) : -1;
+        pthread_mutex_unlock(&conn->lock);
+        conn->in_off += 1 + SRV_SIG_SIZE;
+        conn->state = CONN_C2;
+        return ret < 0 ? -1 : 1;
+    }
+    if (avail < SRV_SIG_SIZE) {
+        return 0;
+    }
+    conn->in_off += SRV_SIG_SIZE;
+    conn->state = CONN_OPEN;
+    return 1;
+}
+
+static int http_reply(struct srv_conn *conn, const char *head, const uint8_t *body, uint32_t len)
+{
+    uint32_t n = strlen(head);
+    struct srv_buf *buf = buf_alloc(n + len);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf->data, head, n);
+    memcpy(buf->data + n, body, len);
+    pthread_mutex_lock(&conn->lock);
+    int ret = conn_queue(conn, buf) == 0 ? conn_flush(conn) : -1;
+    pthread_mutex_unlock(&conn->lock);
+    return ret;
+}
+
+// http-flv: GET /app/name.flv plays app/name. The answer is one chunked flv
+// that lasts as long as the connection, its tags share the buffers of the
+// rtmp players. Returns like conn_handshake, -1 also after an error reply.
+static int conn_http(struct rtmp_server *server, struct srv_conn *conn)
+{
+    static const uint8_t flv_header[] = "d\r\nFLV\x01\x05\x00\x00\x00\x09\x00\x00\x00\x00\r\n";
+    const char *p = (const char *)conn->in + conn->in_off;
+    uint32_t avail = conn->in_len - conn->in_off;
+
+    if (conn->state == CONN_HTTP_FLV) {
+        // nothing more is expected
+        conn->in_off = conn->in_len;
+        return 0;
+    }
+    const char *end = (const char *)memmem(p, avail, "\r\n\r\n", 4);
+    if (!end) {
+        return avail >= SRV_HTTP_HEAD ? -1 : 0;
+    }
+    conn->in_off = conn->in_len;
+    conn->deadline = 0;
+    conn->state = CONN_HTTP_FLV;
+
+    // request line: GET /app/name.flv?query HTTP/1.1
+    const char *line_end = (const char *)memchr(p, '\r', end + 2 - p);
+    const char *path = (const char *)memchr(p, ' ', line_end - p);
+    if (!path || path - p != 3 || memcmp(p, "GET", 3)) {
+        http_reply(conn, "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", NULL, 0);
+        return -1;
+    }
+    path++;
+    int len = 0;
+    while (path + len < line_end && path[len] != ' ' && path[len] != '?') {
+        len++;
+    }
+    if (len <= 5 || path[0] != '/' || memcmp(path + len - 4, ".flv", 4) || len - 5 >= 512) {
+        http_reply(conn, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", NULL, 0);
+        return -1;
+    }
+    char key[512];
+    snprintf(key, sizeof(key), "%.*s", len - 5, path + 1);
+    struct rtmp_server_stream *stream = stream_get(server, key);
+    if (!stream) {
+        return -1;
+    }
+    if (http_reply(conn, "HTTP/1.1 200 OK\r\nContent-Type: video/x-flv\r\nTransfer-Encoding: chunked\r\n"
+                   "Connection: close\r\nCache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\n\r\n",
+                   flv_header, sizeof(flv_header) - 1) < 0) {
+        stream_put(server, stream);
+        return -1;
+    }
+    stream_join(server, stream, conn, 0, -2);
+    return 1;
+}
+
+static int conn_read(struct rtmp_server *server, struct srv_conn *conn)
+{
+    for (int round = 0; round < SRV_READ_ROUNDS; round++) {
+        if (conn->in_len == conn->in_size) {
+            if (conn->in_off) {
+                memmove(conn->in, conn->in + conn->in_off, conn->in_len - conn->in_off);
+                conn->in_len -= conn->in_off;
+                conn->in_off = 0;
+            } else {
+                // one chunk does not fit, the peer raised its chunk size
+                if (conn->in_size >= (1u << 25)) {
+                    return -1;
+                }
+                uint8_t *in = (uint8_t *)realloc(conn->in, conn->in_size * 2);
+                if (!in) {
+                    return -1;
+                }
+                conn->in = in;
+                conn->in_size *= 2;
+            }
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len, 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        conn->in_len += n;
+        conn->in_bytes += n;
+        conn->last_recv = monotonic_ms();
+
+        int ret;
+        do {
+            if (conn->http) {
+                ret = conn_http(server, conn);
+            } else {
+                ret = conn->state == CONN_OPEN ? conn_chunk(server, conn) : conn_handshake(conn);
+            }
+        } while (ret > 0);
+        if (ret < 0 || conn->dead) {
+            return -1;
+        }
+        if (conn->in_off == conn->in_len) {
+            conn->in_off = conn->in_len = 0;
+        }
+    }
+
+    if (conn->in_window && conn->in_bytes - conn->in_acked >= conn->in_window / 2) {
+        conn->in_acked = conn->in_bytes;
+        return send_uint32(conn, RTMP_PACKET_TYPE_BYTES_READ_REPORT, conn->in_bytes);
+    }
+    return 0;
+}
+
+static void conn_accept(struct rtmp_server_worker *worker, int fd, int http)
+{
+    struct rtmp_server *server = worker->server;
+    struct srv_conn *conn = (struct srv_conn *)calloc(1, sizeof(struct srv_conn));
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (conn) {
+        conn->in = (uint8_t *)malloc(SRV_IN_SIZE);
+    }
+    if (!conn || !conn->in) {
+        free(conn);
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->worker = worker;
+    conn->http = http;
+    conn->state = http ? CONN_HTTP : CONN_C0C1;
+    conn->in_size = SRV_IN_SIZE;
+    conn->in_chunk = RTMP_DEFAULT_CHUNKSIZE;
+    conn->out_chunk = RTMP_DEFAULT_CHUNKSIZE;
+    conn->last_recv = monotonic_ms();
+    conn->deadline = conn->last_recv + server->para.timeout_ms;
+    pthread_mutex_init(&conn->lock, NULL);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        pthread_mutex_destroy(&conn->lock);
+        free(conn->in);
+        free(conn);
+        close(fd);
+        return;
+    }
+    conn->next = worker->conns;
+    if (worker->conns) {
+        worker->conns->prev = conn;
+    }
+    worker->conns = conn;
+}
+
+static void conn_close(struct rtmp_server_worker *worker, struct srv_conn *conn)
+{
+    conn_leave(worker->server, conn);
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    while (conn->out_head) {
+        struct srv_out *o = conn->out_head;
+        conn->out_head = o->next;
+        buf_unref(o->buf);
+        free(o);
+    }
+    for (uint32_t i = 0; i < conn->chan_count; i++) {
+        free(conn->chans[i].body);
+    }
+    free(conn->chans);
+    free(conn->in);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
+
+static void worker_sweep(struct rtmp_server_worker *worker, int64_t now)
+{
+    int timeout = worker->server->para.timeout_ms;
+    struct srv_conn *conn = worker->conns;
+
+    while (conn) {
+        struct srv_conn *next = conn->next;
+        const char *why = NULL;
+        pthread_mutex_lock(&conn->lock);
+        if (conn->dead) {
+            why = "write failed";
+        } else if (conn->stalled_at && now - conn->stalled_at > timeout) {
+            why = "player stalled";
+        }
+        pthread_mutex_unlock(&conn->lock);
+        if (!why && conn->deadline && now > conn->deadline) {
+            why = "no connect in time";
+        } else if (!why && conn->publishing && now - conn->last_recv > timeout) {
+            why = "publisher silent";
+        }
+        if (why) {
+            log_print(TAG, "closing connection: %s\n", why);
+            conn_close(worker, conn);
+        }
+        conn = next;
+    }
+}
+
+static void *server_worker(void *arg)
+{
+    struct rtmp_server_worker *worker = (struct rtmp_server_worker *)arg;
+    struct rtmp_server *server = worker->server;
+    struct epoll_event events[SRV_EVENTS];
+    int64_t next_sweep = monotonic_ms() + SRV_SWEEP;
+
+    while (!server->quit) {
+        int count = epoll_wait(worker->epfd, events, SRV_EVENTS, worker->dvr_players ? SRV_DVR_TICK : SRV_SWEEP);
+        for (int i = 0; i < count && !server->quit; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == server || ptr == &server->http_fd) {
+                int http = ptr != server;
+                for (int n = 0; n < SRV_ACCEPT_BURST; n++) {
+                    int fd = accept4(http ? server->http_fd : server->listen_fd, NULL, NULL,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (fd < 0) {
+                        break;
+                    }
+                    conn_accept(worker, fd, http);
+                }
+                continue;
+            }
+            if (ptr == worker) {
+                uint64_t val;
+                if (read(worker->wake_fd, &val, sizeof(val)) < 0) {
+                    // drained by another read
+                }
+                continue;
+            }
+            struct srv_conn *conn = (struct srv_conn *)ptr;
+            int ret = 0;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ret = conn_read(server, conn);
+            }
+            if (ret == 0 && (events[i].events & EPOLLOUT)) {
+                pthread_mutex_lock(&conn->lock);
+                ret = conn_flush(conn);
+                pthread_mutex_unlock(&conn->lock);
+            }
+            if (ret < 0) {
+                conn_close(worker, conn);
+            }
+        }
+        int64_t now = monotonic_ms();
+        if (worker->dvr_players) {
+            for (struct srv_conn *conn = worker->conns; conn; conn = conn->next) {
+                if (conn->dvr) {
+                    conn_dvr_feed(server, conn, now);
+                }
+            }
+        }
+        if (now >= next_sweep) {
+            worker_sweep(worker, now);
+            next_sweep = now + SRV_SWEEP;
+        }
+    }
+
+    while (worker->conns) {
+        conn_close(worker, worker->conns);
+    }
+    return NULL;
+}
+
+// binds *port, a negative one picks a free port and is replaced by it
+static int server_listen(struct rtmp_server *server, int *port, int *listen_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(*port > 0 ? *port : 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (server->para.ip[0] && inet_pton(AF_INET, server->para.ip, &addr.sin_addr) != 1) {
+        log_print(TAG, "bad listen address %s\n", server->para.ip);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0
+            || getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        log_print(TAG, "listen on %s:%d failed: %s\n", server->para.ip, *port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    *listen_fd = fd;
+    return 0;
+}
+
+static int worker_start(struct rtmp_server *server, struct rtmp_server_worker *worker)
+{
+    struct epoll_event ev;
+
+    worker->server = server;
+    worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->epfd < 0 || worker->wake_fd < 0) {
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = worker;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wake_fd, &ev) < 0) {
+        return -1;
+    }
+    // every worker accepts, only one of them is woken per connection
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = server;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, server->listen_fd, &ev) < 0) {
+        return -1;
+    }
+    ev.data.ptr = &server->http_fd;
+    if (server->http_fd >= 0 && epoll_ctl(worker->epfd, EPOLL_CTL_ADD, server->http_fd, &ev) < 0) {
+        return -1;
+    }
+    if (pthread_create(&worker->thread, NULL, server_worker, worker) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void worker_stop(struct rtmp_server_worker *worker)
+{
+    if (worker->thread) {
+        uint64_t val = 1;
+        if (write(worker->wake_fd, &val, sizeof(val)) < 0) {
+            log_print(TAG, "wake up failed\n");
+        }
+        pthread_join(worker->thread, NULL);
+    }
+    if (worker->wake_fd >= 0) {
+        close(worker->wake_fd);
+    }
+    if (worker->epfd >= 0) {
+        close(worker->epfd);
+    }
+}
+
+struct rtmp_server *rtmp_server_open(struct rtmp_server_para *para)
+{
+    struct rtmp_server *server = (struct rtmp_server *)calloc(1, sizeof(struct rtmp_server));
+    if (!server) {
+        return NULL;
+    }
+    memcpy(&server->para, para, sizeof(struct rtmp_server_para));
+    if (server->para.port == 0) {
+        server->para.port = RTMP_SERVER_PORT;
+    }
+    if (server->para.threads <= 0) {
+        server->para.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (server->para.threads <= 0) {
+            server->para.threads = 1;
+        }
+    }
+    if (server->para.chunk_size <= 0) {
+        server->para.chunk_size = RTMP_SERVER_CHUNK_SIZE;
+    }
+    if (server->para.max_queue <= 0) {
+        server->para.max_queue = RTMP_SERVER_MAX_QUEUE;
+    }
+    if (server->para.gop_cache_size == 0) {
+        server->para.gop_cache_size = RTMP_SERVER_GOP_CACHE;
+    }
+    if (server->para.gop_cache_size > server->para.max_queue) {
+        // the burst must not trip the lagging player check
+        server->para.gop_cache_size = server->para.max_queue;
+    }
+    if (server->para.timeout_ms <= 0) {
+        server->para.timeout_ms = RTMP_SERVER_TIMEOUT;
+    }
+    if (server->para.dvr_seconds <= 0) {
+        server->para.dvr_seconds = RTMP_SERVER_DVR_SECONDS;
+    }
+    if (server->para.dvr_size <= 0) {
+        // 72 mb for the default 300 s
+        uint64_t bytes = (uint64_t)server->para.dvr_seconds * RTMP_SERVER_DVR_KBPS * 1000 / 8;
+        server->para.dvr_size = (int)((bytes + (1 << 20) - 1) >> 20);
+    }
+    server->listen_fd = -1;
+    server->http_fd = -1;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+    server->cancel = RTMP_CancelAlloc();
+    server->workers = (struct rtmp_server_worker *)calloc(server->para.threads, sizeof(struct rtmp_server_worker));
+    if (!server->cancel || !server->workers || server_listen(server, &server->para.port, &server->listen_fd) < 0
+            || (server->para.http_port && server_listen(server, &server->para.http_port, &server->http_fd) < 0)) {
+        rtmp_server_close(server);
+        return NULL;
+    }
+    for (int i = 0; i < server->para.threads; i++) {
+        server->workers[i].epfd = -1;
+        server->workers[i].wake_fd = -1;
+    }
+    for (int i = 0; i < server->para.threads; i++) {
+        server->worker_count++;
+        if (worker_start(server, &server->workers[i]) < 0) {
+            log_print(TAG, "worker %d failed\n", i);
+            rtmp_server_close(server);
+            return NULL;
+        }
+    }
+    log_print(TAG, "listening on %s:%d, %d workers\n", server->para.ip[0] ? server->para.ip : "*",
+              server->para.port, server->para.threads);
+    if (server->http_fd >= 0) {
+        log_print(TAG, "http-flv on port %d\n", server->para.http_port);
+    }
+    return server;
+}
+
+void rtmp_server_close(struct rtmp_server *server)
+{
+    server->quit = 1;
+    for (int i = 0; i < server->worker_count; i++) {
+        worker_stop(&server->workers[i]);
+    }
+
+    // players are gone, origin pulls stop at their next packet; unblock the waiting ones
+    if (server->cancel) {
+        RTMP_Cancel(server->cancel);
+    }
+    pthread_mutex_lock(&server->lock);
+    for (struct rtmp_server_stream *stream = server->streams; stream; stream = stream->next) {
+        pthread_mutex_lock(&stream->lock);
+        if (stream->pull) {
+            shutdown(RTMP_Socket(stream->pull), SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&stream->lock);
+    }
+    while (server->pulls > 0) {
+        pthread_cond_wait(&server->cond, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+    }
+    if (server->http_fd >= 0) {
+        close(server->http_fd);
+    }
+    if (server->cancel) {
+        RTMP_CancelFree(server->cancel);
+    }
+    free(server->workers);
+    pthread_cond_destroy(&server->cond);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
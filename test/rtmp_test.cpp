@@ -16,15 +16,32 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "rtmp_api.h"
 #include "flvmux_api.h"
+#include "flvfile_api.h"
+#include "rtmp_server_api.h"
+#include "rtmp_pool_api.h"
+#include "amf.h"
+#include "rtmp.h"
 
 #include "log_print.h"
 #define TAG "RTMP-TEST"
 
-// Red5 RTMP Server
+// Served by the embedded server below on free ports, build with -DEMBED_SERVER=0
+// to publish to an external one at RTMP_LIVE_ADDR instead
 #define RTMP_LIVE_ADDR "rtmp://127.0.0.1:1935/live/test"
+#ifndef EMBED_SERVER
+#define EMBED_SERVER 1
+#endif
+#define TTFF_FRAMES 100 // a player joins after this many frames and reports its time to first frame
+#define TTFF_LIMIT_MS 2000 // the test fails when that first frame takes longer
+#define SIG_SIZE 1536 // handshake C1/S1
 #define VIDEO_SIZE 10 *1024 *1024
 #define AUDIO_SIZE 5*1024*1024
 
@@ -147,27 +164,522 @@ uint8_t *h264_find_NAL(uint8_t *buffer, uint32_t total)
     return buf;
 }
 
-void dump_data(char *file, uint8_t *data, int size)
+static AMFObjectProperty amf_prop(const char *name, AMFDataType type, double num, const char *str)
+{
+    AMFObjectProperty prop;
+    memset(&prop, 0, sizeof(prop));
+    prop.p_name.av_val = (char *)name;
+    prop.p_name.av_len = strlen(name);
+    prop.p_type = type;
+    prop.p_vu.p_number = num;
+    if (str) {
+        prop.p_vu.p_aval.av_val = (char *)str;
+        prop.p_vu.p_aval.av_len = strlen(str);
+    }
+    return prop;
+}
+
+static int amf_same(AMFObject *a, AMFObject *b)
+{
+    if (a->o_num != b->o_num) {
+        return 0;
+    }
+    for (int i = 0; i < a->o_num; i++) {
+        AMFObjectProperty *x = &a->o_props[i];
+        AMFObjectProperty *y = &b->o_props[i];
+        if (!AVMATCH(&x->p_name, &y->p_name) || x->p_type != y->p_type) {
+            return 0;
+        }
+        if (x->p_type == AMF_STRING ? !AVMATCH(&x->p_vu.p_aval, &y->p_vu.p_aval)
+                : x->p_type == AMF_OBJECT ? !amf_same(&x->p_vu.p_object, &y->p_vu.p_object)
+                : x->p_vu.p_number != y->p_vu.p_number) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// AMF3 encode -> decode: date, double, integer, a repeated string and two
+// objects with the same members, sent as string and trait references
+static int amf3_check()
+{
+    AMFObject obj = { 0, NULL };
+    AMFObject a = { 0, NULL };
+    AMFObject b = { 0, NULL };
+    AMFObjectProperty prop;
+    AVal cls = AVC("Sample");
+    char pbuf[256];
+    AMFBuilder out;
+    AMF3Encoder enc;
+
+    prop = amf_prop("x", AMF_STRING, 0, "live/test");
+    AMF_AddProp(&a, &prop);
+    prop = amf_prop("y", AMF_NUMBER, 1.5, NULL);
+    AMF_AddProp(&a, &prop);
+    prop = amf_prop("x", AMF_STRING, 0, "other");
+    AMF_AddProp(&b, &prop);
+    prop = amf_prop("y", AMF_NUMBER, 2, NULL);
+    AMF_AddProp(&b, &prop);
+    prop = amf_prop("when", AMF_DATE, 1700000000123.0, NULL);
+    AMF_AddProp(&obj, &prop);
+    prop = amf_prop("ratio", AMF_NUMBER, 0.1, NULL);
+    AMF_AddProp(&obj, &prop);
+    prop = amf_prop("count", AMF_NUMBER, -42, NULL);
+    AMF_AddProp(&obj, &prop);
+    prop = amf_prop("name", AMF_STRING, 0, "live/test");
+    AMF_AddProp(&obj, &prop);
+    prop = amf_prop("a", AMF_OBJECT, 0, NULL);
+    prop.p_vu.p_object = a;
+    AMF_AddProp(&obj, &prop);
+    prop = amf_prop("b", AMF_OBJECT, 0, NULL);
+    prop.p_vu.p_object = b;
+    AMF_AddProp(&obj, &prop);
+
+    AMFBuilder_Init(&out, pbuf, sizeof(pbuf), 0);
+    AMF3Enc_Init(&enc, &out);
+    AMF3Enc_Object(&enc, &cls, &obj);
+    int ret = -1;
+    if (!out.ab_err && AMF3Prop_Decode(&prop, AMFBuilder_Data(&out), out.ab_len, FALSE) == (int)out.ab_len) {
+        ret = prop.p_type == AMF_OBJECT && amf_same(&obj, &prop.p_vu.p_object) ? 0 : -1;
+        AMFProp_Reset(&prop);
+    }
+    log_print(TAG, "amf3 round trip of %d bytes %s\n", (int)out.ab_len, ret == 0 ? "ok" : "FAILED");
+    AMF3Enc_Free(&enc);
+    AMFBuilder_Free(&out);
+    AMF_Reset(&obj);
+    return ret;
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// plain handshake, S1 is zeros and S2 echoes C1. C2 is left unread
+static int peer_handshake(int fd)
 {
-    FILE *fp = fopen(file, "ab+");
-    fwrite(data, 1, size, fp);
-    fclose(fp);
+    uint8_t c1[1 + SIG_SIZE];
+    uint8_t s[1 + 2 * SIG_SIZE];
+    if (recv(fd, c1, sizeof(c1), MSG_WAITALL) != (ssize_t)sizeof(c1)) {
+        return -1;
+    }
+    memset(s, 0, sizeof(s));
+    s[0] = 3;
+    memcpy(s + 1 + SIG_SIZE, c1 + 1, SIG_SIZE);
+    return send(fd, s, sizeof(s), MSG_NOSIGNAL) == (ssize_t)sizeof(s) ? 0 : -1;
+}
+
+// answers one plain handshake on a listening socket, then reads until the client hangs up
+static void *handshake_peer(void *arg)
+{
+    int lfd = (int)(intptr_t)arg;
+    uint8_t buf[SIG_SIZE];
+    struct pollfd pfd = { lfd, POLLIN, 0 };
+    if (poll(&pfd, 1, 3000) <= 0) {
+        return NULL;
+    }
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (peer_handshake(fd) == 0) {
+        struct timeval tv = { 3, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        while (recv(fd, buf, sizeof(buf), 0) > 0) {
+        }
+    }
+    close(fd);
+    return NULL;
 }
 
-void write_flv_header(bool is_have_audio, bool is_have_video)
+static int connect_check(const char *host, int family)
 {
-    char flv_file_header[] = "FLV\x1\x5\0\0\0\x9\0\0\0\0"; // have audio and have video
-    if (is_have_audio && is_have_video) {
-        flv_file_header[4] = 0x05;
-    } else if (is_have_audio && !is_have_video) {
-        flv_file_header[4] = 0x04;
-    } else if (!is_have_audio && is_have_video) {
-        flv_file_header[4] = 0x01;
+    struct sockaddr_storage addr;
+    socklen_t len = family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    memset(&addr, 0, sizeof(addr));
+    addr.ss_family = family;
+    if (family == AF_INET6) {
+        ((struct sockaddr_in6 *)&addr)->sin6_addr = in6addr_loopback;
     } else {
-        flv_file_header[4] = 0x00;
+        ((struct sockaddr_in *)&addr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    int lfd = socket(family, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, len) < 0 || listen(lfd, 1) < 0
+            || getsockname(lfd, (struct sockaddr *)&addr, &len) < 0) {
+        log_print(TAG, "no %s listener, skipped\n", host);
+        if (lfd >= 0) {
+            close(lfd);
+        }
+        return 0;
+    }
+    int port = ntohs(family == AF_INET6 ? ((struct sockaddr_in6 *)&addr)->sin6_port
+                                        : ((struct sockaddr_in *)&addr)->sin_port);
+    pthread_t peer;
+    pthread_create(&peer, NULL, handshake_peer, (void *)(intptr_t)lfd);
+
+    char url[256];
+    snprintf(url, sizeof(url), "rtmp://%s:%d/live", host, port);
+    RTMP *rtmp = RTMP_Alloc();
+    RTMP_Init(rtmp);
+    rtmp->Link.timeout = 3;
+    int ok = RTMP_SetupURL(rtmp, url) && RTMP_Connect(rtmp, NULL);
+    RTMP_Close(rtmp);
+    RTMP_Free(rtmp);
+    pthread_join(peer, NULL);
+    close(lfd);
+    log_print(TAG, "connect to %s %s\n", url, ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+// names and literals of the loopback resolve and connect, a cancelled
+// lookup returns instead of waiting for the resolver
+static int dns_check()
+{
+    if (connect_check("localhost", AF_INET) < 0 || connect_check("[::1]", AF_INET6) < 0) {
+        return -1;
+    }
+    RTMPCancel *cancel = RTMP_CancelAlloc();
+    if (!cancel) {
+        return -1;
+    }
+    char url[] = "rtmp://resolver.check.invalid/live";
+    RTMP *rtmp = RTMP_Alloc();
+    RTMP_Init(rtmp);
+    RTMP_SetCancel(rtmp, cancel);
+    RTMP_Cancel(cancel);
+    int64_t start = now_ms();
+    int ok = RTMP_SetupURL(rtmp, url) && !RTMP_Connect(rtmp, NULL) && now_ms() - start < 100;
+    RTMP_Free(rtmp);
+    RTMP_CancelFree(cancel);
+    log_print(TAG, "cancelled lookup %s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : -1;
+}
+
+enum {
+    PEER_PONG = 0, // answers pings
+    PEER_HANGUP,   // closes right after the connect result
+    PEER_STALL,    // answers a ping with the first bytes of a message, then nothing
+};
+
+// rtmp server just good enough for idle pool connections, one thread per connection
+struct pool_peer {
+    int lfd;
+    int port;
+    int mode;
+    volatile int accepted;
+    volatile int live;
+    volatile int stop;
+    int64_t accepted_ms[4];
+    pthread_t thread;
+};
+
+struct pool_peer_conn {
+    struct pool_peer *peer;
+    int fd;
+    uint32_t lens[64]; // last message header seen per chunk stream
+    uint8_t types[64];
+};
+
+static int peer_recv(struct pool_peer_conn *conn, uint8_t *p, uint32_t n)
+{
+    struct pollfd pfd = { conn->fd, POLLIN, 0 };
+    while (!conn->peer->stop) {
+        int ret = poll(&pfd, 1, 100);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret > 0) {
+            return n == 0 || recv(conn->fd, p, n, MSG_WAITALL) == (ssize_t)n ? 0 : -1;
+        }
     }
+    return -1;
+}
+
+// one whole message, the client never interleaves chunk streams here
+static int peer_message(struct pool_peer_conn *conn, uint32_t *chunk, uint8_t *type, uint8_t *body, uint32_t *len)
+{
+    static const uint32_t header_sizes[4] = { 11, 7, 3, 0 };
+    uint32_t got = 0;
+    uint8_t h[11];
+    do {
+        uint8_t b0;
+        if (peer_recv(conn, &b0, 1) < 0) {
+            return -1;
+        }
+        uint32_t fmt = b0 >> 6;
+        uint32_t csid = b0 & 0x3f;
+        if (csid < 2 || peer_recv(conn, h, header_sizes[fmt]) < 0) {
+            return -1;
+        }
+        if (fmt <= 1) {
+            conn->lens[csid] = (h[3] << 16) | (h[4] << 8) | h[5];
+            conn->types[csid] = h[6];
+        }
+        if (fmt <= 2 && h[0] == 0xff && h[1] == 0xff && h[2] == 0xff && peer_recv(conn, h, 4) < 0) {
+            return -1;
+        }
+        *len = conn->lens[csid];
+        *type = conn->types[csid];
+        if (*len > 4096) {
+            return -1;
+        }
+        uint32_t n = *len - got < *chunk ? *len - got : *chunk;
+        if (peer_recv(conn, body + got, n) < 0) {
+            return -1;
+        }
+        got += n;
+    } while (got < *len);
+    return 0;
+}
+
+static int peer_send(struct pool_peer_conn *conn, int csid, uint8_t type, const uint8_t *body, uint32_t len)
+{
+    uint8_t msg[12 + 128];
+    memset(msg, 0, 12);
+    msg[0] = csid;
+    msg[4] = len >> 16;
+    msg[5] = len >> 8;
+    msg[6] = len;
+    msg[7] = type;
+    memcpy(msg + 12, body, len);
+    return send(conn->fd, msg, 12 + len, MSG_NOSIGNAL) == (ssize_t)(12 + len) ? 0 : -1;
+}
+
+static void *pool_peer_conn_run(void *arg)
+{
+    struct pool_peer_conn *conn = (struct pool_peer_conn *)arg;
+    struct pool_peer *peer = conn->peer;
+    uint8_t body[4096];
+    uint32_t chunk = 128;
+    uint32_t len;
+    uint8_t type;
 
-    dump_data(dump_path, (uint8_t *)flv_file_header, 13);
+    if (peer_handshake(conn->fd) < 0 || peer_recv(conn, body, SIG_SIZE) < 0) {
+        goto done;
+    }
+    while (peer_message(conn, &chunk, &type, body, &len) == 0) {
+        if (type == RTMP_PACKET_TYPE_CHUNK_SIZE && len >= 4) {
+            chunk = AMF_DecodeInt32((char *)body);
+        } else if (type == RTMP_PACKET_TYPE_INVOKE && len > 3 && body[0] == AMF_STRING
+                   && AMF_DecodeInt16((char *)body + 1) == 7 && !memcmp(body + 3, "connect", 7)) {
+            // _result with the txn of the connect, then no properties or info
+            uint8_t result[32];
+            AVal name = AVC("_result");
+            char *p = AMF_EncodeString((char *)result, (char *)result + sizeof(result), &name);
+            memcpy(p, body + 3 + 7, 9);
+            p += 9;
+            *p++ = AMF_NULL;
+            *p++ = AMF_NULL;
+            if (peer_send(conn, 3, RTMP_PACKET_TYPE_INVOKE, result, p - (char *)result) < 0
+                    || peer->mode == PEER_HANGUP) {
+                break;
+            }
+        } else if (type == RTMP_PACKET_TYPE_CONTROL && len >= 6 && AMF_DecodeInt16((char *)body) == 6) {
+            if (peer->mode == PEER_STALL) {
+                // a 100 byte message that never gets past its 10th byte
+                uint8_t part[12 + 10];
+                memset(part, 0, sizeof(part));
+                part[0] = 2;
+                part[6] = 100;
+                part[7] = RTMP_PACKET_TYPE_CONTROL;
+                send(conn->fd, part, sizeof(part), MSG_NOSIGNAL);
+                continue;
+            }
+            body[1] = 7; // pong with the ping's timestamp
+            peer_send(conn, 2, RTMP_PACKET_TYPE_CONTROL, body, 6);
+        }
+    }
+done:
+    close(conn->fd);
+    free(conn);
+    __sync_fetch_and_sub(&peer->live, 1);
+    return NULL;
+}
+
+static void *pool_peer_run(void *arg)
+{
+    struct pool_peer *peer = (struct pool_peer *)arg;
+    struct pollfd pfd = { peer->lfd, POLLIN, 0 };
+    while (!peer->stop) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        struct pool_peer_conn *conn = (struct pool_peer_conn *)calloc(1, sizeof(struct pool_peer_conn));
+        pthread_t thread;
+        if (!conn || (conn->fd = accept(peer->lfd, NULL, NULL)) < 0) {
+            free(conn);
+            continue;
+        }
+        conn->peer = peer;
+        if (peer->accepted < 4) {
+            peer->accepted_ms[peer->accepted] = now_ms();
+        }
+        __sync_fetch_and_add(&peer->accepted, 1);
+        __sync_fetch_and_add(&peer->live, 1);
+        if (pthread_create(&thread, NULL, pool_peer_conn_run, conn) != 0) {
+            close(conn->fd);
+            free(conn);
+            __sync_fetch_and_sub(&peer->live, 1);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static int pool_peer_start(struct pool_peer *peer, int mode)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(peer, 0, sizeof(struct pool_peer));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    peer->mode = mode;
+    peer->lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (peer->lfd < 0 || bind(peer->lfd, (struct sockaddr *)&addr, len) < 0 || listen(peer->lfd, 8) < 0
+            || getsockname(peer->lfd, (struct sockaddr *)&addr, &len) < 0
+            || pthread_create(&peer->thread, NULL, pool_peer_run, peer) != 0) {
+        if (peer->lfd >= 0) {
+            close(peer->lfd);
+        }
+        return -1;
+    }
+    peer->port = ntohs(addr.sin_port);
+    return 0;
+}
+
+static void pool_peer_stop(struct pool_peer *peer)
+{
+    peer->stop = 1;
+    pthread_join(peer->thread, NULL);
+    while (peer->live) {
+        usleep(10000);
+    }
+    close(peer->lfd);
+}
+
+static int pool_idle_count(struct rtmp_pool *pool)
+{
+    int count = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (struct rtmp_pool_key *key = pool->keys; key; key = key->next) {
+        for (struct rtmp_pool_conn *conn = key->idle; conn; conn = conn->next) {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return count;
+}
+
+// one idle connection against a peer in mode, checked by what the peer saw
+static int pool_case(int mode)
+{
+    struct pool_peer peer;
+    if (pool_peer_start(&peer, mode) < 0) {
+        return -1;
+    }
+    struct rtmp_pool_para para;
+    memset(&para, 0, sizeof(para));
+    para.idle_per_key = 1;
+    para.ping_interval_ms = 100;
+    para.ping_timeout_ms = mode == PEER_STALL ? 5000 : 1000; // a stall must end by the read deadline
+    struct rtmp_pool *pool = rtmp_pool_create(&para);
+    if (!pool) {
+        pool_peer_stop(&peer);
+        return -1;
+    }
+    char url[256];
+    snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/warm", peer.port);
+    rtmp_pool_add(pool, url, 1);
+
+    int ret = -1;
+    int64_t start = now_ms();
+    if (mode == PEER_PONG) {
+        // kept alive across several pings, then handed out instead of a new connect
+        while (pool_idle_count(pool) < 1 && now_ms() - start < 3000) {
+            usleep(10000);
+        }
+        usleep(500000);
+        snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/pooled", peer.port);
+        RTMP *rtmp = NULL;
+        for (int i = 0; i < 10 && !rtmp; i++) {
+            // passed over while the worker has it out for a ping
+            if (!(rtmp = (RTMP *)rtmp_pool_claim(pool, url, 1))) {
+                usleep(5000);
+            }
+        }
+        if (rtmp && peer.accepted == 1 && RTMP_IsConnected(rtmp)) {
+            ret = 0;
+        }
+        log_print(TAG, "pool reuse: %s after %d connects\n", rtmp ? "claimed" : "none", peer.accepted);
+        if (rtmp) {
+            RTMP_Close(rtmp);
+            RTMP_Free(rtmp);
+        }
+    } else {
+        // the first connection is dropped and replaced
+        while (peer.accepted < 2 && now_ms() - start < 3000) {
+            usleep(10000);
+        }
+        int replaced = peer.accepted >= 2 ? (int)(peer.accepted_ms[1] - peer.accepted_ms[0]) : -1;
+        // without the read deadline a stalled ping holds the worker for the 10 s socket timeout
+        ret = replaced >= 0 && (mode != PEER_STALL || replaced < 1500) ? 0 : -1;
+        log_print(TAG, "pool %s: replaced after %d ms\n", mode == PEER_STALL ? "stalled ping" : "hangup", replaced);
+    }
+    rtmp_pool_destroy(pool);
+    pool_peer_stop(&peer);
+    return ret;
+}
+
+static int pool_check()
+{
+    int ret = pool_case(PEER_PONG) < 0 || pool_case(PEER_HANGUP) < 0 || pool_case(PEER_STALL) < 0 ? -1 : 0;
+    log_print(TAG, "connection pool %s\n", ret == 0 ? "ok" : "FAILED");
+    return ret;
+}
+
+static char live_addr[256] = RTMP_LIVE_ADDR;
+static char dvr_dir[] = "/tmp/rtmp_test.XXXXXX";
+
+// the ring files are unlinked once open, so only the directory is left
+static void dvr_dir_remove()
+{
+    rmdir(dvr_dir);
+}
+
+static volatile int ttff_status; // 1 once the player got its first frame in time, -1 when it did not
+
+static void *ttff_player(void *)
+{
+    struct rtmp_para para;
+    struct flvmux_packet pkt;
+    memset(&para, 0, sizeof(struct rtmp_para));
+    strcpy(para.uri, live_addr);
+    para.connect_timeout_ms = TTFF_LIMIT_MS;
+    int64_t start = now_ms();
+    int ttff = -1;
+    struct rtmp_context *handle = rtmp_open(&para);
+    if (handle) {
+        RTMP_SetDeadline((RTMP *)handle->rtmp, TTFF_LIMIT_MS - (int)(now_ms() - start));
+        while (rtmp_read_packet(handle, &pkt) >= 0) {
+            if (pkt.type == 0 && (pkt.flags & FLVMUX_PKT_FLAG_KEY) && !(pkt.flags & FLVMUX_PKT_FLAG_HEADER)) {
+                ttff = (int)(now_ms() - start);
+                break;
+            }
+        }
+        rtmp_close(handle);
+    }
+    if (ttff < 0 || ttff > TTFF_LIMIT_MS) {
+        log_print(TAG, "no first frame within %d ms\n", TTFF_LIMIT_MS);
+        ttff_status = -1;
+    } else {
+        log_print(TAG, "time to first frame: %d ms\n", ttff);
+        ttff_status = 1;
+    }
+    return NULL;
 }
 
 int main()
@@ -175,10 +687,33 @@ int main()
     int ret;
     int audio_support = 1;
     int video_support = 1;
+    if (amf3_check() < 0 || dns_check() < 0 || pool_check() < 0) {
+        return -1;
+    }
+#if EMBED_SERVER
+    struct rtmp_server_para server_para;
+    memset(&server_para, 0, sizeof(struct rtmp_server_para));
+    strcpy(server_para.ip, "127.0.0.1");
+    server_para.port = -1;
+    server_para.http_port = -1;
+    // players may rewind with play start or seek
+    if (!mkdtemp(dvr_dir)) {
+        return -1;
+    }
+    atexit(dvr_dir_remove);
+    strcpy(server_para.dvr_dir, dvr_dir);
+    struct rtmp_server *server = rtmp_server_open(&server_para);
+    if (!server) {
+        return -1;
+    }
+    snprintf(live_addr, sizeof(live_addr), "rtmp://127.0.0.1:%d/live/test", server->para.port);
+    log_print(TAG, "serving %s, http://127.0.0.1:%d/live/test.flv plays it too\n", live_addr, server->para.http_port);
+#endif
+
     struct rtmp_para rtmp_para;
     memset(&rtmp_para, 0, sizeof(struct rtmp_para));
     rtmp_para.write_enable = 1;
-    strcpy(rtmp_para.uri, RTMP_LIVE_ADDR);
+    strcpy(rtmp_para.uri, live_addr);
     struct rtmp_context *rtmp_handle = rtmp_open(&rtmp_para);
     if (!rtmp_handle) {
         return -1;
@@ -213,8 +748,11 @@ int main()
     log_print(TAG, "Header send ok. ret:%d \n", ret);
 
 #ifdef DUMP_ENABLE
-    write_flv_header(audio_support, video_support);
-    dump_data(dump_path, flv_handle->header, flv_handle->header_size);
+    struct flvfile_para file_para;
+    memset(&file_para, 0, sizeof(struct flvfile_para));
+    strcpy(file_para.path, dump_path);
+    struct flvfile_context *file_handle = flvfile_open(&file_para);
+    flvfile_write(file_handle, flv_handle->header, flv_handle->header_size);
 #endif
 
     int fd_264 = open("out.264", O_RDONLY);
@@ -247,6 +785,8 @@ int main()
         
     struct flvmux_packet audio_pkt_in, audio_pkt_out;
     struct flvmux_packet video_pkt_in, video_pkt_out;
+    int frames = 0;
+    int status = 0;
     while (1) {
         // 2 Handle One AAC Frame
         if (!audio_support) {
@@ -265,7 +805,7 @@ int main()
         if (ret > 0) {
             ret = rtmp_write(rtmp_handle, audio_pkt_out.data, (int)audio_pkt_out.size);
 #ifdef DUMP_ENABLE
-            dump_data(dump_path, audio_pkt_out.data, audio_pkt_out.size);
+            flvfile_write(file_handle, audio_pkt_out.data, audio_pkt_out.size);
 #endif
             free(audio_pkt_out.data);
             log_print(TAG, "Send audio apkt ok size:%d ret:%d\n", audio_pkt_out.size, ret);
@@ -313,7 +853,7 @@ video_process:
             if (ret > 0) {
                 ret = rtmp_write(rtmp_handle, video_pkt_out.data, (int)video_pkt_out.size);
 #ifdef DUMP_ENABLE
-                dump_data(dump_path, video_pkt_out.data, video_pkt_out.size);
+                flvfile_write(file_handle, video_pkt_out.data, video_pkt_out.size);
 #endif
                 free(video_pkt_out.data);
             }
@@ -336,7 +876,7 @@ video_process:
             if (ret > 0) {
                 ret = rtmp_write(rtmp_handle, video_pkt_out.data, ret);
 #ifdef DUMP_ENABLE
-                dump_data(dump_path, video_pkt_out.data, video_pkt_out.size);
+                flvfile_write(file_handle, video_pkt_out.data, video_pkt_out.size);
 #endif
                 free(video_pkt_out.data);
             }
@@ -348,6 +888,16 @@ video_process:
             //log_print(TAG, "data:%02x \n", nal[4]);
         }
 end:
+        if (++frames == TTFF_FRAMES) {
+            pthread_t ttff;
+            if (pthread_create(&ttff, NULL, ttff_player, NULL) == 0) {
+                pthread_detach(ttff);
+            }
+        }
+        if (ttff_status < 0) {
+            status = -1;
+            goto Finish;
+        }
         usleep(30*1000);
         continue;
     }
@@ -357,7 +907,13 @@ Finish:
     log_print(TAG, "quit \n");
     rtmp_close(rtmp_handle);
     flvmux_close(flv_handle);
+#if EMBED_SERVER
+    rtmp_server_close(server);
+#endif
+#ifdef DUMP_ENABLE
+    flvfile_close(file_handle);
+#endif
     free(buf_264);
     free(buf_aac);
-    return 0;
+    return status;
 }